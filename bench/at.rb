@@ -0,0 +1,45 @@
+#!ruby
+#
+# 12 階層の深さにあるファイルの拡張属性を取得する場合の、
+# 絶対パス名による ExtAttr.get と、ディレクトリからの相対パス名による ExtAttr.get_at を比較します。
+#
+#   $ ruby -I lib bench/at.rb [seconds]
+#
+
+require_relative "helper"
+require "fileutils"
+
+seconds = Float(ARGV[0] || 1)
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  parent = File.join(work, *12.times.map { |i| "level#{i}" })
+  FileUtils.mkdir_p(parent)
+  names = 16.times.map { |i| "file%02d" % i }
+  names.each do |name|
+    path = File.join(parent, name)
+    File.write(path, "")
+    ExtAttr.set(path, ExtAttr::USER, "attr", "value")
+  end
+  paths = names.map { |name| File.join(parent, name) }
+
+  results = {}
+  results["ExtAttr.get (path)"] = measure_rate(seconds) do
+    paths.each { |path| ExtAttr.get(path, ExtAttr::USER, "attr") }
+  end
+  results["ExtAttr.get! (path)"] = measure_rate(seconds) do
+    paths.each { |path| ExtAttr.get!(path, ExtAttr::USER, "attr") }
+  end
+  Dir.open(parent) do |d|
+    results["ExtAttr.get_at"] = measure_rate(seconds) do
+      names.each { |name| ExtAttr.get_at(d, name, ExtAttr::USER, "attr") }
+    end
+    results["ExtAttr.get_at!"] = measure_rate(seconds) do
+      names.each { |name| ExtAttr.get_at!(d, name, ExtAttr::USER, "attr") }
+    end
+  end
+
+  base = results.values.first
+  results.each_pair do |label, rate|
+    puts "%-20s %10.0f files/s (x%.2f)" % [label, rate * names.size, rate / base]
+  end
+end
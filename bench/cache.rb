@@ -0,0 +1,38 @@
+#!ruby
+#
+# ExtAttr::Cache#get と ExtAttr.get を、同じファイルの同じ拡張属性を繰り返し取得して比べます。
+#
+# 頻繁に参照される少数のファイル (hot) と、max_bytes に収まらない多数のファイル (cold) を計測します。
+# 遅いファイルシステムでの効果を見る場合は、EXTATTR_BENCH_DIR にその場所を指定してください。
+#
+#   $ ruby -I lib bench/cache.rb [count]
+#
+
+require_relative "helper"
+
+count = Integer(ARGV[0] || 200000)
+
+abort "ExtAttr::Cache is not available (#{ExtAttr::IMPLEMENT})" unless defined?(ExtAttr::Cache)
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  paths = 1000.times.map do |i|
+    path = File.join(work, "f%04d" % i)
+    File.write(path, "")
+    ExtAttr.set(path, ExtAttr::USER, "mime", "text/html; charset=utf-8")
+    ExtAttr.set(path, ExtAttr::USER, "etag", "%032x" % i)
+    path
+  end
+  sleep 0.1 # 変更直後の ctime は信用されないため、少し待つ
+
+  { "hot (8 files)" => [paths.first(8), 1 << 20],
+    "cold (1000 files)" => [paths, 16 << 10] }.each do |label, (files, max_bytes)|
+    cache = ExtAttr::Cache.new(max_bytes: max_bytes)
+    n = 0
+    plain = measure_calls(count / 5) { ExtAttr.get(files[(n += 1) % files.size], ExtAttr::USER, "etag") }[:ops]
+    n = 0
+    cached = measure_calls(count / 5) { cache.get(files[(n += 1) % files.size], ExtAttr::USER, "etag") }[:ops]
+    stats = cache.stats
+    puts "%-18s ExtAttr.get %10.0f calls/s, Cache#get %10.0f calls/s (hits %d, misses %d, evictions %d)" %
+         [label, plain, cached, stats[:hits], stats[:misses], stats[:evictions]]
+  end
+end
@@ -0,0 +1,39 @@
+#!ruby
+#
+# ExtAttr.copy と、ExtAttr.each_pair と ExtAttr.set による複写を比較します。
+#
+# 5 回計測して最も速かったものと、複写一回あたりに確保されたオブジェクトの数を表示します。
+#
+#   $ ruby -I lib bench/copy.rb [seconds]
+#
+
+require_relative "helper"
+
+seconds = Float(ARGV[0] || 0.5)
+
+def objects_per_call
+  GC.disable
+  n0 = GC.stat(:total_allocated_objects)
+  100.times { yield }
+  (GC.stat(:total_allocated_objects) - n0) / 100.0
+ensure
+  GC.enable
+end
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  [1, 8, 32].each do |count|
+    src = File.join(work, "src#{count}")
+    dst = File.join(work, "dst#{count}")
+    File.write(src, "")
+    File.write(dst, "")
+    count.times { |i| ExtAttr.set(src, ExtAttr::USER, "attr%03d" % i, "value-%03d" % i * 8) }
+
+    loop_copy = -> { ExtAttr.each_pair(src) { |name, data| ExtAttr.set(dst, ExtAttr::USER, name, data) } }
+    native_copy = -> { ExtAttr.copy(src, dst) }
+
+    ruby = measure_rate(seconds, rounds: 5, &loop_copy)
+    native = measure_rate(seconds, rounds: 5, &native_copy)
+    puts "%3d attrs: each_pair+set %9.0f files/s (%5.1f objs), copy %9.0f files/s (%4.1f objs) (x%.2f)" %
+         [count, ruby, objects_per_call(&loop_copy), native, objects_per_call(&native_copy), native / ruby]
+  end
+end
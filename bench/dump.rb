@@ -0,0 +1,56 @@
+#!ruby
+#
+# ExtAttr.dump / ExtAttr.restore と、ExtAttr.each_pair の結果を JSON にして保存し、
+# それを読み込んで ExtAttr.set で戻す場合を、時間と大きさで比べます。
+#
+# JSON では文字列として扱えないバイナリの値を含むため、値は Base64 にします。
+#
+#   $ ruby -I lib bench/dump.rb [files]
+#
+
+require_relative "helper"
+require "fileutils"
+require "json"
+
+nfiles = Integer(ARGV[0] || 20000)
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  src = File.join(work, "src")
+  dst = File.join(work, "dst")
+  rels = nfiles.times.map do |i|
+    rel = File.join("d%02d" % (i % 64), "f%06d" % i)
+    [src, dst].each do |root|
+      FileUtils.mkdir_p File.dirname(File.join(root, rel))
+      File.write(File.join(root, rel), "")
+    end
+    path = File.join(src, rel)
+    ExtAttr.set(path, ExtAttr::USER, "etag", "%032x" % i)
+    ExtAttr.set(path, ExtAttr::USER, "mime", "application/octet-stream")
+    ExtAttr.set(path, ExtAttr::USER, "digest", [i].pack("N") * 8)
+    rel
+  end
+
+  json_path = File.join(work, "dump.json")
+  json_dump = measure_time {
+    File.open(json_path, "w") do |io|
+      rels.each do |rel|
+        hash = {}
+        ExtAttr.each_pair(File.join(src, rel)) { |name, value| hash[name] = [value].pack("m0") }
+        io.puts JSON.generate([rel, hash])
+      end
+    end
+  }
+  json_restore = measure_time {
+    File.foreach(json_path) do |line|
+      rel, hash = JSON.parse(line)
+      hash.each_pair { |name, value| ExtAttr.set(File.join(dst, rel), ExtAttr::USER, name, value.unpack1("m0")) }
+    end
+  }
+
+  bin_path = File.join(work, "dump.bin")
+  bin_dump = measure_time { ExtAttr.dump(src, bin_path) }
+  bin_restore = measure_time { ExtAttr.restore(bin_path, dst) }
+
+  puts "json    dump %8.1f ms  restore %8.1f ms  %10d bytes" % [json_dump * 1000, json_restore * 1000, File.size(json_path)]
+  puts "binary  dump %8.1f ms  restore %8.1f ms  %10d bytes" % [bin_dump * 1000, bin_restore * 1000, File.size(bin_path)]
+end
@@ -0,0 +1,106 @@
+#!ruby
+#
+# 遅いファイルシステム上で、ファイバースケジューラの下から ExtAttr.get を呼び出した時のスループットを計測します。
+#
+# bench/slow_xattr.c を LD_PRELOAD で読み込み、getxattr の呼び出しごとに遅延を入れます。
+# スケジューラが有効な間は拡張属性の呼び出しが別スレッドで行われるため、ファイバーの数に応じて処理量が増えます。
+#
+#   $ ruby -I lib bench/fiber.rb [seconds]
+#
+# ワーカースレッドの上限 (ExtAttr.offload_threads) は、環境変数 EXTATTR_OFFLOAD_THREADS で変えられます。
+#
+
+require "rbconfig"
+require "tmpdir"
+
+unless ENV["LD_PRELOAD"].to_s.include?("slow_xattr")
+  shim = File.join(Dir.tmpdir, "extattr-bench-slow_xattr.so")
+  src = File.join(__dir__, "slow_xattr.c")
+  cc = RbConfig::CONFIG["CC"] || "cc"
+  system(cc, "-shared", "-fPIC", "-o", shim, src, "-ldl", exception: true)
+  env = { "LD_PRELOAD" => [shim, ENV["LD_PRELOAD"]].compact.join(" ") }
+  env["EXTATTR_SLOW_USEC"] ||= ENV.fetch("EXTATTR_SLOW_USEC", "1000")
+  exec(env, RbConfig.ruby, "-I", File.expand_path("../lib", __dir__), __FILE__, *ARGV)
+end
+
+require "extattr"
+
+#
+# IO.select だけで動く最小限のスケジューラ。
+#
+class SelectScheduler
+  def initialize
+    @waiting = {}
+  end
+
+  def fiber(&block)
+    fiber = Fiber.new(blocking: false, &block)
+    fiber.resume
+    fiber
+  end
+
+  def io_wait(io, events, timeout)
+    @waiting[io] = Fiber.current
+    Fiber.yield
+    events
+  end
+
+  def kernel_sleep(*duration)
+    sleep(*duration)
+  end
+
+  def block(blocker, timeout = nil)
+    raise NotImplementedError
+  end
+
+  def unblock(blocker, fiber)
+    raise NotImplementedError
+  end
+
+  def close
+    until @waiting.empty?
+      readable, = IO.select(@waiting.keys)
+      readable.each { |io| @waiting.delete(io).resume }
+    end
+  end
+end
+
+seconds = Float(ARGV[0] || 1)
+
+Dir.mktmpdir("extattr-bench-") do |work|
+  path = File.join(work, "file")
+  File.write(path, "")
+  ExtAttr.set(path, ExtAttr::USER, "bench", "value")
+
+  puts "delay: #{ENV["EXTATTR_SLOW_USEC"]} usec/getxattr"
+  if ExtAttr.respond_to?(:offload_threads)
+    ExtAttr.offload_threads = Integer(ENV["EXTATTR_OFFLOAD_THREADS"]) if ENV["EXTATTR_OFFLOAD_THREADS"]
+    puts "offload_threads: #{ExtAttr.offload_threads}"
+  end
+
+  n = 0
+  stop = Process.clock_gettime(Process::CLOCK_MONOTONIC) + seconds
+  while Process.clock_gettime(Process::CLOCK_MONOTONIC) < stop
+    ExtAttr.get(path, ExtAttr::USER, "bench")
+    n += 1
+  end
+  puts "sequential: %8.0f get/s" % [n / seconds]
+
+  [1, 4, 16, 64, 256].each do |nfibers|
+    count = 0
+    Thread.new {
+      Fiber.set_scheduler(SelectScheduler.new)
+      stop = Process.clock_gettime(Process::CLOCK_MONOTONIC) + seconds
+      nfibers.times do
+        Fiber.schedule do
+          while Process.clock_gettime(Process::CLOCK_MONOTONIC) < stop
+            ExtAttr.get(path, ExtAttr::USER, "bench")
+            count += 1
+          end
+        end
+      end
+      Fiber.set_scheduler(nil)
+    }.join
+    puts "%3d fibers: %8.0f get/s" % [nfibers, count / seconds]
+  end
+end
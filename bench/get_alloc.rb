@@ -0,0 +1,39 @@
+#!ruby
+#
+# ExtAttr.get 1回あたりの malloc 量を計測します。
+#
+#   $ ruby -I lib bench/get_alloc.rb [count]
+#
+
+require_relative "helper"
+
+count = Integer(ARGV[0] || 100000)
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  path = File.join(work, "file")
+  File.write(path, "")
+
+  [0, 16, 256, 4096, 16384].each do |size|
+    begin
+      ExtAttr.set(path, ExtAttr::USER, "bench", "x" * size)
+    rescue SystemCallError => e
+      puts "%6d bytes: skipped (%s)" % [size, e.class]
+      next
+    end
+
+    ExtAttr.get(path, ExtAttr::USER, "bench")
+    GC.start
+    GC.disable
+    malloc0 = GC.stat(:malloc_increase_bytes)
+    objs0 = GC.stat(:total_allocated_objects)
+    t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    count.times { ExtAttr.get(path, ExtAttr::USER, "bench") }
+    t1 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    malloc1 = GC.stat(:malloc_increase_bytes)
+    objs1 = GC.stat(:total_allocated_objects)
+    GC.enable
+
+    puts "%6d bytes: %10.1f malloc bytes/get, %5.2f objects/get, %8.0f get/s" %
+         [size, (malloc1 - malloc0).fdiv(count), (objs1 - objs0).fdiv(count), count / (t1 - t0)]
+  end
+end
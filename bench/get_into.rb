@@ -0,0 +1,33 @@
+#!ruby
+#
+# ExtAttr.get と ExtAttr.get_into の、処理速度と GC の回数を比較します。
+#
+#   $ ruby -I lib bench/get_into.rb [count]
+#
+
+require_relative "helper"
+
+count = Integer(ARGV[0] || 20000)
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  path = File.join(work, "file")
+  File.write(path, "")
+  ns = ExtAttr::USER
+  name = "bench"
+
+  [16, 4096, 32768, 65536].each do |size|
+    begin
+      ExtAttr.set(path, ns, name, "x" * size)
+    rescue SystemCallError => e
+      puts "%6d bytes: skipped (%s)" % [size, e.class]
+      next
+    end
+
+    buf = String.new
+    { "get" => proc { ExtAttr.get(path, ns, name) },
+      "get_into" => proc { ExtAttr.get_into(path, ns, name, buf) } }.each do |label, work|
+      r = measure_calls(count, rounds: 1, &work)
+      puts "%6d bytes %-8s: %9.0f calls/s, %4d GC runs" % [size, label, r[:ops], r[:gc]]
+    end
+  end
+end
@@ -0,0 +1,25 @@
+#!ruby
+#
+# ExtAttr.get_many と ExtAttr.each_pair を比較します。
+#
+#   $ ruby -I lib bench/get_many.rb [seconds]
+#
+
+require_relative "helper"
+
+seconds = Float(ARGV[0] || 1)
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  [1, 10, 100].each do |count|
+    path = File.join(work, "file#{count}")
+    File.write(path, "")
+    names = count.times.map { |i| "attr%03d" % i }
+    names.each { |name| ExtAttr.set(path, ExtAttr::USER, name, "value-#{name}") }
+
+    each_pair = measure_rate(seconds) { ExtAttr.each_pair(path) { |name, data| } }
+    get_many = measure_rate(seconds) { ExtAttr.get_many(path, ExtAttr::USER, names) }
+
+    puts "%4d attrs: each_pair %9.0f files/s, get_many %9.0f files/s (x%.2f)" %
+         [count, each_pair, get_many, get_many / each_pair]
+  end
+end
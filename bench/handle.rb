@@ -0,0 +1,34 @@
+#!ruby
+#
+# 深い階層にあるファイルの拡張属性を繰り返し取得する場合の、
+# パス名、ExtAttr.open (Accessor)、ExtAttr::Handle を比較します。
+#
+#   $ ruby -I lib bench/handle.rb [seconds]
+#
+
+require_relative "helper"
+require "fileutils"
+
+seconds = Float(ARGV[0] || 1)
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  path = File.join(work, *12.times.map { |i| "level#{i}" })
+  FileUtils.mkdir_p(path)
+  path = File.join(path, "file")
+  File.write(path, "")
+  ExtAttr.set(path, ExtAttr::USER, "attr", "value")
+
+  results = {}
+  results["ExtAttr.get (path)"] = measure_rate(seconds) { ExtAttr.get(path, ExtAttr::USER, "attr") }
+  ExtAttr.open(path) do |ea|
+    results["Accessor#get"] = measure_rate(seconds) { ea.get("attr") }
+  end
+  ExtAttr::Handle.open(path) do |h|
+    results["Handle#get"] = measure_rate(seconds) { h.get(ExtAttr::USER, "attr") }
+  end
+
+  base = results.values.first
+  results.each_pair do |label, rate|
+    puts "%-20s %10.0f calls/s (x%.2f)" % [label, rate, rate / base]
+  end
+end
@@ -0,0 +1,75 @@
+#
+# bench/*.rb が共通して用いる計測用のメソッドです。
+#
+#   require_relative "helper"
+#
+# 計測は環境変数 EXTATTR_BENCH_DIR で指定した場所 (既定は /dev/shm、ない場合は Dir.tmpdir) で行います。
+#
+
+require "extattr"
+require "tmpdir"
+
+def bench_dir
+  ENV["EXTATTR_BENCH_DIR"] || (File.directory?("/dev/shm") ? "/dev/shm" : Dir.tmpdir)
+end
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+#
+# seconds 秒の間ブロックを繰り返し呼び出し、[呼び出した回数, 経過時間] を返します。
+#
+def run_for(seconds)
+  n = 0
+  t0 = now
+  stop = t0 + seconds
+  while now < stop
+    yield
+    n += 1
+  end
+  [n, now - t0]
+end
+
+#
+# run_for を rounds 回繰り返し、最も速かった回の 1 秒あたりの呼び出し回数を返します。
+#
+def measure_rate(seconds, rounds: 1, &block)
+  rounds.times.map {
+    n, t = run_for(seconds, &block)
+    n / t
+  }.max
+end
+
+#
+# ブロックを rounds 回呼び出し、最も短かった時間を返します。
+#
+# prepare を与えた場合は、計測の前に毎回、何回目 (0 から) かを与えて呼び出します。その時間は含みません。
+#
+def measure_time(rounds: 5, prepare: nil)
+  rounds.times.map { |round|
+    prepare&.call(round)
+    t0 = now
+    yield
+    now - t0
+  }.min
+end
+
+#
+# 準備運転の後、ブロックを count 回呼び出すことを rounds 回繰り返し、最も速かった回について
+# 1 秒あたりの呼び出し回数 (:ops)、1 回あたりの時間 (:usec)、1 回あたりに確保したオブジェクトの数 (:objects)、
+# GC の回数 (:gc) を返します。
+#
+def measure_calls(count, rounds: 5)
+  yield
+  rounds.times.map {
+    GC.start
+    gc0 = GC.count
+    obj0 = GC.stat(:total_allocated_objects)
+    t0 = now
+    count.times { yield }
+    t = now - t0
+    { ops: count / t, usec: t / count * 1_000_000,
+      objects: (GC.stat(:total_allocated_objects) - obj0).fdiv(count), gc: GC.count - gc0 }
+  }.max_by { |r| r[:ops] }
+end
@@ -0,0 +1,52 @@
+#!ruby
+#
+# ExtAttr::Index の作成、refresh、問い合わせの速さを、ExtAttr.scan でツリー全体をたどる場合と比べます。
+#
+# 多数のファイルを持つツリーに tag 属性を付けて、同じ値を持つファイルを探します。
+# refresh は一部のファイルだけを変更した状態で計測します。
+#
+#   $ ruby -I lib bench/index.rb [files]
+#
+
+require_relative "helper"
+require "fileutils"
+
+nfiles = Integer(ARGV[0] || 20000)
+
+abort "ExtAttr::Index is not available (#{ExtAttr::IMPLEMENT})" unless defined?(ExtAttr::Index)
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  root = File.join(work, "tree")
+  paths = nfiles.times.map do |i|
+    sub = File.join(root, "d%02d" % (i % 64))
+    FileUtils.mkdir_p sub
+    path = File.join(sub, "f%06d" % i)
+    File.write(path, "")
+    ExtAttr.set(path, ExtAttr::USER, "tag", "tag-%04d" % (i % 1000))
+    ExtAttr.set(path, ExtAttr::USER, "owner", "user%d" % (i % 7))
+    path
+  end
+  sleep 0.1 # 変更直後の ctime は信用されないため、少し待つ
+
+  dbpath = File.join(work, "index.db")
+  index = nil
+  build = measure_time { index = ExtAttr::Index.build(dbpath, root) }
+  puts "build      %8.1f ms  (%d files, %d keys, %d bytes)" %
+       [build * 1000, index.stats[:files], index.stats[:keys], index.stats[:bytes]]
+
+  index.refresh
+  sleep 0.1
+  refresh = measure_time {
+    paths.sample(nfiles / 100).each { |path| ExtAttr.set(path, ExtAttr::USER, "tag", "tag-changed") }
+    index.refresh
+  }
+  puts "refresh    %8.1f ms  (reused %d, scanned %d)" % [refresh * 1000, index.stats[:reused], index.stats[:scanned]]
+
+  hits = nil
+  scan = measure_time { hits = ExtAttr.scan(root, names: %w(tag)).select { |_, h| h["tag"] == "tag-0042" }.size }
+  lookup = measure_time { 1000.times { index.lookup("tag", "tag-0042") } } / 1000
+  prefix = measure_time { 1000.times { index.lookup_prefix("tag", "tag-004") } } / 1000
+  puts "scan       %8.1f ms  (%d hits)" % [scan * 1000, hits]
+  puts "lookup     %8.1f us  (%d hits)" % [lookup * 1e6, index.lookup("tag", "tag-0042").size]
+  puts "prefix     %8.1f us  (%d hits)" % [prefix * 1e6, index.lookup_prefix("tag", "tag-004").size]
+end
@@ -0,0 +1,45 @@
+#!ruby
+#
+# ExtAttr.list / ExtAttr.to_h を繰り返し呼び出した時の GC の回数を計測します。
+#
+# 結果は 100 万回の呼び出しあたりの GC 回数に換算して出力します。
+# 拡張属性の数が多い場合は、count を減らして計測します。
+#
+#   $ ruby -I lib bench/list_gc.rb [count]
+#
+
+require_relative "helper"
+
+count = Integer(ARGV[0] || 100000)
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  # 一覧の大きさが 4 KiB 以内に収まるものと、収まらないもの。
+  [[4, 16], [8, 240], [64, 240], [1000, 16]].each do |num, namelen|
+    path = File.join(work, "list#{num}x#{namelen}")
+    File.write(path, "")
+    names = num.times.map { |i| "%0*d" % [namelen, i] }
+    begin
+      names.each { |name| ExtAttr.set(path, ExtAttr::USER, name, "x") }
+    rescue SystemCallError => e
+      puts "%4d names x %3d bytes: skipped (%s)" % [num, namelen, e.class]
+      next
+    end
+    listsize = names.sum { |name| "user.".bytesize + name.bytesize + 1 }
+
+    { list: proc { ExtAttr.list(path, ExtAttr::USER) },
+      to_h: proc { ExtAttr.to_h(path, ExtAttr::USER) } }.each do |label, work|
+      next unless ExtAttr.respond_to?(label)
+      n = [count * 8 / num, 100].max
+      work.()
+      GC.start
+      gc0 = GC.count
+      t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      n.times(&work)
+      t1 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      gc1 = GC.count
+
+      puts "%-4s %4d names (list %6d bytes): %8.1f GC runs/1M calls, %8.0f calls/s" %
+           [label, num, listsize, (gc1 - gc0) * 1_000_000.0 / n, n / (t1 - t0)]
+    end
+  end
+end
@@ -0,0 +1,33 @@
+#!ruby
+#
+# listxattr の一覧を解析する処理を、合成した一覧に対して計測します。
+#
+# 拡張属性を実際に設定する代わりに、非公開メソッド ExtAttr.decode_list を用います。
+#
+#   $ ruby -I lib bench/list_parse.rb [entries]
+#
+
+require "extattr"
+
+num = Integer(ARGV[0] || 10000)
+
+unless ExtAttr.respond_to?(:decode_list, true)
+  abort "ExtAttr.decode_list is not available (#{ExtAttr::IMPLEMENT})"
+end
+
+[16, 64, 240].each do |namelen|
+  buf = num.times.map { |i| "user.%0*d\0" % [namelen, i] }.join
+  # 他の名前空間が混在した一覧
+  mixed = num.times.map { |i| "#{i.even? ? "user" : "trusted"}.%0*d\0" % [namelen, i] }.join
+
+  { "user" => [buf, ExtAttr::USER], "mixed" => [mixed, ExtAttr::USER], "all" => [mixed, ExtAttr::ALL] }.each do |label, (list, ns)|
+    next if ns == :all && !defined?(ExtAttr::ALL)
+    ExtAttr.send(:decode_list, list, ns)
+    n = [2_000_000 / num, 20].max
+    t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    n.times { ExtAttr.send(:decode_list, list, ns) }
+    t1 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    puts "%-5s %5d names x %3d bytes (list %8d bytes): %10.0f entries/s, %8.1f MiB/s" %
+         [label, num, namelen, list.bytesize, n * num / (t1 - t0), n * list.bytesize / (t1 - t0) / 1048576]
+  end
+end
@@ -0,0 +1,45 @@
+#!ruby
+#
+# 各操作で確保される ruby オブジェクトの数を計測します。
+#
+#   $ ruby -I lib bench/name_alloc.rb [count]
+#
+
+require_relative "helper"
+
+count = Integer(ARGV[0] || 100000)
+
+def allocations(count)
+  GC.start
+  GC.disable
+  objs0 = GC.stat(:total_allocated_objects)
+  count.times { yield }
+  (GC.stat(:total_allocated_objects) - objs0).fdiv(count)
+ensure
+  GC.enable
+end
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  path = File.join(work, "file")
+  File.write(path, "")
+  name = "checksum".freeze
+  data = "0123456789abcdef".freeze
+  ExtAttr.set(path, ExtAttr::USER, name, data)
+  buf = String.new
+
+  File.open(path) do |file|
+    {
+      "get (File)" => -> { ExtAttr.get(file, ExtAttr::USER, name) },
+      "get (File, Symbol)" => -> { ExtAttr.get(file, ExtAttr::USER, :checksum) },
+      "get (path)" => -> { ExtAttr.get(path, ExtAttr::USER, name) },
+      "get (path, Symbol)" => -> { ExtAttr.get(path, ExtAttr::USER, :checksum) },
+      "size (File)" => -> { ExtAttr.size(file, ExtAttr::USER, name) },
+      "get_into (File, Symbol)" => -> { ExtAttr.get_into(file, ExtAttr::USER, :checksum, buf) },
+      "set (File)" => -> { ExtAttr.set(file, ExtAttr::USER, name, data) },
+      "delete+set (File)" => -> { ExtAttr.delete(file, ExtAttr::USER, name); ExtAttr.set(file, ExtAttr::USER, name, data) },
+    }.each_pair do |label, op|
+      op.call
+      puts "%-24s %5.2f objects/call" % [label, allocations(count, &op)]
+    end
+  end
+end
@@ -0,0 +1,39 @@
+#!ruby
+#
+# ExtAttr.names で名前を列挙して、途中で探索を打ち切る場合を計測します。
+#
+# ExtAttr::NameIterator と、以前の実装にあたる to_enum(:list, ...) を比べます。
+# 結果は 1 回の呼び出しあたりの時間 (5 回計測した中で最短のもの) と、作成したオブジェクトの数です。
+#
+#   $ ruby -I lib bench/names.rb [count]
+#
+
+require_relative "helper"
+
+count = Integer(ARGV[0] || 2000)
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  path = File.join(work, "names#{count}")
+  File.write(path, "")
+  names = count.times.map { |i| "attr%05d" % i }
+  begin
+    ExtAttr.set_many(path, ExtAttr::USER, names.to_h { |name| [name, "x"] })
+  rescue SystemCallError => e
+    abort "cannot set #{count} attributes in #{bench_dir} (#{e.class})"
+  end
+  first = ExtAttr.list(path, ExtAttr::USER).first
+  n = [40_000 / count, 4].max
+
+  {
+    "find first" => proc { |e| e.find { |name| name == first } },
+    "next"       => proc { |e| e.next },
+    "first(3)"   => proc { |e| e.first(3) },
+    "size"       => proc { |e| e.size || e.count }, # to_enum の size は nil となる
+    "to_a"       => proc { |e| e.to_a },
+  }.each do |label, work|
+    enum = measure_calls(n) { work.(ExtAttr.to_enum(:list, path, ExtAttr::USER)) }
+    iter = measure_calls(n) { work.(ExtAttr.names(path, ExtAttr::USER)) }
+    puts "%-10s %5d names: to_enum %9.1f us %8.1f objs, #{ExtAttr.names(path, ExtAttr::USER).class.name.split("::").last} %9.1f us %8.1f objs" %
+         [label, count, enum[:usec], enum[:objects], iter[:usec], iter[:objects]]
+  end
+end
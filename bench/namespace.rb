@@ -0,0 +1,48 @@
+#!ruby
+#
+# 名前空間の与え方ごとに、ExtAttr.size の処理速度を計測します。
+#
+# システムコールを伴わない ExtAttr::Ring#get (要求を溜めるだけ) の処理速度も計測し、
+# 名前空間の変換にかかる時間の違いを見やすくします。
+#
+#   $ ruby -I lib bench/namespace.rb [count]
+#
+
+require_relative "helper"
+
+count = Integer(ARGV[0] || 500000)
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  path = File.join(work, "file")
+  File.write(path, "")
+  ExtAttr.set(path, ExtAttr::USER, "checksum", "0123456789abcdef")
+
+  File.open(path) do |file|
+    {
+      "ExtAttr::USER" => ExtAttr::USER,
+      ":user" => :user,
+      ":USER" => :USER,
+      '"user"' => "user".freeze,
+      "nil" => nil,
+    }.each_pair do |label, namespace|
+      ExtAttr.size(file, namespace, :checksum)
+      GC.start
+      objs0 = GC.stat(:total_allocated_objects)
+      t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      count.times { ExtAttr.size(file, namespace, :checksum) }
+      t1 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+      objs1 = GC.stat(:total_allocated_objects)
+      line = "%-14s %9.0f calls/s, %4.2f objects/call" % [label, count / (t1 - t0), (objs1 - objs0).fdiv(count)]
+
+      if defined?(ExtAttr::Ring)
+        ring = ExtAttr::Ring.new
+        t0 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        count.times { ring.get(file, namespace, :checksum) }
+        t1 = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+        line << ", Ring#get %9.0f calls/s" % [count / (t1 - t0)]
+      end
+
+      puts line
+    end
+  end
+end
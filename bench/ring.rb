@@ -0,0 +1,53 @@
+#!ruby
+#
+# 多数のファイルの拡張属性を取得・設定する場合の、
+# ExtAttr.get / ExtAttr.set の繰り返しと ExtAttr::Ring の各バックエンドを比較します。
+#
+#   $ ruby -I lib bench/ring.rb [seconds]
+#
+
+require_relative "helper"
+
+seconds = Float(ARGV[0] || 1)
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  paths = 1000.times.map do |i|
+    path = File.join(work, "file%04d" % i)
+    File.write(path, "")
+    ExtAttr.set(path, ExtAttr::USER, "tag", "value")
+    path
+  end
+  files = paths.map { |path| File.open(path) }
+
+  backends = [:threads]
+  begin
+    backends.unshift(ExtAttr::Ring.new(backend: :io_uring).backend)
+  rescue SystemCallError, NotImplementedError
+  end
+
+  { "path" => paths, "File" => files }.each_pair do |kind, targets|
+    results = {}
+    results["ExtAttr.get"] = measure_rate(seconds) { targets.each { |t| ExtAttr.get(t, ExtAttr::USER, "tag") } }
+    backends.each do |backend|
+      ring = ExtAttr::Ring.new(backend: backend, entries: 256)
+      results["Ring(#{backend}) get"] = measure_rate(seconds) do
+        targets.each { |t| ring.get(t, ExtAttr::USER, "tag") }
+        ring.submit
+      end
+    end
+    results["ExtAttr.set"] = measure_rate(seconds) { targets.each { |t| ExtAttr.set(t, ExtAttr::USER, "tag", "value") } }
+    backends.each do |backend|
+      ring = ExtAttr::Ring.new(backend: backend, entries: 256)
+      results["Ring(#{backend}) set"] = measure_rate(seconds) do
+        targets.each { |t| ring.set(t, ExtAttr::USER, "tag", "value") }
+        ring.submit
+      end
+    end
+
+    results.each_pair do |label, rate|
+      puts "%-6s %-22s %10.0f ops/s" % [kind, label, rate * targets.size]
+    end
+  end
+
+  files.each(&:close)
+end
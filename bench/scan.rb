@@ -0,0 +1,38 @@
+#!ruby
+#
+# ExtAttr.scan と、Find.find + ExtAttr.list / ExtAttr.get によるディレクトリツリーの走査を比較します。
+#
+#   $ ruby -I lib bench/scan.rb [files]
+#
+
+require_relative "helper"
+require "find"
+require "fileutils"
+
+nfiles = Integer(ARGV[0] || 20000)
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  nfiles.times do |i|
+    sub = File.join(work, "d%03d" % (i % 100), "e%02d" % (i / 100 % 10))
+    FileUtils.mkdir_p(sub)
+    path = File.join(sub, "file#{i}")
+    File.write(path, "")
+    ExtAttr.set(path, ExtAttr::USER, "checksum", "%064x" % i) if i.even?
+    ExtAttr.set(path, ExtAttr::USER, "mime", "text/plain")
+  end
+
+  n = 0
+  t = measure_time(rounds: 1) {
+    Find.find(work) do |path|
+      names = ExtAttr.list!(path, ExtAttr::USER) & ["checksum"]
+      names.each { |name| ExtAttr.get!(path, ExtAttr::USER, name) }
+      n += 1 unless names.empty?
+    end
+  }
+  puts "%-24s %8d files in %6.3f s (%9.0f entries/s)" % ["Find.find + list/get", n, t, nfiles / t]
+
+  [1, 2, 4, 8].each do |threads|
+    t = measure_time(rounds: 1) { n = ExtAttr.scan(work, names: ["checksum"], threads: threads).count }
+    puts "%-24s %8d files in %6.3f s (%9.0f entries/s)" % ["scan (threads: #{threads})", n, t, nfiles / t]
+  end
+end
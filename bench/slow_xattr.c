@@ -0,0 +1,40 @@
+/*
+ * 遅いファイルシステムを模倣するための LD_PRELOAD 用ライブラリ。
+ *
+ * getxattr / lgetxattr / fgetxattr の呼び出しごとに EXTATTR_SLOW_USEC
+ * マイクロ秒 (規定値は 1000) だけ待ってから本来の関数を呼び出す。
+ *
+ *   $ cc -shared -fPIC -o slow_xattr.so bench/slow_xattr.c -ldl
+ *   $ LD_PRELOAD=./slow_xattr.so ruby ...
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void
+slow_down(void)
+{
+    static long usec = -1;
+    if (usec < 0) {
+        const char *env = getenv("EXTATTR_SLOW_USEC");
+        usec = env ? atol(env) : 1000;
+    }
+    usleep(usec);
+}
+
+#define WRAP(NAME, TARGET)                                                  \
+    ssize_t                                                                 \
+    NAME(TARGET t, const char *name, void *value, size_t size)              \
+    {                                                                       \
+        static ssize_t (*real)(TARGET, const char *, void *, size_t);       \
+        if (!real) { real = dlsym(RTLD_NEXT, #NAME); }                      \
+        slow_down();                                                        \
+        return real(t, name, value, size);                                  \
+    }                                                                       \
+
+WRAP(getxattr, const char *)
+WRAP(lgetxattr, const char *)
+WRAP(fgetxattr, int)
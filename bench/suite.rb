@@ -0,0 +1,253 @@
+#!ruby
+#
+# ExtAttr の各メソッドを計測して、結果を JSON として出力します。
+#
+#   $ rake bench
+#   $ ruby -I lib bench/suite.rb [-t seconds] [-o output.json] [-f filter]
+#
+# 計測は EXTATTR_BENCH_DIR (既定は /dev/shm) の一時ディレクトリ内で行います。
+# ファイルシステムが大きな値に対応していない場合、その項目は "error" を記録して続行します。
+#
+
+require_relative "helper"
+require "fileutils"
+require "json"
+require "optparse"
+require "time"
+
+seconds = 0.2
+output = nil
+filter = nil
+OptionParser.new do |opts|
+  opts.on("-t SECONDS", Float, "measuring time per case (default: #{seconds})") { |v| seconds = v }
+  opts.on("-o FILE", "write JSON to FILE instead of stdout") { |v| output = v }
+  opts.on("-f REGEXP", Regexp, "run only cases whose name matches") { |v| filter = v }
+end.parse!(ARGV)
+
+VALUE_SIZES = [0, 16, 256, 4096, 65536]
+ATTR_COUNTS = [1, 10, 100, 1000]
+VARIANTS = %w(file path link)
+
+#
+# variant ごとに、操作対象 (File かパス名) と呼び出すメソッド名を返します。
+#
+#   file: File オブジェクトに対して ExtAttr.get など
+#   path: パス名に対して ExtAttr.get など
+#   link: パス名に対して ExtAttr.get! など
+#
+def target(variant, path, file, meth)
+  case variant
+  when "file" then [file, meth]
+  when "path" then [path, meth]
+  when "link" then [path, :"#{meth}!"]
+  end
+end
+
+results = []
+run = ->(name, params, &block) do
+  label = ([name] + params.map { |k, v| "#{k}=#{v}" }).join(" ")
+  next if filter && label !~ filter
+  entry = { "name" => name }.merge(params)
+  begin
+    block.call # 準備運転
+    n, elapsed = run_for(seconds, &block)
+    entry.merge!("iterations" => n, "seconds" => elapsed, "ops_per_sec" => n / elapsed)
+  rescue SystemCallError => e
+    entry["error"] = e.class.name
+  end
+  $stderr.puts "%-48s %s" % [label, entry["ops_per_sec"] ? "%12.0f ops/s" % entry["ops_per_sec"] : entry["error"]]
+  results << entry
+end
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  ns = ExtAttr::USER
+
+  VALUE_SIZES.each do |size|
+    path = File.join(work, "value#{size}")
+    File.write(path, "")
+    value = "x" * size
+    begin
+      ExtAttr.set(path, ns, "attr", value)
+    rescue SystemCallError
+    end
+
+    File.open(path) do |file|
+      VARIANTS.each do |variant|
+        obj, get = target(variant, path, file, :get)
+        _, size_m = target(variant, path, file, :size)
+        _, set = target(variant, path, file, :set)
+        _, delete = target(variant, path, file, :delete)
+        params = { "variant" => variant, "value_size" => size, "attr_count" => 1 }
+
+        run.("get", params) { ExtAttr.send(get, obj, ns, "attr") }
+        run.("size", params) { ExtAttr.send(size_m, obj, ns, "attr") }
+        run.("set", params) { ExtAttr.send(set, obj, ns, "attr", value) }
+        run.("set+delete", params) do
+          ExtAttr.send(set, obj, ns, "tmp", value)
+          ExtAttr.send(delete, obj, ns, "tmp")
+        end
+      end
+    end
+
+    if ExtAttr.respond_to?(:get_into)
+      buf = String.new
+      run.("get_into", { "value_size" => size, "attr_count" => 1 }) { ExtAttr.get_into(path, ns, "attr", buf) }
+    end
+    if defined?(ExtAttr::Handle)
+      ExtAttr::Handle.open(path) do |h|
+        run.("handle_get", { "value_size" => size, "attr_count" => 1 }) { h.get(ns, "attr") }
+      end
+    end
+    if ExtAttr.respond_to?(:get_at)
+      Dir.open(work) do |d|
+        name = File.basename(path)
+        %w(path link).each do |variant|
+          _, get_at = target(variant, path, d, :get_at)
+          _, size_at = target(variant, path, d, :size_at)
+          _, set_at = target(variant, path, d, :set_at)
+          _, delete_at = target(variant, path, d, :delete_at)
+          params = { "variant" => variant, "value_size" => size, "attr_count" => 1 }
+
+          run.("get_at", params) { ExtAttr.send(get_at, d, name, ns, "attr") }
+          run.("size_at", params) { ExtAttr.send(size_at, d, name, ns, "attr") }
+          run.("set_at", params) { ExtAttr.send(set_at, d, name, ns, "attr", value) }
+          run.("set_at+delete_at", params) do
+            ExtAttr.send(set_at, d, name, ns, "tmp", value)
+            ExtAttr.send(delete_at, d, name, ns, "tmp")
+          end
+        end
+      end
+    end
+  end
+
+  ATTR_COUNTS.each do |count|
+    path = File.join(work, "count#{count}")
+    File.write(path, "")
+    names = count.times.map { |i| "attr%04d" % i }
+    pairs = names.each_with_object({}) { |name, h| h[name] = "x" * 16 }
+    ExtAttr.set_many(path, ns, pairs)
+
+    File.open(path) do |file|
+      VARIANTS.each do |variant|
+        obj, list = target(variant, path, file, :list)
+        _, get = target(variant, path, file, :get)
+        _, get_many = target(variant, path, file, :get_many)
+        _, to_h = target(variant, path, file, :to_h)
+        _, set_many = target(variant, path, file, :set_many)
+        _, names_m = target(variant, path, file, :names)
+        params = { "variant" => variant, "value_size" => 16, "attr_count" => count }
+
+        run.("list", params) { ExtAttr.send(list, obj, ns) }
+        run.("names", params) { ExtAttr.send(names_m, obj, ns).each { |name| } }
+        run.("get", params) { ExtAttr.send(get, obj, ns, names.last) }
+        run.("each_pair", params) { names.each { |name| ExtAttr.send(get, obj, ns, name) } }
+        run.("get_many", params) { ExtAttr.send(get_many, obj, ns, names) }
+        run.("to_h", params) { ExtAttr.send(to_h, obj, ns) }
+        run.("set_many", params) { ExtAttr.send(set_many, obj, ns, pairs) }
+      end
+    end
+
+    if ExtAttr.respond_to?(:list_at)
+      Dir.open(work) do |d|
+        name = File.basename(path)
+        %w(path link).each do |variant|
+          _, list_at = target(variant, path, d, :list_at)
+          run.("list_at", { "variant" => variant, "value_size" => 16, "attr_count" => count }) do
+            ExtAttr.send(list_at, d, name, ns)
+          end
+        end
+      end
+    end
+    if ExtAttr.respond_to?(:copy)
+      dst = File.join(work, "copy#{count}")
+      File.write(dst, "")
+      run.("copy", { "value_size" => 16, "attr_count" => count }) { ExtAttr.copy(path, dst) }
+    end
+  end
+
+  [10, 100, 1000].each do |count|
+    root = File.join(work, "tree#{count}")
+    mirror = File.join(work, "mirror#{count}")
+    paths = count.times.map do |i|
+      rel = File.join("d%02d" % (i % 10), "f%04d" % i)
+      [root, mirror].each do |dir|
+        FileUtils.mkdir_p(File.join(dir, File.dirname(rel)))
+        File.write(File.join(dir, rel), "")
+      end
+      ExtAttr.set(File.join(root, rel), ns, "tag", "x" * 16)
+      File.join(root, rel)
+    end
+    params = { "file_count" => count }
+
+    run.("scan", params) { ExtAttr.scan(root) { |path, hash| } }
+    if ExtAttr.respond_to?(:dump)
+      dumpfile = File.join(work, "tree#{count}.dump")
+      run.("dump", params) { ExtAttr.dump(root, dumpfile) }
+      run.("restore", params) { ExtAttr.restore(dumpfile, mirror) }
+    end
+    if ExtAttr.respond_to?(:sync_tree)
+      run.("sync_tree", params) { ExtAttr.sync_tree(root, mirror) }
+    end
+    if defined?(ExtAttr::Ring)
+      backends = [:threads]
+      begin
+        backends.unshift(ExtAttr::Ring.new(backend: :io_uring).backend)
+      rescue SystemCallError, NotImplementedError
+      end
+      backends.each do |backend|
+        ring = ExtAttr::Ring.new(backend: backend, entries: 256)
+        run.("ring_get", params.merge("backend" => backend.to_s)) do
+          paths.each { |path| ring.get(path, ns, "tag") }
+          ring.submit
+        end
+      end
+    end
+
+    sleep 0.1 # 変更直後の ctime は信用されないため、少し待つ
+    if defined?(ExtAttr::Cache)
+      cache = ExtAttr::Cache.new
+      n = 0
+      run.("cache_get", params) { cache.get(paths[(n += 1) % count], ns, "tag") }
+    end
+    if defined?(ExtAttr::Index)
+      index = ExtAttr::Index.build(File.join(work, "tree#{count}.index"), root)
+      begin
+        run.("index_lookup", params) { index.lookup("tag", "x" * 16) }
+        run.("index_refresh", params) { index.refresh }
+      ensure
+        index.close
+      end
+    end
+    if defined?(ExtAttr::Watcher)
+      # 一つの拡張属性を書き換えて、その変更を受け取るまで
+      watcher = ExtAttr::Watcher.new(root)
+      begin
+        n = 0
+        run.("watcher", params) do
+          ExtAttr.set(paths.first, ns, "tag", "w%08d" % (n += 1))
+          watcher.read(1)
+        end
+      ensure
+        watcher.close
+      end
+    end
+  end
+end
+
+report = {
+  "ruby" => RUBY_DESCRIPTION,
+  "implement" => ExtAttr::IMPLEMENT,
+  "platform" => RUBY_PLATFORM,
+  "time" => Time.now.utc.iso8601,
+  "seconds_per_case" => seconds,
+  "results" => results,
+}
+commit = `git rev-parse --short HEAD 2>#{File::NULL}`.chomp rescue ""
+report["commit"] = commit unless commit.empty?
+
+json = JSON.pretty_generate(report)
+if output
+  File.write(output, json + "\n")
+else
+  puts json
+end
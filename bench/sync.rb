@@ -0,0 +1,48 @@
+#!ruby
+#
+# ExtAttr.sync_tree で拡張属性を揃える場合と、ExtAttr.scan で読んだ全ての拡張属性を
+# 複写先に ExtAttr.set し直す場合を比べます。
+#
+# 複写元のツリーのうち一部のファイルの拡張属性だけを書き換えて、複写先を揃えるまでを計測します。
+#
+#   $ ruby -I lib bench/sync.rb [files] [changes]
+#
+
+require_relative "helper"
+require "fileutils"
+
+nfiles = Integer(ARGV[0] || 20000)
+nchanges = Integer(ARGV[1] || 200)
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  src = File.join(work, "src")
+  dst = File.join(work, "dst")
+  paths = nfiles.times.map do |i|
+    rel = File.join("d%02d" % (i % 64), "f%06d" % i)
+    [src, dst].each do |root|
+      FileUtils.mkdir_p File.dirname(File.join(root, rel))
+      File.write(File.join(root, rel), "")
+    end
+    path = File.join(src, rel)
+    ExtAttr.set(path, ExtAttr::USER, "etag", "%032x" % i)
+    ExtAttr.set(path, ExtAttr::USER, "mime", "application/octet-stream")
+    ExtAttr.set(path, ExtAttr::USER, "blob", "%08d" % i * 64)
+    path
+  end
+  ExtAttr.sync_tree(src, dst)
+
+  stats = nil
+  change = ->(round) { paths.sample(nchanges).each { |path| ExtAttr.set(path, ExtAttr::USER, "etag", "round-#{round}") } }
+  sync = measure_time(prepare: change) { stats = ExtAttr.sync_tree(src, dst) }
+
+  change = ->(round) { paths.sample(nchanges).each { |path| ExtAttr.set(path, ExtAttr::USER, "etag", "full-#{round}") } }
+  full = measure_time(prepare: change) {
+    ExtAttr.scan(src) do |path, hash|
+      target = File.join(dst, path[src.size..-1])
+      hash.each_pair { |name, value| ExtAttr.set(target, ExtAttr::USER, name, value) }
+    end
+  }
+
+  puts "scan + set all  %8.1f ms  (%d writes)" % [full * 1000, nfiles * 3]
+  puts "sync_tree       %8.1f ms  (compared %d, written %d)" % [sync * 1000, stats[:compared], stats[:written]]
+end
@@ -0,0 +1,49 @@
+#!ruby
+#
+# 遅いファイルシステム上で ExtAttr.get を複数のスレッドから呼び出した時のスループットを計測します。
+#
+# bench/slow_xattr.c を LD_PRELOAD で読み込み、getxattr の呼び出しごとに遅延を入れます。
+#
+#   $ ruby -I lib bench/threads.rb [seconds]
+#
+
+require "rbconfig"
+require "tmpdir"
+
+unless ENV["LD_PRELOAD"].to_s.include?("slow_xattr")
+  shim = File.join(Dir.tmpdir, "extattr-bench-slow_xattr.so")
+  src = File.join(__dir__, "slow_xattr.c")
+  cc = RbConfig::CONFIG["CC"] || "cc"
+  system(cc, "-shared", "-fPIC", "-o", shim, src, "-ldl", exception: true)
+  env = { "LD_PRELOAD" => [shim, ENV["LD_PRELOAD"]].compact.join(" ") }
+  env["EXTATTR_SLOW_USEC"] ||= ENV.fetch("EXTATTR_SLOW_USEC", "1000")
+  exec(env, RbConfig.ruby, "-I", File.expand_path("../lib", __dir__), __FILE__, *ARGV)
+end
+
+require "extattr"
+
+seconds = Float(ARGV[0] || 1)
+
+Dir.mktmpdir("extattr-bench-") do |work|
+  path = File.join(work, "file")
+  File.write(path, "")
+  ExtAttr.set(path, ExtAttr::USER, "bench", "value")
+
+  puts "delay: #{ENV["EXTATTR_SLOW_USEC"]} usec/getxattr"
+  [1, 2, 4, 8, 16].each do |nthreads|
+    count = 0
+    stop = Process.clock_gettime(Process::CLOCK_MONOTONIC) + seconds
+    threads = nthreads.times.map {
+      Thread.new {
+        n = 0
+        while Process.clock_gettime(Process::CLOCK_MONOTONIC) < stop
+          ExtAttr.get(path, ExtAttr::USER, "bench")
+          n += 1
+        end
+        n
+      }
+    }
+    count = threads.sum(&:value)
+    puts "%3d threads: %8.0f get/s" % [nthreads, count / seconds]
+  end
+end
@@ -0,0 +1,24 @@
+#!ruby
+#
+# ExtAttr.to_h と ExtAttr.each_pair による全拡張属性の取得を比較します。
+#
+#   $ ruby -I lib bench/to_h.rb [seconds]
+#
+
+require_relative "helper"
+
+seconds = Float(ARGV[0] || 1)
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  [1, 10, 100].each do |count|
+    path = File.join(work, "file#{count}")
+    File.write(path, "")
+    count.times { |i| ExtAttr.set(path, ExtAttr::USER, "attr%03d" % i, "value-%03d" % i) }
+
+    each_pair = measure_rate(seconds) { h = {}; ExtAttr.each_pair(path) { |name, data| h[name] = data } }
+    to_h = measure_rate(seconds) { ExtAttr.to_h(path, ExtAttr::USER) }
+
+    puts "%4d attrs: each_pair %9.0f files/s, to_h %9.0f files/s (x%.2f)" %
+         [count, each_pair, to_h, to_h / each_pair]
+  end
+end
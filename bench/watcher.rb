@@ -0,0 +1,55 @@
+#!ruby
+#
+# ExtAttr::Watcher で変更を受け取る場合と、ExtAttr.scan でツリー全体を読み直して
+# 前回との差分を求める場合 (ポーリング) を、変更を知るまでの時間で比べます。
+#
+# 多数のファイルのうち一部の拡張属性を書き換えて、その全てを知るまでを計測します。
+#
+#   $ ruby -I lib bench/watcher.rb [files] [changes]
+#
+
+require_relative "helper"
+require "fileutils"
+
+nfiles = Integer(ARGV[0] || 20000)
+nchanges = Integer(ARGV[1] || 100)
+
+abort "ExtAttr::Watcher is not available (#{ExtAttr::IMPLEMENT})" unless defined?(ExtAttr::Watcher)
+
+Dir.mktmpdir("extattr-bench-", bench_dir) do |work|
+  paths = nfiles.times.map do |i|
+    sub = File.join(work, "d%02d" % (i % 64))
+    FileUtils.mkdir_p sub
+    path = File.join(sub, "f%06d" % i)
+    File.write(path, "")
+    ExtAttr.set(path, ExtAttr::USER, "etag", "%032x" % i)
+    path
+  end
+
+  t0 = now
+  watcher = ExtAttr::Watcher.new(work)
+  puts "watcher start   %8.1f ms  (%d directories)" % [(now - t0) * 1000, watcher.stats[:directories]]
+
+  snapshot = ExtAttr.scan(work).to_h
+  best_poll = best_watch = Float::INFINITY
+  5.times do |round|
+    changed = paths.sample(nchanges)
+    changed.each { |path| ExtAttr.set(path, ExtAttr::USER, "etag", "round-#{round}") }
+
+    t0 = now
+    current = ExtAttr.scan(work).to_h
+    diff = current.count { |path, hash| snapshot[path] != hash }
+    snapshot = current
+    best_poll = [best_poll, now - t0].min
+    abort "polling found #{diff} changes" unless diff == nchanges
+
+    t0 = now
+    events = []
+    events.concat(watcher.read(5)) while events.size < nchanges
+    best_watch = [best_watch, now - t0].min
+  end
+
+  puts "poll (scan+diff) %8.2f ms per round" % (best_poll * 1000)
+  puts "watcher read     %8.2f ms per round  (overflows %d)" % [best_watch * 1000, watcher.stats[:overflows]]
+  watcher.close
+end
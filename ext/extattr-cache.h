@@ -0,0 +1,629 @@
+/*
+ * ExtAttr::Cache の実装。
+ *
+ * 拡張属性の値と一覧を inode (st_dev, st_ino) ごとに記憶して、取り出す前に stat で
+ * st_ctime が変わっていないことを確かめる。拡張属性を変更すると ctime が更新されるため、
+ * 変更されたファイルは自動的に取得し直す。
+ *
+ * ctime の刻みはカーネルのタイマーに依存するため、同じ刻みの間に続けて変更されると
+ * ctime が変わらないことがある。記憶した時点で ctime からの経過が
+ * EXTATTR_CACHE_RACY_NSEC 以内の項目は信用せず、次の呼び出しで取得し直す。
+ *
+ * 記憶する量は max_bytes で制限して、超えた分は最も長く使われていない inode から捨てる。
+ * 表の操作は全て GVL を保持した状態で行う。
+ *
+ * 取得には各環境の ExtAttr.get / ExtAttr.list をそのまま用いるため、環境には依存しない。
+ */
+
+#include <sys/stat.h>
+#include <time.h>
+
+#define EXTATTR_HAVE_CACHE 1
+
+#if defined(ENOATTR)
+#   define EXTATTR_CACHE_ENOATTR ENOATTR
+#else
+#   define EXTATTR_CACHE_ENOATTR ENODATA
+#endif
+
+#define EXTATTR_CACHE_RACY_NSEC (20 * 1000 * 1000LL)
+
+enum {
+    EXTATTR_CACHE_NAMESPACE_MAX = 8,
+    EXTATTR_CACHE_ENTRY_OVERHEAD = 256,     // inode ごとに見積もる大きさ
+    EXTATTR_CACHE_ITEM_OVERHEAD = 96,       // 値や名前ごとに見積もる大きさ
+    EXTATTR_CACHE_MAX_BYTES_DEFAULT = 4 << 20,
+};
+
+static VALUE cCache;
+static ID id_max_bytes, id_errno, id_list;
+static ID id_hits, id_misses, id_evictions, id_entries, id_bytes;
+
+struct extattr_cache_entry
+{
+    struct extattr_cache_entry *prev, *next;    // 最近使われた順の双方向リスト
+    dev_t dev;
+    ino_t ino;
+    struct timespec ctime;
+    struct timespec stamp;                      // 記憶を始めた時刻
+    size_t bytes;
+
+    // 名前空間ごとの、名前から値 (存在しなければ errno の整数) への Hash と、名前の一覧。
+    VALUE values[EXTATTR_CACHE_NAMESPACE_MAX];
+    VALUE lists[EXTATTR_CACHE_NAMESPACE_MAX];
+};
+
+struct extattr_cache
+{
+    st_table *inodes;
+    struct extattr_cache_entry *head, *tail;
+    size_t bytes;
+    size_t max_bytes;
+    size_t hits, misses, evictions;
+};
+
+static int
+extattr_cache_key_cmp(st_data_t a, st_data_t b)
+{
+    const struct extattr_cache_entry *x = (const struct extattr_cache_entry *)a;
+    const struct extattr_cache_entry *y = (const struct extattr_cache_entry *)b;
+    return !(x->ino == y->ino && x->dev == y->dev);
+}
+
+static st_index_t
+extattr_cache_key_hash(st_data_t a)
+{
+    const struct extattr_cache_entry *x = (const struct extattr_cache_entry *)a;
+    return (st_index_t)((uint64_t)x->ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t)x->dev);
+}
+
+static const struct st_hash_type extattr_cache_key_type = {
+    extattr_cache_key_cmp,
+    extattr_cache_key_hash,
+};
+
+static void
+extattr_cache_mark(void *ptr)
+{
+    struct extattr_cache *c = (struct extattr_cache *)ptr;
+    for (struct extattr_cache_entry *e = c->head; e; e = e->next) {
+        for (int i = 0; i < EXTATTR_CACHE_NAMESPACE_MAX; i++) {
+            rb_gc_mark(e->values[i]);
+            rb_gc_mark(e->lists[i]);
+        }
+    }
+}
+
+static void
+extattr_cache_clear_entries(struct extattr_cache *c)
+{
+    struct extattr_cache_entry *e = c->head;
+    while (e) {
+        struct extattr_cache_entry *next = e->next;
+        xfree(e);
+        e = next;
+    }
+    c->head = c->tail = NULL;
+    c->bytes = 0;
+    if (c->inodes) { st_clear(c->inodes); }
+}
+
+static void
+extattr_cache_free(void *ptr)
+{
+    struct extattr_cache *c = (struct extattr_cache *)ptr;
+    extattr_cache_clear_entries(c);
+    if (c->inodes) { st_free_table(c->inodes); }
+    xfree(c);
+}
+
+static size_t
+extattr_cache_memsize(const void *ptr)
+{
+    const struct extattr_cache *c = (const struct extattr_cache *)ptr;
+    size_t n = (c->inodes ? c->inodes->num_entries : 0);
+    return sizeof(struct extattr_cache) + n * sizeof(struct extattr_cache_entry) +
+           (c->inodes ? st_memsize(c->inodes) : 0);
+}
+
+static const rb_data_type_t extattr_cache_type = {
+    "extattr.cache",
+    { extattr_cache_mark, extattr_cache_free, extattr_cache_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+extattr_cache_alloc(VALUE klass)
+{
+    struct extattr_cache *c;
+    VALUE obj = TypedData_Make_Struct(klass, struct extattr_cache, &extattr_cache_type, c);
+    c->inodes = st_init_table(&extattr_cache_key_type);
+    c->max_bytes = EXTATTR_CACHE_MAX_BYTES_DEFAULT;
+    return obj;
+}
+
+static struct extattr_cache *
+extattr_cache_ref(VALUE obj)
+{
+    return rb_check_typeddata(obj, &extattr_cache_type);
+}
+
+static void
+extattr_cache_unlink(struct extattr_cache *c, struct extattr_cache_entry *e)
+{
+    if (e->prev) { e->prev->next = e->next; } else { c->head = e->next; }
+    if (e->next) { e->next->prev = e->prev; } else { c->tail = e->prev; }
+    e->prev = e->next = NULL;
+}
+
+static void
+extattr_cache_push(struct extattr_cache *c, struct extattr_cache_entry *e)
+{
+    e->prev = NULL;
+    e->next = c->head;
+    if (c->head) { c->head->prev = e; }
+    c->head = e;
+    if (!c->tail) { c->tail = e; }
+}
+
+static void
+extattr_cache_touch(struct extattr_cache *c, struct extattr_cache_entry *e)
+{
+    if (c->head == e) { return; }
+    extattr_cache_unlink(c, e);
+    extattr_cache_push(c, e);
+}
+
+/*
+ * 上限を超えた分を、最も古くに使われた項目から捨てる。keep は捨てずに残す。
+ */
+static void
+extattr_cache_evict(struct extattr_cache *c, const struct extattr_cache_entry *keep)
+{
+    while (c->bytes > c->max_bytes && c->tail && c->tail != keep) {
+        struct extattr_cache_entry *e = c->tail;
+        st_data_t key = (st_data_t)e;
+        st_delete(c->inodes, &key, NULL);
+        extattr_cache_unlink(c, e);
+        c->bytes -= e->bytes;
+        c->evictions++;
+        xfree(e);
+    }
+}
+
+/*
+ * 記憶した時点で ctime から十分に時間が経っていなければ、同じ ctime のまま変更されている恐れがある。
+ * ctime が未来を指している (時刻のずれたファイルサーバーなど) 場合も信用しない。
+ */
+static int
+extattr_cache_racy_p(const struct extattr_cache_entry *e)
+{
+    long long diff = (long long)(e->stamp.tv_sec - e->ctime.tv_sec) * 1000000000LL +
+                     (e->stamp.tv_nsec - e->ctime.tv_nsec);
+    return diff <= EXTATTR_CACHE_RACY_NSEC;
+}
+
+static int
+extattr_cache_same_time(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static int
+extattr_cache_time_cmp(const struct timespec *a, const struct timespec *b)
+{
+    if (a->tv_sec != b->tv_sec) { return a->tv_sec < b->tv_sec ? -1 : 1; }
+    if (a->tv_nsec != b->tv_nsec) { return a->tv_nsec < b->tv_nsec ? -1 : 1; }
+    return 0;
+}
+
+/*
+ * 対象の stat の結果と、stat を始めた時刻。
+ */
+struct extattr_cache_stat
+{
+    const char *path;           // NULL であれば fd を用いる
+    int fd;
+    int follow;
+    struct timespec stamp;
+    struct stat st;
+    int status;
+    int err;
+};
+
+static void *
+extattr_cache_stat_nogvl(void *arg)
+{
+    struct extattr_cache_stat *p = (struct extattr_cache_stat *)arg;
+    clock_gettime(CLOCK_REALTIME, &p->stamp);
+    do {
+        if (!p->path) {
+            p->status = fstat(p->fd, &p->st);
+        } else if (p->follow) {
+            p->status = stat(p->path, &p->st);
+        } else {
+            p->status = lstat(p->path, &p->st);
+        }
+    } while (p->status < 0 && errno == EINTR);
+    p->err = errno;
+    return NULL;
+}
+
+static void
+extattr_cache_stat(struct extattr_cache_stat *p, VALUE path, int follow)
+{
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        p->path = NULL;
+        p->fd = file2fd(path);
+    } else {
+        p->path = StringValueCStr(path);
+        p->fd = -1;
+    }
+    p->follow = follow;
+    aux_blocking_call(extattr_cache_stat_nogvl, p);
+    if (p->status < 0) {
+        errno = p->err;
+        aux_sys_fail(path, "stat");
+    }
+}
+
+/*
+ * stat の結果に対応する項目を返す。
+ *
+ * ctime が変わっていたり信用できなかったりすれば、記憶していた内容を捨てて空の項目とする。
+ * 項目がなければ作成する。
+ */
+static struct extattr_cache_entry *
+extattr_cache_lookup(struct extattr_cache *c, const struct extattr_cache_stat *s)
+{
+    struct extattr_cache_entry key = { NULL, NULL, s->st.st_dev, s->st.st_ino };
+    st_data_t found;
+    struct extattr_cache_entry *e;
+
+    if (st_lookup(c->inodes, (st_data_t)&key, &found)) {
+        e = (struct extattr_cache_entry *)found;
+        if (!extattr_cache_same_time(&e->ctime, &s->st.st_ctim) || extattr_cache_racy_p(e)) {
+            for (int i = 0; i < EXTATTR_CACHE_NAMESPACE_MAX; i++) {
+                e->values[i] = e->lists[i] = Qnil;
+            }
+            c->bytes -= e->bytes - EXTATTR_CACHE_ENTRY_OVERHEAD;
+            e->bytes = EXTATTR_CACHE_ENTRY_OVERHEAD;
+            e->ctime = s->st.st_ctim;
+            e->stamp = s->stamp;
+        }
+    } else {
+        e = ALLOC(struct extattr_cache_entry);
+        e->prev = e->next = NULL;
+        e->dev = s->st.st_dev;
+        e->ino = s->st.st_ino;
+        e->ctime = s->st.st_ctim;
+        e->stamp = s->stamp;
+        e->bytes = EXTATTR_CACHE_ENTRY_OVERHEAD;
+        for (int i = 0; i < EXTATTR_CACHE_NAMESPACE_MAX; i++) {
+            e->values[i] = e->lists[i] = Qnil;
+        }
+        st_insert(c->inodes, (st_data_t)e, (st_data_t)e);
+        extattr_cache_push(c, e);
+        c->bytes += e->bytes;
+        // 値を記憶しない (stat だけの) 呼び出しが続いても、項目が増え続けないようにする。
+        extattr_cache_evict(c, e);
+        return e;
+    }
+    extattr_cache_touch(c, e);
+
+    return e;
+}
+
+/*
+ * 取得している間に GVL を手放すため、記憶する前に項目を探し直す。
+ *
+ * 項目が捨てられていたり、stat の後に他のスレッドが作り直していたりした場合は、
+ * 食い違わないように記憶しない。
+ */
+static struct extattr_cache_entry *
+extattr_cache_relookup(struct extattr_cache *c, const struct extattr_cache_stat *s)
+{
+    struct extattr_cache_entry key = { NULL, NULL, s->st.st_dev, s->st.st_ino };
+    st_data_t found;
+    if (!st_lookup(c->inodes, (st_data_t)&key, &found)) { return NULL; }
+
+    struct extattr_cache_entry *e = (struct extattr_cache_entry *)found;
+    if (!extattr_cache_same_time(&e->ctime, &s->st.st_ctim) ||
+        extattr_cache_time_cmp(&e->stamp, &s->stamp) > 0) {
+        return NULL;
+    }
+
+    return e;
+}
+
+static int
+extattr_cache_namespace_index(int namespace1)
+{
+    if (namespace1 < 0 || namespace1 >= EXTATTR_CACHE_NAMESPACE_MAX) {
+        rb_raise(rb_eArgError, "namespace out of range for cache - %d", namespace1);
+    }
+    return namespace1;
+}
+
+static void
+extattr_cache_store(struct extattr_cache *c, struct extattr_cache_entry *e, size_t bytes)
+{
+    e->bytes += bytes;
+    c->bytes += bytes;
+    extattr_cache_evict(c, NULL);
+}
+
+struct extattr_cache_get
+{
+    VALUE path;
+    VALUE namespace;
+    VALUE name;
+    int follow;
+};
+
+static VALUE
+extattr_cache_get_body(VALUE arg)
+{
+    struct extattr_cache_get *p = (struct extattr_cache_get *)arg;
+    return rb_obj_freeze(p->follow ? ext_s_get(mExtAttr, p->path, p->namespace, p->name)
+                                   : ext_s_get_link(mExtAttr, p->path, p->namespace, p->name));
+}
+
+static VALUE
+extattr_cache_get_rescue(VALUE arg, VALUE exc)
+{
+    int err = NUM2INT(rb_funcall2(exc, id_errno, 0, NULL));
+    if (err != EXTATTR_CACHE_ENOATTR) { rb_exc_raise(exc); }
+    return INT2FIX(err);
+}
+
+static VALUE
+extattr_cache_get_common(VALUE self, VALUE path, VALUE namespace, VALUE name, int follow)
+{
+    struct extattr_cache *c = extattr_cache_ref(self);
+    int ns = extattr_cache_namespace_index(conv_namespace(namespace));
+    name = aux_name_string(aux_should_be_name(name));
+    if (!rb_obj_is_kind_of(path, rb_cFile)) { path = aux_to_path(path); }
+
+    struct extattr_cache_stat s;
+    extattr_cache_stat(&s, path, follow);
+
+    struct extattr_cache_entry *e = extattr_cache_lookup(c, &s);
+    VALUE v = (NIL_P(e->values[ns]) ? Qundef : rb_hash_lookup2(e->values[ns], name, Qundef));
+    if (v != Qundef) {
+        c->hits++;
+    } else {
+        c->misses++;
+        struct extattr_cache_get args = { path, namespace, name, follow };
+        v = rb_rescue2(extattr_cache_get_body, (VALUE)&args,
+                       extattr_cache_get_rescue, (VALUE)&args,
+                       rb_eSystemCallError, (VALUE)0);
+
+        size_t bytes = RSTRING_LEN(name) + EXTATTR_CACHE_ITEM_OVERHEAD +
+                       (RB_TYPE_P(v, T_STRING) ? RSTRING_LEN(v) : 0);
+        e = extattr_cache_relookup(c, &s);
+        if (e && bytes <= c->max_bytes / 4) {
+            if (NIL_P(e->values[ns])) { e->values[ns] = rb_hash_new(); }
+            if (rb_hash_lookup2(e->values[ns], name, Qundef) == Qundef) {
+                rb_hash_aset(e->values[ns], name, v);
+                extattr_cache_store(c, e, bytes);
+            }
+        }
+    }
+
+    if (FIXNUM_P(v)) { ext_error_extattr(FIX2INT(v), path, name); }
+    RB_GC_GUARD(path);
+    return rb_str_dup(v);
+}
+
+/*
+ * call-seq:
+ *  get(path, namespace, name) -> string
+ *
+ * ExtAttr.get と同じように拡張属性の値を返します。
+ *
+ * ファイルの ctime が記憶した時から変わっていなければ、記憶した値を返します。
+ * 存在しない拡張属性も記憶して、同じ例外を発生させます。
+ */
+static VALUE
+extattr_cache_get(VALUE self, VALUE path, VALUE namespace, VALUE name)
+{
+    return extattr_cache_get_common(self, path, namespace, name, 1);
+}
+
+/*
+ * call-seq:
+ *  get!(path, namespace, name) -> string
+ */
+static VALUE
+extattr_cache_get_link(VALUE self, VALUE path, VALUE namespace, VALUE name)
+{
+    return extattr_cache_get_common(self, path, namespace, name, 0);
+}
+
+static VALUE
+extattr_cache_list_common(VALUE self, VALUE path, VALUE namespace, int follow)
+{
+    struct extattr_cache *c = extattr_cache_ref(self);
+    int ns = extattr_cache_namespace_index(conv_namespace_list(namespace));
+    if (!rb_obj_is_kind_of(path, rb_cFile)) { path = aux_to_path(path); }
+
+    struct extattr_cache_stat s;
+    extattr_cache_stat(&s, path, follow);
+
+    struct extattr_cache_entry *e = extattr_cache_lookup(c, &s);
+    VALUE list = e->lists[ns];
+    if (!NIL_P(list)) {
+        c->hits++;
+    } else {
+        c->misses++;
+
+        // ブロックを引き継がないように、メソッドとして呼び出す。
+        VALUE args[2] = { path, namespace };
+        list = rb_funcall2(mExtAttr, follow ? id_list : rb_intern("list!"), 2, args);
+        size_t bytes = EXTATTR_CACHE_ITEM_OVERHEAD;
+        for (long i = 0; i < RARRAY_LEN(list); i++) {
+            VALUE item = RARRAY_AREF(list, i);
+            if (RB_TYPE_P(item, T_ARRAY)) {
+                rb_obj_freeze(rb_ary_entry(item, 1)); // ExtAttr::ALL による [名前空間, 名前]
+                bytes += RSTRING_LEN(rb_ary_entry(item, 1));
+            } else {
+                bytes += RSTRING_LEN(item);
+            }
+            rb_obj_freeze(item);
+            bytes += EXTATTR_CACHE_ITEM_OVERHEAD;
+        }
+        rb_obj_freeze(list);
+
+        e = extattr_cache_relookup(c, &s);
+        if (e && NIL_P(e->lists[ns]) && bytes <= c->max_bytes / 4) {
+            e->lists[ns] = list;
+            extattr_cache_store(c, e, bytes);
+        }
+    }
+
+    RB_GC_GUARD(path);
+    if (rb_block_given_p()) {
+        for (long i = 0; i < RARRAY_LEN(list); i++) {
+            rb_yield(RARRAY_AREF(list, i));
+        }
+        RB_GC_GUARD(list);
+        return Qnil;
+    }
+
+    return rb_ary_dup(list);
+}
+
+/*
+ * call-seq:
+ *  list(path, namespace) -> names array
+ *  list(path, namespace) { |name| ... } -> nil
+ *
+ * ExtAttr.list と同じように拡張属性名の一覧を返します。
+ *
+ * 名前の文字列は記憶しているものを共有するため、凍結されています。
+ */
+static VALUE
+extattr_cache_list(VALUE self, VALUE path, VALUE namespace)
+{
+    return extattr_cache_list_common(self, path, namespace, 1);
+}
+
+/*
+ * call-seq:
+ *  list!(path, namespace) -> names array
+ *  list!(path, namespace) { |name| ... } -> nil
+ */
+static VALUE
+extattr_cache_list_link(VALUE self, VALUE path, VALUE namespace)
+{
+    return extattr_cache_list_common(self, path, namespace, 0);
+}
+
+/*
+ * call-seq:
+ *  initialize(max_bytes: 4 * 1024 * 1024)
+ *
+ * max_bytes は記憶する量の目安の上限です。
+ * 値や名前の大きさに、項目ごとの管理に必要な大きさを見積もって加えたもので数えます。
+ */
+static VALUE
+extattr_cache_initialize(int argc, VALUE argv[], VALUE self)
+{
+    VALUE opts;
+    struct extattr_cache *c = extattr_cache_ref(self);
+    rb_scan_args(argc, argv, "0:", &opts);
+    VALUE max = hash_lookup(opts, ID2SYM(id_max_bytes), SIZET2NUM(EXTATTR_CACHE_MAX_BYTES_DEFAULT));
+    c->max_bytes = NUM2SIZET(max);
+    return self;
+}
+
+/*
+ * call-seq:
+ *  clear -> self
+ *
+ * 記憶した内容を全て捨てます。hits などの計数はそのままです。
+ */
+static VALUE
+extattr_cache_clear(VALUE self)
+{
+    extattr_cache_clear_entries(extattr_cache_ref(self));
+    return self;
+}
+
+/*
+ * call-seq:
+ *  hits -> integer
+ */
+static VALUE
+extattr_cache_hits(VALUE self)
+{
+    return SIZET2NUM(extattr_cache_ref(self)->hits);
+}
+
+/*
+ * call-seq:
+ *  misses -> integer
+ */
+static VALUE
+extattr_cache_misses(VALUE self)
+{
+    return SIZET2NUM(extattr_cache_ref(self)->misses);
+}
+
+/*
+ * call-seq:
+ *  max_bytes -> integer
+ */
+static VALUE
+extattr_cache_max_bytes(VALUE self)
+{
+    return SIZET2NUM(extattr_cache_ref(self)->max_bytes);
+}
+
+/*
+ * call-seq:
+ *  stats -> hash
+ *
+ * hits、misses、evictions (捨てた inode の数)、entries (記憶している inode の数)、
+ * bytes (見積もった大きさ)、max_bytes からなるハッシュを返します。
+ */
+static VALUE
+extattr_cache_stats(VALUE self)
+{
+    struct extattr_cache *c = extattr_cache_ref(self);
+    VALUE h = rb_hash_new();
+    rb_hash_aset(h, ID2SYM(id_hits), SIZET2NUM(c->hits));
+    rb_hash_aset(h, ID2SYM(id_misses), SIZET2NUM(c->misses));
+    rb_hash_aset(h, ID2SYM(id_evictions), SIZET2NUM(c->evictions));
+    rb_hash_aset(h, ID2SYM(id_entries), SIZET2NUM(c->inodes->num_entries));
+    rb_hash_aset(h, ID2SYM(id_bytes), SIZET2NUM(c->bytes));
+    rb_hash_aset(h, ID2SYM(id_max_bytes), SIZET2NUM(c->max_bytes));
+    return h;
+}
+
+static void
+extattr_cache_init(void)
+{
+    id_max_bytes = rb_intern("max_bytes");
+    id_errno = rb_intern("errno");
+    id_list = rb_intern("list");
+    id_hits = rb_intern("hits");
+    id_misses = rb_intern("misses");
+    id_evictions = rb_intern("evictions");
+    id_entries = rb_intern("entries");
+    id_bytes = rb_intern("bytes");
+
+    cCache = rb_define_class_under(mExtAttr, "Cache", rb_cObject);
+    rb_define_alloc_func(cCache, extattr_cache_alloc);
+    rb_define_method(cCache, "initialize", RUBY_METHOD_FUNC(extattr_cache_initialize), -1);
+    rb_define_method(cCache, "get", RUBY_METHOD_FUNC(extattr_cache_get), 3);
+    rb_define_method(cCache, "get!", RUBY_METHOD_FUNC(extattr_cache_get_link), 3);
+    rb_define_method(cCache, "list", RUBY_METHOD_FUNC(extattr_cache_list), 2);
+    rb_define_method(cCache, "list!", RUBY_METHOD_FUNC(extattr_cache_list_link), 2);
+    rb_define_method(cCache, "clear", RUBY_METHOD_FUNC(extattr_cache_clear), 0);
+    rb_define_method(cCache, "hits", RUBY_METHOD_FUNC(extattr_cache_hits), 0);
+    rb_define_method(cCache, "misses", RUBY_METHOD_FUNC(extattr_cache_misses), 0);
+    rb_define_method(cCache, "max_bytes", RUBY_METHOD_FUNC(extattr_cache_max_bytes), 0);
+    rb_define_method(cCache, "stats", RUBY_METHOD_FUNC(extattr_cache_stats), 0);
+}
@@ -29,31 +29,64 @@ get_extattr_list_size(ssize_t (*extattr_list)(), intptr_t d, VALUE filesrc, int
     return size;
 }
 
+struct extattr_list
+{
+    ssize_t (*extattr_list)();
+    intptr_t d;
+    VALUE filesrc;
+    int namespace1;
+    struct aux_scratch *scratch;
+    VALUE tmp;
+};
+
 static VALUE
-extattr_list_common(ssize_t (*extattr_list)(), intptr_t d, VALUE filesrc, int namespace1)
+extattr_list_body(VALUE arg)
 {
-    size_t size = get_extattr_list_size(extattr_list, d, filesrc, namespace1);
-    VALUE buf;
-    char *ptr = ALLOCV(buf, size);
+    struct extattr_list *p = (struct extattr_list *)arg;
+
+    size_t size = get_extattr_list_size(p->extattr_list, p->d, p->filesrc, p->namespace1);
+    char *ptr;
+    if (p->scratch) {
+        // 一覧はスレッドごとの作業領域に受け取り、名前だけを ruby の文字列にする。
+        ptr = aux_scratch_reserve(p->scratch, size);
+        if (!ptr) { rb_memerror(); }
+    } else {
+        ptr = rb_alloc_tmp_buffer(&p->tmp, size);
+    }
 
-    ssize_t size1 = extattr_list(d, namespace1, ptr, size);
-    if (size1 < 0) { aux_sys_fail(filesrc, "extattr_list"); }
+    ssize_t size1 = p->extattr_list(p->d, p->namespace1, ptr, size);
+    if (size1 < 0) { aux_sys_fail(p->filesrc, "extattr_list"); }
 
     VALUE list = Qnil;
     if (rb_block_given_p()) {
-        extattr_list_name(ptr, size1, filesrc,
+        extattr_list_name(ptr, size1, p->filesrc,
                           (void (*)(void *, VALUE))rb_yield_values, (void *)(1));
     } else {
         list = rb_ary_new();
-        OBJ_INFECT(list, filesrc);
-        extattr_list_name(ptr, size1, filesrc,
+        OBJ_INFECT(list, p->filesrc);
+        extattr_list_name(ptr, size1, p->filesrc,
                           (void (*)(void *, VALUE))rb_ary_push, (void *)list);
     }
-    ALLOCV_END(buf);
 
     return list;
 }
 
+static VALUE
+extattr_list_cleanup(VALUE arg)
+{
+    struct extattr_list *p = (struct extattr_list *)arg;
+    if (p->scratch) { aux_scratch_release(p->scratch); }
+    if (p->tmp) { rb_free_tmp_buffer(&p->tmp); }
+    return Qnil;
+}
+
+static VALUE
+extattr_list_common(ssize_t (*extattr_list)(), intptr_t d, VALUE filesrc, int namespace1)
+{
+    struct extattr_list p = { extattr_list, d, filesrc, namespace1, aux_scratch_acquire(), 0 };
+    return rb_ensure(extattr_list_body, (VALUE)&p, extattr_list_cleanup, (VALUE)&p);
+}
+
 static VALUE
 file_extattr_list_main(VALUE file, int fd, int namespace1)
 {
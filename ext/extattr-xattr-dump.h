@@ -0,0 +1,671 @@
+/*
+ * ExtAttr.dump / ExtAttr.restore の xattr による実装。
+ *
+ * ディレクトリツリーの拡張属性を、ファイルごとの長さ付きレコードとして書き出す。
+ * 書き出しは extattr-xattr-walk.h のワーカースレッドがレコードを組み立て、呼び出し元のスレッドは
+ * それを GVL を解放したまま書き込むだけとする。受け渡し待ちのレコード数には上限があるため、
+ * ツリーの大きさによらず使用するメモリは一定となる。
+ *
+ * 読み込みはダンプファイルを mmap して先頭から順に処理し、処理し終えた範囲は
+ * XATTR_DUMP_RELEASE_BYTES ごとに手放す。
+ *
+ * ファイルの形式 (全てリトルエンディアン):
+ *
+ *      "EXTADUMP"                          8 バイトの識別子
+ *      u32 version, u32 flags              flags は将来の圧縮のために予約 (現在は 0 のみ)
+ *      レコード ...
+ *      u32 0xffffffff, u64 nfiles, u64 nattrs
+ *                                          終端。これがなければ途中で切れたものとみなす
+ *
+ * レコード:
+ *
+ *      u32 pathlen, u8 kind, char path[pathlen], u32 nattrs,
+ *      (u8 namespace, u8 namelen, u32 valuelen, char name[namelen], char value[valuelen]) ...
+ *
+ * path はルートからの相対パス名で、ルート自身は空文字列。
+ * kind は 1 であればファイルを開いて (通常ファイルかディレクトリ)、0 であればパス名で操作する。
+ * name は名前空間の接頭辞を除いたもの。
+ */
+
+#include <sys/mman.h>
+
+#define EXTATTR_HAVE_DUMP 1
+
+#define XATTR_DUMP_MAGIC "EXTADUMP"
+
+enum {
+    XATTR_DUMP_VERSION = 1,
+    XATTR_DUMP_HEADER_SIZE = 16,
+    XATTR_DUMP_TRAILER_SIZE = 20,
+    XATTR_DUMP_END = 0xffffffffu,
+    XATTR_DUMP_KIND_PATH = 0,
+    XATTR_DUMP_KIND_OPEN = 1,
+    XATTR_DUMP_WRITE_BUFFER = 1 << 20,      // 書き込みをまとめる大きさ
+    XATTR_DUMP_RELEASE_BYTES = 64 << 20,    // 読み込みで、この大きさごとに処理済みの範囲を手放す
+};
+
+static ID id_dump_files, id_dump_attributes, id_dump_bytes, id_dump_missing, id_dump_failed;
+
+static inline void
+xattr_dump_put32(char *p, uint32_t n)
+{
+    p[0] = (char)n;
+    p[1] = (char)(n >> 8);
+    p[2] = (char)(n >> 16);
+    p[3] = (char)(n >> 24);
+}
+
+static inline void
+xattr_dump_put64(char *p, uint64_t n)
+{
+    xattr_dump_put32(p, (uint32_t)n);
+    xattr_dump_put32(p + 4, (uint32_t)(n >> 32));
+}
+
+static inline uint32_t
+xattr_dump_get32(const char *p)
+{
+    const unsigned char *u = (const unsigned char *)p;
+    return (uint32_t)u[0] | ((uint32_t)u[1] << 8) | ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+static inline uint64_t
+xattr_dump_get64(const char *p)
+{
+    return (uint64_t)xattr_dump_get32(p) | ((uint64_t)xattr_dump_get32(p + 4) << 32);
+}
+
+
+/*
+ * ExtAttr.dump の実装
+ */
+
+struct xattr_dump
+{
+    struct xattr_walk walk;
+    int namespace1;                     // EXTATTR_NAMESPACE_ALL であれば全ての名前空間
+    VALUE root;
+    VALUE dest;                         // パス名か IO オブジェクト
+    int fd;
+    int needclose;
+
+    struct xattr_walk_record *records;  // 書き込み待ちのレコード
+    struct xattr_walk_record *cursor;   // records のうち、次に out へ移すレコード
+    struct xattr_buf out;
+    size_t outpos;                      // out のうち書き出し終えた位置
+    int finish;                         // 0 でなければ、out を全て書き出す
+    int wait;                           // 書き出しを中断した理由 (EAGAIN か EINTR)。なければ 0
+    uint64_t nfiles, nattrs, bytes;
+
+    int err;
+    const char *funcname;
+};
+
+static void
+xattr_dump_visit(struct xattr_walk_worker *w, const struct xattr_target *t,
+                 const char *path, size_t pathlen, const char *relpath, size_t relpathlen)
+{
+    const struct xattr_dump *d = (const struct xattr_dump *)w->user;
+
+    if (relpathlen >= XATTR_DUMP_END) { return; }
+    if (xattr_target_list_into(t, &w->list) <= 0) { return; }
+
+    struct xattr_buf *b = &w->work;
+    char head[6];
+    b->size = 0;
+    xattr_dump_put32(head, (uint32_t)relpathlen);
+    head[4] = (t->fd >= 0 ? XATTR_DUMP_KIND_OPEN : XATTR_DUMP_KIND_PATH);
+    if (xattr_buf_append(b, head, 5) < 0 ||
+        xattr_buf_append(b, relpath, relpathlen) < 0 ||
+        xattr_buf_append(b, head, 4) < 0) {
+        return;
+    }
+    size_t countpos = b->size - 4;
+    uint32_t nattrs = 0;
+
+    const char *cursor = w->list.ptr;
+    const char *end = w->list.ptr + w->list.size;
+    const char *entry;
+    size_t n;
+    while ((entry = xattr_list_entry(&cursor, end, &n)) != NULL) {
+        size_t prefixlen;
+        int ns = xattr_namespace_of(entry, n, &prefixlen);
+        if (ns == EXTATTR_NAMESPACE_ALL) { continue; }
+        if (d->namespace1 != EXTATTR_NAMESPACE_ALL && ns != d->namespace1) { continue; }
+        size_t namelen = n - prefixlen;
+        if (namelen > UINT8_MAX) { continue; }
+
+        size_t mark = b->size;
+        head[0] = (char)ns;
+        head[1] = (char)namelen;
+        if (xattr_buf_append(b, head, 6) < 0 ||
+            xattr_buf_append(b, entry + prefixlen, namelen) < 0) {
+            return;
+        }
+        ssize_t size = xattr_target_get_into(t, entry, b);
+        if (size < 0 || (uint64_t)size >= XATTR_DUMP_END) {
+            // 一覧を取得した後に削除された場合など
+            b->size = mark;
+            continue;
+        }
+        xattr_dump_put32(b->ptr + mark + 2, (uint32_t)size);
+        nattrs++;
+    }
+
+    if (nattrs > 0) {
+        xattr_dump_put32(b->ptr + countpos, nattrs);
+        xattr_walk_emit(w, b->ptr, b->size);
+    }
+}
+
+/*
+ * out に溜めた内容を書き出す。
+ *
+ * 書き込めない (EAGAIN) か割り込まれた (EINTR) 場合は、書き出した所までを記録して 1 を返すので、
+ * GVL を取得した状態で xattr_dump_wait を呼んでから、もう一度呼び出すこと。
+ */
+static int
+xattr_dump_flush(struct xattr_dump *d)
+{
+    while (d->outpos < d->out.size) {
+        ssize_t n = write(d->fd, d->out.ptr + d->outpos, d->out.size - d->outpos);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+                d->wait = (errno == EINTR ? EINTR : EAGAIN);
+                return 1;
+            }
+            d->err = errno;
+            d->funcname = "write";
+            return -1;
+        }
+        d->outpos += n;
+        d->bytes += n;
+    }
+    d->out.size = d->outpos = 0;
+    return 0;
+}
+
+static int
+xattr_dump_put(struct xattr_dump *d, const void *ptr, size_t size)
+{
+    if (xattr_buf_append(&d->out, ptr, size) < 0) {
+        d->err = errno;
+        d->funcname = "realloc";
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * cursor 以降のレコードを out へ移しながら、溜まった分を書き出す。
+ * finish が 0 でなければ、最後に out を全て書き出す。
+ */
+static void *
+xattr_dump_write_nogvl(void *arg)
+{
+    struct xattr_dump *d = (struct xattr_dump *)arg;
+
+    d->wait = 0;
+    while (d->err == 0) {
+        if (d->out.size >= XATTR_DUMP_WRITE_BUFFER || (d->cursor == NULL && d->finish && d->out.size > 0)) {
+            if (xattr_dump_flush(d) != 0) { break; }
+            continue;
+        }
+        struct xattr_walk_record *r = d->cursor;
+        if (r == NULL) { break; }
+        d->cursor = r->next;
+        uint32_t pathlen = xattr_dump_get32(r->data);
+        d->nfiles++;
+        d->nattrs += xattr_dump_get32(r->data + 5 + pathlen);
+        xattr_dump_put(d, r->data, r->size);
+    }
+
+    return NULL;
+}
+
+/*
+ * 書き出しを中断した理由に応じて、書き込めるようになるまで待つか、割り込みを処理する。
+ * 中断していなければ 0 を返す。
+ */
+static int
+xattr_dump_wait(struct xattr_dump *d)
+{
+    switch (d->wait) {
+    case 0:
+        return 0;
+    case EINTR:
+        rb_thread_check_ints();
+        break;
+    default:
+#if RUBY_API_VERSION_CODE >= 30000
+        if (rb_obj_is_kind_of(d->dest, rb_cIO)) {
+            // ファイバースケジューラが有効であれば、それを通して待つ
+            rb_io_wait(d->dest, RB_INT2NUM(RUBY_IO_WRITABLE), Qnil);
+            break;
+        }
+#endif
+        rb_thread_fd_writable(d->fd);
+        break;
+    }
+    d->wait = 0;
+    return 1;
+}
+
+/*
+ * 書き出しが中断されても、割り込みを処理するか書き込めるまで待ってから続ける。
+ * 割り込みで例外が発生する場合は、そこで中断する。
+ */
+static void
+xattr_dump_write(struct xattr_dump *d)
+{
+    do {
+        aux_blocking_call(xattr_dump_write_nogvl, d);
+    } while (d->err == 0 && xattr_dump_wait(d));
+}
+
+static VALUE
+xattr_dump_free_records(VALUE arg)
+{
+    struct xattr_dump *d = (struct xattr_dump *)arg;
+    xattr_walk_record_free_all(d->records);
+    d->records = NULL;
+    return Qnil;
+}
+
+static VALUE
+xattr_dump_write_records(VALUE arg)
+{
+    struct xattr_dump *d = (struct xattr_dump *)arg;
+    d->cursor = d->records;
+    xattr_dump_write(d);
+    return Qnil;
+}
+
+static VALUE
+xattr_dump_body(VALUE arg)
+{
+    struct xattr_dump *d = (struct xattr_dump *)arg;
+
+    if (d->fd < 0) {
+        d->fd = open(RSTRING_PTR(d->dest), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (d->fd < 0) { aux_sys_fail(d->dest, "open"); }
+        d->needclose = 1;
+    }
+
+    char header[XATTR_DUMP_HEADER_SIZE];
+    memcpy(header, XATTR_DUMP_MAGIC, 8);
+    xattr_dump_put32(header + 8, XATTR_DUMP_VERSION);
+    xattr_dump_put32(header + 12, 0);
+    xattr_dump_put(d, header, sizeof(header));
+
+    if (xattr_walk_start(&d->walk, RSTRING_PTR(d->root), RSTRING_LEN(d->root)) < 1) {
+        errno = EAGAIN;
+        rb_sys_fail("pthread_create");
+    }
+
+    while (d->err == 0 && (d->records = xattr_walk_wait(&d->walk)) != NULL) {
+        rb_ensure(xattr_dump_write_records, arg, xattr_dump_free_records, arg);
+    }
+
+    if (d->err == 0) {
+        char trailer[XATTR_DUMP_TRAILER_SIZE];
+        xattr_dump_put32(trailer, XATTR_DUMP_END);
+        xattr_dump_put64(trailer + 4, d->nfiles);
+        xattr_dump_put64(trailer + 12, d->nattrs);
+        if (xattr_dump_put(d, trailer, sizeof(trailer)) == 0) {
+            d->finish = 1;
+            xattr_dump_write(d);
+        }
+    }
+
+    return Qnil;
+}
+
+static VALUE
+xattr_dump_cleanup(VALUE arg)
+{
+    struct xattr_dump *d = (struct xattr_dump *)arg;
+    xattr_walk_cleanup(&d->walk);
+    xattr_buf_free(&d->out);
+    if (d->needclose) {
+        close(d->fd);
+        d->needclose = 0;
+    }
+    return Qnil;
+}
+
+/*
+ * dest はパス名か、destfd にその記述子を与えた IO オブジェクト。
+ */
+static VALUE
+file_s_extattr_dump_main(VALUE root, VALUE dest, int destfd, int namespace1, int nthreads)
+{
+    if (nthreads < 1 || nthreads > XATTR_WALK_THREADS_MAX) {
+        rb_raise(rb_eArgError, "wrong number of threads - %d (expected 1..%d)",
+                 nthreads, XATTR_WALK_THREADS_MAX);
+    }
+    if (namespace1 != EXTATTR_NAMESPACE_ALL) {
+        size_t prefixlen;
+        xattr_prefix(namespace1, &prefixlen);
+    }
+
+    struct xattr_dump d;
+    memset(&d, 0, sizeof(d));
+    d.namespace1 = namespace1;
+    d.root = root = rb_str_new_frozen(root);
+    StringValueCStr(root);
+    d.fd = destfd;
+    if (destfd < 0) {
+        dest = rb_str_new_frozen(dest);
+        StringValueCStr(dest);
+    }
+    d.dest = dest;
+
+    xattr_walk_init(&d.walk, nthreads, xattr_dump_visit);
+    for (int i = 0; i < nthreads; i++) {
+        d.walk.workers[i].user = &d;
+    }
+
+    rb_ensure(xattr_dump_body, (VALUE)&d, xattr_dump_cleanup, (VALUE)&d);
+    RB_GC_GUARD(root);
+    RB_GC_GUARD(dest);
+
+    if (d.err != 0) {
+        // IO であればそのパス名を、なければ IO そのものを示す
+        VALUE name = dest;
+        if (destfd >= 0) {
+            ID id_path = rb_intern("path");
+            name = rb_respond_to(dest, id_path) ? rb_funcall(dest, id_path, 0) : Qnil;
+            name = NIL_P(name) ? rb_inspect(dest) : rb_String(name);
+        }
+        rb_syserr_fail_str(d.err, rb_sprintf("%"PRIsVALUE" (%s error)", name, d.funcname));
+    }
+
+    VALUE stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(id_dump_files), ULL2NUM(d.nfiles));
+    rb_hash_aset(stats, ID2SYM(id_dump_attributes), ULL2NUM(d.nattrs));
+    rb_hash_aset(stats, ID2SYM(id_dump_bytes), ULL2NUM(d.bytes));
+    return stats;
+}
+
+
+/*
+ * ExtAttr.restore の実装
+ */
+
+struct xattr_restore
+{
+    const char *src;
+    const char *root;
+    int rootfd;
+
+    char *ptr;                          // ダンプファイルの写像
+    size_t size;
+    size_t pos;                         // 次に処理するレコードの位置 (中断した場合はここから再開する)
+    size_t released;                    // 手放した範囲の終わり
+
+    struct xattr_buf path;              // ヌル終端したレコードのパス名
+    uint64_t nrecords, nentries;        // 読んだレコードと拡張属性の数
+    uint64_t nfiles, nattrs, missing, failed;
+
+    int err;                            // EINVAL で funcname が NULL であれば、壊れたダンプファイル
+    int errroot;                        // ルートディレクトリで失敗した
+    const char *funcname;
+    volatile int cancel;
+};
+
+static void *
+xattr_restore_open_nogvl(void *arg)
+{
+    struct xattr_restore *p = (struct xattr_restore *)arg;
+    struct stat st;
+
+    int fd = open(p->src, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { p->err = errno; p->funcname = "open"; return NULL; }
+    if (fstat(fd, &st) < 0) {
+        p->err = errno;
+        p->funcname = "fstat";
+    } else if ((uint64_t)st.st_size < XATTR_DUMP_HEADER_SIZE + XATTR_DUMP_TRAILER_SIZE) {
+        p->err = EINVAL;
+    } else if ((p->ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        p->ptr = NULL;
+        p->err = errno;
+        p->funcname = "mmap";
+    } else {
+        p->size = st.st_size;
+        madvise(p->ptr, p->size, MADV_SEQUENTIAL);
+        const char *tail = p->ptr + p->size - XATTR_DUMP_TRAILER_SIZE;
+        if (memcmp(p->ptr, XATTR_DUMP_MAGIC, 8) != 0 ||
+            xattr_dump_get32(p->ptr + 8) != XATTR_DUMP_VERSION ||
+            xattr_dump_get32(p->ptr + 12) != 0 ||
+            xattr_dump_get32(tail) != XATTR_DUMP_END) {
+            p->err = EINVAL;
+        }
+        p->pos = XATTR_DUMP_HEADER_SIZE;
+    }
+    close(fd);
+
+    if (p->err == 0) {
+        p->rootfd = open(p->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (p->rootfd < 0) { p->err = errno; p->errroot = 1; p->funcname = "open"; }
+    }
+
+    return NULL;
+}
+
+/*
+ * レコードが指すファイルを用意する。見つからなければ 0 を、開けなければ -1 を返す。
+ *
+ * 連結したパス名は使わず、ルートディレクトリの記述子から xattr_target_beneath でたどる。
+ */
+static int
+xattr_restore_target(struct xattr_restore *p, const char *relpath, size_t relpathlen, int kind,
+                     struct xattr_target *t, char *procpath, int *pathfd)
+{
+    if (relpathlen == 0) {
+        xattr_target_fd(t, p->rootfd);
+        return 1;
+    }
+
+    // レコードのパス名はヌル終端されていない。
+    p->path.size = 0;
+    if (xattr_buf_reserve(&p->path, relpathlen + 1) < 0) { return -1; }
+    memcpy(p->path.ptr, relpath, relpathlen);
+    p->path.ptr[relpathlen] = '\0';
+
+    return xattr_target_beneath(t, p->rootfd, p->path.ptr, (kind == XATTR_DUMP_KIND_OPEN), procpath, pathfd);
+}
+
+/*
+ * レコードのパス名が、ルートの外を指したりヌルバイトを含んだりしていないかを確かめる。
+ */
+static int
+xattr_restore_path_ok(const char *path, size_t len)
+{
+    if (len == 0) { return 1; }
+    if (path[0] == '/' || memchr(path, '\0', len)) { return 0; }
+
+    const char *end = path + len;
+    while (path < end) {
+        const char *sep = memchr(path, '/', end - path);
+        if (!sep) { sep = end; }
+        if (sep - path == 2 && path[0] == '.' && path[1] == '.') { return 0; }
+        path = sep + 1;
+    }
+
+    return 1;
+}
+
+/*
+ * pos のレコードを処理して、次のレコードの位置を返す。壊れていれば 0 を返す。
+ */
+static size_t
+xattr_restore_record(struct xattr_restore *p, size_t pos, size_t end)
+{
+    const char *ptr = p->ptr;
+    if (end - pos < 5) { return 0; }
+    uint32_t pathlen = xattr_dump_get32(ptr + pos);
+    int kind = (unsigned char)ptr[pos + 4];
+    pos += 5;
+    if (end - pos < (uint64_t)pathlen + 4) { return 0; }
+    const char *relpath = ptr + pos;
+    if (!xattr_restore_path_ok(relpath, pathlen)) { return 0; }
+    pos += pathlen;
+    uint32_t nattrs = xattr_dump_get32(ptr + pos);
+    pos += 4;
+
+    struct xattr_target t = { -1, 0, 0, NULL };
+    char procpath[EXTATTR_PROCPATH_SIZE];
+    int pathfd = -1;
+    int found = xattr_restore_target(p, relpath, pathlen, kind, &t, procpath, &pathfd);
+    if (found == 0) { p->missing++; }
+    if (found < 0) { p->failed++; }
+
+    int broken = 0;
+    for (uint32_t i = 0; i < nattrs; i++) {
+        if (end - pos < 6) { broken = 1; break; }
+        int ns = (unsigned char)ptr[pos];
+        size_t namelen = (unsigned char)ptr[pos + 1];
+        uint32_t valuelen = xattr_dump_get32(ptr + pos + 2);
+        pos += 6;
+        if (end - pos < (uint64_t)namelen + valuelen) { broken = 1; break; }
+        const char *name = ptr + pos;
+        const char *value = name + namelen;
+        pos += namelen + valuelen;
+
+        size_t prefixlen;
+        const char *prefix = (ns == EXTATTR_NAMESPACE_ALL ? NULL : xattr_prefix_lookup(ns, &prefixlen));
+        if (!prefix || namelen == 0 || prefixlen + namelen > XATTR_NAME_MAX || memchr(name, '\0', namelen)) {
+            broken = 1;
+            break;
+        }
+        p->nentries++;
+        if (found <= 0) { continue; }
+
+        char namebuf[XATTR_NAME_MAX + 1];
+        memcpy(namebuf, prefix, prefixlen);
+        memcpy(namebuf + prefixlen, name, namelen);
+        namebuf[prefixlen + namelen] = '\0';
+        if (xattr_target_set(&t, namebuf, value, valuelen, 0) == 0) {
+            p->nattrs++;
+        } else if (errno == ENOENT && t.fd < 0) {
+            // パス名で操作する項目が見つからなかった
+            p->missing++;
+            found = 0;
+        } else {
+            p->failed++;
+        }
+    }
+    xattr_target_close(&t);
+    if (pathfd >= 0) { close(pathfd); }
+
+    if (broken) { return 0; }
+    p->nrecords++;
+    if (found > 0) { p->nfiles++; }
+    return pos;
+}
+
+static void *
+xattr_restore_nogvl(void *arg)
+{
+    struct xattr_restore *p = (struct xattr_restore *)arg;
+    size_t end = p->size - XATTR_DUMP_TRAILER_SIZE;
+
+    while (!p->cancel && p->pos < end) {
+        size_t next = xattr_restore_record(p, p->pos, end);
+        if (next == 0) {
+            p->err = EINVAL;
+            return NULL;
+        }
+        p->pos = next;
+
+        // 処理し終えた範囲のページを手放して、写像が占めるメモリを一定に保つ。
+        if (p->pos - p->released >= XATTR_DUMP_RELEASE_BYTES) {
+            size_t pagesize = (size_t)sysconf(_SC_PAGESIZE);
+            size_t upto = p->pos / pagesize * pagesize;
+            madvise(p->ptr + p->released, upto - p->released, MADV_DONTNEED);
+            p->released = upto;
+        }
+    }
+
+    // 終端に記録した件数と、実際に読んだ件数を比べる。
+    const char *tail = p->ptr + end;
+    if (p->pos == end &&
+        (xattr_dump_get64(tail + 4) != p->nrecords || xattr_dump_get64(tail + 12) != p->nentries)) {
+        p->err = EINVAL;
+    }
+
+    return NULL;
+}
+
+static VALUE
+xattr_restore_body(VALUE arg)
+{
+    struct xattr_restore *p = (struct xattr_restore *)arg;
+
+    aux_blocking_call(xattr_restore_open_nogvl, p);
+    if (p->err != 0) { return Qnil; }
+
+    do {
+        p->cancel = 0;
+        aux_blocking_call_cancelable(xattr_restore_nogvl, p, &p->cancel);
+    } while (p->cancel && p->err == 0);
+
+    return Qnil;
+}
+
+static VALUE
+xattr_restore_cleanup(VALUE arg)
+{
+    struct xattr_restore *p = (struct xattr_restore *)arg;
+    if (p->ptr) {
+        munmap(p->ptr, p->size);
+        p->ptr = NULL;
+    }
+    if (p->rootfd >= 0) {
+        close(p->rootfd);
+        p->rootfd = -1;
+    }
+    xattr_buf_free(&p->path);
+    return Qnil;
+}
+
+static VALUE
+file_s_extattr_restore_main(VALUE src, VALUE root)
+{
+    struct xattr_restore work;
+    memset(&work, 0, sizeof(work));
+    work.rootfd = -1;
+    src = rb_str_new_frozen(src);
+    root = rb_str_new_frozen(root);
+    work.src = StringValueCStr(src);
+    work.root = StringValueCStr(root);
+
+    rb_ensure(xattr_restore_body, (VALUE)&work, xattr_restore_cleanup, (VALUE)&work);
+    RB_GC_GUARD(src);
+    RB_GC_GUARD(root);
+
+    if (work.err == EINVAL && !work.funcname) {
+        rb_raise(rb_eRuntimeError, "corrupted extattr dump - %"PRIsVALUE, src);
+    } else if (work.err != 0) {
+        errno = work.err;
+        aux_sys_fail(work.errroot ? root : src, work.funcname);
+    }
+
+    VALUE stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(id_dump_files), ULL2NUM(work.nfiles));
+    rb_hash_aset(stats, ID2SYM(id_dump_attributes), ULL2NUM(work.nattrs));
+    rb_hash_aset(stats, ID2SYM(id_dump_missing), ULL2NUM(work.missing));
+    rb_hash_aset(stats, ID2SYM(id_dump_failed), ULL2NUM(work.failed));
+    return stats;
+}
+
+static void
+xattr_dump_init(void)
+{
+    id_dump_files = rb_intern("files");
+    id_dump_attributes = rb_intern("attributes");
+    id_dump_bytes = rb_intern("bytes");
+    id_dump_missing = rb_intern("missing");
+    id_dump_failed = rb_intern("failed");
+}
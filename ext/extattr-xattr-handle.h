@@ -0,0 +1,528 @@
+/*
+ * ExtAttr::Handle の xattr による実装。
+ *
+ * 開いたままのファイル記述子を保持して、f*xattr を直接呼び出す。
+ * 読み込みのために開けないファイル (権限がない、シンボリックリンクそのものである、など) は
+ * O_PATH で開き、"/proc/self/fd/N" を経由して操作する。
+ * いずれの場合も、利用者が与えたパス名の解決は最初の一度だけで済む。
+ *
+ * ExtAttr.get_at などの、ディレクトリからの相対パス名による操作も同じ仕組みで行う。
+ *
+ * 操作は GVL を解放して行うため、その間に他のスレッドから close されても記述子を閉じずに、
+ * 使い終わった時に閉じる (閉じた番号が別のファイルに再利用されて、無関係なファイルを操作しないように)。
+ */
+
+#define EXTATTR_HAVE_HANDLE 1
+#define EXTATTR_HAVE_AT 1
+
+static VALUE cHandle;
+static ID id_follow, id_fileno;
+
+struct xattr_handle
+{
+    int fd;
+    int pathfd;                 // O_PATH で開いたため f*xattr が使えない
+    VALUE path;                 // 利用者が与えたパス名 (例外の表示用)
+    VALUE procpath;             // pathfd の場合の "/proc/self/fd/N"
+    int busy;                   // 使用中の操作の数 (GVL で保護される)
+    int closing;                // close が呼ばれたので、busy が 0 になった時に閉じる
+};
+
+static void
+xattr_handle_mark(void *ptr)
+{
+    struct xattr_handle *h = (struct xattr_handle *)ptr;
+    rb_gc_mark(h->path);
+    rb_gc_mark(h->procpath);
+}
+
+static void
+xattr_handle_free(void *ptr)
+{
+    struct xattr_handle *h = (struct xattr_handle *)ptr;
+    if (h->fd >= 0) { close(h->fd); }
+    xfree(h);
+}
+
+static size_t
+xattr_handle_memsize(const void *ptr)
+{
+    return sizeof(struct xattr_handle);
+}
+
+static const rb_data_type_t xattr_handle_type = {
+    "extattr.handle",
+    { xattr_handle_mark, xattr_handle_free, xattr_handle_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+xattr_handle_alloc(VALUE klass)
+{
+    struct xattr_handle *h;
+    VALUE obj = TypedData_Make_Struct(klass, struct xattr_handle, &xattr_handle_type, h);
+    h->fd = -1;
+    h->path = Qnil;
+    h->procpath = Qnil;
+    return obj;
+}
+
+static struct xattr_handle *
+xattr_handle_ref(VALUE obj)
+{
+    struct xattr_handle *h = rb_check_typeddata(obj, &xattr_handle_type);
+    if (h->fd < 0 || h->closing) { rb_raise(rb_eIOError, "closed handle"); }
+    return h;
+}
+
+static struct xattr_handle *
+xattr_handle_acquire(VALUE obj)
+{
+    struct xattr_handle *h = xattr_handle_ref(obj);
+    h->busy++;
+    return h;
+}
+
+static void
+xattr_handle_release(struct xattr_handle *h)
+{
+    if (--h->busy == 0 && h->closing) {
+        close(h->fd);
+        h->fd = -1;
+        h->closing = 0;
+    }
+}
+
+struct xattr_handle_open
+{
+    int dirfd;
+    const char *name;
+    int nofollow;
+    int fd;
+    int pathfd;
+    int err;
+};
+
+static void *
+xattr_handle_open_nogvl(void *arg)
+{
+    struct xattr_handle_open *p = (struct xattr_handle_open *)arg;
+    p->fd = xattr_open_checked(p->dirfd, p->name, p->nofollow, 0, &p->pathfd);
+    p->err = errno;
+    return NULL;
+}
+
+static int
+xattr_handle_dirfd(VALUE dir)
+{
+    if (rb_typeddata_is_kind_of(dir, &xattr_handle_type)) {
+        return xattr_handle_ref(dir)->fd;
+    } else if (RB_INTEGER_TYPE_P(dir)) {
+        return NUM2INT(dir);
+    } else {
+        return NUM2INT(rb_funcall2(dir, id_fileno, 0, NULL));
+    }
+}
+
+/*
+ * dirfd からの相対パス名 path を開いて h に設定する。
+ *
+ * 通常ファイルとディレクトリ以外や、読み込みのために開けない場合は O_PATH で開き、"/proc/self/fd/N" を経由して操作する。
+ */
+static void
+xattr_handle_open(struct xattr_handle *h, int dirfd, VALUE path, int follow)
+{
+    struct xattr_handle_open args = { dirfd, StringValueCStr(path), (follow ? 0 : O_NOFOLLOW), -1, -1, 0 };
+    do {
+        aux_blocking_call(xattr_handle_open_nogvl, &args);
+    } while (args.fd < 0 && args.pathfd < 0 && args.err == EINTR);
+
+    int fd = args.fd;
+    int pathfd = 0;
+    if (fd < 0 && args.pathfd >= 0) {
+        fd = args.pathfd;
+        pathfd = 1;
+    }
+    errno = args.err;
+    if (fd < 0) { aux_sys_fail(path, "open"); }
+
+    h->fd = fd;
+    h->pathfd = pathfd;
+    h->path = path;
+    h->procpath = (pathfd ? rb_str_freeze(rb_sprintf("/proc/self/fd/%d", fd)) : Qnil);
+}
+
+struct xattr_handle_open_in
+{
+    struct xattr_handle *h;
+    struct xattr_handle *dir;
+    VALUE path;
+    int follow;
+};
+
+static VALUE
+xattr_handle_open_in_body(VALUE arg)
+{
+    struct xattr_handle_open_in *p = (struct xattr_handle_open_in *)arg;
+    xattr_handle_open(p->h, p->dir->fd, p->path, p->follow);
+    return Qnil;
+}
+
+static VALUE
+xattr_handle_open_in_ensure(VALUE arg)
+{
+    xattr_handle_release(((struct xattr_handle_open_in *)arg)->dir);
+    return Qnil;
+}
+
+/*
+ * dir からの相対パス名 path を開いて h に設定する。
+ *
+ * dir が ExtAttr::Handle であれば、開き終わるまでそれを使用中とする。
+ */
+static void
+xattr_handle_open_in(struct xattr_handle *h, VALUE dir, VALUE path, int follow)
+{
+    if (!rb_typeddata_is_kind_of(dir, &xattr_handle_type)) {
+        xattr_handle_open(h, xattr_handle_dirfd(dir), path, follow);
+        return;
+    }
+
+    struct xattr_handle_open_in args = { h, xattr_handle_acquire(dir), path, follow };
+    rb_ensure(xattr_handle_open_in_body, (VALUE)&args, xattr_handle_open_in_ensure, (VALUE)&args);
+    RB_GC_GUARD(dir);
+}
+
+enum {
+    XATTR_OP_LIST,
+    XATTR_OP_SIZE,
+    XATTR_OP_GET,
+    XATTR_OP_SET,
+    XATTR_OP_DELETE,
+    XATTR_OP_GET_MANY,
+    XATTR_OP_TO_H,
+};
+
+/*
+ * 開いている h に対して op を行う。
+ */
+static VALUE
+xattr_handle_call(const struct xattr_handle *h, int op, int namespace1, VALUE name, VALUE data)
+{
+    if (h->pathfd) {
+        switch (op) {
+        case XATTR_OP_LIST:     return file_s_extattr_list_main(h->procpath, namespace1);
+        case XATTR_OP_SIZE:     return file_s_extattr_size_main(h->procpath, namespace1, name);
+        case XATTR_OP_GET:      return file_s_extattr_get_main(h->procpath, namespace1, name);
+        case XATTR_OP_SET:      return file_s_extattr_set_main(h->procpath, namespace1, name, data);
+        case XATTR_OP_DELETE:   return file_s_extattr_delete_main(h->procpath, namespace1, name);
+        case XATTR_OP_GET_MANY: return file_s_extattr_get_many_main(h->procpath, namespace1, name);
+        case XATTR_OP_TO_H:     return file_s_extattr_to_h_main(h->procpath, namespace1);
+        }
+    } else {
+        switch (op) {
+        case XATTR_OP_LIST:     return file_extattr_list_main(h->path, h->fd, namespace1);
+        case XATTR_OP_SIZE:     return file_extattr_size_main(h->path, h->fd, namespace1, name);
+        case XATTR_OP_GET:      return file_extattr_get_main(h->path, h->fd, namespace1, name);
+        case XATTR_OP_SET:      return file_extattr_set_main(h->path, h->fd, namespace1, name, data);
+        case XATTR_OP_DELETE:   return file_extattr_delete_main(h->path, h->fd, namespace1, name);
+        case XATTR_OP_GET_MANY: return file_extattr_get_many_main(h->path, h->fd, namespace1, name);
+        case XATTR_OP_TO_H:     return file_extattr_to_h_main(h->path, h->fd, namespace1);
+        }
+    }
+
+    rb_bug("unknown xattr operation - %d", op);
+}
+
+struct xattr_handle_use
+{
+    struct xattr_handle *h;
+    int op;
+    int namespace1;
+    VALUE name;
+    VALUE data;
+};
+
+static VALUE
+xattr_handle_use_body(VALUE arg)
+{
+    struct xattr_handle_use *p = (struct xattr_handle_use *)arg;
+    return xattr_handle_call(p->h, p->op, p->namespace1, p->name, p->data);
+}
+
+static VALUE
+xattr_handle_use_ensure(VALUE arg)
+{
+    xattr_handle_release(((struct xattr_handle_use *)arg)->h);
+    return Qnil;
+}
+
+/*
+ * self に対して op を行う。その間は使用中として、他のスレッドから閉じられても記述子を閉じない。
+ */
+static VALUE
+xattr_handle_use(VALUE self, int op, int namespace1, VALUE name, VALUE data)
+{
+    struct xattr_handle_use use = { xattr_handle_acquire(self), op, namespace1, name, data };
+    VALUE v = rb_ensure(xattr_handle_use_body, (VALUE)&use, xattr_handle_use_ensure, (VALUE)&use);
+    RB_GC_GUARD(self);
+    return v;
+}
+
+/*
+ * call-seq:
+ *  new(path, follow: true) -> handle
+ *  new(dir, name, follow: true) -> handle
+ *
+ * path を開いて、拡張属性を繰り返し操作するためのハンドルを作成します。
+ *
+ * dir と name を与えた場合は、ディレクトリ dir からの相対パス名として name を開きます。
+ * dir には Dir、File、ExtAttr::Handle またはファイル記述子を与えることが出来ます。
+ *
+ * follow に偽を与えると、シンボリックリンクをたどりません。
+ */
+static VALUE
+xattr_handle_initialize(int argc, VALUE argv[], VALUE self)
+{
+    VALUE dir, path, opts;
+    struct xattr_handle *h = rb_check_typeddata(self, &xattr_handle_type);
+    if (h->fd >= 0) { rb_raise(rb_eRuntimeError, "already initialized"); }
+
+    rb_scan_args(argc, argv, "11:", &dir, &path, &opts);
+    int follow = RTEST(hash_lookup(opts, ID2SYM(id_follow), Qtrue));
+    if (NIL_P(path)) {
+        path = aux_to_path(dir);
+        ext_check_path_security(path, Qnil, Qnil);
+        xattr_handle_open(h, AT_FDCWD, rb_str_new_frozen(path), follow);
+    } else {
+        path = aux_to_path(path);
+        ext_check_path_security(path, Qnil, Qnil);
+        xattr_handle_open_in(h, dir, rb_str_new_frozen(path), follow);
+    }
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  list(namespace = ExtAttr::USER) -> names array
+ *  list(namespace = ExtAttr::USER) { |name| ... } -> nil
+ */
+static VALUE
+xattr_handle_list(int argc, VALUE argv[], VALUE self)
+{
+    rb_check_arity(argc, 0, 1);
+    return xattr_handle_use(self, XATTR_OP_LIST, conv_namespace_list(argc > 0 ? argv[0] : Qnil), Qnil, Qnil);
+}
+
+/*
+ * call-seq:
+ *  size(namespace, name) -> size
+ */
+static VALUE
+xattr_handle_size(VALUE self, VALUE namespace, VALUE name)
+{
+    return xattr_handle_use(self, XATTR_OP_SIZE, conv_namespace(namespace),
+                            aux_should_be_name(name), Qnil);
+}
+
+/*
+ * call-seq:
+ *  get(namespace, name) -> data
+ */
+static VALUE
+xattr_handle_get(VALUE self, VALUE namespace, VALUE name)
+{
+    return xattr_handle_use(self, XATTR_OP_GET, conv_namespace(namespace),
+                            aux_should_be_name(name), Qnil);
+}
+
+/*
+ * call-seq:
+ *  set(namespace, name, data) -> nil
+ */
+static VALUE
+xattr_handle_set(VALUE self, VALUE namespace, VALUE name, VALUE data)
+{
+    return xattr_handle_use(self, XATTR_OP_SET, conv_namespace(namespace),
+                            aux_should_be_name(name), aux_should_be_string(data));
+}
+
+/*
+ * call-seq:
+ *  delete(namespace, name) -> nil
+ */
+static VALUE
+xattr_handle_delete(VALUE self, VALUE namespace, VALUE name)
+{
+    return xattr_handle_use(self, XATTR_OP_DELETE, conv_namespace(namespace),
+                            aux_should_be_name(name), Qnil);
+}
+
+/*
+ * call-seq:
+ *  get_many(namespace, names) -> hash
+ */
+static VALUE
+xattr_handle_get_many(VALUE self, VALUE namespace, VALUE names)
+{
+    return xattr_handle_use(self, XATTR_OP_GET_MANY, conv_namespace(namespace),
+                            rb_convert_type(names, RUBY_T_ARRAY, "Array", "to_ary"), Qnil);
+}
+
+/*
+ * call-seq:
+ *  to_h(namespace = ExtAttr::USER) -> hash
+ */
+static VALUE
+xattr_handle_to_h(int argc, VALUE argv[], VALUE self)
+{
+    rb_check_arity(argc, 0, 1);
+    return xattr_handle_use(self, XATTR_OP_TO_H, conv_namespace(argc > 0 ? argv[0] : Qnil), Qnil, Qnil);
+}
+
+/*
+ * call-seq:
+ *  fileno -> integer
+ */
+static VALUE
+xattr_handle_fileno(VALUE self)
+{
+    return INT2NUM(xattr_handle_ref(self)->fd);
+}
+
+/*
+ * call-seq:
+ *  path -> string
+ */
+static VALUE
+xattr_handle_path(VALUE self)
+{
+    return ((struct xattr_handle *)rb_check_typeddata(self, &xattr_handle_type))->path;
+}
+
+/*
+ * call-seq:
+ *  close -> nil
+ *
+ * ファイル記述子を閉じます。閉じた後の操作は IOError 例外となります。
+ *
+ * 他のスレッドが操作している最中であれば、その操作が終わった時に閉じます。
+ */
+static VALUE
+xattr_handle_close(VALUE self)
+{
+    struct xattr_handle *h = rb_check_typeddata(self, &xattr_handle_type);
+    if (h->busy > 0) {
+        h->closing = 1;
+    } else if (h->fd >= 0) {
+        int fd = h->fd;
+        h->fd = -1;
+        if (close(fd) < 0) { aux_sys_fail(h->path, "close"); }
+    }
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  closed? -> true or false
+ */
+static VALUE
+xattr_handle_closed_p(VALUE self)
+{
+    struct xattr_handle *h = rb_check_typeddata(self, &xattr_handle_type);
+    return (h->fd < 0 || h->closing ? Qtrue : Qfalse);
+}
+
+/*
+ * *_at の作業領域。
+ *
+ * 一時的に開いた h に対して op を行い、例外が発生した場合でも必ず閉じる。
+ */
+struct xattr_at
+{
+    struct xattr_handle h;
+    int op;
+    int namespace1;
+    VALUE name;
+    VALUE data;
+};
+
+static VALUE
+extattr_at_body(VALUE arg)
+{
+    struct xattr_at *p = (struct xattr_at *)arg;
+    return xattr_handle_call(&p->h, p->op, p->namespace1, p->name, p->data);
+}
+
+static VALUE
+extattr_at_cleanup(VALUE arg)
+{
+    struct xattr_at *p = (struct xattr_at *)arg;
+    close(p->h.fd);
+    p->h.fd = -1;
+    return Qnil;
+}
+
+static VALUE
+extattr_at_common(int op, VALUE dir, VALUE path, int follow, int namespace1, VALUE name, VALUE data)
+{
+    struct xattr_at at = { { -1, 0, Qnil, Qnil, 0, 0 }, op, namespace1, name, data };
+    xattr_handle_open_in(&at.h, dir, path, follow);
+    VALUE v = rb_ensure(extattr_at_body, (VALUE)&at, extattr_at_cleanup, (VALUE)&at);
+    RB_GC_GUARD(path);
+    RB_GC_GUARD(at.h.procpath);
+    return v;
+}
+
+static VALUE
+file_s_extattr_list_at_main(VALUE dir, VALUE path, int follow, int namespace1)
+{
+    return extattr_at_common(XATTR_OP_LIST, dir, path, follow, namespace1, Qnil, Qnil);
+}
+
+static VALUE
+file_s_extattr_size_at_main(VALUE dir, VALUE path, int follow, int namespace1, VALUE name)
+{
+    return extattr_at_common(XATTR_OP_SIZE, dir, path, follow, namespace1, name, Qnil);
+}
+
+static VALUE
+file_s_extattr_get_at_main(VALUE dir, VALUE path, int follow, int namespace1, VALUE name)
+{
+    return extattr_at_common(XATTR_OP_GET, dir, path, follow, namespace1, name, Qnil);
+}
+
+static VALUE
+file_s_extattr_set_at_main(VALUE dir, VALUE path, int follow, int namespace1, VALUE name, VALUE data)
+{
+    return extattr_at_common(XATTR_OP_SET, dir, path, follow, namespace1, name, data);
+}
+
+static VALUE
+file_s_extattr_delete_at_main(VALUE dir, VALUE path, int follow, int namespace1, VALUE name)
+{
+    return extattr_at_common(XATTR_OP_DELETE, dir, path, follow, namespace1, name, Qnil);
+}
+
+static void
+xattr_handle_init(void)
+{
+    id_follow = rb_intern("follow");
+    id_fileno = rb_intern("fileno");
+
+    cHandle = rb_define_class_under(mExtAttr, "Handle", rb_cObject);
+    rb_define_alloc_func(cHandle, xattr_handle_alloc);
+    rb_define_method(cHandle, "initialize", RUBY_METHOD_FUNC(xattr_handle_initialize), -1);
+    rb_define_method(cHandle, "list", RUBY_METHOD_FUNC(xattr_handle_list), -1);
+    rb_define_method(cHandle, "size", RUBY_METHOD_FUNC(xattr_handle_size), 2);
+    rb_define_method(cHandle, "get", RUBY_METHOD_FUNC(xattr_handle_get), 2);
+    rb_define_method(cHandle, "set", RUBY_METHOD_FUNC(xattr_handle_set), 3);
+    rb_define_method(cHandle, "delete", RUBY_METHOD_FUNC(xattr_handle_delete), 2);
+    rb_define_method(cHandle, "get_many", RUBY_METHOD_FUNC(xattr_handle_get_many), 2);
+    rb_define_method(cHandle, "to_h", RUBY_METHOD_FUNC(xattr_handle_to_h), -1);
+    rb_define_method(cHandle, "fileno", RUBY_METHOD_FUNC(xattr_handle_fileno), 0);
+    rb_define_method(cHandle, "path", RUBY_METHOD_FUNC(xattr_handle_path), 0);
+    rb_define_method(cHandle, "close", RUBY_METHOD_FUNC(xattr_handle_close), 0);
+    rb_define_method(cHandle, "closed?", RUBY_METHOD_FUNC(xattr_handle_closed_p), 0);
+}
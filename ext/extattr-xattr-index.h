@@ -0,0 +1,1180 @@
+/*
+ * ExtAttr::Index の xattr による実装。
+ *
+ * ディレクトリツリーをたどって得た拡張属性を、(名前, 値) から inode への転置索引としてファイルに書き出す。
+ * 索引ファイルは mmap で読み込み、問い合わせはファイルシステムに触れずに二分探索だけで答える。
+ *
+ * ファイルの形式 (全てネイティブのバイト順。各区画は 8 バイト境界に置く):
+ *
+ *      header                          struct xattr_index_header
+ *      files[nfiles]                   パス名の順に並べたファイルの表
+ *      names[nnames]                   名前の順に並べた拡張属性名の表
+ *      keys[nkeys]                     (名前, 値) の順に並べた表。同じ名前のものは連続する
+ *      postings[nrefs]                 キーごとのファイル番号 (昇順)
+ *      forward[nrefs]                  ファイルごとのキー番号 (昇順)
+ *      strings                         パス名、名前、値の実体
+ *
+ * forward は問い合わせには使わず、refresh で変更のないファイルの拡張属性を読み直さずに
+ * 引き継ぐために用いる。変更の有無は inode と st_ctime で判断して、作成を始めた時点で
+ * ctime からの経過が XATTR_INDEX_RACY_NSEC 以内のファイルは信用しない
+ * (ExtAttr::Cache と同じ理由による)。
+ *
+ * 書き出しは同じディレクトリに mkstemp で作った一時ファイルに行い、fsync してから rename で置き換えるため、
+ * 読み込み中の索引も、同じ索引ファイルを更新する他のオブジェクトの書き出しも壊れない。
+ */
+
+#include <sys/mman.h>
+#include <time.h>
+
+#define EXTATTR_HAVE_INDEX 1
+
+#define XATTR_INDEX_MAGIC "EXTATIDX"
+#define XATTR_INDEX_BYTEORDER 0x01020304u
+#define XATTR_INDEX_RACY_NSEC (20 * 1000 * 1000LL)
+
+enum {
+    XATTR_INDEX_VERSION = 1,
+};
+
+static VALUE cIndex;
+static ID id_index_files, id_index_keys, id_index_bytes, id_index_reused, id_index_scanned;
+
+struct xattr_index_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteorder;
+    uint32_t namespace1;
+    uint32_t reserved;
+    int64_t stamp_sec;                  // 作成を始めた時刻
+    int64_t stamp_nsec;
+    uint64_t nfiles, nnames, nkeys, nrefs;
+    uint64_t root_off, root_len;        // strings からの位置
+    uint64_t files_off, names_off, keys_off, postings_off, forward_off, strings_off;
+    uint64_t size;
+};
+
+struct xattr_index_file
+{
+    uint64_t dev;
+    uint64_t ino;
+    int64_t ctime_sec;
+    uint32_t ctime_nsec;
+    uint32_t pathlen;
+    uint64_t pathoff;
+    uint64_t fwd;                       // forward の開始位置
+    uint64_t nfwd;
+};
+
+struct xattr_index_name
+{
+    uint64_t off;
+    uint64_t len;
+    uint64_t key;                       // keys の開始位置
+    uint64_t nkeys;
+};
+
+struct xattr_index_key
+{
+    uint64_t valueoff;
+    uint64_t valuelen;
+    uint64_t post;                      // postings の開始位置
+    uint64_t npost;
+    uint64_t name;
+};
+
+/*
+ * 読み込んだ索引。
+ */
+struct xattr_index_map
+{
+    char *ptr;
+    size_t size;
+    const struct xattr_index_header *header;
+    const struct xattr_index_file *files;
+    const struct xattr_index_name *names;
+    const struct xattr_index_key *keys;
+    const uint32_t *postings;
+    const uint32_t *forward;
+    const char *strings;
+    uint64_t strsize;
+};
+
+struct xattr_index
+{
+    struct xattr_index_map map;
+    VALUE path;                         // 索引ファイルのパス名
+    size_t reused, scanned;             // 直前の作成での、引き継いだファイルと読み直したファイルの数
+    int busy;                           // refresh でワーカーが map を参照している
+};
+
+static void
+xattr_index_map_release(struct xattr_index_map *m)
+{
+    if (m->ptr) { munmap(m->ptr, m->size); }
+    memset(m, 0, sizeof(*m));
+}
+
+static void
+xattr_index_mark(void *ptr)
+{
+    struct xattr_index *ix = (struct xattr_index *)ptr;
+    rb_gc_mark(ix->path);
+}
+
+static void
+xattr_index_free(void *ptr)
+{
+    struct xattr_index *ix = (struct xattr_index *)ptr;
+    xattr_index_map_release(&ix->map);
+    xfree(ix);
+}
+
+static size_t
+xattr_index_memsize(const void *ptr)
+{
+    // 索引の本体はファイルの写像であるため、数えない。
+    return sizeof(struct xattr_index);
+}
+
+static const rb_data_type_t xattr_index_type = {
+    "extattr.index",
+    { xattr_index_mark, xattr_index_free, xattr_index_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static struct xattr_index *
+xattr_index_ref(VALUE obj)
+{
+    return rb_check_typeddata(obj, &xattr_index_type);
+}
+
+static struct xattr_index *
+xattr_index_ref_open(VALUE obj)
+{
+    struct xattr_index *ix = xattr_index_ref(obj);
+    if (!ix->map.ptr) { rb_raise(rb_eIOError, "closed extattr index"); }
+    return ix;
+}
+
+NORETURN(static void xattr_index_corrupted(const struct xattr_index *ix));
+
+static void
+xattr_index_corrupted(const struct xattr_index *ix)
+{
+    rb_raise(rb_eRuntimeError, "corrupted extattr index - %"PRIsVALUE, ix->path);
+}
+
+static int
+xattr_index_bytes_cmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+    int cmp = memcmp(a, b, (alen < blen ? alen : blen));
+    if (cmp != 0) { return cmp; }
+    return (alen < blen ? -1 : alen > blen ? 1 : 0);
+}
+
+/*
+ * strings の範囲外を指していれば NULL を返す。
+ */
+static const char *
+xattr_index_string(const struct xattr_index_map *m, uint64_t off, uint64_t len)
+{
+    if (off > m->strsize || len > m->strsize - off) { return NULL; }
+    return m->strings + off;
+}
+
+static int
+xattr_index_section_ok(uint64_t off, uint64_t count, size_t elemsize, uint64_t size)
+{
+    return (off % 8 == 0 && off <= size && count <= (size - off) / elemsize);
+}
+
+/*
+ * 写像した内容の見出しを確かめて、各区画の位置を求める。
+ * 各要素の中身は、それを参照する時に確かめる。
+ */
+static int
+xattr_index_map_setup(struct xattr_index_map *m)
+{
+    const struct xattr_index_header *h = (const struct xattr_index_header *)m->ptr;
+    if (m->size < sizeof(*h) ||
+        memcmp(h->magic, XATTR_INDEX_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != XATTR_INDEX_VERSION ||
+        h->byteorder != XATTR_INDEX_BYTEORDER ||
+        h->size != m->size ||
+        h->nfiles > UINT32_MAX || h->nkeys > UINT32_MAX ||
+        !xattr_index_section_ok(h->files_off, h->nfiles, sizeof(struct xattr_index_file), h->size) ||
+        !xattr_index_section_ok(h->names_off, h->nnames, sizeof(struct xattr_index_name), h->size) ||
+        !xattr_index_section_ok(h->keys_off, h->nkeys, sizeof(struct xattr_index_key), h->size) ||
+        !xattr_index_section_ok(h->postings_off, h->nrefs, sizeof(uint32_t), h->size) ||
+        !xattr_index_section_ok(h->forward_off, h->nrefs, sizeof(uint32_t), h->size) ||
+        h->strings_off > h->size) {
+        return -1;
+    }
+
+    m->header = h;
+    m->files = (const struct xattr_index_file *)(m->ptr + h->files_off);
+    m->names = (const struct xattr_index_name *)(m->ptr + h->names_off);
+    m->keys = (const struct xattr_index_key *)(m->ptr + h->keys_off);
+    m->postings = (const uint32_t *)(m->ptr + h->postings_off);
+    m->forward = (const uint32_t *)(m->ptr + h->forward_off);
+    m->strings = m->ptr + h->strings_off;
+    m->strsize = h->size - h->strings_off;
+
+    if (!xattr_index_string(m, h->root_off, h->root_len)) { return -1; }
+
+    return 0;
+}
+
+struct xattr_index_load
+{
+    const char *path;
+    struct xattr_index_map map;
+    int err;
+    const char *funcname;
+};
+
+static void *
+xattr_index_load_nogvl(void *arg)
+{
+    struct xattr_index_load *p = (struct xattr_index_load *)arg;
+    struct stat st;
+    void *ptr;
+
+    int fd = open(p->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { p->err = errno; p->funcname = "open"; return NULL; }
+    if (fstat(fd, &st) < 0) {
+        p->err = errno;
+        p->funcname = "fstat";
+    } else if ((uint64_t)st.st_size < sizeof(struct xattr_index_header)) {
+        p->err = EINVAL;
+    } else if ((ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        p->err = errno;
+        p->funcname = "mmap";
+    } else {
+        p->map.ptr = ptr;
+        p->map.size = st.st_size;
+        if (xattr_index_map_setup(&p->map) < 0) {
+            xattr_index_map_release(&p->map);
+            p->err = EINVAL;
+        }
+    }
+    close(fd);
+
+    return NULL;
+}
+
+/*
+ * path の索引ファイルを読み込んで ix の写像を置き換える。
+ */
+static void
+xattr_index_load(struct xattr_index *ix, VALUE path)
+{
+    struct xattr_index_load load = { StringValueCStr(path) };
+    aux_blocking_call(xattr_index_load_nogvl, &load);
+    RB_GC_GUARD(path);
+
+    if (load.err == EINVAL && !load.funcname) {
+        rb_raise(rb_eRuntimeError, "not an extattr index - %"PRIsVALUE, path);
+    } else if (load.err != 0) {
+        errno = load.err;
+        aux_sys_fail(path, load.funcname);
+    }
+
+    xattr_index_map_release(&ix->map);
+    ix->map = load.map;
+}
+
+
+/*
+ * 索引の作成
+ *
+ * ワーカーが出力するレコードの形式:
+ *      struct xattr_index_rec, char path[pathlen],
+ *      (uint32_t namelen, uint32_t valuelen, char name[namelen], char value[valuelen]) ...
+ *
+ * 以前の索引から引き継ぐ場合は、拡張属性は続かない。
+ */
+
+struct xattr_index_rec
+{
+    uint64_t dev;
+    uint64_t ino;
+    int64_t ctime_sec;
+    uint32_t ctime_nsec;
+    uint32_t pathlen;
+    uint32_t old;                       // 引き継ぐ以前のファイル番号 + 1。読み直した場合は 0
+    uint32_t npairs;
+};
+
+/*
+ * 並べ替えの単位。(名前, 値, ファイル番号) の組。
+ */
+struct xattr_index_triple
+{
+    const char *name;
+    const char *value;
+    uint32_t namelen;
+    uint32_t valuelen;
+    uint32_t file;
+};
+
+struct xattr_index_build
+{
+    struct xattr_walk walk;
+    int namespace1;
+    const struct xattr_index_map *old;  // 引き継ぎ元 (なければ NULL)
+    struct timespec stamp;
+
+    struct xattr_walk_record *head, *tail;
+    size_t nrecs;
+
+    const char *root;
+    size_t rootlen;
+    char *dest;                         // 書き出す一時ファイル (mkstemp のテンプレート)
+    const char *path;                   // 置き換える索引ファイル
+
+    size_t reused, scanned;
+    int err;
+    const char *funcname;
+};
+
+static int
+xattr_index_find_file(const struct xattr_index_map *m, const char *path, size_t pathlen, uint32_t *id)
+{
+    uint64_t lo = 0, hi = m->header->nfiles;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const struct xattr_index_file *f = &m->files[mid];
+        const char *p = xattr_index_string(m, f->pathoff, f->pathlen);
+        if (!p) { return 0; }
+        int cmp = xattr_index_bytes_cmp(p, f->pathlen, path, pathlen);
+        if (cmp == 0) { *id = (uint32_t)mid; return 1; }
+        if (cmp < 0) { lo = mid + 1; } else { hi = mid; }
+    }
+    return 0;
+}
+
+static int
+xattr_index_file_fresh(const struct xattr_index_map *m, uint32_t id, const struct stat *st)
+{
+    const struct xattr_index_header *h = m->header;
+    const struct xattr_index_file *f = &m->files[id];
+    if (f->dev != (uint64_t)st->st_dev || f->ino != (uint64_t)st->st_ino ||
+        f->ctime_sec != (int64_t)st->st_ctim.tv_sec || f->ctime_nsec != (uint32_t)st->st_ctim.tv_nsec) {
+        return 0;
+    }
+    if (f->fwd > h->nrefs || f->nfwd > h->nrefs - f->fwd) { return 0; }
+
+    int64_t age = (h->stamp_sec - f->ctime_sec) * 1000000000LL + (h->stamp_nsec - (int64_t)f->ctime_nsec);
+    return age > XATTR_INDEX_RACY_NSEC;
+}
+
+static void
+xattr_index_visit(struct xattr_walk_worker *w, const struct xattr_target *t,
+                  const char *path, size_t pathlen, const char *relpath, size_t relpathlen)
+{
+    const struct xattr_index_build *b = (const struct xattr_index_build *)w->user;
+    struct stat st;
+    int ret = (t->fd >= 0 ? fstat(t->fd, &st) : t->follow ? stat(t->path, &st) : lstat(t->path, &st));
+    if (ret < 0 || pathlen > UINT32_MAX) { return; }
+
+    struct xattr_index_rec rec = { 0 };
+    rec.dev = st.st_dev;
+    rec.ino = st.st_ino;
+    rec.ctime_sec = st.st_ctim.tv_sec;
+    rec.ctime_nsec = st.st_ctim.tv_nsec;
+    rec.pathlen = pathlen;
+
+    uint32_t id;
+    if (b->old && xattr_index_find_file(b->old, path, pathlen, &id) &&
+        xattr_index_file_fresh(b->old, id, &st)) {
+        rec.old = id + 1;
+    }
+
+    struct xattr_buf *out = &w->work;
+    out->size = 0;
+    if (xattr_buf_append(out, &rec, sizeof(rec)) < 0 ||
+        xattr_buf_append(out, path, pathlen) < 0) {
+        return;
+    }
+
+    // 拡張属性を扱えないファイルシステムなどでは、拡張属性のないファイルとして記録する。
+    if (!rec.old && xattr_target_list_into(t, &w->list) > 0) {
+        size_t prefixlen;
+        xattr_prefix_lookup(b->namespace1, &prefixlen);
+
+        const char *cursor = w->list.ptr;
+        const char *end = w->list.ptr + w->list.size;
+        const char *namep;
+        size_t namelen;
+        while ((namep = xattr_list_next(&cursor, end, b->namespace1, &namelen)) != NULL) {
+            size_t mark = out->size;
+            uint32_t lens[2] = { namelen, 0 };
+            if (xattr_buf_append(out, lens, sizeof(lens)) < 0 ||
+                xattr_buf_append(out, namep, namelen) < 0) {
+                return;
+            }
+            ssize_t size = xattr_target_get_into(t, namep - prefixlen, out);
+            if (size < 0 || (uint64_t)size > UINT32_MAX) {
+                // 一覧を取得した後に削除された場合など
+                out->size = mark;
+                continue;
+            }
+            lens[1] = size;
+            memcpy(out->ptr + mark, lens, sizeof(lens));
+            rec.npairs++;
+        }
+        memcpy(out->ptr, &rec, sizeof(rec));
+    }
+
+    xattr_walk_emit(w, out->ptr, out->size);
+}
+
+static int
+xattr_index_rec_cmp(const void *a, const void *b)
+{
+    const struct xattr_walk_record *ra = *(const struct xattr_walk_record *const *)a;
+    const struct xattr_walk_record *rb = *(const struct xattr_walk_record *const *)b;
+    struct xattr_index_rec ha, hb;
+    memcpy(&ha, ra->data, sizeof(ha));
+    memcpy(&hb, rb->data, sizeof(hb));
+    return xattr_index_bytes_cmp(ra->data + sizeof(ha), ha.pathlen, rb->data + sizeof(hb), hb.pathlen);
+}
+
+static int
+xattr_index_triple_cmp(const void *a, const void *b)
+{
+    const struct xattr_index_triple *ta = (const struct xattr_index_triple *)a;
+    const struct xattr_index_triple *tb = (const struct xattr_index_triple *)b;
+    int cmp = xattr_index_bytes_cmp(ta->name, ta->namelen, tb->name, tb->namelen);
+    if (cmp == 0) { cmp = xattr_index_bytes_cmp(ta->value, ta->valuelen, tb->value, tb->valuelen); }
+    if (cmp == 0) { cmp = (ta->file < tb->file ? -1 : ta->file > tb->file ? 1 : 0); }
+    return cmp;
+}
+
+static uint64_t
+xattr_index_align(uint64_t off)
+{
+    return (off + 7) & ~(uint64_t)7;
+}
+
+/*
+ * 以前の索引の、ファイル id が持つ (名前, 値) を triples に追加する。
+ */
+static int
+xattr_index_inherit(const struct xattr_index_map *m, uint32_t id, uint32_t file,
+                    struct xattr_index_triple *triples, size_t *n)
+{
+    const struct xattr_index_file *f = &m->files[id];
+    for (uint64_t i = 0; i < f->nfwd; i++) {
+        uint32_t k = m->forward[f->fwd + i];
+        if (k >= m->header->nkeys) { return -1; }
+        const struct xattr_index_key *key = &m->keys[k];
+        if (key->name >= m->header->nnames) { return -1; }
+        const struct xattr_index_name *name = &m->names[key->name];
+        const char *namep = xattr_index_string(m, name->off, name->len);
+        const char *valuep = xattr_index_string(m, key->valueoff, key->valuelen);
+        if (!namep || !valuep || name->len > UINT32_MAX || key->valuelen > UINT32_MAX) { return -1; }
+
+        struct xattr_index_triple *t = &triples[(*n)++];
+        t->name = namep;
+        t->namelen = name->len;
+        t->value = valuep;
+        t->valuelen = key->valuelen;
+        t->file = file;
+    }
+    return 0;
+}
+
+/*
+ * 集めたレコードから索引を組み立てて、b->dest に書き出す。
+ */
+static int
+xattr_index_write(struct xattr_index_build *b, struct xattr_walk_record **recs, uint64_t *fwdpos)
+{
+    const struct xattr_index_map *old = b->old;
+    size_t nfiles = b->nrecs;
+    struct xattr_index_triple *triples = NULL;
+    size_t ntriples = 0, total = 0;
+    int fd = -1;
+    char *ptr = MAP_FAILED;
+    uint64_t size = 0;
+    int ret = -1;
+    int created = 0;
+
+    qsort(recs, nfiles, sizeof(*recs), xattr_index_rec_cmp);
+
+    for (size_t i = 0; i < nfiles; i++) {
+        struct xattr_index_rec rec;
+        memcpy(&rec, recs[i]->data, sizeof(rec));
+        total += (rec.old ? old->files[rec.old - 1].nfwd : rec.npairs);
+    }
+    if (total > 0 && !(triples = malloc(sizeof(*triples) * total))) {
+        b->err = ENOMEM;
+        return -1;
+    }
+
+    uint64_t pathbytes = 0;
+    for (size_t i = 0; i < nfiles; i++) {
+        struct xattr_index_rec rec;
+        memcpy(&rec, recs[i]->data, sizeof(rec));
+        pathbytes += rec.pathlen;
+        fwdpos[i] = 0;
+        if (rec.old) {
+            b->reused++;
+            if (xattr_index_inherit(old, rec.old - 1, i, triples, &ntriples) < 0) {
+                b->err = EINVAL;
+                goto done;
+            }
+            continue;
+        }
+
+        b->scanned++;
+        const char *p = recs[i]->data + sizeof(rec) + rec.pathlen;
+        for (uint32_t j = 0; j < rec.npairs; j++) {
+            uint32_t lens[2];
+            memcpy(lens, p, sizeof(lens));
+            p += sizeof(lens);
+            struct xattr_index_triple *t = &triples[ntriples++];
+            t->name = p;
+            t->namelen = lens[0];
+            t->value = p + lens[0];
+            t->valuelen = lens[1];
+            t->file = i;
+            p += lens[0] + lens[1];
+        }
+    }
+
+    if (ntriples > 0) { qsort(triples, ntriples, sizeof(*triples), xattr_index_triple_cmp); }
+
+    // 名前とキーを数えて、各区画の大きさを決める。
+    uint64_t nnames = 0, nkeys = 0, strbytes = b->rootlen + pathbytes;
+    for (size_t i = 0; i < ntriples; i++) {
+        const struct xattr_index_triple *t = &triples[i];
+        const struct xattr_index_triple *prev = (i > 0 ? &triples[i - 1] : NULL);
+        int newname = !prev || xattr_index_bytes_cmp(prev->name, prev->namelen, t->name, t->namelen) != 0;
+        if (newname) { nnames++; strbytes += t->namelen; }
+        if (newname || xattr_index_bytes_cmp(prev->value, prev->valuelen, t->value, t->valuelen) != 0) {
+            nkeys++;
+            strbytes += t->valuelen;
+        }
+        fwdpos[t->file]++;
+    }
+    if (nkeys > UINT32_MAX) { b->err = EOVERFLOW; goto done; }
+
+    struct xattr_index_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, XATTR_INDEX_MAGIC, sizeof(h.magic));
+    h.version = XATTR_INDEX_VERSION;
+    h.byteorder = XATTR_INDEX_BYTEORDER;
+    h.namespace1 = b->namespace1;
+    h.stamp_sec = b->stamp.tv_sec;
+    h.stamp_nsec = b->stamp.tv_nsec;
+    h.nfiles = nfiles;
+    h.nnames = nnames;
+    h.nkeys = nkeys;
+    h.nrefs = ntriples;
+    h.files_off = xattr_index_align(sizeof(h));
+    h.names_off = xattr_index_align(h.files_off + sizeof(struct xattr_index_file) * nfiles);
+    h.keys_off = xattr_index_align(h.names_off + sizeof(struct xattr_index_name) * nnames);
+    h.postings_off = xattr_index_align(h.keys_off + sizeof(struct xattr_index_key) * nkeys);
+    h.forward_off = xattr_index_align(h.postings_off + sizeof(uint32_t) * ntriples);
+    h.strings_off = xattr_index_align(h.forward_off + sizeof(uint32_t) * ntriples);
+    h.size = size = h.strings_off + strbytes;
+    h.root_off = 0;
+    h.root_len = b->rootlen;
+
+    fd = mkostemp(b->dest, O_CLOEXEC);
+    if (fd < 0) { b->err = errno; b->funcname = "mkstemp"; goto done; }
+    created = 1;
+    // mkstemp は 0600 で作るため、以前と同じく誰でも読めるようにする。
+    if (fchmod(fd, 0644) < 0) { b->err = errno; b->funcname = "fchmod"; goto done; }
+    if (ftruncate(fd, size) < 0) { b->err = errno; b->funcname = "ftruncate"; goto done; }
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) { b->err = errno; b->funcname = "mmap"; goto done; }
+
+    struct xattr_index_file *files = (struct xattr_index_file *)(ptr + h.files_off);
+    struct xattr_index_name *names = (struct xattr_index_name *)(ptr + h.names_off);
+    struct xattr_index_key *keys = (struct xattr_index_key *)(ptr + h.keys_off);
+    uint32_t *postings = (uint32_t *)(ptr + h.postings_off);
+    uint32_t *forward = (uint32_t *)(ptr + h.forward_off);
+    char *strings = ptr + h.strings_off;
+    uint64_t stroff = 0;
+
+    memcpy(strings, b->root, b->rootlen);
+    stroff += b->rootlen;
+
+    uint64_t fwd = 0;
+    for (size_t i = 0; i < nfiles; i++) {
+        struct xattr_index_rec rec;
+        memcpy(&rec, recs[i]->data, sizeof(rec));
+        struct xattr_index_file *f = &files[i];
+        f->dev = rec.dev;
+        f->ino = rec.ino;
+        f->ctime_sec = rec.ctime_sec;
+        f->ctime_nsec = rec.ctime_nsec;
+        f->pathlen = rec.pathlen;
+        f->pathoff = stroff;
+        memcpy(strings + stroff, recs[i]->data + sizeof(rec), rec.pathlen);
+        stroff += rec.pathlen;
+        f->fwd = fwd;
+        f->nfwd = fwdpos[i];
+        fwdpos[i] = fwd;
+        fwd += f->nfwd;
+    }
+
+    // triples はキーの順に並んでいるため、postings はキーごとに、forward はファイルごとに昇順となる。
+    int64_t name = -1, key = -1;
+    for (size_t i = 0; i < ntriples; i++) {
+        const struct xattr_index_triple *t = &triples[i];
+        const struct xattr_index_triple *prev = (i > 0 ? &triples[i - 1] : NULL);
+        int newname = !prev || xattr_index_bytes_cmp(prev->name, prev->namelen, t->name, t->namelen) != 0;
+        if (newname) {
+            struct xattr_index_name *n = &names[++name];
+            n->off = stroff;
+            n->len = t->namelen;
+            n->key = key + 1;
+            n->nkeys = 0;
+            memcpy(strings + stroff, t->name, t->namelen);
+            stroff += t->namelen;
+        }
+        if (newname || xattr_index_bytes_cmp(prev->value, prev->valuelen, t->value, t->valuelen) != 0) {
+            struct xattr_index_key *k = &keys[++key];
+            k->valueoff = stroff;
+            k->valuelen = t->valuelen;
+            k->post = i;
+            k->npost = 0;
+            k->name = name;
+            names[name].nkeys++;
+            memcpy(strings + stroff, t->value, t->valuelen);
+            stroff += t->valuelen;
+        }
+        keys[key].npost++;
+        postings[i] = t->file;
+        forward[fwdpos[t->file]++] = key;
+    }
+
+    memcpy(ptr, &h, sizeof(h));
+
+    if (munmap(ptr, size) < 0) { ptr = MAP_FAILED; b->err = errno; b->funcname = "munmap"; goto done; }
+    ptr = MAP_FAILED;
+    // 置き換えた後に電源断などで中身のない索引が残らないように、内容を書き込んでから rename する。
+    if (fsync(fd) < 0) { b->err = errno; b->funcname = "fsync"; goto done; }
+    if (close(fd) < 0) { fd = -1; b->err = errno; b->funcname = "close"; goto done; }
+    fd = -1;
+    if (rename(b->dest, b->path) < 0) { b->err = errno; b->funcname = "rename"; goto done; }
+    ret = 0;
+
+done:
+    if (ptr != MAP_FAILED) { munmap(ptr, size); }
+    if (fd >= 0) { close(fd); }
+    if (ret < 0 && created) { unlink(b->dest); }
+    free(triples);
+    return ret;
+}
+
+static void *
+xattr_index_write_nogvl(void *arg)
+{
+    struct xattr_index_build *b = (struct xattr_index_build *)arg;
+    struct xattr_walk_record **recs = malloc(sizeof(*recs) * (b->nrecs > 0 ? b->nrecs : 1));
+    uint64_t *fwdpos = malloc(sizeof(*fwdpos) * (b->nrecs > 0 ? b->nrecs : 1));
+
+    if (b->nrecs > UINT32_MAX) {
+        b->err = EOVERFLOW;
+    } else if (!recs || !fwdpos) {
+        b->err = ENOMEM;
+    } else {
+        size_t i = 0;
+        for (struct xattr_walk_record *r = b->head; r; r = r->next) { recs[i++] = r; }
+        xattr_index_write(b, recs, fwdpos);
+    }
+
+    free(fwdpos);
+    free(recs);
+    return NULL;
+}
+
+static VALUE
+xattr_index_build_body(VALUE arg)
+{
+    struct xattr_index_build *b = (struct xattr_index_build *)arg;
+    struct xattr_walk *walk = &b->walk;
+
+    clock_gettime(CLOCK_REALTIME, &b->stamp);
+    if (xattr_walk_start(walk, b->root, b->rootlen) < 1) {
+        errno = EAGAIN;
+        rb_sys_fail("pthread_create");
+    }
+
+    struct xattr_walk_record *records;
+    while ((records = xattr_walk_wait(walk)) != NULL) {
+        if (b->tail) {
+            b->tail->next = records;
+        } else {
+            b->head = records;
+        }
+        for (; records; records = records->next) {
+            b->tail = records;
+            b->nrecs++;
+        }
+    }
+
+    aux_blocking_call(xattr_index_write_nogvl, b);
+
+    return Qnil;
+}
+
+static VALUE
+xattr_index_build_cleanup(VALUE arg)
+{
+    struct xattr_index_build *b = (struct xattr_index_build *)arg;
+    xattr_walk_cleanup(&b->walk);
+    xattr_walk_record_free_all(b->head);
+    b->head = b->tail = NULL;
+    return Qnil;
+}
+
+static VALUE
+xattr_index_clear_busy(VALUE obj)
+{
+    xattr_index_ref(obj)->busy = 0;
+    return Qnil;
+}
+
+struct xattr_index_rebuild
+{
+    VALUE self;
+    struct xattr_index_build *build;
+};
+
+static VALUE
+xattr_index_rebuild_body(VALUE arg)
+{
+    struct xattr_index_rebuild *p = (struct xattr_index_rebuild *)arg;
+    return rb_ensure(xattr_index_build_body, (VALUE)p->build,
+                     xattr_index_build_cleanup, (VALUE)p->build);
+}
+
+/*
+ * root をたどって、ix の索引ファイルを作り直す。
+ * ix に読み込まれた索引があれば、変更のないファイルはそこから引き継ぐ。
+ */
+static void
+xattr_index_rebuild(VALUE self, VALUE root, int namespace1, int nthreads)
+{
+    struct xattr_index *ix = xattr_index_ref(self);
+    if (nthreads < 1 || nthreads > XATTR_WALK_THREADS_MAX) {
+        rb_raise(rb_eArgError, "wrong number of threads - %d (expected 1..%d)",
+                 nthreads, XATTR_WALK_THREADS_MAX);
+    }
+    if (ix->busy) { rb_raise(rb_eRuntimeError, "extattr index is being refreshed"); }
+
+    size_t prefixlen;
+    xattr_prefix(namespace1, &prefixlen);
+    root = rb_str_new_frozen(root);
+    // 一時ファイルの名前は、同じ索引ファイルを更新する他の Index オブジェクトと衝突しないように mkstemp で決める。
+    VALUE dest = rb_sprintf("%"PRIsVALUE".XXXXXX", ix->path);
+
+    struct xattr_index_build b;
+    memset(&b, 0, sizeof(b));
+    b.namespace1 = namespace1;
+    b.old = (ix->map.ptr && (int)ix->map.header->namespace1 == namespace1 ? &ix->map : NULL);
+    b.root = StringValueCStr(root);
+    b.rootlen = RSTRING_LEN(root);
+    b.dest = StringValueCStr(dest);
+    b.path = StringValueCStr(ix->path);
+
+    // 末尾の区切り文字は、ワーカーが出力するパス名と揃えるために取り除いておく。
+    while (b.rootlen > 1 && b.root[b.rootlen - 1] == '/') { b.rootlen--; }
+
+    xattr_walk_init(&b.walk, nthreads, xattr_index_visit);
+    for (int i = 0; i < nthreads; i++) {
+        b.walk.workers[i].user = &b;
+    }
+
+    struct xattr_index_rebuild arg = { self, &b };
+    ix->busy = 1;
+    rb_ensure(xattr_index_rebuild_body, (VALUE)&arg, xattr_index_clear_busy, self);
+    RB_GC_GUARD(root);
+    RB_GC_GUARD(dest);
+
+    if (b.err == EINVAL && !b.funcname) {
+        xattr_index_corrupted(ix);
+    } else if (b.err != 0) {
+        errno = b.err;
+        aux_sys_fail(b.funcname ? dest : ix->path, b.funcname);
+    }
+
+    xattr_index_load(ix, ix->path);
+    ix->reused = b.reused;
+    ix->scanned = b.scanned;
+}
+
+static VALUE
+xattr_index_new(VALUE path)
+{
+    struct xattr_index *ix;
+    VALUE obj = TypedData_Make_Struct(cIndex, struct xattr_index, &xattr_index_type, ix);
+    ix->path = rb_str_new_frozen(path);
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  build(index_path, root, namespace: ExtAttr::USER, threads: 4) -> index
+ *
+ * root 以下のディレクトリツリーを threads 個のネイティブスレッドでたどり、
+ * namespace の拡張属性の索引を index_path に作成します。
+ *
+ * シンボリックリンクはたどりません (root を除く)。
+ * 読めないファイルやディレクトリは無視されます。
+ */
+static VALUE
+xattr_index_s_build(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE path, root, opts;
+    rb_scan_args(argc, argv, "2:", &path, &root, &opts);
+    int nthreads = NUM2INT(hash_lookup(opts, ID2SYM(id_threads), INT2FIX(4)));
+    int namespace1 = conv_namespace(hash_lookup(opts, ID2SYM(id_namespace), Qnil));
+    path = aux_to_path(path);
+    root = aux_to_path(root);
+    ext_check_path_security(root, Qnil, Qnil);
+
+    VALUE obj = xattr_index_new(path);
+    xattr_index_rebuild(obj, root, namespace1, nthreads);
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  open(index_path) -> index
+ *
+ * 作成済みの索引ファイルを読み込みます。
+ */
+static VALUE
+xattr_index_s_open(VALUE mod, VALUE path)
+{
+    path = aux_to_path(path);
+    VALUE obj = xattr_index_new(path);
+    xattr_index_load(xattr_index_ref(obj), path);
+    return obj;
+}
+
+/*
+ * call-seq:
+ *  refresh(threads: 4) -> self
+ *
+ * 索引を作成したディレクトリツリーを再びたどり、索引ファイルを作り直します。
+ *
+ * inode と ctime が前回から変わっていないファイルは、拡張属性を読み直さずに引き継ぎます。
+ */
+static VALUE
+xattr_index_refresh(int argc, VALUE argv[], VALUE self)
+{
+    VALUE opts;
+    rb_scan_args(argc, argv, "0:", &opts);
+    int nthreads = NUM2INT(hash_lookup(opts, ID2SYM(id_threads), INT2FIX(4)));
+
+    struct xattr_index *ix = xattr_index_ref_open(self);
+    const struct xattr_index_header *h = ix->map.header;
+    const char *root = xattr_index_string(&ix->map, h->root_off, h->root_len);
+    xattr_index_rebuild(self, rb_str_new(root, h->root_len), h->namespace1, nthreads);
+
+    return self;
+}
+
+/*
+ * name に一致する names の要素を探す。見つからなければ NULL を返す。
+ */
+static const struct xattr_index_name *
+xattr_index_find_name(const struct xattr_index *ix, VALUE name)
+{
+    const struct xattr_index_map *m = &ix->map;
+    const char *namep;
+    long namelen;
+    RSTRING_GETMEM(name, namep, namelen);
+
+    uint64_t lo = 0, hi = m->header->nnames;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const struct xattr_index_name *n = &m->names[mid];
+        const char *p = xattr_index_string(m, n->off, n->len);
+        if (!p) { xattr_index_corrupted(ix); }
+        int cmp = xattr_index_bytes_cmp(p, n->len, namep, namelen);
+        if (cmp == 0) {
+            if (n->key > m->header->nkeys || n->nkeys > m->header->nkeys - n->key) {
+                xattr_index_corrupted(ix);
+            }
+            return n;
+        }
+        if (cmp < 0) { lo = mid + 1; } else { hi = mid; }
+    }
+
+    return NULL;
+}
+
+static const char *
+xattr_index_key_value(const struct xattr_index *ix, uint64_t k)
+{
+    const struct xattr_index_key *key = &ix->map.keys[k];
+    const char *p = xattr_index_string(&ix->map, key->valueoff, key->valuelen);
+    if (!p) { xattr_index_corrupted(ix); }
+    return p;
+}
+
+/*
+ * n のキーのうち、値が value 以上となる最初の位置を返す。
+ */
+static uint64_t
+xattr_index_lower_bound(const struct xattr_index *ix, const struct xattr_index_name *n,
+                        const char *value, size_t valuelen)
+{
+    uint64_t lo = n->key, hi = n->key + n->nkeys;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        const struct xattr_index_key *key = &ix->map.keys[mid];
+        const char *p = xattr_index_key_value(ix, mid);
+        if (xattr_index_bytes_cmp(p, key->valuelen, value, valuelen) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static VALUE
+xattr_index_file_path(const struct xattr_index *ix, uint32_t id)
+{
+    const struct xattr_index_map *m = &ix->map;
+    if (id >= m->header->nfiles) { xattr_index_corrupted(ix); }
+    const struct xattr_index_file *f = &m->files[id];
+    const char *p = xattr_index_string(m, f->pathoff, f->pathlen);
+    if (!p) { xattr_index_corrupted(ix); }
+    return rb_enc_str_new(p, f->pathlen, rb_filesystem_encoding());
+}
+
+static const uint32_t *
+xattr_index_key_postings(const struct xattr_index *ix, uint64_t k)
+{
+    const struct xattr_index_key *key = &ix->map.keys[k];
+    uint64_t nrefs = ix->map.header->nrefs;
+    if (key->post > nrefs || key->npost > nrefs - key->post) { xattr_index_corrupted(ix); }
+    return ix->map.postings + key->post;
+}
+
+static int
+xattr_index_id_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x < y ? -1 : x > y ? 1 : 0);
+}
+
+/*
+ * call-seq:
+ *  lookup(name, value) -> array
+ *
+ * 拡張属性 name の値が value と一致するファイルのパス名を、パス名の順に返します。
+ *
+ * 索引の内容だけを参照して、ファイルシステムには触れません。
+ */
+static VALUE
+xattr_index_lookup(VALUE self, VALUE name, VALUE value)
+{
+    struct xattr_index *ix = xattr_index_ref_open(self);
+    name = aux_name_string(aux_should_be_name(name));
+    StringValue(value);
+
+    VALUE list = rb_ary_new();
+    const struct xattr_index_name *n = xattr_index_find_name(ix, name);
+    if (!n) { return list; }
+
+    uint64_t k = xattr_index_lower_bound(ix, n, RSTRING_PTR(value), RSTRING_LEN(value));
+    if (k >= n->key + n->nkeys) { return list; }
+    const struct xattr_index_key *key = &ix->map.keys[k];
+    const char *p = xattr_index_key_value(ix, k);
+    if (xattr_index_bytes_cmp(p, key->valuelen, RSTRING_PTR(value), RSTRING_LEN(value)) != 0) {
+        return list;
+    }
+
+    const uint32_t *post = xattr_index_key_postings(ix, k);
+    for (uint64_t i = 0; i < key->npost; i++) {
+        rb_ary_push(list, xattr_index_file_path(ix, post[i]));
+    }
+
+    return list;
+}
+
+/*
+ * call-seq:
+ *  lookup_prefix(name, prefix) -> array
+ *
+ * 拡張属性 name の値が prefix で始まるファイルのパス名を、パス名の順に返します。
+ *
+ * 索引の内容だけを参照して、ファイルシステムには触れません。
+ */
+static VALUE
+xattr_index_lookup_prefix(VALUE self, VALUE name, VALUE prefix)
+{
+    struct xattr_index *ix = xattr_index_ref_open(self);
+    name = aux_name_string(aux_should_be_name(name));
+    StringValue(prefix);
+    const char *prefixp = RSTRING_PTR(prefix);
+    size_t prefixlen = RSTRING_LEN(prefix);
+
+    VALUE list = rb_ary_new();
+    const struct xattr_index_name *n = xattr_index_find_name(ix, name);
+    if (!n) { return list; }
+
+    // 値は辞書順に並んでいるため、接頭辞の一致するキーは連続する。
+    uint64_t first = xattr_index_lower_bound(ix, n, prefixp, prefixlen);
+    uint64_t last = first, total = 0;
+    for (; last < n->key + n->nkeys; last++) {
+        const struct xattr_index_key *key = &ix->map.keys[last];
+        const char *p = xattr_index_key_value(ix, last);
+        if (key->valuelen < prefixlen || memcmp(p, prefixp, prefixlen) != 0) { break; }
+        xattr_index_key_postings(ix, last);
+        total += key->npost;
+    }
+    if (total == 0) { return list; }
+
+    // 複数のキーに含まれるファイルを一つにまとめる。
+    VALUE tmp;
+    uint32_t *ids = ALLOCV_N(uint32_t, tmp, total);
+    size_t nids = 0;
+    for (uint64_t k = first; k < last; k++) {
+        const struct xattr_index_key *key = &ix->map.keys[k];
+        memcpy(ids + nids, ix->map.postings + key->post, sizeof(uint32_t) * key->npost);
+        nids += key->npost;
+    }
+    if (last - first > 1) { qsort(ids, nids, sizeof(*ids), xattr_index_id_cmp); }
+
+    for (size_t i = 0; i < nids; i++) {
+        if (i > 0 && ids[i] == ids[i - 1]) { continue; }
+        rb_ary_push(list, xattr_index_file_path(ix, ids[i]));
+    }
+    ALLOCV_END(tmp);
+
+    return list;
+}
+
+/*
+ * call-seq:
+ *  root -> string
+ */
+static VALUE
+xattr_index_root(VALUE self)
+{
+    struct xattr_index *ix = xattr_index_ref_open(self);
+    const struct xattr_index_header *h = ix->map.header;
+    const char *root = xattr_index_string(&ix->map, h->root_off, h->root_len);
+    return rb_enc_str_new(root, h->root_len, rb_filesystem_encoding());
+}
+
+/*
+ * call-seq:
+ *  namespace -> symbol
+ */
+static VALUE
+xattr_index_namespace(VALUE self)
+{
+    return aux_namespace_symbol(xattr_index_ref_open(self)->map.header->namespace1);
+}
+
+/*
+ * call-seq:
+ *  path -> string
+ *
+ * 索引ファイルのパス名を返します。
+ */
+static VALUE
+xattr_index_path(VALUE self)
+{
+    return xattr_index_ref(self)->path;
+}
+
+/*
+ * call-seq:
+ *  size -> integer
+ *
+ * 索引に含まれるファイルの数を返します。拡張属性を持たないファイルも数えます。
+ */
+static VALUE
+xattr_index_size(VALUE self)
+{
+    return ULL2NUM(xattr_index_ref_open(self)->map.header->nfiles);
+}
+
+/*
+ * call-seq:
+ *  stats -> hash
+ *
+ * 索引の規模と、直前の作成で引き継いだファイル (reused) と読み直したファイル (scanned) の数を返します。
+ * open で読み込んだだけの場合、reused と scanned は 0 です。
+ */
+static VALUE
+xattr_index_stats(VALUE self)
+{
+    struct xattr_index *ix = xattr_index_ref_open(self);
+    const struct xattr_index_header *h = ix->map.header;
+    VALUE stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(id_index_files), ULL2NUM(h->nfiles));
+    rb_hash_aset(stats, ID2SYM(id_names), ULL2NUM(h->nnames));
+    rb_hash_aset(stats, ID2SYM(id_index_keys), ULL2NUM(h->nkeys));
+    rb_hash_aset(stats, ID2SYM(id_index_bytes), SIZET2NUM(ix->map.size));
+    rb_hash_aset(stats, ID2SYM(id_index_reused), SIZET2NUM(ix->reused));
+    rb_hash_aset(stats, ID2SYM(id_index_scanned), SIZET2NUM(ix->scanned));
+    return stats;
+}
+
+/*
+ * call-seq:
+ *  close -> nil
+ *
+ * 索引の写像を解放します。
+ */
+static VALUE
+xattr_index_close(VALUE self)
+{
+    struct xattr_index *ix = xattr_index_ref(self);
+    if (ix->busy) { rb_raise(rb_eRuntimeError, "extattr index is being refreshed"); }
+    xattr_index_map_release(&ix->map);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  closed? -> true or false
+ */
+static VALUE
+xattr_index_closed_p(VALUE self)
+{
+    return (xattr_index_ref(self)->map.ptr ? Qfalse : Qtrue);
+}
+
+static void
+xattr_index_init(void)
+{
+    id_index_files = rb_intern("files");
+    id_index_keys = rb_intern("keys");
+    id_index_bytes = rb_intern("bytes");
+    id_index_reused = rb_intern("reused");
+    id_index_scanned = rb_intern("scanned");
+
+    cIndex = rb_define_class_under(mExtAttr, "Index", rb_cObject);
+    rb_undef_alloc_func(cIndex);
+    rb_define_singleton_method(cIndex, "build", RUBY_METHOD_FUNC(xattr_index_s_build), -1);
+    rb_define_singleton_method(cIndex, "open", RUBY_METHOD_FUNC(xattr_index_s_open), 1);
+    rb_define_method(cIndex, "refresh", RUBY_METHOD_FUNC(xattr_index_refresh), -1);
+    rb_define_method(cIndex, "lookup", RUBY_METHOD_FUNC(xattr_index_lookup), 2);
+    rb_define_method(cIndex, "lookup_prefix", RUBY_METHOD_FUNC(xattr_index_lookup_prefix), 2);
+    rb_define_method(cIndex, "root", RUBY_METHOD_FUNC(xattr_index_root), 0);
+    rb_define_method(cIndex, "namespace", RUBY_METHOD_FUNC(xattr_index_namespace), 0);
+    rb_define_method(cIndex, "path", RUBY_METHOD_FUNC(xattr_index_path), 0);
+    rb_define_method(cIndex, "size", RUBY_METHOD_FUNC(xattr_index_size), 0);
+    rb_define_method(cIndex, "stats", RUBY_METHOD_FUNC(xattr_index_stats), 0);
+    rb_define_method(cIndex, "close", RUBY_METHOD_FUNC(xattr_index_close), 0);
+    rb_define_method(cIndex, "closed?", RUBY_METHOD_FUNC(xattr_index_closed_p), 0);
+}
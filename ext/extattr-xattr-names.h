@@ -0,0 +1,287 @@
+/*
+ * ExtAttr::NameIterator の xattr による実装。
+ *
+ * listxattr で得た一覧をそのまま保持して、名前の文字列は取り出す時に一つずつ作成する。
+ * 外部イテレータ (next / peek / rewind) は Fiber を使わず、一覧の中の位置を進めるだけで済む。
+ * each は next とは別に先頭から辿るため、途中で抜け出せば残りの名前は作成されない。
+ */
+
+#define EXTATTR_HAVE_NAME_ITERATOR 1
+
+static VALUE cNameIterator;
+
+struct xattr_names
+{
+    struct xattr_buf list;
+    size_t cursor;              // next で次に調べる、list.ptr からの位置
+    long count;                 // 名前の数。数えていなければ -1
+    int namespace1;
+    VALUE path;                 // 一覧を取得したファイルかパス名 (例外の表示用)
+};
+
+static void
+xattr_names_mark(void *ptr)
+{
+    struct xattr_names *n = (struct xattr_names *)ptr;
+    rb_gc_mark(n->path);
+}
+
+static void
+xattr_names_free(void *ptr)
+{
+    struct xattr_names *n = (struct xattr_names *)ptr;
+    xattr_buf_free(&n->list);
+    xfree(n);
+}
+
+static size_t
+xattr_names_memsize(const void *ptr)
+{
+    const struct xattr_names *n = (const struct xattr_names *)ptr;
+    return sizeof(struct xattr_names) + n->list.capa;
+}
+
+static const rb_data_type_t xattr_names_type = {
+    "extattr.name_iterator",
+    { xattr_names_mark, xattr_names_free, xattr_names_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static struct xattr_names *
+xattr_names_ref(VALUE obj)
+{
+    return rb_check_typeddata(obj, &xattr_names_type);
+}
+
+/*
+ * 一覧の offset の位置から次の名前を取り出して、offset を進める。
+ *
+ * ExtAttr::ALL であれば [名前空間, 名前] の組を返す。一覧の終わりに達した場合は Qundef を返す。
+ */
+static VALUE
+xattr_names_read(const struct xattr_names *n, size_t *offset)
+{
+    const char *ptr = n->list.ptr + *offset;
+    const char *end = n->list.ptr + n->list.size;
+    const char *namep;
+    size_t len;
+    VALUE v = Qundef;
+
+    if (n->namespace1 == EXTATTR_NAMESPACE_ALL) {
+        while ((namep = xattr_list_entry(&ptr, end, &len)) != NULL) {
+            size_t prefixlen;
+            int ns = xattr_namespace_of(namep, len, &prefixlen);
+            if (ns == EXTATTR_NAMESPACE_ALL) { continue; }
+            v = rb_assoc_new(aux_namespace_symbol(ns), rb_str_new(namep + prefixlen, len - prefixlen));
+            break;
+        }
+    } else if ((namep = xattr_list_next(&ptr, end, n->namespace1, &len)) != NULL) {
+        v = rb_str_new(namep, len);
+    }
+
+    *offset = ptr - n->list.ptr;
+    return v;
+}
+
+/*
+ * 一覧はスレッドごとの作業領域に受け取り、ちょうどの大きさに複写して保持する。
+ * 作業領域は前回の大きさを保っているため、多くの場合 listxattr は一度で済む。
+ */
+struct xattr_names_fetch
+{
+    struct xattr_target target;
+    struct xattr_names *names;
+    struct xattr_buf work;
+    struct aux_scratch *scratch;
+    int err;
+};
+
+static void *
+xattr_names_fetch_nogvl(void *arg)
+{
+    struct xattr_names_fetch *p = (struct xattr_names_fetch *)arg;
+    p->err = (xattr_target_list_into(&p->target, &p->work) < 0 ? errno : 0);
+    return NULL;
+}
+
+static VALUE
+xattr_names_fetch_body(VALUE arg)
+{
+    struct xattr_names_fetch *p = (struct xattr_names_fetch *)arg;
+    aux_blocking_call(xattr_names_fetch_nogvl, p);
+    if (p->err == 0) {
+        struct xattr_buf *list = &p->names->list;
+        size_t capa = (p->work.size > 0 ? p->work.size : 1);
+        list->ptr = malloc(capa);
+        if (!list->ptr) {
+            p->err = ENOMEM;
+        } else {
+            memcpy(list->ptr, p->work.ptr, p->work.size);
+            list->size = p->work.size;
+            list->capa = capa;
+        }
+    }
+    return Qnil;
+}
+
+static VALUE
+xattr_names_fetch_cleanup(VALUE arg)
+{
+    struct xattr_names_fetch *p = (struct xattr_names_fetch *)arg;
+    xattr_buf_giveback(&p->work, p->scratch);
+    return Qnil;
+}
+
+static VALUE
+extattr_names_common(const struct xattr_target *target, VALUE path, int namespace1)
+{
+    struct xattr_names *n;
+    VALUE obj = TypedData_Make_Struct(cNameIterator, struct xattr_names, &xattr_names_type, n);
+    n->count = -1;
+    n->namespace1 = namespace1;
+    n->path = path;
+
+    struct xattr_names_fetch fetch = { *target, n };
+    fetch.scratch = xattr_buf_borrow(&fetch.work);
+    rb_ensure(xattr_names_fetch_body, (VALUE)&fetch, xattr_names_fetch_cleanup, (VALUE)&fetch);
+    if (fetch.err != 0) {
+        errno = fetch.err;
+        aux_sys_fail(path, "listxattr");
+    }
+
+    return obj;
+}
+
+static VALUE
+file_extattr_names_main(VALUE file, int fd, int namespace1)
+{
+    struct xattr_target t;
+    xattr_target_fd(&t, fd);
+    return extattr_names_common(&t, file, namespace1);
+}
+
+static VALUE
+file_s_extattr_names_main(VALUE path, int namespace1)
+{
+    path = rb_str_new_frozen(path);
+    struct xattr_target t = { -1, 0, 1, StringValueCStr(path) };
+    return extattr_names_common(&t, path, namespace1);
+}
+
+static VALUE
+file_s_extattr_names_link_main(VALUE path, int namespace1)
+{
+    path = rb_str_new_frozen(path);
+    struct xattr_target t = { -1, 0, 0, StringValueCStr(path) };
+    return extattr_names_common(&t, path, namespace1);
+}
+
+/*
+ * call-seq:
+ *  next -> name
+ *
+ * 次の名前を返します。一覧の終わりに達している場合は StopIteration 例外が発生します。
+ */
+static VALUE
+xattr_names_next(VALUE self)
+{
+    struct xattr_names *n = xattr_names_ref(self);
+    VALUE v = xattr_names_read(n, &n->cursor);
+    if (v == Qundef) { rb_raise(rb_eStopIteration, "iteration reached an end"); }
+    return v;
+}
+
+/*
+ * call-seq:
+ *  peek -> name
+ *
+ * next が返す名前を、位置を進めずに返します。
+ */
+static VALUE
+xattr_names_peek(VALUE self)
+{
+    struct xattr_names *n = xattr_names_ref(self);
+    size_t offset = n->cursor;
+    VALUE v = xattr_names_read(n, &offset);
+    if (v == Qundef) { rb_raise(rb_eStopIteration, "iteration reached an end"); }
+    return v;
+}
+
+/*
+ * call-seq:
+ *  rewind -> self
+ *
+ * next の位置を先頭に戻します。一覧は取得し直しません。
+ */
+static VALUE
+xattr_names_rewind(VALUE self)
+{
+    xattr_names_ref(self)->cursor = 0;
+    return self;
+}
+
+/*
+ * call-seq:
+ *  size -> integer
+ *
+ * 名前の数を返します。名前の文字列は作成しません。
+ */
+static VALUE
+xattr_names_size(VALUE self)
+{
+    struct xattr_names *n = xattr_names_ref(self);
+    if (n->count < 0) {
+        const char *ptr = n->list.ptr;
+        const char *end = n->list.ptr + n->list.size;
+        const char *namep;
+        size_t len;
+        long count = 0;
+        if (n->namespace1 == EXTATTR_NAMESPACE_ALL) {
+            while ((namep = xattr_list_entry(&ptr, end, &len)) != NULL) {
+                size_t prefixlen;
+                if (xattr_namespace_of(namep, len, &prefixlen) != EXTATTR_NAMESPACE_ALL) { count++; }
+            }
+        } else {
+            while (xattr_list_next(&ptr, end, n->namespace1, &len) != NULL) { count++; }
+        }
+        n->count = count;
+    }
+
+    return LONG2NUM(n->count);
+}
+
+/*
+ * call-seq:
+ *  each { |name| ... } -> self
+ *  each -> self
+ *
+ * 先頭から順に名前を渡します。next の位置には影響しません。
+ */
+static VALUE
+xattr_names_each(VALUE self)
+{
+    if (!rb_block_given_p()) { return self; }
+
+    struct xattr_names *n = xattr_names_ref(self);
+    size_t offset = 0;
+    VALUE v;
+    while ((v = xattr_names_read(n, &offset)) != Qundef) {
+        rb_yield(v);
+    }
+    RB_GC_GUARD(self);
+
+    return self;
+}
+
+static void
+xattr_names_init(void)
+{
+    cNameIterator = rb_define_class_under(mExtAttr, "NameIterator", rb_cObject);
+    rb_undef_alloc_func(cNameIterator);
+    rb_include_module(cNameIterator, rb_mEnumerable);
+    rb_define_method(cNameIterator, "next", RUBY_METHOD_FUNC(xattr_names_next), 0);
+    rb_define_method(cNameIterator, "peek", RUBY_METHOD_FUNC(xattr_names_peek), 0);
+    rb_define_method(cNameIterator, "rewind", RUBY_METHOD_FUNC(xattr_names_rewind), 0);
+    rb_define_method(cNameIterator, "size", RUBY_METHOD_FUNC(xattr_names_size), 0);
+    rb_define_method(cNameIterator, "each", RUBY_METHOD_FUNC(xattr_names_each), 0);
+}
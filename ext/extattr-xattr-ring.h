@@ -0,0 +1,794 @@
+/*
+ * ExtAttr::Ring の xattr による実装。
+ *
+ * get / set の要求を溜めておき、submit でまとめて処理する。
+ * io_uring (IORING_OP_FGETXATTR など) が使えれば io_uring_enter でまとめて発行し、
+ * 使えなければワーカースレッドで f*xattr / *xattr を呼び出す。
+ *
+ * liburing には依存せず、システムコールを直接用いる。
+ */
+
+#define EXTATTR_HAVE_RING 1
+
+#if defined(HAVE_LINUX_IO_URING_H) && defined(HAVE_SYS_MMAN_H) && \
+    defined(HAVE_SYS_SYSCALL_H) && defined(HAVE_CONST_IORING_OP_FGETXATTR)
+#   include <linux/io_uring.h>
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#   if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#       define XATTR_RING_URING 1
+#   endif
+#endif
+
+static VALUE cRing;
+static ID id_entries, id_backend, id_io_uring;
+
+enum {
+    XATTR_RING_GET,
+    XATTR_RING_SET,
+};
+
+enum {
+    XATTR_RING_BACKEND_THREADS,
+    XATTR_RING_BACKEND_URING,
+};
+
+enum {
+    XATTR_RING_ENTRIES_DEFAULT = 64,
+    XATTR_RING_ENTRIES_MAX = 4096,
+    XATTR_RING_THREADS_MAX = 64,
+};
+
+struct xattr_ring_req
+{
+    int op;
+    int fd;                     // 負の値ならば path を用いる
+    size_t path;                // arena 内の位置
+    size_t name;                // arena 内の位置 (接頭辞を含む)
+    size_t value;               // set: arena 内の位置
+    size_t size;                // set: 値の長さ
+    int flags;                  // set: XATTR_CREATE / XATTR_REPLACE
+
+    int done;
+    ssize_t res;                // get: 値の長さ。失敗した場合は -errno
+    int out;                    // get: 値を格納した outs の添字
+    size_t outoffset;
+    int ownfd;                  // 要求のために dup した記述子 (処理が終われば閉じる)。なければ -1
+};
+
+#ifdef XATTR_RING_URING
+struct xattr_uring
+{
+    int fd;
+    unsigned entries;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    char *slots;                // 要求ごとの取得用バッファ (entries * EXTATTR_STACKBUF_SIZE)
+};
+#endif
+
+struct xattr_ring
+{
+    int backend;
+    int nthreads;
+    unsigned entries;
+    int busy;
+
+    struct xattr_buf arena;     // パス名、拡張属性名、設定する値
+    struct xattr_buf reqs;      // struct xattr_ring_req の配列
+    VALUE keep;                 // 要求ごとの [対象, 拡張属性名] (例外の表示と GC からの保護)
+
+#ifdef XATTR_RING_URING
+    struct xattr_uring uring;
+#endif
+};
+
+/*
+ * submit の作業領域。
+ */
+struct xattr_ring_submit
+{
+    struct xattr_ring *ring;
+    struct xattr_ring_req *reqs;
+    long num;
+    long pos;                   // 次に処理する要求 (ワーカー間で共有)
+    struct xattr_buf *outs;     // ワーカーごとの取得した値
+    int nouts;
+    volatile int cancel;
+};
+
+#define XATTR_RING_REQS(R) ((struct xattr_ring_req *)(R)->reqs.ptr)
+#define XATTR_RING_NUM(R) ((long)((R)->reqs.size / sizeof(struct xattr_ring_req)))
+
+
+/*
+ * 要求ひとつを同期的に処理する。GVL を解放した状態から呼び出される。
+ */
+static void
+xattr_ring_do_sync(const struct xattr_ring *ring, struct xattr_ring_req *r, struct xattr_buf *out)
+{
+    const char *base = ring->arena.ptr;
+    struct xattr_target t;
+    if (r->fd >= 0) {
+        xattr_target_fd(&t, r->fd);
+    } else {
+        t.fd = -1;
+        t.needclose = 0;
+        t.follow = 1;
+        t.path = base + r->path;
+    }
+
+    if (r->op == XATTR_RING_GET) {
+        r->outoffset = out->size;
+        r->res = xattr_target_get_into(&t, base + r->name, out);
+    } else {
+        int status;
+        do {
+            status = xattr_target_set(&t, base + r->name, base + r->value, r->size, r->flags);
+        } while (status < 0 && errno == EINTR);
+        r->res = status;
+    }
+    if (r->res < 0) { r->res = -errno; }
+}
+
+
+#ifdef XATTR_RING_URING
+static void
+xattr_uring_close(struct xattr_uring *u)
+{
+    if (u->sqes) { munmap(u->sqes, u->sqes_size); }
+    if (u->cq_ptr && u->cq_ptr != u->sq_ptr) { munmap(u->cq_ptr, u->cq_size); }
+    if (u->sq_ptr) { munmap(u->sq_ptr, u->sq_size); }
+    if (u->fd >= 0) { close(u->fd); }
+    free(u->slots);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+/*
+ * xattr の操作が全て使えるかを IORING_REGISTER_PROBE で確認する。
+ */
+static int
+xattr_uring_probe(int fd)
+{
+    enum { NOPS = 256 };
+    size_t size = sizeof(struct io_uring_probe) + NOPS * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (!probe) { return 0; }
+
+    int ok = 0;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, NOPS) >= 0) {
+        static const int ops[] = {
+            IORING_OP_FGETXATTR, IORING_OP_GETXATTR, IORING_OP_FSETXATTR, IORING_OP_SETXATTR,
+        };
+        ok = 1;
+        for (size_t i = 0; i < ELEMENTOF(ops); i++) {
+            if (ops[i] > probe->last_op || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+                ok = 0;
+            }
+        }
+    }
+    free(probe);
+    return ok;
+}
+
+/*
+ * io_uring を準備する。使えない場合は -1 を返して errno を設定する。
+ */
+static int
+xattr_uring_setup(struct xattr_uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    u->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (u->fd < 0) { return -1; }
+    fcntl(u->fd, F_SETFD, FD_CLOEXEC);
+
+    if (!xattr_uring_probe(u->fd)) {
+        xattr_uring_close(u);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    u->entries = p.sq_entries;
+    u->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    u->sq_ptr = mmap(NULL, u->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED) { u->sq_ptr = NULL; goto failed; }
+    u->cq_ptr = mmap(NULL, u->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    if (u->cq_ptr == MAP_FAILED) { u->cq_ptr = NULL; goto failed; }
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) { u->sqes = NULL; goto failed; }
+    u->slots = malloc((size_t)u->entries * EXTATTR_STACKBUF_SIZE);
+    if (!u->slots) { errno = ENOMEM; goto failed; }
+
+    u->sq_head = (unsigned *)((char *)u->sq_ptr + p.sq_off.head);
+    u->sq_tail = (unsigned *)((char *)u->sq_ptr + p.sq_off.tail);
+    u->sq_mask = (unsigned *)((char *)u->sq_ptr + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *)((char *)u->sq_ptr + p.sq_off.array);
+    u->cq_head = (unsigned *)((char *)u->cq_ptr + p.cq_off.head);
+    u->cq_tail = (unsigned *)((char *)u->cq_ptr + p.cq_off.tail);
+    u->cq_mask = (unsigned *)((char *)u->cq_ptr + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)((char *)u->cq_ptr + p.cq_off.cqes);
+
+    return 0;
+
+failed:
+    {
+        int err = errno;
+        xattr_uring_close(u);
+        errno = err;
+    }
+    return -1;
+}
+
+/*
+ * s->pos から最大 entries 個の要求をまとめて発行し、全ての完了を待つ。
+ */
+static void
+xattr_uring_batch(struct xattr_ring_submit *s)
+{
+    struct xattr_ring *ring = s->ring;
+    struct xattr_uring *u = &ring->uring;
+    const char *base = ring->arena.ptr;
+    long first = s->pos;
+    unsigned n = (unsigned)((s->num - first) < (long)u->entries ? (s->num - first) : u->entries);
+
+    unsigned tail = *u->sq_tail;
+    unsigned mask = *u->sq_mask;
+    for (unsigned i = 0; i < n; i++) {
+        struct xattr_ring_req *r = &s->reqs[first + i];
+        unsigned idx = (tail + i) & mask;
+        struct io_uring_sqe *sqe = &u->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        if (r->op == XATTR_RING_GET) {
+            sqe->opcode = (r->fd >= 0 ? IORING_OP_FGETXATTR : IORING_OP_GETXATTR);
+            sqe->addr2 = (uintptr_t)(u->slots + (size_t)i * EXTATTR_STACKBUF_SIZE);
+            sqe->len = EXTATTR_STACKBUF_SIZE;
+        } else {
+            sqe->opcode = (r->fd >= 0 ? IORING_OP_FSETXATTR : IORING_OP_SETXATTR);
+            sqe->addr2 = (uintptr_t)(base + r->value);
+            sqe->len = (unsigned)r->size;
+            sqe->xattr_flags = r->flags;
+        }
+        sqe->fd = (r->fd >= 0 ? r->fd : -1);
+        sqe->addr = (uintptr_t)(base + r->name);
+        if (r->fd < 0) { sqe->addr3 = (uintptr_t)(base + r->path); }
+        sqe->user_data = i;
+        u->sq_array[idx] = idx;
+    }
+    __atomic_store_n(u->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+    // 全ての完了を待つ。シグナルで中断されても、発行済みの要求はバッファを使っているため待ち続ける。
+    // 発行に失敗した場合は、発行されずに残った要求を取り下げて、発行済みの要求の完了だけを待つ。
+    unsigned submitted = 0, completed = 0, want = n;
+    int err = 0;
+    while (completed < want) {
+        long ret = syscall(__NR_io_uring_enter, u->fd, want - submitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret >= 0) {
+            submitted += (unsigned)ret;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            if (err) { break; }     // 発行済みの要求の完了も待てない
+            err = errno;
+            // カーネルは io_uring_enter の中でしか SQ を読まないため、ここで取り下げられる。
+            want = submitted;
+            __atomic_store_n(u->sq_tail, tail + submitted, __ATOMIC_RELEASE);
+        }
+
+        // EAGAIN や EBUSY は CQ が溢れている場合もあるため、失敗しても刈り取る。
+        unsigned head = *u->cq_head;
+        unsigned ctail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; head++) {
+            const struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            unsigned i = (unsigned)cqe->user_data;
+            struct xattr_ring_req *r = &s->reqs[first + i];
+            r->res = cqe->res;
+            if (r->op == XATTR_RING_GET && r->res >= 0) {
+                r->out = 0;
+                r->outoffset = s->outs[0].size;
+                if (xattr_buf_reserve(&s->outs[0], r->res) < 0) {
+                    r->res = -ENOMEM;
+                } else {
+                    memcpy(s->outs[0].ptr + s->outs[0].size, u->slots + (size_t)i * EXTATTR_STACKBUF_SIZE, r->res);
+                    s->outs[0].size += r->res;
+                }
+            }
+            r->done = 1;
+            completed++;
+        }
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // 発行したが完了を確かめられなかった要求は、処理されたかどうかが分からないため失敗とする。
+    for (unsigned i = 0; i < submitted; i++) {
+        struct xattr_ring_req *r = &s->reqs[first + i];
+        if (!r->done) {
+            r->res = -err;
+            r->done = 1;
+        }
+    }
+
+    // ERANGE (スロットに入りきらない値) や発行しなかった要求は、同期的に処理し直す。
+    for (unsigned i = 0; i < n; i++) {
+        struct xattr_ring_req *r = &s->reqs[first + i];
+        if (!r->done || (r->op == XATTR_RING_GET && r->res == -ERANGE)) {
+            r->out = 0;
+            xattr_ring_do_sync(ring, r, &s->outs[0]);
+        }
+    }
+
+    if (err) {
+        // 以降はワーカースレッドで処理する。
+        // 完了を確かめられなかった要求がスロットに書き込むかもしれないため、その場合はスロットを解放しない。
+        if (completed < want) { u->slots = NULL; }
+        xattr_uring_close(u);
+        ring->backend = XATTR_RING_BACKEND_THREADS;
+    }
+
+    s->pos = first + n;
+}
+
+static void *
+xattr_uring_submit_nogvl(void *arg)
+{
+    struct xattr_ring_submit *s = (struct xattr_ring_submit *)arg;
+    while (s->pos < s->num && !s->cancel && s->ring->backend == XATTR_RING_BACKEND_URING) {
+        xattr_uring_batch(s);
+    }
+    return NULL;
+}
+#endif /* XATTR_RING_URING */
+
+
+static void
+xattr_ring_worker_loop(struct xattr_ring_submit *s, int out)
+{
+    for (;;) {
+        if (s->cancel) { break; }
+        long i = __atomic_fetch_add(&s->pos, 1, __ATOMIC_RELAXED);
+        if (i >= s->num) { break; }
+        struct xattr_ring_req *r = &s->reqs[i];
+        r->out = out;
+        xattr_ring_do_sync(s->ring, r, &s->outs[out]);
+    }
+}
+
+#if HAVE_PTHREAD_H
+struct xattr_ring_worker
+{
+    struct xattr_ring_submit *submit;
+    int out;
+};
+
+static void *
+xattr_ring_worker_main(void *arg)
+{
+    struct xattr_ring_worker *w = (struct xattr_ring_worker *)arg;
+    xattr_ring_worker_loop(w->submit, w->out);
+    return NULL;
+}
+#endif
+
+static void *
+xattr_ring_threads_nogvl(void *arg)
+{
+    struct xattr_ring_submit *s = (struct xattr_ring_submit *)arg;
+
+#if HAVE_PTHREAD_H
+    long rest = s->num - s->pos;
+    int nthreads = s->nouts;
+    if (rest < nthreads) { nthreads = (int)rest; }
+
+    // 呼び出し元のスレッドも 0 番目のワーカーとして働く。
+    pthread_t threads[XATTR_RING_THREADS_MAX];
+    struct xattr_ring_worker workers[XATTR_RING_THREADS_MAX];
+    int started = 0;
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (int i = 1; i < nthreads; i++) {
+        workers[started].submit = s;
+        workers[started].out = i;
+        if (pthread_create(&threads[started], NULL, xattr_ring_worker_main, &workers[started]) == 0) {
+            started++;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    xattr_ring_worker_loop(s, 0);
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+#else
+    xattr_ring_worker_loop(s, 0);
+#endif
+
+    return NULL;
+}
+
+
+static void
+xattr_ring_mark(void *ptr)
+{
+    struct xattr_ring *ring = (struct xattr_ring *)ptr;
+    rb_gc_mark(ring->keep);
+}
+
+/*
+ * 要求のために複製した記述子を閉じる。
+ */
+static void
+xattr_ring_close_reqs(struct xattr_ring_req *reqs, long num)
+{
+    for (long i = 0; i < num; i++) {
+        if (reqs[i].ownfd >= 0) {
+            close(reqs[i].ownfd);
+            reqs[i].ownfd = -1;
+        }
+    }
+}
+
+static void
+xattr_ring_free(void *ptr)
+{
+    struct xattr_ring *ring = (struct xattr_ring *)ptr;
+    xattr_ring_close_reqs(XATTR_RING_REQS(ring), XATTR_RING_NUM(ring));
+#ifdef XATTR_RING_URING
+    if (ring->backend == XATTR_RING_BACKEND_URING) { xattr_uring_close(&ring->uring); }
+#endif
+    xattr_buf_free(&ring->arena);
+    xattr_buf_free(&ring->reqs);
+    xfree(ring);
+}
+
+static size_t
+xattr_ring_memsize(const void *ptr)
+{
+    const struct xattr_ring *ring = (const struct xattr_ring *)ptr;
+    size_t size = sizeof(*ring) + ring->arena.capa + ring->reqs.capa;
+#ifdef XATTR_RING_URING
+    if (ring->backend == XATTR_RING_BACKEND_URING) {
+        size += (size_t)ring->uring.entries * EXTATTR_STACKBUF_SIZE;
+    }
+#endif
+    return size;
+}
+
+static const rb_data_type_t xattr_ring_type = {
+    "extattr.ring",
+    { xattr_ring_mark, xattr_ring_free, xattr_ring_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+xattr_ring_alloc(VALUE klass)
+{
+    struct xattr_ring *ring;
+    VALUE obj = TypedData_Make_Struct(klass, struct xattr_ring, &xattr_ring_type, ring);
+    ring->keep = Qnil;
+    ring->entries = 0;
+#ifdef XATTR_RING_URING
+    ring->uring.fd = -1;
+#endif
+    return obj;
+}
+
+static struct xattr_ring *
+xattr_ring_ref(VALUE obj)
+{
+    struct xattr_ring *ring = rb_check_typeddata(obj, &xattr_ring_type);
+    if (ring->entries == 0) { rb_raise(rb_eTypeError, "uninitialized ring"); }
+    return ring;
+}
+
+/*
+ * call-seq:
+ *  new(entries: 64, threads: 4, backend: nil) -> ring
+ *
+ * 拡張属性の get / set の要求を溜めておき、まとめて処理するためのオブジェクトを作成します。
+ *
+ * backend に :io_uring を与えると io_uring を、:threads か nil を与えるとワーカースレッドを用います。
+ * xattr の操作はカーネルの io-wq ワーカーに回されるため、io_uring の方が速いとは限りません。
+ * 既定はワーカースレッドとし、io_uring は計測して速いことを確かめた場合に指定してください。
+ *
+ * entries は io_uring でまとめて発行する要求の数、threads はワーカースレッドの数です。
+ */
+static VALUE
+xattr_ring_initialize(int argc, VALUE argv[], VALUE self)
+{
+    VALUE opts;
+    struct xattr_ring *ring = rb_check_typeddata(self, &xattr_ring_type);
+    if (ring->entries != 0) { rb_raise(rb_eRuntimeError, "already initialized"); }
+
+    rb_scan_args(argc, argv, "0:", &opts);
+    int entries = NUM2INT(hash_lookup(opts, ID2SYM(id_entries), INT2FIX(XATTR_RING_ENTRIES_DEFAULT)));
+    int nthreads = NUM2INT(hash_lookup(opts, ID2SYM(id_threads), INT2FIX(4)));
+    VALUE backend = hash_lookup(opts, ID2SYM(id_backend), Qnil);
+    if (entries < 1 || entries > XATTR_RING_ENTRIES_MAX) {
+        rb_raise(rb_eArgError, "entries must be in 1..%d", XATTR_RING_ENTRIES_MAX);
+    }
+    if (nthreads < 1 || nthreads > XATTR_RING_THREADS_MAX) {
+        rb_raise(rb_eArgError, "threads must be in 1..%d", XATTR_RING_THREADS_MAX);
+    }
+    if (!NIL_P(backend) && backend != ID2SYM(id_io_uring) && backend != ID2SYM(id_threads)) {
+        rb_raise(rb_eArgError, "wrong backend - %"PRIsVALUE" (expected :io_uring or :threads)", backend);
+    }
+
+    ring->nthreads = nthreads;
+    ring->backend = XATTR_RING_BACKEND_THREADS;
+    if (backend == ID2SYM(id_io_uring)) {
+#ifdef XATTR_RING_URING
+        if (xattr_uring_setup(&ring->uring, entries) < 0) { rb_sys_fail("io_uring_setup"); }
+        ring->backend = XATTR_RING_BACKEND_URING;
+#else
+        rb_raise(rb_eNotImpError, "io_uring is not available");
+#endif
+    }
+    ring->entries = entries;
+    RB_OBJ_WRITE(self, &ring->keep, rb_ary_new());
+
+    return self;
+}
+
+static size_t
+xattr_ring_arena_push(struct xattr_ring *ring, const char *prefix, size_t prefixlen, const char *ptr, size_t len)
+{
+    if (xattr_buf_reserve(&ring->arena, prefixlen + len + 1) < 0) { rb_memerror(); }
+    size_t offset = ring->arena.size;
+    char *p = ring->arena.ptr + offset;
+    memcpy(p, prefix, prefixlen);
+    memcpy(p + prefixlen, ptr, len);
+    p[prefixlen + len] = '\0';
+    ring->arena.size += prefixlen + len + 1;
+    return offset;
+}
+
+static VALUE
+xattr_ring_push(VALUE self, int op, VALUE target, VALUE namespace, VALUE name, VALUE data, int flags)
+{
+    struct xattr_ring *ring = xattr_ring_ref(self);
+    int namespace1 = conv_namespace(namespace);
+    name = aux_name_string(aux_should_be_name(name));
+    size_t prefixlen;
+    const char *prefix = xattr_prefix(namespace1, &prefixlen);
+    StringValueCStr(name);
+    if (prefixlen + RSTRING_LEN(name) > XATTR_NAME_MAX) { rb_syserr_fail_str(ERANGE, name); }
+
+    struct xattr_ring_req r = { op, -1 };
+    r.ownfd = -1;
+    r.name = xattr_ring_arena_push(ring, prefix, prefixlen, RSTRING_PTR(name), RSTRING_LEN(name));
+    if (op == XATTR_RING_SET) {
+        data = aux_should_be_string(data);
+        r.value = xattr_ring_arena_push(ring, "", 0, RSTRING_PTR(data), RSTRING_LEN(data));
+        r.size = RSTRING_LEN(data);
+        r.flags = flags;
+    }
+    if (xattr_buf_reserve(&ring->reqs, sizeof(r)) < 0) { rb_memerror(); }
+
+    if (rb_obj_is_kind_of(target, rb_cFile)) {
+        r.fd = file2fd(target);
+    } else if (rb_typeddata_is_kind_of(target, &xattr_handle_type)) {
+        // submit までに handle が閉じられてもよいように、記述子を複製して要求に持たせる。
+        // 複製した後に例外が発生しないように、パス名の領域は先に確保しておく。
+        const struct xattr_handle *h = xattr_handle_ref(target);
+        if (xattr_buf_reserve(&ring->arena, EXTATTR_PROCPATH_SIZE) < 0) { rb_memerror(); }
+        r.ownfd = fcntl(h->fd, F_DUPFD_CLOEXEC, 0);
+        if (r.ownfd < 0) { aux_sys_fail(h->path, "dup"); }
+        if (h->pathfd) {
+            char procpath[EXTATTR_PROCPATH_SIZE];
+            int len = snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", r.ownfd);
+            r.path = xattr_ring_arena_push(ring, "", 0, procpath, len);
+        } else {
+            r.fd = r.ownfd;
+        }
+    } else {
+        target = aux_to_path(target);
+        ext_check_path_security(target, name, data);
+        StringValueCStr(target);
+        r.path = xattr_ring_arena_push(ring, "", 0, RSTRING_PTR(target), RSTRING_LEN(target));
+    }
+
+    memcpy(ring->reqs.ptr + ring->reqs.size, &r, sizeof(r));
+    ring->reqs.size += sizeof(r);
+    rb_ary_push(ring->keep, target);
+    rb_ary_push(ring->keep, name);
+
+    return LONG2NUM(XATTR_RING_NUM(ring) - 1);
+}
+
+/*
+ * call-seq:
+ *  get(path, namespace, name) -> index
+ *
+ * 拡張属性を取得する要求を追加して、その番号を返します。
+ * path には File、ExtAttr::Handle またはパス名を与えることが出来ます。
+ *
+ * File を与えた場合は、submit するまで閉じないで下さい。
+ * ExtAttr::Handle を与えた場合は記述子を複製して持つため、submit する前に閉じても構いません。
+ */
+static VALUE
+xattr_ring_get(VALUE self, VALUE path, VALUE namespace, VALUE name)
+{
+    return xattr_ring_push(self, XATTR_RING_GET, path, namespace, name, Qnil, 0);
+}
+
+/*
+ * call-seq:
+ *  set(path, namespace, name, data, flags = 0) -> index
+ *
+ * 拡張属性を設定する要求を追加して、その番号を返します。
+ */
+static VALUE
+xattr_ring_set(int argc, VALUE argv[], VALUE self)
+{
+    rb_check_arity(argc, 4, 5);
+    int flags = (argc > 4 ? NUM2INT(argv[4]) : 0);
+    return xattr_ring_push(self, XATTR_RING_SET, argv[0], argv[1], argv[2], argv[3], flags);
+}
+
+struct xattr_ring_submit_args
+{
+    struct xattr_ring_submit submit;
+    struct xattr_ring *owner;
+    VALUE keep;
+};
+
+static VALUE
+xattr_ring_submit_body(VALUE arg)
+{
+    struct xattr_ring_submit_args *args = (struct xattr_ring_submit_args *)arg;
+    struct xattr_ring_submit *s = &args->submit;
+    struct xattr_ring *ring = s->ring;
+
+    while (s->pos < s->num) {
+        // io_uring が使えなくなった場合は、途中からワーカースレッドで処理する。
+        void *(*func)(void *) = xattr_ring_threads_nogvl;
+#ifdef XATTR_RING_URING
+        if (ring->backend == XATTR_RING_BACKEND_URING) { func = xattr_uring_submit_nogvl; }
+#endif
+        s->cancel = 0;
+        aux_blocking_call_cancelable(func, s, &s->cancel);
+    }
+
+    VALUE results = rb_ary_new_capa(s->num);
+    for (long i = 0; i < s->num; i++) {
+        const struct xattr_ring_req *r = &s->reqs[i];
+        if (r->res >= 0) {
+            if (r->op == XATTR_RING_GET) {
+                rb_ary_push(results, rb_str_new(s->outs[r->out].ptr + r->outoffset, r->res));
+            } else {
+                rb_ary_push(results, Qnil);
+            }
+        } else if (r->op == XATTR_RING_GET && r->res == -ENODATA) {
+            rb_ary_push(results, Qnil);
+        } else {
+            VALUE path = RARRAY_AREF(args->keep, i * 2);
+            VALUE name = RARRAY_AREF(args->keep, i * 2 + 1);
+            if (rb_typeddata_is_kind_of(path, &xattr_handle_type)) {
+                path = ((struct xattr_handle *)RTYPEDDATA_DATA(path))->path;
+            } else {
+                path = aux_to_path(path);
+            }
+            VALUE mesg = rb_sprintf("%"PRIsVALUE" [%"PRIsVALUE"]", path, name);
+            rb_ary_push(results, rb_syserr_new_str((int)-r->res, mesg));
+        }
+    }
+
+    return results;
+}
+
+static VALUE
+xattr_ring_submit_cleanup(VALUE arg)
+{
+    struct xattr_ring_submit_args *args = (struct xattr_ring_submit_args *)arg;
+    struct xattr_ring_submit *s = &args->submit;
+    for (int i = 0; i < s->nouts; i++) {
+        xattr_buf_free(&s->outs[i]);
+    }
+    ruby_xfree(s->outs);
+    xattr_ring_close_reqs(s->reqs, s->num);
+#ifdef XATTR_RING_URING
+    // io_uring を閉じてワーカースレッドに切り替えた場合は、それを引き継ぐ。
+    args->owner->backend = s->ring->backend;
+    args->owner->uring = s->ring->uring;
+#endif
+    args->owner->busy = 0;
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  submit -> results array
+ *
+ * 溜めておいた要求を全て処理して、要求の順に結果を返します。
+ *
+ * get の結果は値 (文字列) で、拡張属性が存在しない場合は nil となります。
+ * set の結果は nil です。
+ * 失敗した要求の結果は、例外を発生させる代わりに SystemCallError のインスタンスとなります。
+ */
+static VALUE
+xattr_ring_submit(VALUE self)
+{
+    struct xattr_ring *ring = xattr_ring_ref(self);
+    if (ring->busy) { rb_raise(rb_eRuntimeError, "ring is submitting in another thread"); }
+
+    // 処理中に要求が追加されないように、要求の一覧を空の状態と入れ替えてから処理する。
+    struct xattr_buf arena = ring->arena, reqs = ring->reqs;
+    VALUE keep = ring->keep;
+    memset(&ring->arena, 0, sizeof(ring->arena));
+    memset(&ring->reqs, 0, sizeof(ring->reqs));
+    RB_OBJ_WRITE(self, &ring->keep, rb_ary_new());
+
+    struct xattr_ring work = *ring;
+    work.arena = arena;
+    work.reqs = reqs;
+
+    struct xattr_ring_submit_args args = { { 0 }, ring, keep };
+    struct xattr_ring_submit *s = &args.submit;
+    s->ring = &work;
+    s->reqs = XATTR_RING_REQS(&work);
+    s->num = XATTR_RING_NUM(&work);
+    s->nouts = (ring->backend == XATTR_RING_BACKEND_URING ? 1 : ring->nthreads);
+    s->outs = ruby_xcalloc(s->nouts, sizeof(struct xattr_buf));
+
+    // io_uring は ring ごとにひとつなので、同時に submit できるのはひとつのスレッドだけ。
+    ring->busy = 1;
+    VALUE results = rb_ensure(xattr_ring_submit_body, (VALUE)&args,
+                              xattr_ring_submit_cleanup, (VALUE)&args);
+    xattr_buf_free(&arena);
+    xattr_buf_free(&reqs);
+    RB_GC_GUARD(keep);
+
+    return results;
+}
+
+/*
+ * call-seq:
+ *  size -> integer
+ *
+ * 溜めている要求の数を返します。
+ */
+static VALUE
+xattr_ring_size(VALUE self)
+{
+    return LONG2NUM(XATTR_RING_NUM(xattr_ring_ref(self)));
+}
+
+/*
+ * call-seq:
+ *  backend -> :io_uring or :threads
+ *
+ * io_uring_enter が失敗して io_uring を使えなくなった場合は、以降 :threads となります。
+ */
+static VALUE
+xattr_ring_backend(VALUE self)
+{
+    struct xattr_ring *ring = rb_check_typeddata(self, &xattr_ring_type);
+    return ID2SYM(ring->backend == XATTR_RING_BACKEND_URING ? id_io_uring : id_threads);
+}
+
+static void
+xattr_ring_init(void)
+{
+    id_entries = rb_intern("entries");
+    id_backend = rb_intern("backend");
+    id_io_uring = rb_intern("io_uring");
+
+    cRing = rb_define_class_under(mExtAttr, "Ring", rb_cObject);
+    rb_define_alloc_func(cRing, xattr_ring_alloc);
+    rb_define_method(cRing, "initialize", RUBY_METHOD_FUNC(xattr_ring_initialize), -1);
+    rb_define_method(cRing, "get", RUBY_METHOD_FUNC(xattr_ring_get), 3);
+    rb_define_method(cRing, "set", RUBY_METHOD_FUNC(xattr_ring_set), -1);
+    rb_define_method(cRing, "submit", RUBY_METHOD_FUNC(xattr_ring_submit), 0);
+    rb_define_method(cRing, "size", RUBY_METHOD_FUNC(xattr_ring_size), 0);
+    rb_define_method(cRing, "backend", RUBY_METHOD_FUNC(xattr_ring_backend), 0);
+}
@@ -0,0 +1,278 @@
+/*
+ * ExtAttr.sync_tree の xattr による実装。
+ *
+ * extattr-xattr-walk.h のワーカースレッドで複写元のツリーをたどり、見つかった項目ごとに
+ * 複写先の同じ相対パス名の項目を複写先のルートディレクトリから開いて、拡張属性を比べる。
+ * 値の異なる拡張属性だけを設定し、複写元にない拡張属性だけを削除する。
+ *
+ * 大きな値はまず大きさを比べ、大きさが同じ場合に限って複写先の値を読んで内容を比べる。
+ * 複写元と複写先はどちらも手元で読めるため、内容のハッシュ値は求めずに直接比べる。
+ *
+ * ワーカースレッドはレコードを出力せず、ワーカーごとの件数だけを数える。
+ */
+
+#define EXTATTR_HAVE_SYNC_TREE 1
+
+static ID id_sync_files, id_sync_missing, id_sync_compared, id_sync_written, id_sync_removed, id_sync_failed;
+
+struct xattr_sync
+{
+    int namespace1;                     // EXTATTR_NAMESPACE_ALL であれば全ての名前空間
+    int dstfd;                          // 複写先のルートディレクトリ
+    const char *dstroot;
+};
+
+struct xattr_sync_worker
+{
+    const struct xattr_sync *sync;
+
+    struct xattr_buf list;              // 複写先の拡張属性名の一覧
+    struct xattr_buf value;             // 複写先の値
+
+    size_t files, missing, compared, written, removed, failed;
+};
+
+static int
+xattr_sync_wanted(const struct xattr_sync *sync, const char *name, size_t len)
+{
+    size_t prefixlen;
+    int ns = xattr_namespace_of(name, len, &prefixlen);
+    if (ns == EXTATTR_NAMESPACE_ALL) { return 0; }
+    return (sync->namespace1 == EXTATTR_NAMESPACE_ALL || ns == sync->namespace1);
+}
+
+/*
+ * 接頭辞を含む拡張属性名が、一覧 list に含まれているかを返す。
+ */
+static int
+xattr_sync_listed(const struct xattr_buf *list, const char *name, size_t len)
+{
+    const char *cursor = list->ptr;
+    const char *end = list->ptr + list->size;
+    const char *entry;
+    size_t n;
+    while ((entry = xattr_list_entry(&cursor, end, &n)) != NULL) {
+        if (n == len && memcmp(entry, name, len) == 0) { return 1; }
+    }
+
+    return 0;
+}
+
+/*
+ * 複写先の拡張属性 name の値が、value と同じであるかを返す。
+ *
+ * 大きな値は先に大きさだけを問い合わせ、大きさが異なれば値を読まない。
+ * 作業領域に収まる値は、大きさを問い合わせずにそのまま読んで比べる。
+ */
+static int
+xattr_sync_same(const struct xattr_target *dst, const char *name, struct xattr_sync_worker *sw,
+                const char *value, size_t size)
+{
+    if (size > EXTATTR_STACKBUF_SIZE) {
+        ssize_t dstsize = xattr_target_get(dst, name, NULL, 0);
+        if (dstsize < 0 || (size_t)dstsize != size) { return 0; }
+    }
+
+    sw->value.size = 0;
+    ssize_t dstsize = xattr_target_get_into(dst, name, &sw->value);
+    return (dstsize >= 0 && (size_t)dstsize == size && memcmp(sw->value.ptr, value, size) == 0);
+}
+
+/*
+ * 複写先の対象を用意する。見つからなければ 0 を、開けなければ -1 を返す。
+ *
+ * 連結したパス名は使わず、複写先のルートディレクトリの記述子から xattr_target_beneath でたどる。
+ * 複写元が通常ファイルやディレクトリであれば、複写先のシンボリックリンクは見つからなかったものとする。
+ */
+static int
+xattr_sync_target(struct xattr_sync_worker *sw, const struct xattr_target *src, const char *relpath,
+                  size_t relpathlen, struct xattr_target *dst, char *procpath, int *pathfd)
+{
+    const struct xattr_sync *sync = sw->sync;
+
+    if (relpathlen == 0) {
+        xattr_target_fd(dst, sync->dstfd);
+        return 1;
+    }
+
+    return xattr_target_beneath(dst, sync->dstfd, relpath, (src->fd >= 0), procpath, pathfd);
+}
+
+static void
+xattr_sync_visit(struct xattr_walk_worker *w, const struct xattr_target *t,
+                 const char *path, size_t pathlen, const char *relpath, size_t relpathlen)
+{
+    struct xattr_sync_worker *sw = (struct xattr_sync_worker *)w->user;
+    const struct xattr_sync *sync = sw->sync;
+
+    // 読めない複写元は、ExtAttr.scan と同じく無視する。
+    if (xattr_target_list_into(t, &w->list) < 0) { return; }
+
+    struct xattr_target dst;
+    char procpath[EXTATTR_PROCPATH_SIZE];
+    int pathfd = -1;
+    int found = xattr_sync_target(sw, t, relpath, relpathlen, &dst, procpath, &pathfd);
+    if (found == 0) { sw->missing++; return; }
+    if (found < 0) { sw->failed++; return; }
+
+    if (xattr_target_list_into(&dst, &sw->list) < 0) {
+        if (errno == ENOENT) { sw->missing++; } else { sw->failed++; }
+        xattr_target_close(&dst);
+        if (pathfd >= 0) { close(pathfd); }
+        return;
+    }
+    sw->files++;
+
+    const char *cursor = w->list.ptr;
+    const char *end = w->list.ptr + w->list.size;
+    const char *entry;
+    size_t n;
+    while ((entry = xattr_list_entry(&cursor, end, &n)) != NULL) {
+        if (!xattr_sync_wanted(sync, entry, n)) { continue; }
+
+        w->work.size = 0;
+        ssize_t size = xattr_target_get_into(t, entry, &w->work);
+        if (size < 0) {
+            if (errno != ENODATA) { sw->failed++; } // ENODATA: 一覧を取得した後に削除された
+            continue;
+        }
+        sw->compared++;
+
+        if (xattr_sync_listed(&sw->list, entry, n) && xattr_sync_same(&dst, entry, sw, w->work.ptr, size)) {
+            continue;
+        }
+
+        if (xattr_target_set(&dst, entry, w->work.ptr, size, 0) < 0) {
+            sw->failed++;
+        } else {
+            sw->written++;
+        }
+    }
+
+    cursor = sw->list.ptr;
+    end = sw->list.ptr + sw->list.size;
+    while ((entry = xattr_list_entry(&cursor, end, &n)) != NULL) {
+        if (!xattr_sync_wanted(sync, entry, n) || xattr_sync_listed(&w->list, entry, n)) { continue; }
+
+        if (xattr_target_remove(&dst, entry) < 0) {
+            if (errno != ENODATA) { sw->failed++; }
+        } else {
+            sw->removed++;
+        }
+    }
+
+    xattr_target_close(&dst);
+    if (pathfd >= 0) { close(pathfd); }
+}
+
+struct xattr_sync_args
+{
+    struct xattr_walk walk;
+    struct xattr_sync sync;
+    struct xattr_sync_worker *workers;
+    VALUE src, dst;
+};
+
+static VALUE
+xattr_sync_body(VALUE arg)
+{
+    struct xattr_sync_args *args = (struct xattr_sync_args *)arg;
+    struct xattr_walk *walk = &args->walk;
+
+    args->sync.dstfd = open(args->sync.dstroot, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (args->sync.dstfd < 0) { aux_sys_fail(args->dst, "open"); }
+
+    if (xattr_walk_start(walk, RSTRING_PTR(args->src), RSTRING_LEN(args->src)) < 1) {
+        errno = EAGAIN;
+        rb_sys_fail("pthread_create");
+    }
+
+    struct xattr_walk_record *records;
+    while ((records = xattr_walk_wait(walk)) != NULL) {
+        xattr_walk_record_free_all(records);
+    }
+
+    return Qnil;
+}
+
+static VALUE
+xattr_sync_cleanup(VALUE arg)
+{
+    struct xattr_sync_args *args = (struct xattr_sync_args *)arg;
+    int nthreads = args->walk.nthreads;
+    xattr_walk_cleanup(&args->walk);
+    for (int i = 0; i < nthreads; i++) {
+        xattr_buf_free(&args->workers[i].list);
+        xattr_buf_free(&args->workers[i].value);
+    }
+    if (args->sync.dstfd >= 0) { close(args->sync.dstfd); }
+    return Qnil;
+}
+
+static VALUE
+file_s_extattr_sync_tree_main(VALUE src, VALUE dst, int namespace1, int nthreads)
+{
+    if (nthreads < 1 || nthreads > XATTR_WALK_THREADS_MAX) {
+        rb_raise(rb_eArgError, "wrong number of threads - %d (expected 1..%d)",
+                 nthreads, XATTR_WALK_THREADS_MAX);
+    }
+    if (namespace1 != EXTATTR_NAMESPACE_ALL) {
+        size_t prefixlen;
+        xattr_prefix(namespace1, &prefixlen);
+    }
+
+    struct xattr_sync_args args;
+    src = rb_str_new_frozen(src);
+    dst = rb_str_new_frozen(dst);
+    args.src = src;
+    args.dst = dst;
+    StringValueCStr(src);
+    args.sync.namespace1 = namespace1;
+    args.sync.dstfd = -1;
+    args.sync.dstroot = StringValueCStr(dst);
+
+    VALUE tmp = 0;
+    args.workers = ALLOCV_N(struct xattr_sync_worker, tmp, nthreads);
+    memset(args.workers, 0, sizeof(struct xattr_sync_worker) * nthreads);
+    xattr_walk_init(&args.walk, nthreads, xattr_sync_visit);
+    for (int i = 0; i < nthreads; i++) {
+        args.workers[i].sync = &args.sync;
+        args.walk.workers[i].user = &args.workers[i];
+    }
+
+    rb_ensure(xattr_sync_body, (VALUE)&args, xattr_sync_cleanup, (VALUE)&args);
+
+    size_t files = 0, missing = 0, compared = 0, written = 0, removed = 0, failed = 0;
+    for (int i = 0; i < nthreads; i++) {
+        const struct xattr_sync_worker *sw = &args.workers[i];
+        files += sw->files;
+        missing += sw->missing;
+        compared += sw->compared;
+        written += sw->written;
+        removed += sw->removed;
+        failed += sw->failed;
+    }
+    if (tmp) { ALLOCV_END(tmp); }
+    RB_GC_GUARD(src);
+    RB_GC_GUARD(dst);
+
+    VALUE stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(id_sync_files), SIZET2NUM(files));
+    rb_hash_aset(stats, ID2SYM(id_sync_missing), SIZET2NUM(missing));
+    rb_hash_aset(stats, ID2SYM(id_sync_compared), SIZET2NUM(compared));
+    rb_hash_aset(stats, ID2SYM(id_sync_written), SIZET2NUM(written));
+    rb_hash_aset(stats, ID2SYM(id_sync_removed), SIZET2NUM(removed));
+    rb_hash_aset(stats, ID2SYM(id_sync_failed), SIZET2NUM(failed));
+    return stats;
+}
+
+static void
+xattr_sync_init(void)
+{
+    id_sync_files = rb_intern("files");
+    id_sync_missing = rb_intern("missing");
+    id_sync_compared = rb_intern("compared");
+    id_sync_written = rb_intern("written");
+    id_sync_removed = rb_intern("removed");
+    id_sync_failed = rb_intern("failed");
+}
@@ -0,0 +1,779 @@
+/*
+ * ディレクトリツリーを複数のネイティブスレッドでたどる仕組みと、それを用いた ExtAttr.scan の実装。
+ *
+ * extattr-xattr.h から読み込まれる。
+ *
+ * ワーカースレッドは ruby のオブジェクトに一切触れない。
+ * 結果は malloc で確保したレコードとしてまとめて受け渡し、ruby のオブジェクトへの変換は
+ * GVL を持つ呼び出し元のスレッドで行う。
+ */
+
+#include <ruby/encoding.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#define EXTATTR_HAVE_SCAN 1
+
+enum {
+    XATTR_WALK_BATCH = 64,              // ワーカーがまとめて受け渡すレコード数
+    XATTR_WALK_QUEUE_PER_THREAD = 4,    // 受け渡し待ちのバッチ数の上限 (スレッドあたり)
+    XATTR_WALK_THREADS_MAX = 256,
+};
+
+/*
+ * ワーカーから呼び出し元へ受け渡す結果。data の中身は visit 関数が決める。
+ */
+struct xattr_walk_record
+{
+    struct xattr_walk_record *next;
+    size_t size;
+    char data[];
+};
+
+/*
+ * 子ディレクトリを開くための、親ディレクトリの記述子。
+ *
+ * 未処理の子ディレクトリと、親ディレクトリを処理中のワーカーから参照され、全ての参照がなくなれば閉じる。
+ * 記述子を持つのは子ディレクトリが残っている親ディレクトリだけなので、ツリーの幅によらず記述子を使い切らない。
+ */
+struct xattr_walk_dirfd
+{
+    int fd;
+    int refs;                           // xattr_walk::mutex で保護される
+};
+
+/*
+ * 未処理のディレクトリ。
+ *
+ * ルート以外は、パス名をたどり直さずに parent から名前で開く。
+ */
+struct xattr_walk_dir
+{
+    struct xattr_walk_dir *next;
+    struct xattr_walk_dirfd *parent;    // ルートであれば NULL
+    int root;                           // ルートであれば、ディレクトリ自身も visit する
+    size_t len;
+    size_t namepos;                     // path のうち、parent からの名前の位置
+    char path[];
+};
+
+struct xattr_walk;
+
+struct xattr_walk_worker
+{
+    struct xattr_walk *walk;
+    pthread_t thread;
+    int started;
+
+    struct xattr_walk_record *head, *tail;
+    size_t count;
+
+    struct xattr_buf path;              // 作業中の項目のパス名
+    struct xattr_buf list;              // visit 関数の作業領域
+    struct xattr_buf work;              // visit 関数の作業領域
+    void *user;                         // visit 関数が自由に使う
+};
+
+/*
+ * 見つかった項目ごとに、ワーカースレッドから呼び出される。
+ *
+ * t は項目の拡張属性を操作するための対象で、path はそのパス名。
+ * relpath はルートからの相対パス名 (ルート自身であれば空文字列)。
+ */
+typedef void xattr_walk_visit_f(struct xattr_walk_worker *w, const struct xattr_target *t,
+                                const char *path, size_t pathlen,
+                                const char *relpath, size_t relpathlen);
+
+struct xattr_walk
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_work;           // ディレクトリの追加待ち (ワーカー)
+    pthread_cond_t cond_output;         // 結果待ち (呼び出し元)
+    pthread_cond_t cond_space;          // 受け渡しの空き待ち (ワーカー)
+
+    struct xattr_walk_dir *dirs;        // 未処理のディレクトリ (深さ優先とするため、スタックとして扱う)
+    int active;                         // ディレクトリを処理中のワーカー数
+    int running;                        // 動作中のワーカー数
+    volatile int stop;                  // ワーカーへの中断要求
+    volatile int cancel;                // 結果待ちへの割り込み
+
+    int nthreads;
+    struct xattr_walk_worker *workers;
+
+    struct xattr_walk_record *out_head, *out_tail;
+    size_t out_count;
+    size_t out_max;
+
+    size_t rootlen;
+    xattr_walk_visit_f *visit;
+};
+
+static struct xattr_walk_record *
+xattr_walk_record_new(const void *data, size_t size)
+{
+    struct xattr_walk_record *r = malloc(sizeof(struct xattr_walk_record) + size);
+    if (!r) { return NULL; }
+    r->next = NULL;
+    r->size = size;
+    memcpy(r->data, data, size);
+    return r;
+}
+
+static void
+xattr_walk_record_free_all(struct xattr_walk_record *r)
+{
+    while (r) {
+        struct xattr_walk_record *next = r->next;
+        free(r);
+        r = next;
+    }
+}
+
+static void
+xattr_walk_dirfd_release(struct xattr_walk *walk, struct xattr_walk_dirfd *p)
+{
+    if (!p) { return; }
+
+    pthread_mutex_lock(&walk->mutex);
+    int refs = --p->refs;
+    pthread_mutex_unlock(&walk->mutex);
+
+    if (refs == 0) {
+        close(p->fd);
+        free(p);
+    }
+}
+
+static int
+xattr_walk_push_dir(struct xattr_walk *walk, struct xattr_walk_dirfd *parent,
+                    const char *path, size_t len, size_t namepos, int root)
+{
+    struct xattr_walk_dir *d = malloc(sizeof(struct xattr_walk_dir) + len + 1);
+    if (!d) { return -1; }
+    d->parent = parent;
+    d->root = root;
+    d->len = len;
+    d->namepos = namepos;
+    memcpy(d->path, path, len);
+    d->path[len] = '\0';
+
+    pthread_mutex_lock(&walk->mutex);
+    if (parent) { parent->refs++; }
+    d->next = walk->dirs;
+    walk->dirs = d;
+    pthread_cond_signal(&walk->cond_work);
+    pthread_mutex_unlock(&walk->mutex);
+
+    return 0;
+}
+
+/*
+ * ワーカーが溜め込んだレコードを呼び出し元へ受け渡す。
+ */
+static void
+xattr_walk_flush(struct xattr_walk_worker *w)
+{
+    struct xattr_walk *walk = w->walk;
+    if (!w->head) { return; }
+
+    pthread_mutex_lock(&walk->mutex);
+    while (walk->out_count >= walk->out_max && !walk->stop) {
+        pthread_cond_wait(&walk->cond_space, &walk->mutex);
+    }
+    if (walk->stop) {
+        pthread_mutex_unlock(&walk->mutex);
+        xattr_walk_record_free_all(w->head);
+    } else {
+        if (walk->out_tail) {
+            walk->out_tail->next = w->head;
+        } else {
+            walk->out_head = w->head;
+        }
+        walk->out_tail = w->tail;
+        walk->out_count += w->count;
+        pthread_cond_signal(&walk->cond_output);
+        pthread_mutex_unlock(&walk->mutex);
+    }
+
+    w->head = w->tail = NULL;
+    w->count = 0;
+}
+
+/*
+ * visit 関数から、結果をひとつ出力する。
+ */
+static void
+xattr_walk_emit(struct xattr_walk_worker *w, const void *data, size_t size)
+{
+    struct xattr_walk_record *r = xattr_walk_record_new(data, size);
+    if (!r) { return; }
+
+    if (w->tail) {
+        w->tail->next = r;
+    } else {
+        w->head = r;
+    }
+    w->tail = r;
+    if (++w->count >= XATTR_WALK_BATCH) {
+        xattr_walk_flush(w);
+    }
+}
+
+static void
+xattr_walk_visit(struct xattr_walk_worker *w, struct xattr_target *t, size_t pathlen)
+{
+    struct xattr_walk *walk = w->walk;
+    const char *path = w->path.ptr;
+    const char *relpath = path + walk->rootlen;
+    size_t relpathlen = pathlen - walk->rootlen;
+
+    // ルートからの相対パス名は区切り文字で始まらないようにする。
+    if (relpathlen > 0 && *relpath == '/') {
+        relpath++;
+        relpathlen--;
+    }
+
+    walk->visit(w, t, path, pathlen, relpath, relpathlen);
+}
+
+static void
+xattr_walk_process(struct xattr_walk_worker *w, struct xattr_walk_dir *d)
+{
+    struct xattr_walk *walk = w->walk;
+    struct xattr_target t;
+
+    w->path.size = 0;
+    if (xattr_buf_reserve(&w->path, d->len + 1) < 0) { return; }
+    memcpy(w->path.ptr, d->path, d->len + 1);
+
+    if (d->root) {
+        xattr_target_open(&t, d->path, 1);
+        xattr_walk_visit(w, &t, d->len);
+        xattr_target_close(&t);
+    }
+
+    // 途中のパス名が置き換えられても、見つけた時の親ディレクトリの中だけを開く。
+    const int dirflags = O_RDONLY | O_DIRECTORY | O_NONBLOCK | O_CLOEXEC;
+    int dfd = (d->parent ? openat(d->parent->fd, d->path + d->namepos, dirflags | O_NOFOLLOW)
+                         : open(d->path, dirflags));
+    xattr_walk_dirfd_release(walk, d->parent);
+    d->parent = NULL;
+    if (dfd < 0) { return; }
+    DIR *dir = fdopendir(dfd);
+    if (!dir) { close(dfd); return; }
+
+    // 子ディレクトリを開くための記述子は、子ディレクトリが見つかった時に用意する。
+    struct xattr_walk_dirfd *self = NULL;
+
+    size_t dirlen = d->len;
+    int needsep = (dirlen == 0 || d->path[dirlen - 1] != '/');
+
+    struct dirent *ent;
+    while (!walk->stop && (ent = readdir(dir)) != NULL) {
+        const char *name = ent->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+
+        size_t namelen = strlen(name);
+        size_t pathlen = dirlen + needsep + namelen;
+        w->path.size = 0;
+        if (xattr_buf_reserve(&w->path, pathlen + 1) < 0) { break; }
+        char *p = w->path.ptr;
+        memcpy(p, d->path, dirlen);
+        if (needsep) { p[dirlen] = '/'; }
+        memcpy(p + dirlen + needsep, name, namelen + 1);
+
+        // d_type は読んだ後に置き換えられることがあるため頼らずに、開いたものの種類を確かめる。
+        // 通常ファイルとディレクトリ以外は、開くことによる副作用を避けるために O_PATH の記述子を通して操作する。
+        char procpath[EXTATTR_PROCPATH_SIZE];
+        struct stat st;
+        int pathfd;
+        int isdir = 0;
+        t.path = p;
+        t.follow = 0;
+        t.fd = xattr_open_checked(dfd, name, O_NOFOLLOW, 0, &pathfd);
+        t.needclose = (t.fd >= 0);
+        if (t.fd >= 0) {
+            isdir = (fstat(t.fd, &st) == 0 && S_ISDIR(st.st_mode));
+        } else if (pathfd >= 0) {
+            if (fstat(pathfd, &st) == 0 && !S_ISLNK(st.st_mode)) {
+                isdir = S_ISDIR(st.st_mode);
+                snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", pathfd);
+                t.path = procpath;
+                t.follow = 1;
+            }
+        } else if (errno == ENOENT) {
+            continue;
+        }
+
+        xattr_walk_visit(w, &t, pathlen);
+        xattr_target_close(&t);
+        if (pathfd >= 0) { close(pathfd); }
+
+        if (isdir) {
+            if (!self && (self = malloc(sizeof(*self))) != NULL) {
+                self->refs = 1;
+                self->fd = fcntl(dfd, F_DUPFD_CLOEXEC, 0);
+                if (self->fd < 0) { free(self); self = NULL; }
+            }
+            if (self) { xattr_walk_push_dir(walk, self, p, pathlen, dirlen + needsep, 0); }
+        }
+    }
+
+    xattr_walk_dirfd_release(walk, self);
+    closedir(dir);
+}
+
+static void *
+xattr_walk_worker_main(void *arg)
+{
+    struct xattr_walk_worker *w = (struct xattr_walk_worker *)arg;
+    struct xattr_walk *walk = w->walk;
+
+    pthread_mutex_lock(&walk->mutex);
+    for (;;) {
+        while (!walk->dirs && walk->active > 0 && !walk->stop) {
+            pthread_cond_wait(&walk->cond_work, &walk->mutex);
+        }
+        if (walk->stop || !walk->dirs) { break; }
+
+        struct xattr_walk_dir *d = walk->dirs;
+        walk->dirs = d->next;
+        walk->active++;
+        pthread_mutex_unlock(&walk->mutex);
+
+        xattr_walk_process(w, d);
+        free(d);
+        xattr_walk_flush(w);
+
+        pthread_mutex_lock(&walk->mutex);
+        walk->active--;
+        if (!walk->dirs && walk->active == 0) {
+            pthread_cond_broadcast(&walk->cond_work);
+        }
+    }
+    if (--walk->running == 0) {
+        pthread_cond_broadcast(&walk->cond_output);
+    }
+    pthread_mutex_unlock(&walk->mutex);
+
+    xattr_walk_record_free_all(w->head);
+    w->head = w->tail = NULL;
+
+    return NULL;
+}
+
+static void
+xattr_walk_init(struct xattr_walk *walk, int nthreads, xattr_walk_visit_f *visit)
+{
+    memset(walk, 0, sizeof(*walk));
+    pthread_mutex_init(&walk->mutex, NULL);
+    pthread_cond_init(&walk->cond_work, NULL);
+    pthread_cond_init(&walk->cond_output, NULL);
+    pthread_cond_init(&walk->cond_space, NULL);
+    walk->nthreads = nthreads;
+    walk->out_max = (size_t)nthreads * XATTR_WALK_BATCH * XATTR_WALK_QUEUE_PER_THREAD;
+    walk->visit = visit;
+    walk->workers = ruby_xcalloc(nthreads, sizeof(struct xattr_walk_worker));
+}
+
+/*
+ * ワーカースレッドを起動する。起動できたスレッドの数を返す。
+ */
+static int
+xattr_walk_start(struct xattr_walk *walk, const char *root, size_t rootlen)
+{
+    // ルートの末尾の区切り文字は取り除いておく。
+    while (rootlen > 1 && root[rootlen - 1] == '/') { rootlen--; }
+    walk->rootlen = rootlen;
+    if (xattr_walk_push_dir(walk, NULL, root, rootlen, 0, 1) < 0) { return 0; }
+
+    // ワーカースレッドはシグナルを受け取らないようにする。
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    int started = 0;
+    for (int i = 0; i < walk->nthreads; i++) {
+        struct xattr_walk_worker *w = &walk->workers[i];
+        w->walk = walk;
+        pthread_mutex_lock(&walk->mutex);
+        walk->running++;
+        pthread_mutex_unlock(&walk->mutex);
+        if (pthread_create(&w->thread, NULL, xattr_walk_worker_main, w) == 0) {
+            w->started = 1;
+            started++;
+        } else {
+            pthread_mutex_lock(&walk->mutex);
+            walk->running--;
+            pthread_mutex_unlock(&walk->mutex);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return started;
+}
+
+static void *
+xattr_walk_join_nogvl(void *arg)
+{
+    struct xattr_walk *walk = (struct xattr_walk *)arg;
+    for (int i = 0; i < walk->nthreads; i++) {
+        struct xattr_walk_worker *w = &walk->workers[i];
+        if (w->started) {
+            pthread_join(w->thread, NULL);
+            w->started = 0;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * ワーカースレッドを止めて、全ての資源を解放する。
+ *
+ * ワーカーは処理中のシステムコールを終えるまで止まらないため、GVL を解放して待つ。
+ */
+static void
+xattr_walk_cleanup(struct xattr_walk *walk)
+{
+    pthread_mutex_lock(&walk->mutex);
+    walk->stop = 1;
+    pthread_cond_broadcast(&walk->cond_work);
+    pthread_cond_broadcast(&walk->cond_space);
+    pthread_mutex_unlock(&walk->mutex);
+
+    rb_thread_call_without_gvl(xattr_walk_join_nogvl, walk, NULL, NULL);
+
+    for (int i = 0; i < walk->nthreads; i++) {
+        struct xattr_walk_worker *w = &walk->workers[i];
+        xattr_buf_free(&w->path);
+        xattr_buf_free(&w->list);
+        xattr_buf_free(&w->work);
+    }
+    ruby_xfree(walk->workers);
+    walk->workers = NULL;
+
+    while (walk->dirs) {
+        struct xattr_walk_dir *d = walk->dirs;
+        walk->dirs = d->next;
+        xattr_walk_dirfd_release(walk, d->parent);
+        free(d);
+    }
+    xattr_walk_record_free_all(walk->out_head);
+    walk->out_head = walk->out_tail = NULL;
+
+    pthread_cond_destroy(&walk->cond_space);
+    pthread_cond_destroy(&walk->cond_output);
+    pthread_cond_destroy(&walk->cond_work);
+    pthread_mutex_destroy(&walk->mutex);
+}
+
+struct xattr_walk_wait
+{
+    struct xattr_walk *walk;
+    struct xattr_walk_record *records;
+};
+
+static void *
+xattr_walk_wait_nogvl(void *arg)
+{
+    struct xattr_walk_wait *p = (struct xattr_walk_wait *)arg;
+    struct xattr_walk *walk = p->walk;
+
+    pthread_mutex_lock(&walk->mutex);
+    while (!walk->out_head && walk->running > 0 && !walk->cancel) {
+        pthread_cond_wait(&walk->cond_output, &walk->mutex);
+    }
+    p->records = walk->out_head;
+    walk->out_head = walk->out_tail = NULL;
+    walk->out_count = 0;
+    pthread_cond_broadcast(&walk->cond_space);
+    pthread_mutex_unlock(&walk->mutex);
+
+    return NULL;
+}
+
+static void
+xattr_walk_wait_ubf(void *arg)
+{
+    struct xattr_walk *walk = (struct xattr_walk *)arg;
+    pthread_mutex_lock(&walk->mutex);
+    walk->cancel = 1;
+    pthread_cond_broadcast(&walk->cond_output);
+    pthread_mutex_unlock(&walk->mutex);
+}
+
+/*
+ * ワーカーからの結果を待って、受け取ったレコードの連結リストを返す。
+ * 全てのワーカーが終了していれば NULL を返す。
+ *
+ * 返されたレコードは、呼び出し側が xattr_walk_record_free_all で解放すること。
+ */
+static struct xattr_walk_record *
+xattr_walk_wait(struct xattr_walk *walk)
+{
+    struct xattr_walk_wait args = { walk, NULL };
+
+    for (;;) {
+        walk->cancel = 0;
+        rb_thread_call_without_gvl(xattr_walk_wait_nogvl, &args, xattr_walk_wait_ubf, walk);
+        if (args.records) { return args.records; }
+
+        // レコードを出力しない visit 関数でも割り込めるようにする。
+        rb_thread_check_ints();
+
+        pthread_mutex_lock(&walk->mutex);
+        int running = walk->running;
+        pthread_mutex_unlock(&walk->mutex);
+        if (running == 0) { return NULL; }
+    }
+}
+
+
+/*
+ * ExtAttr.scan の実装
+ *
+ * レコードの形式:
+ *      size_t pathlen, char path[pathlen],
+ *      (size_t namelen, char name[namelen], size_t valuelen, char value[valuelen]) ...
+ *
+ * name は名前空間の接頭辞を除いたもの。
+ */
+
+struct xattr_scan
+{
+    int namespace1;
+    long numnames;
+    const char **names;                 // NULL であれば全ての拡張属性
+    size_t *namelens;
+};
+
+static int
+xattr_buf_append(struct xattr_buf *b, const void *ptr, size_t size)
+{
+    if (xattr_buf_reserve(b, size) < 0) { return -1; }
+    memcpy(b->ptr + b->size, ptr, size);
+    b->size += size;
+    return 0;
+}
+
+static int
+xattr_scan_wanted(const struct xattr_scan *scan, const char *name, size_t len)
+{
+    if (!scan->names) { return 1; }
+
+    for (long i = 0; i < scan->numnames; i++) {
+        if (scan->namelens[i] == len && memcmp(scan->names[i], name, len) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void
+xattr_scan_visit(struct xattr_walk_worker *w, const struct xattr_target *t,
+                 const char *path, size_t pathlen, const char *relpath, size_t relpathlen)
+{
+    const struct xattr_scan *scan = (const struct xattr_scan *)w->user;
+    size_t prefixlen;
+    xattr_prefix_lookup(scan->namespace1, &prefixlen);
+
+    if (xattr_target_list_into(t, &w->list) <= 0) { return; }
+
+    struct xattr_buf *b = &w->work;
+    b->size = 0;
+    if (xattr_buf_append(b, &pathlen, sizeof(pathlen)) < 0 ||
+        xattr_buf_append(b, path, pathlen) < 0) {
+        return;
+    }
+    size_t header = b->size;
+
+    const char *cursor = w->list.ptr;
+    const char *end = w->list.ptr + w->list.size;
+    const char *namep;
+    size_t namelen;
+    while ((namep = xattr_list_next(&cursor, end, scan->namespace1, &namelen)) != NULL) {
+        if (!xattr_scan_wanted(scan, namep, namelen)) { continue; }
+
+        size_t mark = b->size;
+        size_t valuelen = 0;
+        if (xattr_buf_append(b, &namelen, sizeof(namelen)) < 0 ||
+            xattr_buf_append(b, namep, namelen) < 0 ||
+            xattr_buf_append(b, &valuelen, sizeof(valuelen)) < 0) {
+            return;
+        }
+
+        // 一覧の各要素はヌル終端されているため、接頭辞を含めた名前をそのまま使える。
+        ssize_t size = xattr_target_get_into(t, namep - prefixlen, b);
+        if (size < 0) {
+            // 一覧を取得した後に削除された場合など
+            b->size = mark;
+            continue;
+        }
+        valuelen = size;
+        memcpy(b->ptr + b->size - size - sizeof(valuelen), &valuelen, sizeof(valuelen));
+    }
+
+    if (b->size > header) {
+        xattr_walk_emit(w, b->ptr, b->size);
+    }
+}
+
+struct extattr_scan_args
+{
+    struct xattr_walk walk;
+    struct xattr_scan scan;
+    VALUE root;
+    rb_encoding *enc;
+};
+
+/*
+ * xattr_scan_visit が出力したレコードを、パス名と拡張属性のハッシュにする。
+ */
+static VALUE
+xattr_scan_record_decode(const struct xattr_walk_record *r, rb_encoding *enc, VALUE *hash)
+{
+    const char *p = r->data;
+    size_t len;
+
+    memcpy(&len, p, sizeof(len));
+    p += sizeof(len);
+    VALUE path = rb_enc_str_new(p, len, enc);
+    p += len;
+
+    *hash = rb_hash_new();
+    const char *end = r->data + r->size;
+    while (p < end) {
+        memcpy(&len, p, sizeof(len));
+        p += sizeof(len);
+        VALUE name = rb_str_new(p, len);
+        p += len;
+        memcpy(&len, p, sizeof(len));
+        p += sizeof(len);
+        rb_hash_aset(*hash, name, rb_str_new(p, len));
+        p += len;
+    }
+
+    return path;
+}
+
+static VALUE
+extattr_scan_yield_records(struct extattr_scan_args *args, struct xattr_walk_record *r)
+{
+    for (; r; r = r->next) {
+        VALUE hash;
+        VALUE path = xattr_scan_record_decode(r, args->enc, &hash);
+        rb_yield_values(2, path, hash);
+    }
+
+    return Qnil;
+}
+
+struct extattr_scan_batch
+{
+    struct extattr_scan_args *args;
+    struct xattr_walk_record *records;
+};
+
+static VALUE
+extattr_scan_yield_batch(VALUE arg)
+{
+    struct extattr_scan_batch *batch = (struct extattr_scan_batch *)arg;
+    return extattr_scan_yield_records(batch->args, batch->records);
+}
+
+static VALUE
+extattr_scan_free_batch(VALUE arg)
+{
+    struct extattr_scan_batch *batch = (struct extattr_scan_batch *)arg;
+    xattr_walk_record_free_all(batch->records);
+    batch->records = NULL;
+    return Qnil;
+}
+
+static VALUE
+extattr_scan_body(VALUE arg)
+{
+    struct extattr_scan_args *args = (struct extattr_scan_args *)arg;
+    struct xattr_walk *walk = &args->walk;
+
+    if (xattr_walk_start(walk, RSTRING_PTR(args->root), RSTRING_LEN(args->root)) < 1) {
+        errno = EAGAIN;
+        rb_sys_fail("pthread_create");
+    }
+
+    struct xattr_walk_record *records;
+    while ((records = xattr_walk_wait(walk)) != NULL) {
+        struct extattr_scan_batch batch = { args, records };
+        rb_ensure(extattr_scan_yield_batch, (VALUE)&batch,
+                  extattr_scan_free_batch, (VALUE)&batch);
+    }
+
+    return Qnil;
+}
+
+static VALUE
+extattr_scan_cleanup(VALUE arg)
+{
+    struct extattr_scan_args *args = (struct extattr_scan_args *)arg;
+    xattr_walk_cleanup(&args->walk);
+    return Qnil;
+}
+
+static VALUE
+file_s_extattr_scan_main(VALUE root, int namespace1, VALUE names, int nthreads)
+{
+    if (nthreads < 1 || nthreads > XATTR_WALK_THREADS_MAX) {
+        rb_raise(rb_eArgError, "wrong number of threads - %d (expected 1..%d)",
+                 nthreads, XATTR_WALK_THREADS_MAX);
+    }
+
+    struct extattr_scan_args args;
+    size_t prefixlen;
+    xattr_prefix(namespace1, &prefixlen);
+    root = rb_str_new_frozen(root);
+    args.root = root;
+    args.enc = rb_enc_get(root);
+    StringValueCStr(root);
+
+    args.scan.namespace1 = namespace1;
+    args.scan.numnames = 0;
+    args.scan.names = NULL;
+    args.scan.namelens = NULL;
+
+    VALUE tmp = 0;
+    if (!NIL_P(names)) {
+        names = rb_ary_dup(names);
+        long num = RARRAY_LEN(names);
+        char *work = ALLOCV(tmp, (sizeof(const char *) + sizeof(size_t)) * (num > 0 ? num : 1));
+        args.scan.names = (const char **)work;
+        args.scan.namelens = (size_t *)(args.scan.names + num);
+        for (long i = 0; i < num; i++) {
+            VALUE name = rb_str_new_frozen(aux_name_string(aux_should_be_name(RARRAY_AREF(names, i))));
+            rb_ary_store(names, i, name);
+            args.scan.names[i] = RSTRING_PTR(name);
+            args.scan.namelens[i] = RSTRING_LEN(name);
+        }
+        args.scan.numnames = num;
+    }
+
+    xattr_walk_init(&args.walk, nthreads, xattr_scan_visit);
+    for (int i = 0; i < nthreads; i++) {
+        args.walk.workers[i].user = &args.scan;
+    }
+
+    rb_ensure(extattr_scan_body, (VALUE)&args,
+              extattr_scan_cleanup, (VALUE)&args);
+
+    if (tmp) { ALLOCV_END(tmp); }
+    RB_GC_GUARD(names);
+    RB_GC_GUARD(root);
+
+    return Qnil;
+}
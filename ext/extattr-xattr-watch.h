@@ -0,0 +1,987 @@
+/*
+ * ExtAttr::Watcher の xattr (inotify) による実装。
+ *
+ * ディレクトリツリーの全てのディレクトリを inotify で監視して、IN_ATTRIB などを受け取った
+ * ファイルの拡張属性をネイティブスレッドで読み直す。読み直した結果は一度の read で受け取った
+ * イベントごとにまとめて受け渡し、呼び出し元のスレッドで最後に知っている内容 (snapshot) と
+ * 比べて、変わった拡張属性ごとのイベントにする。
+ *
+ * 監視を始める時は ExtAttr.scan と同じワーカーでツリーをたどり、ディレクトリの監視を
+ * 追加してから、その中のファイルの拡張属性を snapshot として読み込む。
+ *
+ * ディレクトリが移動された場合は、元のパス名以下の snapshot を取り除いて削除のイベントにし、
+ * ツリーの中へ移動したのであれば、移動先を新たに現れたディレクトリとして読み込む。
+ *
+ * inotify のキューが溢れた場合は、その間の変更を見逃す。溢れた回数は stats で確かめられる。
+ */
+
+#include <sys/inotify.h>
+#include <poll.h>
+
+#define EXTATTR_HAVE_WATCHER 1
+
+#define XATTR_WATCH_MASK (IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                          IN_DELETE_SELF | IN_MOVE_SELF | \
+                          IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+
+enum {
+    XATTR_WATCH_EVENTBUF_SIZE = 64 * 1024,
+    XATTR_WATCH_QUEUE_MAX = 64 * 1024,  // 受け渡し待ちのレコード数の上限
+};
+
+/*
+ * ExtAttr.scan の形式のレコードの代わりに、パス名以下の snapshot を取り除くことを示すレコードの先頭。
+ * 続いて size_t pathlen, char path[pathlen] を置く。
+ */
+#define XATTR_WATCH_PRUNE SIZE_MAX
+
+static VALUE cWatcher;
+static ID id_directories, id_overflows, id_pending;
+
+struct xattr_watcher
+{
+    int fd;                             // inotify の記述子
+    int wake[2];                        // close で監視スレッドを起こすためのパイプ
+    int namespace1;
+    pthread_t thread;
+    int started;
+    int rootwd;                         // ルートの監視記述子
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    char **dirs;                        // 監視記述子ごとの、ディレクトリのパス名
+    int dirs_capa;
+    long ndirs;
+    struct xattr_walk_record *head, *tail;
+    size_t count;
+    size_t overflows;
+    int stop;                           // 監視スレッドへの終了要求
+    int done;                           // 監視スレッドが終了した
+    int closing;                        // close が呼ばれた (GVL で保護される)
+    volatile int cancel;                // 結果待ちへの割り込み
+
+    struct xattr_buf path, list, work;  // 監視スレッドの作業領域
+
+    VALUE root;
+    VALUE snapshot;                     // パス名から、拡張属性の名前と値の Hash への Hash
+};
+
+/*
+ * 監視スレッドを止めて、監視を終える。
+ *
+ * ruby のオブジェクトには触れないため、GVL を解放した状態からも呼び出せる。
+ */
+static void
+xattr_watcher_stop(struct xattr_watcher *wt)
+{
+    if (wt->started) {
+        pthread_mutex_lock(&wt->mutex);
+        wt->stop = 1;
+        pthread_mutex_unlock(&wt->mutex);
+        char c = 0;
+        while (write(wt->wake[1], &c, 1) < 0 && errno == EINTR) { }
+        pthread_join(wt->thread, NULL);
+        wt->started = 0;
+    }
+
+    // 結果待ちのスレッドは mutex を参照したまま起きることがあるため、mutex と cond は残しておく。
+    pthread_mutex_lock(&wt->mutex);
+    wt->done = 1;
+    pthread_cond_broadcast(&wt->cond);
+    xattr_walk_record_free_all(wt->head);
+    wt->head = wt->tail = NULL;
+    wt->count = 0;
+    pthread_mutex_unlock(&wt->mutex);
+
+    if (wt->fd >= 0) { close(wt->fd); wt->fd = -1; }
+    if (wt->wake[0] >= 0) { close(wt->wake[0]); wt->wake[0] = -1; }
+    if (wt->wake[1] >= 0) { close(wt->wake[1]); wt->wake[1] = -1; }
+
+    for (int i = 0; i < wt->dirs_capa; i++) { free(wt->dirs[i]); }
+    free(wt->dirs);
+    wt->dirs = NULL;
+    wt->dirs_capa = 0;
+    wt->ndirs = 0;
+
+    xattr_buf_free(&wt->path);
+    xattr_buf_free(&wt->list);
+    xattr_buf_free(&wt->work);
+}
+
+static void *
+xattr_watcher_stop_nogvl(void *arg)
+{
+    xattr_watcher_stop((struct xattr_watcher *)arg);
+    return NULL;
+}
+
+static void
+xattr_watcher_mark(void *ptr)
+{
+    struct xattr_watcher *wt = (struct xattr_watcher *)ptr;
+    rb_gc_mark(wt->root);
+    rb_gc_mark(wt->snapshot);
+}
+
+static void
+xattr_watcher_free(void *ptr)
+{
+    struct xattr_watcher *wt = (struct xattr_watcher *)ptr;
+    xattr_watcher_stop(wt);
+    pthread_cond_destroy(&wt->cond);
+    pthread_mutex_destroy(&wt->mutex);
+    xfree(wt);
+}
+
+static size_t
+xattr_watcher_memsize(const void *ptr)
+{
+    const struct xattr_watcher *wt = (const struct xattr_watcher *)ptr;
+    return sizeof(struct xattr_watcher) + sizeof(char *) * wt->dirs_capa +
+           wt->path.capa + wt->list.capa + wt->work.capa;
+}
+
+static const rb_data_type_t xattr_watcher_type = {
+    "extattr.watcher",
+    { xattr_watcher_mark, xattr_watcher_free, xattr_watcher_memsize, },
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+xattr_watcher_alloc(VALUE klass)
+{
+    struct xattr_watcher *wt;
+    VALUE obj = TypedData_Make_Struct(klass, struct xattr_watcher, &xattr_watcher_type, wt);
+    wt->fd = wt->wake[0] = wt->wake[1] = -1;
+    wt->rootwd = -1;
+    wt->done = 1;
+    pthread_mutex_init(&wt->mutex, NULL);
+    pthread_cond_init(&wt->cond, NULL);
+    wt->root = Qnil;
+    wt->snapshot = Qnil;
+    return obj;
+}
+
+static struct xattr_watcher *
+xattr_watcher_ref(VALUE obj)
+{
+    return rb_check_typeddata(obj, &xattr_watcher_type);
+}
+
+static struct xattr_watcher *
+xattr_watcher_ref_open(VALUE obj)
+{
+    struct xattr_watcher *wt = xattr_watcher_ref(obj);
+    if (wt->fd < 0) { rb_raise(rb_eIOError, "closed extattr watcher"); }
+    return wt;
+}
+
+/*
+ * ディレクトリの監視を追加する。ワーカースレッドと監視スレッドから呼び出される。
+ */
+static void
+xattr_watcher_add_dir(struct xattr_watcher *wt, const char *path, size_t len)
+{
+    int wd = inotify_add_watch(wt->fd, path, XATTR_WATCH_MASK);
+    if (wd < 0) { return; }
+
+    char *copy = malloc(len + 1);
+    if (!copy) { return; }
+    memcpy(copy, path, len);
+    copy[len] = '\0';
+
+    pthread_mutex_lock(&wt->mutex);
+    if (wd >= wt->dirs_capa) {
+        int capa = (wt->dirs_capa > 0 ? wt->dirs_capa : 64);
+        while (capa <= wd) { capa *= 2; }
+        char **dirs = realloc(wt->dirs, sizeof(char *) * capa);
+        if (!dirs) {
+            pthread_mutex_unlock(&wt->mutex);
+            free(copy);
+            return;
+        }
+        memset(dirs + wt->dirs_capa, 0, sizeof(char *) * (capa - wt->dirs_capa));
+        wt->dirs = dirs;
+        wt->dirs_capa = capa;
+    }
+    // 同じディレクトリを別のパス名で追加した場合は、同じ監視記述子が返される。
+    if (wt->dirs[wd]) {
+        free(wt->dirs[wd]);
+    } else {
+        wt->ndirs++;
+    }
+    wt->dirs[wd] = copy;
+    pthread_mutex_unlock(&wt->mutex);
+}
+
+static void
+xattr_watcher_remove_dir(struct xattr_watcher *wt, int wd)
+{
+    pthread_mutex_lock(&wt->mutex);
+    if (wd >= 0 && wd < wt->dirs_capa && wt->dirs[wd]) {
+        free(wt->dirs[wd]);
+        wt->dirs[wd] = NULL;
+        wt->ndirs--;
+    }
+    pthread_mutex_unlock(&wt->mutex);
+}
+
+/*
+ * path とそれ以下のディレクトリの監視を取りやめる。監視スレッドから呼び出される。
+ * 取りやめたディレクトリは、その後に読んだイベントではパス名が分からなくなるため無視される。
+ */
+static void
+xattr_watcher_remove_tree(struct xattr_watcher *wt, const char *path, size_t len)
+{
+    pthread_mutex_lock(&wt->mutex);
+    for (int wd = 0; wd < wt->dirs_capa; wd++) {
+        const char *dir = wt->dirs[wd];
+        if (!dir || strncmp(dir, path, len) != 0 || (dir[len] != '\0' && dir[len] != '/')) { continue; }
+        inotify_rm_watch(wt->fd, wd);
+        free(wt->dirs[wd]);
+        wt->dirs[wd] = NULL;
+        wt->ndirs--;
+    }
+    pthread_mutex_unlock(&wt->mutex);
+}
+
+/*
+ * path 以下の snapshot を取り除くことを示すレコードを作る。
+ */
+static struct xattr_walk_record *
+xattr_watcher_prune_record(struct xattr_watcher *wt, const char *path, size_t pathlen)
+{
+    const size_t mark = XATTR_WATCH_PRUNE;
+    struct xattr_buf *b = &wt->work;
+    b->size = 0;
+    if (xattr_buf_append(b, &mark, sizeof(mark)) < 0 ||
+        xattr_buf_append(b, &pathlen, sizeof(pathlen)) < 0 ||
+        xattr_buf_append(b, path, pathlen) < 0) {
+        return NULL;
+    }
+    return xattr_walk_record_new(b->ptr, b->size);
+}
+
+/*
+ * 同じ read で受け取った残りのイベントに、cookie が同じ IN_MOVED_TO (監視しているツリーの中への移動) があるか。
+ */
+static int
+xattr_watcher_moved_inside(const char *p, const char *end, uint32_t cookie)
+{
+    while (p < end) {
+        const struct inotify_event *ev = (const struct inotify_event *)p;
+        if ((ev->mask & IN_MOVED_TO) && ev->cookie == cookie) { return 1; }
+        p += sizeof(struct inotify_event) + ev->len;
+    }
+    return 0;
+}
+
+struct xattr_watcher_walk
+{
+    struct xattr_scan scan;             // xattr_scan_visit が参照するため、先頭に置く
+    struct xattr_watcher *watcher;
+};
+
+static void
+xattr_watcher_walk_visit(struct xattr_walk_worker *w, const struct xattr_target *t,
+                         const char *path, size_t pathlen, const char *relpath, size_t relpathlen)
+{
+    struct xattr_watcher_walk *ww = (struct xattr_watcher_walk *)w->user;
+    struct stat st;
+
+    // 中身を読む前に監視を追加するため、その後の変更は見逃さない。
+    if (t->fd >= 0 && fstat(t->fd, &st) == 0 && S_ISDIR(st.st_mode)) {
+        xattr_watcher_add_dir(ww->watcher, path, pathlen);
+    }
+
+    xattr_scan_visit(w, t, path, pathlen, relpath, relpathlen);
+}
+
+/*
+ * path の拡張属性を読み直して、ExtAttr.scan と同じ形式のレコードにする。
+ * 削除されたなどで読めない場合は、拡張属性のないレコードとなる。
+ */
+static struct xattr_walk_record *
+xattr_watcher_read_attrs(struct xattr_watcher *wt, const char *path, size_t pathlen)
+{
+    struct xattr_target t = { -1, 0, 0, path };
+    struct xattr_buf *b = &wt->work;
+    size_t prefixlen;
+    xattr_prefix_lookup(wt->namespace1, &prefixlen);
+
+    b->size = 0;
+    if (xattr_buf_append(b, &pathlen, sizeof(pathlen)) < 0 ||
+        xattr_buf_append(b, path, pathlen) < 0) {
+        return NULL;
+    }
+
+    if (xattr_target_list_into(&t, &wt->list) > 0) {
+        const char *cursor = wt->list.ptr;
+        const char *end = wt->list.ptr + wt->list.size;
+        const char *namep;
+        size_t namelen;
+        while ((namep = xattr_list_next(&cursor, end, wt->namespace1, &namelen)) != NULL) {
+            size_t mark = b->size;
+            size_t valuelen = 0;
+            if (xattr_buf_append(b, &namelen, sizeof(namelen)) < 0 ||
+                xattr_buf_append(b, namep, namelen) < 0 ||
+                xattr_buf_append(b, &valuelen, sizeof(valuelen)) < 0) {
+                return NULL;
+            }
+            ssize_t size = xattr_target_get_into(&t, namep - prefixlen, b);
+            if (size < 0) {
+                b->size = mark;
+                continue;
+            }
+            valuelen = size;
+            memcpy(b->ptr + b->size - size - sizeof(valuelen), &valuelen, sizeof(valuelen));
+        }
+    }
+
+    return xattr_walk_record_new(b->ptr, b->size);
+}
+
+struct xattr_watcher_batchlist
+{
+    struct xattr_walk_record *head, *tail;
+    size_t count;
+};
+
+static void
+xattr_watcher_batchlist_add(struct xattr_watcher_batchlist *list, struct xattr_walk_record *r)
+{
+    if (!r) { return; }
+    if (list->tail) { list->tail->next = r; } else { list->head = r; }
+    list->tail = r;
+    list->count++;
+}
+
+/*
+ * 新たに現れたディレクトリの監視を追加して、その中身を読み込む。
+ * 監視を追加する前に作られたファイルは、イベントでは知ることができないため。
+ */
+static void
+xattr_watcher_add_tree(struct xattr_watcher *wt, const char *path, size_t pathlen,
+                       struct xattr_watcher_batchlist *list)
+{
+    xattr_watcher_add_dir(wt, path, pathlen);
+
+    DIR *dir = opendir(path);
+    if (!dir) { return; }
+
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL) {
+        const char *name = ent->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) { continue; }
+
+        size_t namelen = strlen(name);
+        char *child = malloc(pathlen + 1 + namelen + 1);
+        if (!child) { break; }
+        memcpy(child, path, pathlen);
+        child[pathlen] = '/';
+        memcpy(child + pathlen + 1, name, namelen + 1);
+        size_t childlen = pathlen + 1 + namelen;
+
+        struct stat st;
+        if (ent->d_type == DT_DIR ||
+            (ent->d_type == DT_UNKNOWN && lstat(child, &st) == 0 && S_ISDIR(st.st_mode))) {
+            xattr_watcher_add_tree(wt, child, childlen, list);
+        }
+        xattr_watcher_batchlist_add(list, xattr_watcher_read_attrs(wt, child, childlen));
+        free(child);
+    }
+
+    closedir(dir);
+}
+
+/*
+ * inotify から一度に読んだイベントを処理して、読み直した結果をまとめて受け渡す。
+ */
+static void
+xattr_watcher_process(struct xattr_watcher *wt, const char *buf, size_t size)
+{
+    struct xattr_watcher_batchlist list = { NULL, NULL, 0 };
+    size_t overflows = 0;
+    int lastwd = -1;
+    const char *lastname = NULL;
+
+    for (const char *p = buf; p < buf + size; ) {
+        const struct inotify_event *ev = (const struct inotify_event *)p;
+        p += sizeof(struct inotify_event) + ev->len;
+
+        if (ev->mask & IN_Q_OVERFLOW) { overflows++; continue; }
+        if (ev->mask & IN_IGNORED) { xattr_watcher_remove_dir(wt, ev->wd); continue; }
+
+        // ルート以外のディレクトリ自身への IN_DELETE_SELF と IN_MOVE_SELF は、親ディレクトリへのイベントで扱う。
+        int self = (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) != 0;
+        if (self && ev->wd != wt->rootwd) { continue; }
+        int movedir = ((ev->mask & (IN_MOVED_FROM | IN_ISDIR)) == (IN_MOVED_FROM | IN_ISDIR));
+
+        const char *name = (ev->len > 0 ? ev->name : "");
+        // 同じファイルへのイベントが続いた場合は、一度だけ読み直す。
+        if (!movedir && !self && ev->wd == lastwd && lastname && strcmp(name, lastname) == 0) { continue; }
+        lastwd = ev->wd;
+        lastname = name;
+
+        struct xattr_buf *path = &wt->path;
+        path->size = 0;
+        pthread_mutex_lock(&wt->mutex);
+        const char *dir = (ev->wd >= 0 && ev->wd < wt->dirs_capa ? wt->dirs[ev->wd] : NULL);
+        int ok = (dir && xattr_buf_append(path, dir, strlen(dir)) == 0);
+        pthread_mutex_unlock(&wt->mutex);
+        if (!ok) { continue; }
+        size_t namelen = strlen(name);
+        if (namelen > 0 &&
+            (xattr_buf_append(path, "/", 1) < 0 || xattr_buf_append(path, name, namelen) < 0)) {
+            continue;
+        }
+        if (xattr_buf_append(path, "", 1) < 0) { continue; }
+        size_t pathlen = path->size - 1;
+
+        if (movedir || self) {
+            // 元のパス名以下は存在しなくなったので、snapshot から取り除く。
+            // ツリーの外へ移動したか削除されたのであれば、その監視も取りやめる。
+            // ツリーの中へ移動した場合は、IN_MOVED_TO で移動先の監視を更新する。
+            xattr_watcher_batchlist_add(&list, xattr_watcher_prune_record(wt, path->ptr, pathlen));
+            if (self || !xattr_watcher_moved_inside(p, buf + size, ev->cookie)) {
+                xattr_watcher_remove_tree(wt, path->ptr, pathlen);
+            }
+            lastname = NULL;
+            continue;
+        }
+
+        if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+            xattr_watcher_add_tree(wt, path->ptr, pathlen, &list);
+        }
+        xattr_watcher_batchlist_add(&list, xattr_watcher_read_attrs(wt, path->ptr, pathlen));
+    }
+
+    pthread_mutex_lock(&wt->mutex);
+    wt->overflows += overflows;
+    if (list.head) {
+        if (wt->count + list.count > XATTR_WATCH_QUEUE_MAX) {
+            // 受け取られないまま溜まり続ける場合は、inotify のキューが溢れた場合と同じく捨てる。
+            wt->overflows++;
+            xattr_walk_record_free_all(list.head);
+        } else {
+            if (wt->tail) { wt->tail->next = list.head; } else { wt->head = list.head; }
+            wt->tail = list.tail;
+            wt->count += list.count;
+            pthread_cond_broadcast(&wt->cond);
+        }
+    }
+    pthread_mutex_unlock(&wt->mutex);
+}
+
+static void *
+xattr_watcher_main(void *arg)
+{
+    struct xattr_watcher *wt = (struct xattr_watcher *)arg;
+    char *buf = malloc(XATTR_WATCH_EVENTBUF_SIZE);
+
+    while (buf) {
+        struct pollfd fds[2] = { { wt->fd, POLLIN, 0 }, { wt->wake[0], POLLIN, 0 } };
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) { continue; }
+            break;
+        }
+        if (fds[1].revents) { break; }
+
+        ssize_t size = read(wt->fd, buf, XATTR_WATCH_EVENTBUF_SIZE);
+        if (size < 0) {
+            if (errno == EINTR || errno == EAGAIN) { continue; }
+            break;
+        }
+        xattr_watcher_process(wt, buf, size);
+
+        pthread_mutex_lock(&wt->mutex);
+        int stop = wt->stop;
+        pthread_mutex_unlock(&wt->mutex);
+        if (stop) { break; }
+    }
+    free(buf);
+
+    pthread_mutex_lock(&wt->mutex);
+    wt->done = 1;
+    pthread_cond_broadcast(&wt->cond);
+    pthread_mutex_unlock(&wt->mutex);
+
+    return NULL;
+}
+
+/*
+ * 受け取ったレコードを snapshot と比べて、変わった拡張属性ごとに
+ * [パス名, 名前, 以前の値, 新しい値] を events に追加する。存在しない値は nil とする。
+ * events が nil であれば、snapshot を更新するだけとする。
+ */
+struct xattr_watcher_diff
+{
+    VALUE path;
+    VALUE other;
+    VALUE events;
+};
+
+static int
+xattr_watcher_diff_old(VALUE name, VALUE oldv, VALUE arg)
+{
+    struct xattr_watcher_diff *d = (struct xattr_watcher_diff *)arg;
+    VALUE newv = rb_hash_lookup2(d->other, name, Qundef);
+    if (newv == Qundef) {
+        rb_ary_push(d->events, rb_ary_new_from_args(4, d->path, name, oldv, Qnil));
+    } else if (!RTEST(rb_str_equal(oldv, newv))) {
+        rb_ary_push(d->events, rb_ary_new_from_args(4, d->path, name, oldv, newv));
+    }
+    return ST_CONTINUE;
+}
+
+static int
+xattr_watcher_diff_new(VALUE name, VALUE newv, VALUE arg)
+{
+    struct xattr_watcher_diff *d = (struct xattr_watcher_diff *)arg;
+    rb_obj_freeze(name);
+    rb_obj_freeze(newv);
+    if (!NIL_P(d->events) && (NIL_P(d->other) || rb_hash_lookup2(d->other, name, Qundef) == Qundef)) {
+        rb_ary_push(d->events, rb_ary_new_from_args(4, d->path, name, Qnil, newv));
+    }
+    return ST_CONTINUE;
+}
+
+struct xattr_watcher_prune
+{
+    const char *prefix;
+    long prefixlen;
+    VALUE path;
+    VALUE events;
+};
+
+static int
+xattr_watcher_prune_attr(VALUE name, VALUE oldv, VALUE arg)
+{
+    const struct xattr_watcher_prune *p = (const struct xattr_watcher_prune *)arg;
+    rb_ary_push(p->events, rb_ary_new_from_args(4, p->path, name, oldv, Qnil));
+    return ST_CONTINUE;
+}
+
+static int
+xattr_watcher_prune_i(VALUE path, VALUE old, VALUE arg)
+{
+    struct xattr_watcher_prune *p = (struct xattr_watcher_prune *)arg;
+    const char *s = RSTRING_PTR(path);
+    long len = RSTRING_LEN(path);
+    if (len < p->prefixlen || memcmp(s, p->prefix, p->prefixlen) != 0 ||
+        (len > p->prefixlen && s[p->prefixlen] != '/' && p->prefix[p->prefixlen - 1] != '/')) {
+        return ST_CONTINUE;
+    }
+    if (!NIL_P(p->events)) {
+        p->path = path;
+        rb_hash_foreach(old, xattr_watcher_prune_attr, arg);
+    }
+    return ST_DELETE;
+}
+
+/*
+ * 移動または削除されたディレクトリ以下の snapshot を取り除き、その拡張属性を削除のイベントにする。
+ */
+static void
+xattr_watcher_prune(struct xattr_watcher *wt, const struct xattr_walk_record *r, VALUE events)
+{
+    size_t len;
+    memcpy(&len, r->data + sizeof(size_t), sizeof(len));
+    struct xattr_watcher_prune p = { r->data + sizeof(size_t) * 2, (long)len, Qnil, events };
+    if (p.prefixlen == 0) { return; }
+    rb_hash_foreach(wt->snapshot, xattr_watcher_prune_i, (VALUE)&p);
+}
+
+static void
+xattr_watcher_apply(struct xattr_watcher *wt, const struct xattr_walk_record *r, VALUE events)
+{
+    size_t mark;
+    memcpy(&mark, r->data, sizeof(mark));
+    if (mark == XATTR_WATCH_PRUNE) {
+        xattr_watcher_prune(wt, r, events);
+        return;
+    }
+
+    VALUE hash;
+    VALUE path = rb_obj_freeze(xattr_scan_record_decode(r, rb_filesystem_encoding(), &hash));
+    VALUE old = rb_hash_lookup2(wt->snapshot, path, Qnil);
+
+    struct xattr_watcher_diff d = { path, old, events };
+    rb_hash_foreach(hash, xattr_watcher_diff_new, (VALUE)&d);
+    if (!NIL_P(events) && !NIL_P(old)) {
+        d.other = hash;
+        rb_hash_foreach(old, xattr_watcher_diff_old, (VALUE)&d);
+    }
+
+    if (RHASH_SIZE(hash) > 0) {
+        rb_hash_aset(wt->snapshot, path, rb_obj_freeze(hash));
+    } else if (!NIL_P(old)) {
+        rb_hash_delete(wt->snapshot, path);
+    }
+}
+
+struct xattr_watcher_wait
+{
+    struct xattr_watcher *watcher;
+    const struct timespec *deadline;
+    struct xattr_walk_record *records;
+};
+
+static void *
+xattr_watcher_wait_nogvl(void *arg)
+{
+    struct xattr_watcher_wait *p = (struct xattr_watcher_wait *)arg;
+    struct xattr_watcher *wt = p->watcher;
+
+    pthread_mutex_lock(&wt->mutex);
+    while (!wt->head && !wt->done && !wt->cancel) {
+        if (p->deadline) {
+            if (pthread_cond_timedwait(&wt->cond, &wt->mutex, p->deadline) == ETIMEDOUT) { break; }
+        } else {
+            pthread_cond_wait(&wt->cond, &wt->mutex);
+        }
+    }
+    p->records = wt->head;
+    wt->head = wt->tail = NULL;
+    wt->count = 0;
+    pthread_mutex_unlock(&wt->mutex);
+
+    return NULL;
+}
+
+static void
+xattr_watcher_wait_ubf(void *arg)
+{
+    struct xattr_watcher *wt = (struct xattr_watcher *)arg;
+    pthread_mutex_lock(&wt->mutex);
+    wt->cancel = 1;
+    pthread_cond_broadcast(&wt->cond);
+    pthread_mutex_unlock(&wt->mutex);
+}
+
+static int
+xattr_watcher_expired(const struct timespec *deadline)
+{
+    struct timespec now;
+    if (!deadline) { return 0; }
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (now.tv_sec > deadline->tv_sec ||
+            (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec));
+}
+
+struct xattr_watcher_batch
+{
+    struct xattr_watcher *watcher;
+    struct xattr_walk_record *records;
+    VALUE events;
+};
+
+static VALUE
+xattr_watcher_apply_batch(VALUE arg)
+{
+    struct xattr_watcher_batch *batch = (struct xattr_watcher_batch *)arg;
+    for (const struct xattr_walk_record *r = batch->records; r; r = r->next) {
+        xattr_watcher_apply(batch->watcher, r, batch->events);
+    }
+    return Qnil;
+}
+
+static VALUE
+xattr_watcher_free_batch(VALUE arg)
+{
+    struct xattr_watcher_batch *batch = (struct xattr_watcher_batch *)arg;
+    xattr_walk_record_free_all(batch->records);
+    batch->records = NULL;
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  read(timeout = nil) -> array
+ *
+ * 拡張属性が変わるまで待って、変わった拡張属性ごとの [パス名, 名前, 以前の値, 新しい値] の配列を返します。
+ * 追加された拡張属性の以前の値と、削除された拡張属性の新しい値は nil です。
+ *
+ * timeout 秒が経つか、他のスレッドから close された場合は、空の配列を返します。
+ */
+static VALUE
+xattr_watcher_read(int argc, VALUE argv[], VALUE self)
+{
+    VALUE timeout;
+    rb_scan_args(argc, argv, "01", &timeout);
+    struct xattr_watcher *wt = xattr_watcher_ref_open(self);
+
+    struct timespec deadline;
+    if (!NIL_P(timeout)) {
+        double sec = NUM2DBL(timeout);
+        if (sec < 0) { sec = 0; }
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)sec;
+        deadline.tv_nsec += (long)((sec - (double)(time_t)sec) * 1e9);
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    struct xattr_watcher_wait args = { wt, (NIL_P(timeout) ? NULL : &deadline), NULL };
+    VALUE events = rb_ary_new();
+    for (;;) {
+        wt->cancel = 0;
+        rb_thread_call_without_gvl(xattr_watcher_wait_nogvl, &args, xattr_watcher_wait_ubf, wt);
+        if (args.records) {
+            struct xattr_watcher_batch batch = { wt, args.records, events };
+            args.records = NULL;
+            rb_ensure(xattr_watcher_apply_batch, (VALUE)&batch, xattr_watcher_free_batch, (VALUE)&batch);
+            // 拡張属性以外の属性の変更であれば、待ち続ける。
+            if (RARRAY_LEN(events) > 0) { break; }
+        }
+
+        pthread_mutex_lock(&wt->mutex);
+        int done = wt->done;
+        pthread_mutex_unlock(&wt->mutex);
+        if (done || xattr_watcher_expired(args.deadline)) { break; }
+    }
+
+    return events;
+}
+
+static VALUE
+xattr_watcher_each_i(VALUE self)
+{
+    while (xattr_watcher_ref(self)->fd >= 0) {
+        VALUE events = xattr_watcher_read(0, NULL, self);
+        if (RARRAY_LEN(events) > 0) { rb_yield(events); }
+    }
+    return self;
+}
+
+/*
+ * call-seq:
+ *  each { |events| ... } -> self
+ *  each -> enumerator
+ *
+ * read を繰り返して、変更があるたびにその配列をブロックに渡します。
+ * 他のスレッドから close されると終了します。
+ */
+static VALUE
+xattr_watcher_each(VALUE self)
+{
+    RETURN_ENUMERATOR(self, 0, NULL);
+    xattr_watcher_ref_open(self);
+    return xattr_watcher_each_i(self);
+}
+
+struct xattr_watcher_start
+{
+    struct xattr_walk walk;
+    struct xattr_watcher_walk user;
+    VALUE root;
+};
+
+static VALUE
+xattr_watcher_start_body(VALUE arg)
+{
+    struct xattr_watcher_start *s = (struct xattr_watcher_start *)arg;
+    struct xattr_watcher *wt = s->user.watcher;
+
+    if (xattr_walk_start(&s->walk, RSTRING_PTR(s->root), RSTRING_LEN(s->root)) < 1) {
+        errno = EAGAIN;
+        rb_sys_fail("pthread_create");
+    }
+
+    struct xattr_walk_record *records;
+    while ((records = xattr_walk_wait(&s->walk)) != NULL) {
+        struct xattr_watcher_batch batch = { wt, records, Qnil };
+        rb_ensure(xattr_watcher_apply_batch, (VALUE)&batch, xattr_watcher_free_batch, (VALUE)&batch);
+    }
+
+    return Qnil;
+}
+
+static VALUE
+xattr_watcher_start_cleanup(VALUE arg)
+{
+    struct xattr_watcher_start *s = (struct xattr_watcher_start *)arg;
+    xattr_walk_cleanup(&s->walk);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  initialize(root, namespace: ExtAttr::USER, threads: 4)
+ *
+ * root 以下の全てのディレクトリの監視を始めて、その中のファイルの拡張属性を読み込みます。
+ * 読み込みは ExtAttr.scan と同じく threads 個のネイティブスレッドで行います。
+ *
+ * シンボリックリンクはたどりません (root を除く)。
+ */
+static VALUE
+xattr_watcher_initialize(int argc, VALUE argv[], VALUE self)
+{
+    VALUE root, opts;
+    rb_scan_args(argc, argv, "1:", &root, &opts);
+    int nthreads = NUM2INT(hash_lookup(opts, ID2SYM(id_threads), INT2FIX(4)));
+    int namespace1 = conv_namespace(hash_lookup(opts, ID2SYM(id_namespace), Qnil));
+    if (nthreads < 1 || nthreads > XATTR_WALK_THREADS_MAX) {
+        rb_raise(rb_eArgError, "wrong number of threads - %d (expected 1..%d)",
+                 nthreads, XATTR_WALK_THREADS_MAX);
+    }
+    size_t prefixlen;
+    xattr_prefix(namespace1, &prefixlen);
+    root = aux_to_path(root);
+    ext_check_path_security(root, Qnil, Qnil);
+
+    struct xattr_watcher *wt = xattr_watcher_ref(self);
+    if (wt->fd >= 0) { rb_raise(rb_eRuntimeError, "already initialized"); }
+    wt->closing = 0;
+
+    // 末尾の区切り文字は、ワーカーが出力するパス名と揃えるために取り除いておく。
+    long rootlen = RSTRING_LEN(root);
+    while (rootlen > 1 && RSTRING_PTR(root)[rootlen - 1] == '/') { rootlen--; }
+    root = rb_str_new_frozen(rb_str_subseq(root, 0, rootlen));
+    StringValueCStr(root);
+    wt->root = root;
+    wt->snapshot = rb_hash_new();
+    wt->namespace1 = namespace1;
+
+    if (pipe2(wt->wake, O_CLOEXEC) < 0) { rb_sys_fail("pipe2"); }
+    wt->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (wt->fd < 0) {
+        int err = errno;
+        xattr_watcher_stop(wt);
+        errno = err;
+        rb_sys_fail("inotify_init1");
+    }
+
+    struct xattr_watcher_start s;
+    s.root = root;
+    s.user.scan.namespace1 = namespace1;
+    s.user.scan.numnames = 0;
+    s.user.scan.names = NULL;
+    s.user.scan.namelens = NULL;
+    s.user.watcher = wt;
+    xattr_walk_init(&s.walk, nthreads, xattr_watcher_walk_visit);
+    for (int i = 0; i < nthreads; i++) {
+        s.walk.workers[i].user = &s.user;
+    }
+    rb_ensure(xattr_watcher_start_body, (VALUE)&s, xattr_watcher_start_cleanup, (VALUE)&s);
+
+    // 既に監視しているルートであれば、同じ監視記述子が返される。
+    wt->rootwd = inotify_add_watch(wt->fd, RSTRING_PTR(root), XATTR_WATCH_MASK);
+
+    // 監視スレッドはシグナルを受け取らないようにする。
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    wt->done = 0;
+    int err = pthread_create(&wt->thread, NULL, xattr_watcher_main, wt);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (err != 0) {
+        wt->done = 1;
+        xattr_watcher_stop(wt);
+        errno = err;
+        rb_sys_fail("pthread_create");
+    }
+    wt->started = 1;
+
+    return self;
+}
+
+/*
+ * call-seq:
+ *  snapshot(path) -> hash or nil
+ *
+ * path について最後に知っている拡張属性の名前と値を返します。拡張属性がなければ nil を返します。
+ * path は監視を始めたときの root からたどったパス名でなければなりません。
+ */
+static VALUE
+xattr_watcher_snapshot(VALUE self, VALUE path)
+{
+    struct xattr_watcher *wt = xattr_watcher_ref_open(self);
+    return rb_hash_lookup2(wt->snapshot, aux_to_path(path), Qnil);
+}
+
+/*
+ * call-seq:
+ *  root -> string
+ */
+static VALUE
+xattr_watcher_root(VALUE self)
+{
+    return xattr_watcher_ref(self)->root;
+}
+
+/*
+ * call-seq:
+ *  stats -> hash
+ *
+ * 監視しているディレクトリの数 (directories)、変更を見逃した恐れのある回数 (overflows)、
+ * 受け取られていない読み直しの結果の数 (pending) を返します。
+ */
+static VALUE
+xattr_watcher_stats(VALUE self)
+{
+    struct xattr_watcher *wt = xattr_watcher_ref(self);
+    pthread_mutex_lock(&wt->mutex);
+    long ndirs = wt->ndirs;
+    size_t overflows = wt->overflows;
+    size_t pending = wt->count;
+    pthread_mutex_unlock(&wt->mutex);
+
+    VALUE stats = rb_hash_new();
+    rb_hash_aset(stats, ID2SYM(id_directories), LONG2NUM(ndirs));
+    rb_hash_aset(stats, ID2SYM(id_overflows), SIZET2NUM(overflows));
+    rb_hash_aset(stats, ID2SYM(id_pending), SIZET2NUM(pending));
+    return stats;
+}
+
+/*
+ * call-seq:
+ *  close -> nil
+ *
+ * 監視を終えて、監視スレッドを止めます。他のスレッドの read は空の配列を返します。
+ */
+static VALUE
+xattr_watcher_close(VALUE self)
+{
+    struct xattr_watcher *wt = xattr_watcher_ref(self);
+
+    // 監視スレッドが終わるのを待つ間は、GVL を解放して他のスレッドを止めないようにする。
+    // 他のスレッドから重ねて close された場合は、最初の close に任せる。
+    if (!wt->closing) {
+        wt->closing = 1;
+        rb_thread_call_without_gvl(xattr_watcher_stop_nogvl, wt, NULL, NULL);
+    }
+    RB_GC_GUARD(self);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ *  closed? -> true or false
+ */
+static VALUE
+xattr_watcher_closed_p(VALUE self)
+{
+    return (xattr_watcher_ref(self)->fd < 0 ? Qtrue : Qfalse);
+}
+
+static void
+xattr_watcher_init(void)
+{
+    id_directories = rb_intern("directories");
+    id_overflows = rb_intern("overflows");
+    id_pending = rb_intern("pending");
+
+    cWatcher = rb_define_class_under(mExtAttr, "Watcher", rb_cObject);
+    rb_define_alloc_func(cWatcher, xattr_watcher_alloc);
+    rb_define_method(cWatcher, "initialize", RUBY_METHOD_FUNC(xattr_watcher_initialize), -1);
+    rb_define_method(cWatcher, "read", RUBY_METHOD_FUNC(xattr_watcher_read), -1);
+    rb_define_method(cWatcher, "each", RUBY_METHOD_FUNC(xattr_watcher_each), 0);
+    rb_define_method(cWatcher, "snapshot", RUBY_METHOD_FUNC(xattr_watcher_snapshot), 1);
+    rb_define_method(cWatcher, "root", RUBY_METHOD_FUNC(xattr_watcher_root), 0);
+    rb_define_method(cWatcher, "stats", RUBY_METHOD_FUNC(xattr_watcher_stats), 0);
+    rb_define_method(cWatcher, "close", RUBY_METHOD_FUNC(xattr_watcher_close), 0);
+    rb_define_method(cWatcher, "closed?", RUBY_METHOD_FUNC(xattr_watcher_closed_p), 0);
+}
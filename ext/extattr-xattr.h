@@ -1,68 +1,434 @@
 #include <sys/types.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if HAVE_PTHREAD_H
+#   include <pthread.h>
+#endif
+#include <fnmatch.h>
 #if HAVE_ATTR_XATTR_H
 #   include <attr/xattr.h>
 #else
 #   include <sys/xattr.h>
 #endif
+#if defined(HAVE_LINUX_OPENAT2_H) && defined(HAVE_SYS_SYSCALL_H)
+#   include <linux/openat2.h>
+#   include <sys/syscall.h>
+#   if defined(SYS_openat2)
+#       define XATTR_OPENAT2 1
+#   endif
+#endif
 
 enum {
+    EXTATTR_NAMESPACE_ALL      = 0,     // 一覧の取得でのみ使える、全ての名前空間
     EXTATTR_NAMESPACE_USER     = 1,
     EXTATTR_NAMESPACE_SYSTEM   = 2,
     EXTATTR_NAMESPACE_TRUSTED  = 3,
     EXTATTR_NAMESPACE_SECURITY = 4,
 };
 
+enum {
+    /*
+     * 最初に試みるスタック上のバッファの大きさ。
+     * ほとんどの拡張属性はこれに収まるため、大きさの問い合わせを省略できる。
+     */
+    EXTATTR_STACKBUF_SIZE = 4096,
+
+    /*
+     * 大きさの問い合わせから取得までの間に拡張属性が大きくなった (ERANGE) 場合の再試行回数。
+     */
+    EXTATTR_RETRY_MAX = 8,
 
-static VALUE NAMESPACE_USER_PREFIX, NAMESPACE_SYSTEM_PREFIX;
+    /*
+     * "/proc/self/fd/N" を書くのに十分な大きさ。
+     */
+    EXTATTR_PROCPATH_SIZE = 32,
+};
 
 
-static VALUE
-xattr_name(int namespace1, VALUE name)
+#define EXTATTR_HAVE_GET_MANY 1
+#define EXTATTR_HAVE_SET_MANY 1
+#define EXTATTR_HAVE_TO_H 1
+#define EXTATTR_HAVE_GET_INTO 1
+#define EXTATTR_HAVE_SYMBOL_NAME 1
+#define EXTATTR_HAVE_TRUSTED_SECURITY 1
+#define EXTATTR_HAVE_LIST_ALL 1
+#define EXTATTR_HAVE_DECODE_LIST 1
+#define EXTATTR_HAVE_COPY 1
+
+#ifndef XATTR_NAME_MAX
+#   define XATTR_NAME_MAX 255
+#endif
+
+
+/*
+ * GVL を解放した状態で xattr 関数を呼び出すための引数と結果。
+ */
+struct xattr_call
+{
+    ssize_t (*func)();      // listxattr / getxattr の仲間
+    int (*ifunc)();         // setxattr / removexattr の仲間
+    void *d;                // パス名、またはファイル記述子
+    const char *name;
+    void *buf;
+    size_t size;
+    int flags;
+
+    ssize_t status;
+    int err;
+};
+
+static void *
+xattr_list_nogvl(void *arg)
+{
+    struct xattr_call *p = (struct xattr_call *)arg;
+    p->status = p->func(p->d, p->buf, p->size);
+    p->err = errno;
+    return NULL;
+}
+
+static void *
+xattr_get_nogvl(void *arg)
+{
+    struct xattr_call *p = (struct xattr_call *)arg;
+    p->status = p->func(p->d, p->name, p->buf, p->size);
+    p->err = errno;
+    return NULL;
+}
+
+static void *
+xattr_set_nogvl(void *arg)
+{
+    struct xattr_call *p = (struct xattr_call *)arg;
+    p->status = p->ifunc(p->d, p->name, p->buf, p->size, p->flags);
+    p->err = errno;
+    return NULL;
+}
+
+static void *
+xattr_delete_nogvl(void *arg)
+{
+    struct xattr_call *p = (struct xattr_call *)arg;
+    p->status = p->ifunc(p->d, p->name);
+    p->err = errno;
+    return NULL;
+}
+
+static ssize_t
+xattr_blocking_call(void *(*nogvl)(void *), struct xattr_call *p)
+{
+    // 割り込みの処理は aux_blocking_call の中で行われるため、ここでは EINTR を再試行するだけでよい。
+    do {
+        aux_blocking_call(nogvl, p);
+    } while (p->status < 0 && p->err == EINTR);
+
+    errno = p->err;
+    return p->status;
+}
+
+static ssize_t
+xattr_list_call(ssize_t (*func)(), void *d, char *buf, size_t size)
+{
+    struct xattr_call args = { func, NULL, d, NULL, buf, size, 0 };
+    return xattr_blocking_call(xattr_list_nogvl, &args);
+}
+
+static ssize_t
+xattr_get_call(ssize_t (*func)(), void *d, const char *name, void *buf, size_t size)
+{
+    struct xattr_call args = { func, NULL, d, name, buf, size, 0 };
+    return xattr_blocking_call(xattr_get_nogvl, &args);
+}
+
+static int
+xattr_set_call(int (*func)(), void *d, const char *name, const void *buf, size_t size, int flags)
+{
+    struct xattr_call args = { NULL, func, d, name, (void *)buf, size, flags };
+    return (int)xattr_blocking_call(xattr_set_nogvl, &args);
+}
+
+static int
+xattr_delete_call(int (*func)(), void *d, const char *name)
+{
+    struct xattr_call args = { NULL, func, d, name, NULL, 0, 0 };
+    return (int)xattr_blocking_call(xattr_delete_nogvl, &args);
+}
+
+
+/*
+ * 名前空間の接頭辞を返す。未知の名前空間であれば NULL を返す。
+ *
+ * GVL を解放した状態からも呼び出される。
+ */
+static const char *
+xattr_prefix_lookup(int namespace1, size_t *len)
 {
     switch (namespace1) {
     case EXTATTR_NAMESPACE_USER:
-        return rb_str_plus(NAMESPACE_USER_PREFIX, name);
+        *len = 5;
+        return "user.";
     case EXTATTR_NAMESPACE_SYSTEM:
-        return rb_str_plus(NAMESPACE_SYSTEM_PREFIX, name);
+        *len = 7;
+        return "system.";
+    case EXTATTR_NAMESPACE_TRUSTED:
+        *len = 8;
+        return "trusted.";
+    case EXTATTR_NAMESPACE_SECURITY:
+        *len = 9;
+        return "security.";
     default:
-        rb_raise(rb_eRuntimeError, "namespace1 error");
-        return Qnil;
+        *len = 0;
+        return NULL;
+    }
+}
+
+static const char *
+xattr_prefix(int namespace1, size_t *len)
+{
+    const char *prefix = xattr_prefix_lookup(namespace1, len);
+    if (!prefix) { rb_raise(rb_eRuntimeError, "namespace1 error"); }
+    return prefix;
+}
+
+/*
+ * 名前空間の接頭辞を付けた拡張属性名を、ヌル終端文字列として buf に作成する。
+ *
+ * ruby の文字列を確保しないように、呼び出し側のスタック上のバッファを用いる。
+ */
+static const char *
+xattr_name_str(int namespace1, VALUE name, char buf[XATTR_NAME_MAX + 1])
+{
+    size_t prefixlen;
+    const char *prefix = xattr_prefix(namespace1, &prefixlen);
+    const char *ptr;
+    long len;
+    RSTRING_GETMEM(name, ptr, len);
+
+    if (memchr(ptr, '\0', len)) {
+        rb_raise(rb_eArgError, "string contains null byte");
+    }
+    if (prefixlen + len > XATTR_NAME_MAX) {
+        rb_syserr_fail_str(ERANGE, name);
+    }
+
+    memcpy(buf, prefix, prefixlen);
+    memcpy(buf + prefixlen, ptr, len);
+    buf[prefixlen + len] = '\0';
+
+    return buf;
+}
+
+#if HAVE_PTHREAD_H
+/*
+ * Symbol で与えられた拡張属性名の、接頭辞を付けたヌル終端文字列の表。
+ *
+ * (名前空間, ID) ごとに一度だけ名前を作成して、呼び出しのたびの検査と複写を省く。
+ * 作成した名前は解放しないため、得られたポインタは mutex の外でも使い続けられる。
+ * 大量のシンボルで際限なく大きくならないように、登録数には上限を設ける。
+ */
+enum {
+    XATTR_INTERN_SLOTS = 1024,  // 2 の冪であること
+    XATTR_INTERN_MAX = XATTR_INTERN_SLOTS / 2,
+};
+
+static struct xattr_intern_entry
+{
+    ID id;
+    int namespace1;
+    const char *name;
+} xattr_intern_table[XATTR_INTERN_SLOTS];
+
+static int xattr_intern_count;
+static pthread_mutex_t xattr_intern_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * mutex を獲得した状態で呼び出すこと。
+ */
+static struct xattr_intern_entry *
+xattr_intern_slot(int namespace1, ID id)
+{
+    size_t i = ((size_t)id * 31 + namespace1) & (XATTR_INTERN_SLOTS - 1);
+    for (;;) {
+        struct xattr_intern_entry *e = &xattr_intern_table[i];
+        if (e->id == 0 || (e->id == id && e->namespace1 == namespace1)) { return e; }
+        i = (i + 1) & (XATTR_INTERN_SLOTS - 1);
+    }
+}
+
+/*
+ * 表から名前を探し、無ければ作成して登録する。
+ *
+ * 表が一杯の場合は buf に作成する。
+ */
+static const char *
+xattr_intern(int namespace1, VALUE sym, char buf[XATTR_NAME_MAX + 1])
+{
+    ID id = SYM2ID(sym);
+
+    pthread_mutex_lock(&xattr_intern_mutex);
+    const char *name = xattr_intern_slot(namespace1, id)->name;
+    pthread_mutex_unlock(&xattr_intern_mutex);
+    if (name) { return name; }
+
+    // 例外が発生しうるため、名前の作成は mutex の外で行う。
+    const char *namep = xattr_name_str(namespace1, rb_sym2str(sym), buf);
+    char *copy = strdup(namep);
+    if (!copy) { return namep; }
+
+    pthread_mutex_lock(&xattr_intern_mutex);
+    struct xattr_intern_entry *e = xattr_intern_slot(namespace1, id);
+    if (e->name) {
+        name = e->name;             // 他のスレッドが先に登録した
+    } else if (xattr_intern_count < XATTR_INTERN_MAX) {
+        e->id = id;
+        e->namespace1 = namespace1;
+        e->name = name = copy;
+        copy = NULL;
+        xattr_intern_count++;
+    }
+    pthread_mutex_unlock(&xattr_intern_mutex);
+    free(copy);
+
+    return name ? name : namep;
+}
+#endif
+
+/*
+ * 名前空間の接頭辞を付けた拡張属性名を返す。
+ *
+ * name が静的なシンボルであれば表に登録した名前を返し、そうでなければ buf に作成する。
+ * 動的なシンボルは ID を得ると解放されなくなるため、表には登録しない。
+ */
+static const char *
+xattr_name(int namespace1, VALUE name, char buf[XATTR_NAME_MAX + 1])
+{
+    if (SYMBOL_P(name)) {
+#if HAVE_PTHREAD_H
+        if (STATIC_SYM_P(name)) { return xattr_intern(namespace1, name, buf); }
+#endif
+        name = rb_sym2str(name);
+    }
+
+    return xattr_name_str(namespace1, name, buf);
+}
+
+
+/*
+ * listxattr で得られた一覧から次の項目を取り出し、*len にその長さを格納する。
+ *
+ * 項目ごとのヌルバイトは end を超えて探さない。
+ * ヌルバイトで終端されていない末尾の断片は壊れたものとして捨て、空の項目は読み飛ばす。
+ * 一覧の終わりに達した場合は NULL を返す。
+ *
+ * GVL を解放した状態からも呼び出される。
+ */
+static inline const char *
+xattr_list_entry(const char **cursor, const char *end, size_t *len)
+{
+    while (*cursor < end) {
+        const char *ptr = *cursor;
+        const char *term = memchr(ptr, '\0', end - ptr);
+        if (!term) {
+            *cursor = end;
+            return NULL;
+        }
+        *cursor = term + 1;
+        if (term > ptr) {
+            *len = term - ptr;
+            return ptr;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * listxattr で得られた一覧から、namespace1 に属する次の名前を取り出す。
+ *
+ * 名前空間の接頭辞を除いた名前を返し、*len にその長さを格納する。
+ * 返した名前はヌルバイトで終端されていることが保証される。
+ * 一覧の終わりに達した場合は NULL を返す。
+ *
+ * GVL を解放した状態からも呼び出される。
+ */
+static const char *
+xattr_list_next(const char **cursor, const char *end, int namespace1, size_t *len)
+{
+    size_t prefixlen;
+    const char *prefix = xattr_prefix_lookup(namespace1, &prefixlen);
+    if (!prefix) { return NULL; }
+
+    const char *ptr;
+    size_t n;
+    while ((ptr = xattr_list_entry(cursor, end, &n)) != NULL) {
+        if (n > prefixlen && memcmp(ptr, prefix, prefixlen) == 0) {
+            *len = n - prefixlen;
+            return ptr + prefixlen;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * 接頭辞を含む拡張属性名から名前空間を判別して、*prefixlen に接頭辞の長さを格納する。
+ *
+ * 既知の名前空間でなければ EXTATTR_NAMESPACE_ALL を返す。
+ */
+static int
+xattr_namespace_of(const char *ptr, size_t len, size_t *prefixlen)
+{
+    for (int ns = EXTATTR_NAMESPACE_USER; ns <= EXTATTR_NAMESPACE_SECURITY; ns++) {
+        const char *prefix = xattr_prefix_lookup(ns, prefixlen);
+        if (len > *prefixlen && memcmp(ptr, prefix, *prefixlen) == 0) { return ns; }
     }
+
+    return EXTATTR_NAMESPACE_ALL;
 }
 
+/*
+ * 全ての名前空間の拡張属性を、[名前空間, 名前] の組として func に渡す。
+ */
+static void
+extattr_list_name_all(const char *ptr, size_t size, VALUE infection_source, VALUE (*func)(void *, VALUE), void *user)
+{
+    const char *end = ptr + size;
+    const char *entry;
+    size_t n;
+    while ((entry = xattr_list_entry(&ptr, end, &n)) != NULL) {
+        size_t prefixlen;
+        int ns = xattr_namespace_of(entry, n, &prefixlen);
+        if (ns == EXTATTR_NAMESPACE_ALL) { continue; }
+        VALUE name = rb_str_new(entry + prefixlen, n - prefixlen);
+        OBJ_INFECT(name, infection_source);
+        func(user, rb_assoc_new(aux_namespace_symbol(ns), name));
+    }
+}
 
 static inline void
 extattr_list_name(const char *ptr, size_t size, VALUE infection_source, int namespace1, VALUE (*func)(void *, VALUE), void *user)
 {
-    const char *end = ptr + size;
-    while (ptr < end) {
-        int len = strlen(ptr);
-        // if (len > (end - ptr)) { ... } // TODO
-        if (namespace1 == EXTATTR_NAMESPACE_USER && len > 5 && strncmp(ptr, "user.", 5) == 0) {
-            ptr += 5;
-        } else if (namespace1 == EXTATTR_NAMESPACE_SYSTEM && len > 7 && strncmp(ptr, "system.", 7) == 0) {
-            ptr += 7;
-        } else {
-            ptr += len + 1;
-            continue;
-        }
+    if (namespace1 == EXTATTR_NAMESPACE_ALL) {
+        extattr_list_name_all(ptr, size, infection_source, func, user);
+        return;
+    }
 
-        VALUE name = rb_str_new_cstr(ptr);
+    const char *end = ptr + size;
+    const char *namep;
+    size_t len;
+    while ((namep = xattr_list_next(&ptr, end, namespace1, &len)) != NULL) {
+        VALUE name = rb_str_new(namep, len);
         OBJ_INFECT(name, infection_source);
         func(user, name);
-        ptr += RSTRING_LEN(name) + 1; // 最後の『+1』は、ヌルバイトの分。
     }
 }
 
 static VALUE
-extattr_list_common(ssize_t (*func)(), void *d, VALUE infection_source, int namespace1)
+extattr_list_yield(const char *ptr, size_t size, VALUE infection_source, int namespace1)
 {
-    ssize_t size = 65536;
-    VALUE buf = rb_str_buf_new(size);
-    char *ptr = RSTRING_PTR(buf);
-    size = func(d, ptr, size);
-    if (size < 0) { rb_sys_fail("listxattr call error"); }
-
     if (rb_block_given_p()) {
         extattr_list_name(ptr, size, infection_source, namespace1,
                           (VALUE (*)(void *, VALUE))rb_yield_values,
@@ -78,6 +444,80 @@ extattr_list_common(ssize_t (*func)(), void *d, VALUE infection_source, int name
     }
 }
 
+/*
+ * list の作業領域。
+ *
+ * 一覧はスレッドごとの作業領域 (使用中であればスタック上か一時バッファ) に受け取り、
+ * 名前だけを ruby の文字列にする。
+ */
+struct extattr_list
+{
+    ssize_t (*func)();
+    void *d;
+    VALUE infection_source;
+    int namespace1;
+    struct aux_scratch *scratch;
+    VALUE tmp;
+};
+
+static char *
+extattr_list_reserve(struct extattr_list *p, size_t size, size_t *capa)
+{
+    if (p->scratch) {
+        char *ptr = aux_scratch_reserve(p->scratch, size);
+        if (!ptr) { rb_memerror(); }
+        *capa = p->scratch->capa;
+        return ptr;
+    } else {
+        if (p->tmp) { rb_free_tmp_buffer(&p->tmp); }
+        *capa = size;
+        return rb_alloc_tmp_buffer(&p->tmp, size);
+    }
+}
+
+static VALUE
+extattr_list_body(VALUE arg)
+{
+    struct extattr_list *p = (struct extattr_list *)arg;
+
+    char stackbuf[EXTATTR_STACKBUF_SIZE];
+    char *ptr = stackbuf;
+    size_t capa = sizeof(stackbuf);
+    if (p->scratch) {
+        // 作業領域は前回の大きさを保っているため、大きな一覧でも問い合わせを省略できることが多い。
+        ptr = extattr_list_reserve(p, EXTATTR_STACKBUF_SIZE, &capa);
+    }
+
+    for (int i = 0; ; i++) {
+        ssize_t size = xattr_list_call(p->func, p->d, ptr, capa);
+        if (size >= 0) {
+            return extattr_list_yield(ptr, size, p->infection_source, p->namespace1);
+        }
+        if (errno != ERANGE || i >= EXTATTR_RETRY_MAX) { rb_sys_fail("listxattr call error"); }
+
+        // バッファが足りなかったため、大きさを問い合わせてから確保する。
+        size = xattr_list_call(p->func, p->d, NULL, 0);
+        if (size < 0) { rb_sys_fail("listxattr call error"); }
+        ptr = extattr_list_reserve(p, size, &capa);
+    }
+}
+
+static VALUE
+extattr_list_cleanup(VALUE arg)
+{
+    struct extattr_list *p = (struct extattr_list *)arg;
+    if (p->scratch) { aux_scratch_release(p->scratch); }
+    if (p->tmp) { rb_free_tmp_buffer(&p->tmp); }
+    return Qnil;
+}
+
+static VALUE
+extattr_list_common(ssize_t (*func)(), void *d, VALUE infection_source, int namespace1)
+{
+    struct extattr_list p = { func, d, infection_source, namespace1, aux_scratch_acquire(), 0 };
+    return rb_ensure(extattr_list_body, (VALUE)&p, extattr_list_cleanup, (VALUE)&p);
+}
+
 static VALUE
 file_extattr_list_main(VALUE file, int fd, int namespace1)
 {
@@ -103,8 +543,9 @@ file_s_extattr_list_link_main(VALUE path, int namespace1)
 static VALUE
 extattr_size_common(ssize_t (*func)(), void *d, int namespace1, VALUE name)
 {
-    name = xattr_name(namespace1, name);
-    ssize_t size = func(d, StringValueCStr(name), NULL, 0);
+    char namebuf[XATTR_NAME_MAX + 1];
+    const char *namep = xattr_name(namespace1, name, namebuf);
+    ssize_t size = xattr_get_call(func, d, namep, NULL, 0);
     if (size < 0) { rb_sys_fail("getxattr call error"); }
     return SSIZET2NUM(size);
 }
@@ -118,27 +559,48 @@ file_extattr_size_main(VALUE file, int fd, int namespace1, VALUE name)
 static VALUE
 file_s_extattr_size_main(VALUE path, int namespace1, VALUE name)
 {
-    return extattr_size_common(getxattr, StringValueCStr(path), namespace1, name);
+    VALUE v = extattr_size_common(getxattr, StringValueCStr(path), namespace1, name);
+    RB_GC_GUARD(path);
+    return v;
 }
 
 static VALUE
 file_s_extattr_size_link_main(VALUE path, int namespace1, VALUE name)
 {
-    return extattr_size_common(lgetxattr, StringValueCStr(path), namespace1, name);
+    VALUE v = extattr_size_common(lgetxattr, StringValueCStr(path), namespace1, name);
+    RB_GC_GUARD(path);
+    return v;
 }
 
 
 static VALUE
 extattr_get_common(ssize_t (*func)(), void *d, int namespace1, VALUE name)
 {
-    name = xattr_name(namespace1, name);
-    ssize_t size = 65536;
-    VALUE buf = rb_str_buf_new(size);
-    char *ptr = RSTRING_PTR(buf);
-    size = func(d, StringValueCStr(name), ptr, size);
-    if (size < 0) { rb_sys_fail("getxattr call error"); }
-    rb_str_set_len(buf, size);
-    return buf;
+    char namebuf[XATTR_NAME_MAX + 1];
+    const char *namep = xattr_name(namespace1, name, namebuf);
+
+    char stackbuf[EXTATTR_STACKBUF_SIZE];
+    ssize_t size = xattr_get_call(func, d, namep, stackbuf, sizeof(stackbuf));
+    if (size >= 0) { return rb_str_new(stackbuf, size); }
+    if (errno != ERANGE) { rb_sys_fail("getxattr call error"); }
+
+    // スタック上のバッファでは足りなかったため、大きさを問い合わせてから確保する。
+    for (int i = 0; i < EXTATTR_RETRY_MAX; i++) {
+        size = xattr_get_call(func, d, namep, NULL, 0);
+        if (size < 0) { rb_sys_fail("getxattr call error"); }
+
+        VALUE buf = rb_str_buf_new(size);
+        ssize_t size1 = xattr_get_call(func, d, namep, RSTRING_PTR(buf), size);
+        RB_GC_GUARD(buf);
+        if (size1 >= 0) {
+            // 問い合わせ後に小さくなっていることもあるため、ぴったりの大きさにする。
+            rb_str_resize(buf, size1);
+            return buf;
+        }
+        if (errno != ERANGE) { rb_sys_fail("getxattr call error"); }
+    }
+
+    rb_sys_fail("getxattr call error");
 }
 
 static VALUE
@@ -150,22 +612,116 @@ file_extattr_get_main(VALUE file, int fd, int namespace1, VALUE name)
 static VALUE
 file_s_extattr_get_main(VALUE path, int namespace1, VALUE name)
 {
-    return extattr_get_common(getxattr, StringValueCStr(path), namespace1, name);
+    VALUE v = extattr_get_common(getxattr, StringValueCStr(path), namespace1, name);
+    RB_GC_GUARD(path);
+    return v;
 }
 
 static VALUE
 file_s_extattr_get_link_main(VALUE path, int namespace1, VALUE name)
 {
-    return extattr_get_common(lgetxattr, StringValueCStr(path), namespace1, name);
+    VALUE v = extattr_get_common(lgetxattr, StringValueCStr(path), namespace1, name);
+    RB_GC_GUARD(path);
+    return v;
+}
+
+
+/*
+ * get_into の作業領域。
+ */
+struct extattr_get_into
+{
+    ssize_t (*func)();
+    void *d;
+    const char *name;
+    struct aux_outbuf out;
+};
+
+static VALUE
+extattr_get_into_body(VALUE arg)
+{
+    struct extattr_get_into *p = (struct extattr_get_into *)arg;
+
+    for (int i = 0; ; i++) {
+        size_t capa;
+        char *ptr = aux_outbuf_ptr(&p->out, &capa);
+        ssize_t size;
+        if (capa < EXTATTR_STACKBUF_SIZE) {
+            // 書き込み先が小さい場合は、一度スタック上のバッファで受け取ってから複写する。
+            char stackbuf[EXTATTR_STACKBUF_SIZE];
+            size = xattr_get_call(p->func, p->d, p->name, stackbuf, sizeof(stackbuf));
+            if (size >= 0) {
+                aux_outbuf_write(&p->out, stackbuf, size);
+                return SSIZET2NUM(size);
+            }
+        } else {
+            aux_outbuf_lock(&p->out);
+            size = xattr_get_call(p->func, p->d, p->name, ptr, capa);
+            aux_outbuf_unlock(&p->out);
+            if (size >= 0) {
+                aux_outbuf_finish(&p->out, size);
+                return SSIZET2NUM(size);
+            }
+        }
+        if (errno != ERANGE || i >= EXTATTR_RETRY_MAX) { rb_sys_fail("getxattr call error"); }
+
+        // 書き込み先では足りなかったため、大きさを問い合わせてから広げる。
+        size = xattr_get_call(p->func, p->d, p->name, NULL, 0);
+        if (size < 0) { rb_sys_fail("getxattr call error"); }
+        aux_outbuf_reserve(&p->out, (size > EXTATTR_STACKBUF_SIZE ? size : EXTATTR_STACKBUF_SIZE));
+    }
+}
+
+static VALUE
+extattr_get_into_cleanup(VALUE arg)
+{
+    struct extattr_get_into *p = (struct extattr_get_into *)arg;
+    aux_outbuf_unlock(&p->out);
+    return Qnil;
+}
+
+static VALUE
+extattr_get_into_common(ssize_t (*func)(), void *d, int namespace1, VALUE name, VALUE buf)
+{
+    char namebuf[XATTR_NAME_MAX + 1];
+    struct extattr_get_into p = { func, d, xattr_name(namespace1, name, namebuf) };
+    aux_outbuf_init(&p.out, buf);
+    return rb_ensure(extattr_get_into_body, (VALUE)&p, extattr_get_into_cleanup, (VALUE)&p);
+}
+
+static VALUE
+file_extattr_get_into_main(VALUE file, int fd, int namespace1, VALUE name, VALUE buf)
+{
+    return extattr_get_into_common(fgetxattr, (void *)fd, namespace1, name, buf);
+}
+
+static VALUE
+file_s_extattr_get_into_main(VALUE path, int namespace1, VALUE name, VALUE buf)
+{
+    VALUE v = extattr_get_into_common(getxattr, StringValueCStr(path), namespace1, name, buf);
+    RB_GC_GUARD(path);
+    return v;
+}
+
+static VALUE
+file_s_extattr_get_into_link_main(VALUE path, int namespace1, VALUE name, VALUE buf)
+{
+    VALUE v = extattr_get_into_common(lgetxattr, StringValueCStr(path), namespace1, name, buf);
+    RB_GC_GUARD(path);
+    return v;
 }
 
 
 static VALUE
 extattr_set_common(int (*func)(), void *d, int namespace1, VALUE name, VALUE data)
 {
-    name = xattr_name(namespace1, name);
-    int status = func(d, StringValueCStr(name), RSTRING_PTR(data), RSTRING_LEN(data), 0);
+    char namebuf[XATTR_NAME_MAX + 1];
+    const char *namep = xattr_name(namespace1, name, namebuf);
+    // GVL を解放している間に他のスレッドから変更されないようにする。
+    data = rb_str_new_frozen(data);
+    int status = xattr_set_call(func, d, namep, RSTRING_PTR(data), RSTRING_LEN(data), 0);
     if (status < 0) { rb_sys_fail("setxattr call error"); }
+    RB_GC_GUARD(data);
     return Qnil;
 }
 
@@ -178,21 +734,26 @@ file_extattr_set_main(VALUE file, int fd, int namespace1, VALUE name, VALUE data
 static VALUE
 file_s_extattr_set_main(VALUE path, int namespace1, VALUE name, VALUE data)
 {
-    return extattr_set_common(setxattr, StringValueCStr(path), namespace1, name, data);
+    VALUE v = extattr_set_common(setxattr, StringValueCStr(path), namespace1, name, data);
+    RB_GC_GUARD(path);
+    return v;
 }
 
 static VALUE
 file_s_extattr_set_link_main(VALUE path, int namespace1, VALUE name, VALUE data)
 {
-    return extattr_set_common(lsetxattr, StringValueCStr(path), namespace1, name, data);
+    VALUE v = extattr_set_common(lsetxattr, StringValueCStr(path), namespace1, name, data);
+    RB_GC_GUARD(path);
+    return v;
 }
 
 
 static VALUE
 extattr_delete_common(int (*func)(), void *d, int namespace1, VALUE name)
 {
-    name = xattr_name(namespace1, name);
-    int status = func(d, StringValueCStr(name));
+    char namebuf[XATTR_NAME_MAX + 1];
+    const char *namep = xattr_name(namespace1, name, namebuf);
+    int status = xattr_delete_call(func, d, namep);
     if (status < 0) { rb_sys_fail("removexattr call error"); }
     return Qnil;
 }
@@ -206,24 +767,1158 @@ file_extattr_delete_main(VALUE file, int fd, int namespace1, VALUE name)
 static VALUE
 file_s_extattr_delete_main(VALUE path, int namespace1, VALUE name)
 {
-    return extattr_delete_common(removexattr, StringValueCStr(path), namespace1, name);
+    VALUE v = extattr_delete_common(removexattr, StringValueCStr(path), namespace1, name);
+    RB_GC_GUARD(path);
+    return v;
 }
 
 static VALUE
 file_s_extattr_delete_link_main(VALUE path, int namespace1, VALUE name)
 {
-    return extattr_delete_common(lremovexattr, StringValueCStr(path), namespace1, name);
+    VALUE v = extattr_delete_common(lremovexattr, StringValueCStr(path), namespace1, name);
+    RB_GC_GUARD(path);
+    return v;
+}
+
+
+/*
+ * ディレクトリ dirfd からの相対パス名で開く。
+ *
+ * dirfd の外に出ることと、シンボリックリンクをたどることを禁じる (末尾が O_PATH | O_NOFOLLOW で開くシンボリックリンクである場合を除く)。
+ */
+static int
+xattr_open_beneath(int dirfd, const char *relpath, int flags)
+{
+#ifdef XATTR_OPENAT2
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = flags;
+    how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_MAGICLINKS;
+    int fd = -1;
+    for (int i = 0; i < EXTATTR_RETRY_MAX; i++) {
+        // EAGAIN: 解決の途中で名前の変更があった
+        fd = (int)syscall(SYS_openat2, dirfd, relpath, &how, sizeof(how));
+        if (fd >= 0 || (errno != EAGAIN && errno != EINTR)) { break; }
+    }
+    if (fd >= 0 || errno != ENOSYS) { return fd; }
+#endif
+
+    // openat2 がなければ、途中のディレクトリを 1 段ずつシンボリックリンクをたどらずに開く。
+#ifdef O_PATH
+    const int dirflags = O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+#else
+    const int dirflags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+#endif
+    char *copy = strdup(relpath);
+    if (!copy) { return -1; }
+    int cwd = dirfd;
+    char *name = copy;
+    char *sep;
+    int res = -1;
+    for (;;) {
+        sep = strchr(name, '/');
+        if (sep) { *sep = '\0'; }
+        if (strcmp(name, "..") == 0) {
+            errno = EXDEV;
+            break;
+        }
+        if (!sep) {
+            res = openat(cwd, name, flags | O_NOFOLLOW);
+            break;
+        }
+        if (name[0] != '\0' && strcmp(name, ".") != 0) {
+            int next = openat(cwd, name, dirflags);
+            if (cwd != dirfd) { close(cwd); }
+            cwd = next;
+            if (cwd < 0) { break; }
+        }
+        name = sep + 1;
+    }
+    int err = errno;
+    if (cwd >= 0 && cwd != dirfd) { close(cwd); }
+    free(copy);
+    errno = err;
+    return res;
+}
+
+/*
+ * 拡張属性を f*xattr で操作するために、ディレクトリ dirfd からの相対パス名 path を読み込み用に開く。
+ * beneath が真であれば xattr_open_beneath で開き、末尾のシンボリックリンクもたどらない。
+ *
+ * デバイスファイルなどは開くだけで副作用 (テープ装置の巻き戻しなど) があるため、先に O_PATH で開いて種類を確かめ、
+ * 通常ファイルとディレクトリだけを "/proc/self/fd/N" から開き直す。それ以外の場合は errno を ENXIO として -1 を返す。
+ *
+ * pathfd が NULL でなければ、開き直さなかった場合に O_PATH で開いた記述子を *pathfd に残す (開けなかった場合は -1)。
+ * 呼び出し側は "/proc/self/fd/N" をパス名として、シンボリックリンクをたどる *xattr で操作できる。
+ *
+ * GVL を解放した状態から呼び出される。
+ */
+static int
+xattr_open_checked(int dirfd, const char *path, int nofollow, int beneath, int *pathfd)
+{
+    const int flags = O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC;
+
+    if (pathfd) { *pathfd = -1; }
+
+#ifdef O_PATH
+    int pfd = (beneath ? xattr_open_beneath(dirfd, path, O_PATH | O_NOFOLLOW | O_CLOEXEC)
+                       : openat(dirfd, path, O_PATH | O_CLOEXEC | nofollow));
+    if (pfd < 0) { return -1; }
+
+    int fd = -1;
+    struct stat st;
+    if (fstat(pfd, &st) == 0) {
+        if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+            errno = ENXIO;
+        } else {
+            char procpath[EXTATTR_PROCPATH_SIZE];
+            snprintf(procpath, sizeof(procpath), "/proc/self/fd/%d", pfd);
+            fd = open(procpath, flags);
+            if (fd < 0 && errno == ENOENT) {
+                // /proc がなければ改めて開き、同じファイルであることを確かめる。
+                struct stat st2;
+                fd = (beneath ? xattr_open_beneath(dirfd, path, flags | O_NOFOLLOW)
+                              : openat(dirfd, path, flags | nofollow));
+                if (fd >= 0 && (fstat(fd, &st2) < 0 || st2.st_dev != st.st_dev || st2.st_ino != st.st_ino)) {
+                    close(fd);
+                    fd = -1;
+                    errno = ENXIO;
+                }
+            }
+        }
+    }
+
+    int err = errno;
+    if (fd < 0 && pathfd) {
+        *pathfd = pfd;
+    } else {
+        close(pfd);
+    }
+    errno = err;
+    return fd;
+#else
+    return (beneath ? xattr_open_beneath(dirfd, path, flags | O_NOFOLLOW)
+                    : openat(dirfd, path, flags | nofollow));
+#endif
 }
 
+/*
+ * 複数の拡張属性をまとめて操作するための対象ファイル。
+ *
+ * 一度だけファイルを開いて f*xattr を用いる。
+ * 開けなかった場合 (読み込み権限がない、通常ファイルでもディレクトリでもない、など) は、パス名を用いる。
+ */
+struct xattr_target
+{
+    int fd;
+    int needclose;
+    int follow;
+    const char *path;
+};
 
 static void
-extattr_init_implement(void)
+xattr_target_open(struct xattr_target *t, const char *path, int follow)
+{
+    t->path = path;
+    t->follow = follow;
+    t->fd = xattr_open_checked(AT_FDCWD, path, (follow ? 0 : O_NOFOLLOW), 0, NULL);
+    t->needclose = (t->fd >= 0);
+}
+
+static void
+xattr_target_fd(struct xattr_target *t, int fd)
 {
-    NAMESPACE_USER_PREFIX = rb_str_new_cstr("user.");
-    NAMESPACE_SYSTEM_PREFIX = rb_str_new_cstr("system.");
+    t->path = NULL;
+    t->follow = 1;
+    t->fd = fd;
+    t->needclose = 0;
+}
 
-    rb_gc_register_mark_object(NAMESPACE_USER_PREFIX);
-    rb_gc_register_mark_object(NAMESPACE_SYSTEM_PREFIX);
+static void
+xattr_target_close(struct xattr_target *t)
+{
+    if (t->needclose) {
+        close(t->fd);
+        t->needclose = 0;
+    }
+    t->fd = -1;
+}
 
-    rb_define_const(mExtAttr, "IMPLEMENT", rb_str_freeze(rb_str_new_cstr("xattr")));
+static ssize_t
+xattr_target_get(const struct xattr_target *t, const char *name, void *buf, size_t size)
+{
+    if (t->fd >= 0) {
+        return fgetxattr(t->fd, name, buf, size);
+    } else if (t->follow) {
+        return getxattr(t->path, name, buf, size);
+    } else {
+        return lgetxattr(t->path, name, buf, size);
+    }
+}
+
+static int
+xattr_target_set(const struct xattr_target *t, const char *name, const void *buf, size_t size, int flags)
+{
+    if (t->fd >= 0) {
+        return fsetxattr(t->fd, name, buf, size, flags);
+    } else if (t->follow) {
+        return setxattr(t->path, name, buf, size, flags);
+    } else {
+        return lsetxattr(t->path, name, buf, size, flags);
+    }
+}
+
+static int
+xattr_target_remove(const struct xattr_target *t, const char *name)
+{
+    if (t->fd >= 0) {
+        return fremovexattr(t->fd, name);
+    } else if (t->follow) {
+        return removexattr(t->path, name);
+    } else {
+        return lremovexattr(t->path, name);
+    }
+}
+
+/*
+ * ディレクトリ dirfd からの相対パス名 relpath の項目を t として用意する。
+ * 見つからなければ 0 を、用意できなければ -1 を返す。
+ *
+ * xattr_open_beneath で開くため、dirfd の外に出ることも、シンボリックリンクをたどることもない。
+ * 通常ファイルとディレクトリ以外や、読み込みのために開けない項目は O_PATH で開いた記述子を *pathfd に残し、
+ * "/proc/self/fd/N" を procpath (EXTATTR_PROCPATH_SIZE バイト) に書いてパス名として操作する。
+ * 呼び出し側は xattr_target_close の後に *pathfd を閉じること。
+ *
+ * file が真であれば、項目は通常ファイルかディレクトリであるはずなので、シンボリックリンクであれば見つからなかったものとする。
+ */
+static int
+xattr_target_beneath(struct xattr_target *t, int dirfd, const char *relpath, int file, char *procpath, int *pathfd)
+{
+    t->path = NULL;
+    t->follow = 1;
+    t->needclose = 0;
+    t->fd = xattr_open_checked(dirfd, relpath, O_NOFOLLOW, 1, pathfd);
+    if (t->fd >= 0) {
+        t->needclose = 1;
+        return 1;
+    }
+
+    if (*pathfd >= 0) {
+        struct stat st;
+        if (file && fstat(*pathfd, &st) == 0 && S_ISLNK(st.st_mode)) {
+            close(*pathfd);
+            *pathfd = -1;
+            return 0;
+        }
+        snprintf(procpath, EXTATTR_PROCPATH_SIZE, "/proc/self/fd/%d", *pathfd);
+        t->path = procpath;
+        return 1;
+    }
+
+    switch (errno) {
+    case ENOENT:
+    case ENOTDIR:   // 途中にシンボリックリンクがある
+    case ELOOP:
+    case EXDEV:     // ルートの外に出ようとした
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+
+/*
+ * GVL を解放した状態でも使える (ruby の GC 管理外の) 伸長可能なバッファ。
+ */
+struct xattr_buf
+{
+    char *ptr;
+    size_t size;
+    size_t capa;
+};
+
+static int
+xattr_buf_reserve(struct xattr_buf *b, size_t need)
+{
+    if (b->capa - b->size >= need) { return 0; }
+
+    size_t capa = (b->capa > 0 ? b->capa : EXTATTR_STACKBUF_SIZE);
+    while (capa - b->size < need) { capa *= 2; }
+
+    char *ptr = realloc(b->ptr, capa);
+    if (!ptr) { errno = ENOMEM; return -1; }
+    b->ptr = ptr;
+    b->capa = capa;
+    return 0;
+}
+
+static void
+xattr_buf_free(struct xattr_buf *b)
+{
+    free(b->ptr);
+    b->ptr = NULL;
+    b->size = b->capa = 0;
+}
+
+/*
+ * スレッドごとの作業領域を b として借りる。使用中であれば b は空のままとなる。
+ */
+static struct aux_scratch *
+xattr_buf_borrow(struct xattr_buf *b)
+{
+    struct aux_scratch *s = aux_scratch_acquire();
+    if (s) {
+        b->ptr = s->ptr;
+        b->capa = s->capa;
+        b->size = 0;
+    }
+    return s;
+}
+
+/*
+ * xattr_buf_borrow で借りた作業領域を返す。s が NULL であれば b を解放する。
+ */
+static void
+xattr_buf_giveback(struct xattr_buf *b, struct aux_scratch *s)
+{
+    if (s) {
+        s->ptr = b->ptr;
+        s->capa = b->capa;
+        b->ptr = NULL;
+        b->size = b->capa = 0;
+        aux_scratch_release(s);
+    } else {
+        xattr_buf_free(b);
+    }
+}
+
+/*
+ * 拡張属性の値を b の末尾に追加して、その長さを返す。
+ */
+static ssize_t
+xattr_target_get_into(const struct xattr_target *t, const char *name, struct xattr_buf *b)
+{
+    if (xattr_buf_reserve(b, EXTATTR_STACKBUF_SIZE) < 0) { return -1; }
+
+    for (int i = 0; i < EXTATTR_RETRY_MAX; i++) {
+        ssize_t size = xattr_target_get(t, name, b->ptr + b->size, b->capa - b->size);
+        if (size >= 0) {
+            b->size += size;
+            return size;
+        }
+        if (errno == EINTR) { continue; }
+        if (errno != ERANGE) { return -1; }
+
+        size = xattr_target_get(t, name, NULL, 0);
+        if (size < 0) { return -1; }
+        if (xattr_buf_reserve(b, size) < 0) { return -1; }
+    }
+
+    errno = ERANGE;
+    return -1;
+}
+
+/*
+ * 拡張属性名の一覧を b に格納して、その長さを返す。
+ */
+static ssize_t
+xattr_target_list_into(const struct xattr_target *t, struct xattr_buf *b)
+{
+    b->size = 0;
+    if (xattr_buf_reserve(b, EXTATTR_STACKBUF_SIZE) < 0) { return -1; }
+
+    for (int i = 0; i < EXTATTR_RETRY_MAX; i++) {
+        ssize_t size;
+        if (t->fd >= 0) {
+            size = flistxattr(t->fd, b->ptr, b->capa);
+        } else if (t->follow) {
+            size = listxattr(t->path, b->ptr, b->capa);
+        } else {
+            size = llistxattr(t->path, b->ptr, b->capa);
+        }
+        if (size >= 0) {
+            b->size = size;
+            return size;
+        }
+        if (errno == EINTR) { continue; }
+        if (errno != ERANGE) { return -1; }
+
+        if (t->fd >= 0) {
+            size = flistxattr(t->fd, NULL, 0);
+        } else if (t->follow) {
+            size = listxattr(t->path, NULL, 0);
+        } else {
+            size = llistxattr(t->path, NULL, 0);
+        }
+        if (size < 0) { return -1; }
+        if (xattr_buf_reserve(b, size) < 0) { return -1; }
+    }
+
+    errno = ERANGE;
+    return -1;
+}
+
+
+/*
+ * get_many の作業領域。
+ */
+struct xattr_get_many
+{
+    struct xattr_target target;
+    const char *path;           // NULL でなければ、これを開いて target とする
+    int follow;
+
+    long num;
+    const char **names;         // 接頭辞を含む拡張属性名
+    struct xattr_get_many_result {
+        size_t offset;
+        ssize_t size;
+        int err;
+    } *results;
+
+    long pos;                   // 次に処理する names の位置
+    struct xattr_buf values;
+    struct aux_scratch *scratch; // values として借りている作業領域
+    volatile int cancel;
+};
+
+static void *
+extattr_get_many_nogvl(void *arg)
+{
+    struct xattr_get_many *p = (struct xattr_get_many *)arg;
+
+    if (p->path && p->target.fd < 0 && !p->target.path) {
+        xattr_target_open(&p->target, p->path, p->follow);
+    }
+
+    for (; p->pos < p->num && !p->cancel; p->pos++) {
+        struct xattr_get_many_result *r = &p->results[p->pos];
+        r->offset = p->values.size;
+        r->size = xattr_target_get_into(&p->target, p->names[p->pos], &p->values);
+        r->err = (r->size < 0 ? errno : 0);
+    }
+
+    return NULL;
+}
+
+static VALUE
+extattr_get_many_cleanup(VALUE arg)
+{
+    struct xattr_get_many *p = (struct xattr_get_many *)arg;
+    xattr_target_close(&p->target);
+    xattr_buf_giveback(&p->values, p->scratch);
+    return Qnil;
+}
+
+struct extattr_get_many_args
+{
+    struct xattr_get_many *many;
+    VALUE path;
+    VALUE names;
+};
+
+static VALUE
+extattr_get_many_body(VALUE arg)
+{
+    struct extattr_get_many_args *args = (struct extattr_get_many_args *)arg;
+    struct xattr_get_many *p = args->many;
+
+    while (p->pos < p->num) {
+        p->cancel = 0;
+        aux_blocking_call_cancelable(extattr_get_many_nogvl, p, &p->cancel);
+    }
+
+    VALUE hash = rb_hash_new();
+    for (long i = 0; i < p->num; i++) {
+        const struct xattr_get_many_result *r = &p->results[i];
+        VALUE name = RARRAY_AREF(args->names, i);
+        if (r->size >= 0) {
+            rb_hash_aset(hash, name, rb_str_new(p->values.ptr + r->offset, r->size));
+        } else if (r->err == ENODATA) {
+            rb_hash_aset(hash, name, Qnil);
+        } else {
+            ext_error_extattr(r->err, args->path, name);
+        }
+    }
+
+    return hash;
+}
+
+static VALUE
+extattr_get_many_common(struct xattr_get_many *many, VALUE path, int namespace1, VALUE names)
+{
+    size_t prefixlen;
+    const char *prefix = xattr_prefix(namespace1, &prefixlen);
+
+    // 接頭辞付きの拡張属性名を、ひとつのバッファにまとめて作成する。
+    names = rb_ary_dup(names);
+    long num = RARRAY_LEN(names);
+    size_t namesize = 0;
+    for (long i = 0; i < num; i++) {
+        VALUE name = aux_name_string(aux_should_be_name(RARRAY_AREF(names, i)));
+        StringValueCStr(name);
+        namesize += prefixlen + RSTRING_LEN(name) + 1;
+    }
+
+    VALUE tmp;
+    char *work = ALLOCV(tmp, sizeof(const char *) * num +
+                             sizeof(struct xattr_get_many_result) * num +
+                             namesize);
+    many->names = (const char **)work;
+    many->results = (struct xattr_get_many_result *)(many->names + num);
+    char *namep = (char *)(many->results + num);
+    for (long i = 0; i < num; i++) {
+        VALUE name = aux_name_string(RARRAY_AREF(names, i));
+        many->names[i] = namep;
+        memcpy(namep, prefix, prefixlen);
+        memcpy(namep + prefixlen, RSTRING_PTR(name), RSTRING_LEN(name));
+        namep += prefixlen + RSTRING_LEN(name);
+        *namep++ = '\0';
+    }
+    many->num = num;
+    many->pos = 0;
+    many->scratch = xattr_buf_borrow(&many->values);
+
+    struct extattr_get_many_args args = { many, path, names };
+    VALUE hash = rb_ensure(extattr_get_many_body, (VALUE)&args,
+                           extattr_get_many_cleanup, (VALUE)many);
+    ALLOCV_END(tmp);
+    RB_GC_GUARD(names);
+    RB_GC_GUARD(path);
+
+    return hash;
+}
+
+static VALUE
+file_extattr_get_many_main(VALUE file, int fd, int namespace1, VALUE names)
+{
+    struct xattr_get_many many = { 0 };
+    xattr_target_fd(&many.target, fd);
+    return extattr_get_many_common(&many, file, namespace1, names);
+}
+
+static VALUE
+file_s_extattr_get_many_main(VALUE path, int namespace1, VALUE names)
+{
+    struct xattr_get_many many = { { -1 } };
+    many.path = StringValueCStr(path);
+    many.follow = 1;
+    return extattr_get_many_common(&many, path, namespace1, names);
+}
+
+static VALUE
+file_s_extattr_get_many_link_main(VALUE path, int namespace1, VALUE names)
+{
+    struct xattr_get_many many = { { -1 } };
+    many.path = StringValueCStr(path);
+    many.follow = 0;
+    return extattr_get_many_common(&many, path, namespace1, names);
+}
+
+
+/*
+ * set_many の作業領域。
+ */
+struct xattr_set_many
+{
+    struct xattr_target target;
+    const char *path;           // NULL でなければ、これを開いて target とする
+    int follow;
+    int flags;
+    int atomic;
+
+    long num;
+    struct xattr_set_many_entry {
+        const char *name;       // 接頭辞を含む拡張属性名
+        const char *value;      // NULL ならば削除する
+        size_t size;
+
+        // 以下は atomic の場合の、変更前の値
+        size_t oldoffset;
+        ssize_t oldsize;        // 負の値ならば存在しなかった
+    } *entries;
+
+    long pos;                   // 適用済みの数
+    int err;                    // entries[pos] で失敗した時の errno
+    struct xattr_buf olds;
+    volatile int cancel;
+};
+
+static void *
+extattr_set_many_nogvl(void *arg)
+{
+    struct xattr_set_many *p = (struct xattr_set_many *)arg;
+
+    if (p->path && !p->target.path) {
+        xattr_target_open(&p->target, p->path, p->follow);
+    }
+
+    for (; p->pos < p->num && !p->cancel; p->pos++) {
+        struct xattr_set_many_entry *e = &p->entries[p->pos];
+
+        if (p->atomic) {
+            e->oldoffset = p->olds.size;
+            e->oldsize = xattr_target_get_into(&p->target, e->name, &p->olds);
+            if (e->oldsize < 0 && errno != ENODATA) { p->err = errno; break; }
+        }
+
+        int status;
+        do {
+            if (e->value) {
+                status = xattr_target_set(&p->target, e->name, e->value, e->size, p->flags);
+            } else {
+                status = xattr_target_remove(&p->target, e->name);
+                if (status < 0 && errno == ENODATA) { status = 0; }
+            }
+        } while (status < 0 && errno == EINTR);
+
+        if (status < 0) { p->err = errno; break; }
+    }
+
+    return NULL;
+}
+
+static void
+extattr_set_many_rollback(struct xattr_set_many *p)
+{
+    while (p->pos > 0) {
+        const struct xattr_set_many_entry *e = &p->entries[--p->pos];
+        if (e->oldsize >= 0) {
+            xattr_target_set(&p->target, e->name, p->olds.ptr + e->oldoffset, e->oldsize, 0);
+        } else {
+            xattr_target_remove(&p->target, e->name);
+        }
+    }
+}
+
+static VALUE
+extattr_set_many_cleanup(VALUE arg)
+{
+    struct xattr_set_many *p = (struct xattr_set_many *)arg;
+
+    // 例外や中断によって全てを適用できなかった場合は、変更前の状態に戻す。
+    if (p->atomic && p->pos < p->num) {
+        extattr_set_many_rollback(p);
+    }
+
+    xattr_target_close(&p->target);
+    xattr_buf_free(&p->olds);
+    return Qnil;
+}
+
+struct extattr_set_many_args
+{
+    struct xattr_set_many *many;
+    VALUE path;
+    VALUE names;
+};
+
+static VALUE
+extattr_set_many_body(VALUE arg)
+{
+    struct extattr_set_many_args *args = (struct extattr_set_many_args *)arg;
+    struct xattr_set_many *p = args->many;
+
+    while (p->pos < p->num && p->err == 0) {
+        p->cancel = 0;
+        aux_blocking_call_cancelable(extattr_set_many_nogvl, p, &p->cancel);
+    }
+
+    if (p->err != 0) {
+        ext_error_extattr(p->err, args->path, RARRAY_AREF(args->names, p->pos));
+    }
+
+    return Qnil;
+}
+
+static int
+extattr_set_many_collect(VALUE name, VALUE data, VALUE arg)
+{
+    VALUE *kv = (VALUE *)arg;
+    name = aux_name_string(aux_should_be_name(name));
+    StringValueCStr(name);
+    rb_ary_push(kv[0], name);
+    rb_ary_push(kv[1], NIL_P(data) ? Qnil : rb_str_new_frozen(aux_should_be_string(data)));
+    return ST_CONTINUE;
+}
+
+static VALUE
+extattr_set_many_common(struct xattr_set_many *many, VALUE path, int namespace1, VALUE pairs)
+{
+    size_t prefixlen;
+    const char *prefix = xattr_prefix(namespace1, &prefixlen);
+
+    // GVL を解放している間に変更されないように、名前と値を複製しておく。
+    VALUE keys = rb_ary_new_capa(RHASH_SIZE(pairs));
+    VALUE values = rb_ary_new_capa(RHASH_SIZE(pairs));
+    VALUE kv[2] = { keys, values };
+    rb_hash_foreach(pairs, extattr_set_many_collect, (VALUE)kv);
+
+    long num = RARRAY_LEN(keys);
+    size_t namesize = 0;
+    for (long i = 0; i < num; i++) {
+        namesize += prefixlen + RSTRING_LEN(RARRAY_AREF(keys, i)) + 1;
+    }
+
+    VALUE tmp;
+    char *work = ALLOCV(tmp, sizeof(struct xattr_set_many_entry) * num + namesize);
+    many->entries = (struct xattr_set_many_entry *)work;
+    char *namep = (char *)(many->entries + num);
+    for (long i = 0; i < num; i++) {
+        VALUE name = RARRAY_AREF(keys, i);
+        VALUE data = RARRAY_AREF(values, i);
+        struct xattr_set_many_entry *e = &many->entries[i];
+        e->name = namep;
+        memcpy(namep, prefix, prefixlen);
+        memcpy(namep + prefixlen, RSTRING_PTR(name), RSTRING_LEN(name));
+        namep += prefixlen + RSTRING_LEN(name);
+        *namep++ = '\0';
+        e->value = NIL_P(data) ? NULL : RSTRING_PTR(data);
+        e->size = NIL_P(data) ? 0 : RSTRING_LEN(data);
+        e->oldoffset = 0;
+        e->oldsize = -1;
+    }
+    many->num = num;
+    many->pos = 0;
+    many->err = 0;
+
+    struct extattr_set_many_args args = { many, path, keys };
+    rb_ensure(extattr_set_many_body, (VALUE)&args,
+              extattr_set_many_cleanup, (VALUE)many);
+    ALLOCV_END(tmp);
+    RB_GC_GUARD(keys);
+    RB_GC_GUARD(values);
+    RB_GC_GUARD(path);
+
+    return Qnil;
+}
+
+static VALUE
+file_extattr_set_many_main(VALUE file, int fd, int namespace1, VALUE pairs, int flags, int atomic)
+{
+    struct xattr_set_many many = { { -1 } };
+    xattr_target_fd(&many.target, fd);
+    many.flags = flags;
+    many.atomic = atomic;
+    return extattr_set_many_common(&many, file, namespace1, pairs);
+}
+
+static VALUE
+file_s_extattr_set_many_main(VALUE path, int namespace1, VALUE pairs, int flags, int atomic)
+{
+    struct xattr_set_many many = { { -1 } };
+    many.path = StringValueCStr(path);
+    many.follow = 1;
+    many.flags = flags;
+    many.atomic = atomic;
+    return extattr_set_many_common(&many, path, namespace1, pairs);
+}
+
+static VALUE
+file_s_extattr_set_many_link_main(VALUE path, int namespace1, VALUE pairs, int flags, int atomic)
+{
+    struct xattr_set_many many = { { -1 } };
+    many.path = StringValueCStr(path);
+    many.follow = 0;
+    many.flags = flags;
+    many.atomic = atomic;
+    return extattr_set_many_common(&many, path, namespace1, pairs);
+}
+
+
+/*
+ * to_h の作業領域。
+ *
+ * 一覧の取得と全ての値の取得を、GVL を解放したまま一度に行う。
+ * 値はひとつのバッファに詰めて格納し、最後にまとめて ruby のハッシュにする。
+ */
+struct xattr_to_h
+{
+    struct xattr_target target;
+    const char *path;           // NULL でなければ、これを開いて target とする
+    int follow;
+    int namespace1;
+
+    struct xattr_buf list;
+    struct xattr_buf values;
+    struct xattr_buf entries;   // struct xattr_to_h_entry の配列
+    struct aux_scratch *scratch; // list として借りている作業領域
+    int err;
+    const char *errfunc;
+    volatile int cancel;
+};
+
+struct xattr_to_h_entry
+{
+    size_t nameoffset;          // list.ptr からの位置 (接頭辞を除く)
+    size_t namelen;
+    size_t valueoffset;         // values.ptr からの位置
+    size_t valuelen;
+};
+
+static void *
+extattr_to_h_nogvl(void *arg)
+{
+    struct xattr_to_h *p = (struct xattr_to_h *)arg;
+
+    if (p->path && !p->target.path) {
+        p->target.fd = -1;
+        p->target.needclose = 0;
+        p->target.path = p->path;
+        p->target.follow = p->follow;
+    }
+
+    p->values.size = p->entries.size = 0;
+    if (xattr_target_list_into(&p->target, &p->list) < 0) {
+        p->err = errno;
+        p->errfunc = "listxattr";
+        return NULL;
+    }
+
+    size_t prefixlen;
+    xattr_prefix_lookup(p->namespace1, &prefixlen);
+    const char *cursor = p->list.ptr;
+    const char *end = p->list.ptr + p->list.size;
+    const char *namep;
+    size_t namelen;
+
+    // 値を複数取得する場合は、パス名の解決を一度で済ませるためにファイルを開く。
+    if (p->path && p->target.fd < 0) {
+        const char *c = cursor;
+        int count = 0;
+        while (count < 2 && xattr_list_next(&c, end, p->namespace1, &namelen)) { count++; }
+        if (count > 1) { xattr_target_open(&p->target, p->path, p->follow); }
+    }
+    while (!p->cancel && (namep = xattr_list_next(&cursor, end, p->namespace1, &namelen)) != NULL) {
+        struct xattr_to_h_entry e;
+        e.nameoffset = namep - p->list.ptr;
+        e.namelen = namelen;
+        e.valueoffset = p->values.size;
+        ssize_t size = xattr_target_get_into(&p->target, namep - prefixlen, &p->values);
+        if (size < 0) {
+            if (errno == ENODATA) { continue; } // 一覧を取得した後に削除された
+            p->err = errno;
+            p->errfunc = "getxattr";
+            return NULL;
+        }
+        e.valuelen = size;
+
+        if (xattr_buf_reserve(&p->entries, sizeof(e)) < 0) {
+            p->err = errno;
+            p->errfunc = "malloc";
+            return NULL;
+        }
+        memcpy(p->entries.ptr + p->entries.size, &e, sizeof(e));
+        p->entries.size += sizeof(e);
+    }
+
+    return NULL;
+}
+
+static VALUE
+extattr_to_h_body(VALUE arg)
+{
+    struct xattr_to_h *p = (struct xattr_to_h *)arg;
+
+    do {
+        p->cancel = 0;
+        aux_blocking_call_cancelable(extattr_to_h_nogvl, p, &p->cancel);
+    } while (p->cancel && p->err == 0);
+
+    if (p->err != 0) { return Qfalse; }
+
+    VALUE hash = rb_hash_new();
+    const struct xattr_to_h_entry *e = (const struct xattr_to_h_entry *)p->entries.ptr;
+    const struct xattr_to_h_entry *eend = (const struct xattr_to_h_entry *)(p->entries.ptr + p->entries.size);
+    for (; e < eend; e++) {
+        rb_hash_aset(hash,
+                     rb_str_new(p->list.ptr + e->nameoffset, e->namelen),
+                     rb_str_new(p->values.ptr + e->valueoffset, e->valuelen));
+    }
+
+    return hash;
+}
+
+static VALUE
+extattr_to_h_cleanup(VALUE arg)
+{
+    struct xattr_to_h *p = (struct xattr_to_h *)arg;
+    xattr_target_close(&p->target);
+    xattr_buf_giveback(&p->list, p->scratch);
+    xattr_buf_free(&p->values);
+    xattr_buf_free(&p->entries);
+    return Qnil;
+}
+
+static VALUE
+extattr_to_h_common(struct xattr_to_h *p, VALUE path, int namespace1)
+{
+    size_t prefixlen;
+    xattr_prefix(namespace1, &prefixlen);
+    p->namespace1 = namespace1;
+    p->scratch = xattr_buf_borrow(&p->list);
+
+    VALUE hash = rb_ensure(extattr_to_h_body, (VALUE)p,
+                           extattr_to_h_cleanup, (VALUE)p);
+    if (p->err != 0) {
+        errno = p->err;
+        aux_sys_fail(path, p->errfunc);
+    }
+    RB_GC_GUARD(path);
+
+    return hash;
+}
+
+static VALUE
+file_extattr_to_h_main(VALUE file, int fd, int namespace1)
+{
+    struct xattr_to_h work = { { -1 } };
+    xattr_target_fd(&work.target, fd);
+    return extattr_to_h_common(&work, file, namespace1);
+}
+
+static VALUE
+file_s_extattr_to_h_main(VALUE path, int namespace1)
+{
+    struct xattr_to_h work = { { -1 } };
+    work.path = StringValueCStr(path);
+    work.follow = 1;
+    return extattr_to_h_common(&work, path, namespace1);
+}
+
+static VALUE
+file_s_extattr_to_h_link_main(VALUE path, int namespace1)
+{
+    struct xattr_to_h work = { { -1 } };
+    work.path = StringValueCStr(path);
+    work.follow = 0;
+    return extattr_to_h_common(&work, path, namespace1);
+}
+
+
+/*
+ * ExtAttr.copy の実装
+ *
+ * 複写元の一覧を一度だけ取得して、値は一つの作業領域を使い回しながら複写先に設定する。
+ * 値を ruby のオブジェクトにすることはない。
+ */
+
+struct xattr_copy
+{
+    struct xattr_target src, dst;
+    const char *srcpath;        // NULL でなければ、これを開いて src とする
+    const char *dstpath;        // NULL でなければ、これを開いて dst とする
+    int namespace1;             // EXTATTR_NAMESPACE_ALL であれば全ての名前空間
+    int skip;                   // 複写先に既にある拡張属性は上書きしない
+    long numpatterns;
+    const char **patterns;      // NULL であれば全ての拡張属性
+
+    struct xattr_buf list;
+    struct xattr_buf value;
+    struct aux_scratch *scratch; // list として借りている作業領域
+    int started;
+    size_t cursor;              // 中断した場合に再開する、list.ptr からの位置
+    size_t copied;
+
+    int err;
+    int errdst;                 // 複写先で失敗した
+    const char *errfunc;
+    char errname[XATTR_NAME_MAX + 1];
+    volatile int cancel;
+};
+
+static int
+extattr_copy_wanted(const struct xattr_copy *p, const char *name)
+{
+    if (!p->patterns) { return 1; }
+
+    for (long i = 0; i < p->numpatterns; i++) {
+        if (fnmatch(p->patterns[i], name, 0) == 0) { return 1; }
+    }
+
+    return 0;
+}
+
+static void
+extattr_copy_fail(struct xattr_copy *p, int dst, const char *func, const char *name, size_t len)
+{
+    p->err = errno;
+    p->errdst = dst;
+    p->errfunc = func;
+    if (len > XATTR_NAME_MAX) { len = XATTR_NAME_MAX; }
+    memcpy(p->errname, name, len);
+    p->errname[len] = '\0';
+}
+
+static void *
+extattr_copy_nogvl(void *arg)
+{
+    struct xattr_copy *p = (struct xattr_copy *)arg;
+
+    if (!p->started) {
+        p->started = 1;
+        // 値ごとのパス名の解決を避けるため、パス名で与えられた場合はファイルを開く。
+        if (p->srcpath) { xattr_target_open(&p->src, p->srcpath, 1); }
+        if (p->dstpath) { xattr_target_open(&p->dst, p->dstpath, 1); }
+        if (xattr_target_list_into(&p->src, &p->list) < 0) {
+            extattr_copy_fail(p, 0, "listxattr", "", 0);
+            return NULL;
+        }
+    }
+
+    const char *cursor = p->list.ptr + p->cursor;
+    const char *end = p->list.ptr + p->list.size;
+    const char *entry;
+    size_t n;
+    while (!p->cancel && (entry = xattr_list_entry(&cursor, end, &n)) != NULL) {
+        p->cursor = cursor - p->list.ptr;
+
+        size_t prefixlen;
+        int ns = xattr_namespace_of(entry, n, &prefixlen);
+        if (ns == EXTATTR_NAMESPACE_ALL) { continue; }
+        if (p->namespace1 != EXTATTR_NAMESPACE_ALL && ns != p->namespace1) { continue; }
+        if (!extattr_copy_wanted(p, entry + prefixlen)) { continue; }
+
+        p->value.size = 0;
+        ssize_t size = xattr_target_get_into(&p->src, entry, &p->value);
+        if (size < 0) {
+            if (errno == ENODATA) { continue; } // 一覧を取得した後に削除された
+            extattr_copy_fail(p, 0, "getxattr", entry + prefixlen, n - prefixlen);
+            return NULL;
+        }
+
+        if (xattr_target_set(&p->dst, entry, p->value.ptr, size, (p->skip ? XATTR_CREATE : 0)) < 0) {
+            if (p->skip && errno == EEXIST) { continue; }
+            extattr_copy_fail(p, 1, "setxattr", entry + prefixlen, n - prefixlen);
+            return NULL;
+        }
+        p->copied++;
+    }
+
+    return NULL;
+}
+
+static VALUE
+extattr_copy_body(VALUE arg)
+{
+    struct xattr_copy *p = (struct xattr_copy *)arg;
+
+    do {
+        p->cancel = 0;
+        aux_blocking_call_cancelable(extattr_copy_nogvl, p, &p->cancel);
+    } while (p->cancel && p->err == 0);
+
+    return Qnil;
+}
+
+static VALUE
+extattr_copy_cleanup(VALUE arg)
+{
+    struct xattr_copy *p = (struct xattr_copy *)arg;
+    xattr_target_close(&p->src);
+    xattr_target_close(&p->dst);
+    xattr_buf_giveback(&p->list, p->scratch);
+    xattr_buf_free(&p->value);
+    return Qnil;
+}
+
+/*
+ * src と dst は File オブジェクトかパス名で、File オブジェクトであれば srcfd と dstfd にその記述子を与える。
+ * patterns は nil か、パターンの文字列の配列。
+ */
+static VALUE
+file_s_extattr_copy_main(VALUE src, int srcfd, VALUE dst, int dstfd, int namespace1, VALUE patterns, int skip)
+{
+    struct xattr_copy work;
+    memset(&work, 0, sizeof(work));
+    work.src.fd = work.dst.fd = -1;
+    work.namespace1 = namespace1;
+    work.skip = skip;
+    if (namespace1 != EXTATTR_NAMESPACE_ALL) {
+        size_t prefixlen;
+        xattr_prefix(namespace1, &prefixlen);
+    }
+
+    if (srcfd >= 0) {
+        xattr_target_fd(&work.src, srcfd);
+    } else {
+        src = rb_str_new_frozen(src);
+        work.srcpath = StringValueCStr(src);
+    }
+    if (dstfd >= 0) {
+        xattr_target_fd(&work.dst, dstfd);
+    } else {
+        dst = rb_str_new_frozen(dst);
+        work.dstpath = StringValueCStr(dst);
+    }
+
+    VALUE tmp = 0;
+    if (!NIL_P(patterns)) {
+        patterns = rb_ary_dup(patterns);
+        long num = RARRAY_LEN(patterns);
+        work.patterns = ALLOCV_N(const char *, tmp, (num > 0 ? num : 1));
+        for (long i = 0; i < num; i++) {
+            VALUE pat = rb_str_new_frozen(RARRAY_AREF(patterns, i));
+            rb_ary_store(patterns, i, pat);
+            work.patterns[i] = StringValueCStr(pat);
+        }
+        work.numpatterns = num;
+    }
+
+    work.scratch = xattr_buf_borrow(&work.list);
+    rb_ensure(extattr_copy_body, (VALUE)&work, extattr_copy_cleanup, (VALUE)&work);
+    if (tmp) { ALLOCV_END(tmp); }
+    RB_GC_GUARD(patterns);
+    RB_GC_GUARD(src);
+    RB_GC_GUARD(dst);
+
+    if (work.err != 0) {
+        VALUE path = (work.errdst ? dst : src);
+        if (work.errname[0] == '\0') {
+            errno = work.err;
+            aux_sys_fail(path, work.errfunc);
+        }
+        ext_error_extattr(work.err, path, rb_str_new_cstr(work.errname));
+    }
+
+    return SIZET2NUM(work.copied);
+}
+
+#if HAVE_PTHREAD_H
+#   include "extattr-xattr-walk.h"
+#   include "extattr-xattr-sync.h"
+#   include "extattr-xattr-dump.h"
+#   include "extattr-xattr-index.h"
+#   if defined(HAVE_SYS_INOTIFY_H)
+#       include "extattr-xattr-watch.h"
+#   endif
+#endif
+
+#include "extattr-xattr-handle.h"
+#include "extattr-xattr-ring.h"
+#include "extattr-xattr-names.h"
+
+
+static void
+extattr_init_implement(void)
+{
+    rb_define_const(mExtAttr, "IMPLEMENT", rb_str_freeze(rb_str_new_cstr("xattr")));
+    rb_define_const(mExtAttr, "CREATE", INT2FIX(XATTR_CREATE));
+    rb_define_const(mExtAttr, "REPLACE", INT2FIX(XATTR_REPLACE));
+
+    xattr_handle_init();
+    xattr_ring_init();
+    xattr_names_init();
+#ifdef EXTATTR_HAVE_SYNC_TREE
+    xattr_sync_init();
+#endif
+#ifdef EXTATTR_HAVE_DUMP
+    xattr_dump_init();
+#endif
+#ifdef EXTATTR_HAVE_INDEX
+    xattr_index_init();
+#endif
+#ifdef EXTATTR_HAVE_WATCHER
+    xattr_watcher_init();
+#endif
 }
@@ -11,7 +11,28 @@
 #include <ruby/io.h>
 #include <ruby/intern.h>
 #include <ruby/version.h>
+#include <ruby/thread.h>
+#include <ruby/encoding.h>
 #include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#if HAVE_RUBY_IO_BUFFER_H && HAVE_RB_IO_BUFFER_GET_BYTES_FOR_WRITING
+#   include <ruby/io/buffer.h>
+#   define EXTATTR_IO_BUFFER 1
+#endif
+#if HAVE_PTHREAD_H
+#   include <pthread.h>
+#endif
+
+#if defined(HAVE_RUBY_FIBER_SCHEDULER_H) && defined(HAVE_RB_FIBER_SCHEDULER_CURRENT) && \
+    defined(HAVE_RB_FIBER_SCHEDULER_IO_WAIT_READABLE) && HAVE_PTHREAD_H
+#   include <ruby/fiber/scheduler.h>
+#   include <errno.h>
+#   include <fcntl.h>
+#   include <signal.h>
+#   include <unistd.h>
+#   define EXTATTR_FIBER_SCHEDULER 1
+#endif
 
 
 static VALUE file_extattr_list_main(VALUE file, int fd, int namespace1);
@@ -29,10 +50,42 @@ static VALUE file_s_extattr_set_main(VALUE path, int namespace1, VALUE name, VAL
 static VALUE file_s_extattr_set_link_main(VALUE path, int namespace1, VALUE name, VALUE data);
 static VALUE file_s_extattr_delete_main(VALUE path, int namespace1, VALUE name);
 static VALUE file_s_extattr_delete_link_main(VALUE path, int namespace1, VALUE name);
+static VALUE file_extattr_get_into_main(VALUE file, int fd, int namespace1, VALUE name, VALUE buf);
+static VALUE file_s_extattr_get_into_main(VALUE path, int namespace1, VALUE name, VALUE buf);
+static VALUE file_s_extattr_get_into_link_main(VALUE path, int namespace1, VALUE name, VALUE buf);
+static VALUE file_extattr_get_many_main(VALUE file, int fd, int namespace1, VALUE names);
+static VALUE file_s_extattr_get_many_main(VALUE path, int namespace1, VALUE names);
+static VALUE file_s_extattr_get_many_link_main(VALUE path, int namespace1, VALUE names);
+static VALUE file_extattr_set_many_main(VALUE file, int fd, int namespace1, VALUE pairs, int flags, int atomic);
+static VALUE file_s_extattr_set_many_main(VALUE path, int namespace1, VALUE pairs, int flags, int atomic);
+static VALUE file_s_extattr_set_many_link_main(VALUE path, int namespace1, VALUE pairs, int flags, int atomic);
+static VALUE file_s_extattr_scan_main(VALUE root, int namespace1, VALUE names, int nthreads);
+static VALUE file_s_extattr_copy_main(VALUE src, int srcfd, VALUE dst, int dstfd, int namespace1, VALUE patterns, int skip);
+static VALUE file_s_extattr_sync_tree_main(VALUE src, VALUE dst, int namespace1, int nthreads);
+static VALUE file_s_extattr_dump_main(VALUE root, VALUE dest, int destfd, int namespace1, int nthreads);
+static VALUE file_s_extattr_restore_main(VALUE src, VALUE root);
+static VALUE file_extattr_to_h_main(VALUE file, int fd, int namespace1);
+static VALUE file_s_extattr_to_h_main(VALUE path, int namespace1);
+static VALUE file_s_extattr_to_h_link_main(VALUE path, int namespace1);
+static VALUE file_extattr_names_main(VALUE file, int fd, int namespace1);
+static VALUE file_s_extattr_names_main(VALUE path, int namespace1);
+static VALUE file_s_extattr_names_link_main(VALUE path, int namespace1);
+static VALUE file_s_extattr_list_at_main(VALUE dir, VALUE path, int follow, int namespace1);
+static VALUE file_s_extattr_size_at_main(VALUE dir, VALUE path, int follow, int namespace1, VALUE name);
+static VALUE file_s_extattr_get_at_main(VALUE dir, VALUE path, int follow, int namespace1, VALUE name);
+static VALUE file_s_extattr_set_at_main(VALUE dir, VALUE path, int follow, int namespace1, VALUE name, VALUE data);
+static VALUE file_s_extattr_delete_at_main(VALUE dir, VALUE path, int follow, int namespace1, VALUE name);
 
 // Init_extattr から呼び出される、環境ごとの初期設定。
 static void extattr_init_implement(void);
 
+static int conv_namespace(VALUE namespace);
+static int conv_namespace_list(VALUE namespace);
+static VALUE aux_namespace_symbol(int namespace1);
+static VALUE aux_should_be_name(VALUE obj);
+static VALUE aux_name_string(VALUE name);
+static void ext_check_path_security(VALUE path, VALUE name, VALUE data);
+
 #if RUBY_API_VERSION_CODE >= 20700
 # define rb_obj_infect(OBJ, SRC) ((void)0)
 #endif
@@ -47,6 +100,15 @@ static VALUE mExtAttr;
 
 static ID id_downcase;
 static ID id_to_path;
+static ID id_flags;
+static ID id_atomic;
+static ID id_namespace;
+static ID id_names;
+static ID id_threads;
+static ID id_filter;
+static ID id_existing;
+static ID id_overwrite;
+static ID id_skip;
 
 
 static inline VALUE
@@ -79,6 +141,7 @@ ext_error_extattr(int err, VALUE filepath, VALUE attrname)
     } else {
         filepath = rb_get_path_no_checksafe(filepath);
     }
+    attrname = aux_name_string(attrname);
     VALUE mesg = rb_sprintf("%s [%s]", StringValueCStr(filepath), StringValueCStr(attrname));
     rb_sys_fail(StringValueCStr(mesg));
 }
@@ -93,8 +156,7 @@ static VALUE
 aux_to_path(VALUE path)
 {
     if (rb_respond_to(path, id_to_path)) {
-        VALUE args[] = { path };
-        path = rb_funcall2(path, id_to_path, 1, args);
+        path = rb_funcall2(path, id_to_path, 0, NULL);
         rb_check_type(path, RUBY_T_STRING);
     } else {
         path = StringValue(path);
@@ -149,359 +211,1685 @@ aux_memcasecmp(const char *a, const char *b, size_t n)
     return 0;
 }
 
+#ifdef EXTATTR_FIBER_SCHEDULER
+/*
+ * ファイバースケジューラが有効な場合に、システムコールを代わりに呼び出すワーカースレッド。
+ *
+ * ワーカースレッドはプロセス全体で共有し、空いているものがなければ上限 (ExtAttr.offload_threads) まで増やす。
+ * 遅いファイルシステムではシステムコールを待つ間もスレッドを占有するため、上限は待っているファイバーの数に
+ * 見合うように大きめにしておき、AUX_OFFLOAD_IDLE_SEC 秒の間仕事のなかったスレッドは終了させる。
+ * 完了を知らせる pipe とその IO はスレッドごとに使い回す (待っているファイバーごとにひとつずつ使う)。
+ */
+enum {
+    AUX_OFFLOAD_THREADS_DEFAULT = 64,
+    AUX_OFFLOAD_THREADS_LIMIT = 4096,   // ExtAttr.offload_threads= で設定できる上限
+    AUX_OFFLOAD_IDLE_SEC = 5,
 
-#if defined(HAVE_SYS_EXTATTR_H)
-#   include "extattr-extattr.h"
-#elif defined(HAVE_WINNT_H)
-#   include "extattr-windows.h"
-#elif defined(HAVE_ATTR_XATTR_H) || defined(HAVE_SYS_XATTR_H)
-#   include "extattr-xattr.h"
-#else
-#   error ruby-extattr not supported on your system
-#endif
+    // スレッドごとに使い回す pipe の数。同時に待つファイバーがこれより多ければ、余った分は閉じる。
+    AUX_OFFLOAD_PIPES_KEEP = 16,
+};
 
+struct aux_offload_job
+{
+    void *(*func)(void *);
+    void *arg;
+    int wfd;                    // 完了を知らせる pipe の書き込み側
+    int done;
+    int refs;                   // 待つ側とワーカースレッドの参照。最後に手放した側が解放する
+    struct aux_offload_job *next;
+};
+
+static pthread_mutex_t aux_offload_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aux_offload_cond_work = PTHREAD_COND_INITIALIZER;    // ジョブの追加待ち (ワーカー)
+static pthread_cond_t aux_offload_cond_done = PTHREAD_COND_INITIALIZER;    // ジョブの完了待ち
+static struct aux_offload_job *aux_offload_head, *aux_offload_tail;
+static int aux_offload_queued;          // まだ取り出されていないジョブの数
+static int aux_offload_nthreads;
+static int aux_offload_idle;            // ジョブを待っているワーカーの数
+static int aux_offload_max = AUX_OFFLOAD_THREADS_DEFAULT;
+static ID id_thread_variable_get, id_thread_variable_set, id_offload_pipes;
 
-static VALUE
-aux_should_be_string(VALUE obj)
+/*
+ * aux_offload_mutex を獲得した状態で呼び出すこと。
+ */
+static void
+aux_offload_unref(struct aux_offload_job *job)
 {
-    rb_check_type(obj, RUBY_T_STRING);
-    return obj;
+    if (--job->refs == 0) { free(job); }
 }
 
-static int
-convert_namespace_int(VALUE namespace)
+static void *
+aux_offload_worker(void *arg)
 {
-    int n = NUM2INT(namespace);
-
-    if (n == EXTATTR_NAMESPACE_USER ||
-        n == EXTATTR_NAMESPACE_SYSTEM) {
-
-        return n;
+    (void)arg;
+    pthread_mutex_lock(&aux_offload_mutex);
+    for (;;) {
+        // しばらく仕事がないか、上限が下げられて多すぎる場合は終了する。
+        if (aux_offload_nthreads > aux_offload_max) { break; }
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += AUX_OFFLOAD_IDLE_SEC;
+        int status = 0;
+        aux_offload_idle++;
+        while (!aux_offload_head && status != ETIMEDOUT && aux_offload_nthreads <= aux_offload_max) {
+            status = pthread_cond_timedwait(&aux_offload_cond_work, &aux_offload_mutex, &deadline);
+        }
+        aux_offload_idle--;
+        if (!aux_offload_head) { break; }
+        struct aux_offload_job *job = aux_offload_head;
+        aux_offload_head = job->next;
+        if (!aux_offload_head) { aux_offload_tail = NULL; }
+        aux_offload_queued--;
+        pthread_mutex_unlock(&aux_offload_mutex);
+
+        job->func(job->arg);
+
+        pthread_mutex_lock(&aux_offload_mutex);
+        job->done = 1;
+        // 待っているファイバーに、終わったことを知らせる。
+        while (write(job->wfd, "", 1) < 0 && errno == EINTR) { }
+        pthread_cond_broadcast(&aux_offload_cond_done);
+        aux_offload_unref(job);
     }
+    aux_offload_nthreads--;
+    pthread_mutex_unlock(&aux_offload_mutex);
 
-    rb_raise(rb_eArgError,
-            "wrong namespace value - #<%s:%p>",
-            rb_obj_classname(namespace), (void *)namespace);
+    return NULL;
 }
 
+/*
+ * ジョブを追加する。ワーカースレッドがひとつもなく、作ることもできなければ 0 を返す。
+ */
 static int
-convert_namespace_str(VALUE namespace)
+aux_offload_enqueue(struct aux_offload_job *job)
 {
-    static const char ns_user[] = "user";
-    static const int ns_user_len = sizeof(ns_user) / sizeof(ns_user[0]) - 1;
-    static const char ns_system[] = "system";
-    static const int ns_system_len = sizeof(ns_system) / sizeof(ns_system[0]) - 1;
-
-    const char *p;
-    size_t len = aux_str_getmem(namespace, &p);
-
-    if (len == ns_user_len && aux_memcasecmp(p, ns_user, ns_user_len) == 0) {
-        return EXTATTR_NAMESPACE_USER;
-    } else if (len == ns_system_len && aux_memcasecmp(p, ns_system, ns_system_len) == 0) {
-        return EXTATTR_NAMESPACE_SYSTEM;
-    } else {
-        rb_raise(rb_eArgError,
-                "wrong namespace - %s (expected to user or system)",
-                StringValueCStr(namespace));
+    pthread_mutex_lock(&aux_offload_mutex);
+    if (aux_offload_queued >= aux_offload_idle && aux_offload_nthreads < aux_offload_max) {
+        // ワーカースレッドはシグナルを受け取らないようにする。
+        pthread_t thread;
+        sigset_t all, old;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+        int status = pthread_create(&thread, NULL, aux_offload_worker, NULL);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (status == 0) {
+            pthread_detach(thread);
+            aux_offload_nthreads++;
+        } else if (aux_offload_nthreads == 0) {
+            pthread_mutex_unlock(&aux_offload_mutex);
+            return 0;
+        }
     }
-}
 
-static int
-conv_namespace(VALUE namespace)
-{
-    if (NIL_P(namespace)) {
-        return EXTATTR_NAMESPACE_USER;
-    } else if (rb_obj_is_kind_of(namespace, rb_cNumeric)) {
-        return convert_namespace_int(namespace);
-    } else if (rb_obj_is_kind_of(namespace, rb_cString) ||
-               rb_obj_is_kind_of(namespace, rb_cSymbol)) {
-        return convert_namespace_str(rb_String(namespace));
+    job->next = NULL;
+    if (aux_offload_tail) {
+        aux_offload_tail->next = job;
     } else {
-        rb_raise(rb_eArgError,
-                "wrong namespace object - %p",
-                (void *)namespace);
+        aux_offload_head = job;
     }
+    aux_offload_tail = job;
+    aux_offload_queued++;
+    pthread_cond_signal(&aux_offload_cond_work);
+    pthread_mutex_unlock(&aux_offload_mutex);
+    return 1;
 }
 
-#if RUBY_API_VERSION_CODE >= 20700
-static void ext_check_file_security(VALUE file, VALUE name, VALUE data) { }
-static void ext_check_path_security(VALUE path, VALUE name, VALUE data) { }
-#else
-static void
-ext_check_file_security(VALUE file, VALUE name, VALUE data)
+static void *
+aux_offload_wait_done(void *arg)
 {
-    /*
-     * - file が汚染されていない場合、他のオブジェクトも汚染されていてはならない。
-     * - file が汚染されている場合、他のオブジェクトの汚染に左右されない。
-     * - $SAFE が4以上の場合、非汚染オブジェクトがあれば失敗する。
-     *
-     *      file name data | list    get     set     delete
-     *      -    -    -    | yes     yes     yes     yes
-     *      -    -    T    |                 no
-     *      -    T    -    |         no      no      no
-     *      -    T    T    |                 no
-     *      T    -    -    | yes     yes     yes     yes
-     *      T    -    T    |                 yes
-     *      T    T    -    |         yes     yes     yes
-     *      T    T    T    |                 yes
-     */
-
-    int safe = rb_safe_level();
-
-    // $SAFE < 1 であれば、常に成功する
-    if (safe < 1) {
-        return;
-    }
-
-    // 0 < $SAFE < 4 であれば、file が汚染されていれば常に成功、
-    // そうでなければ name と data は非汚染状態でなければならない
-    if (safe < 4) {
-        if (OBJ_TAINTED(file)) {
-            return;
-        }
-        if (OBJ_TAINTED(name) || OBJ_TAINTED(data)) {
-            rb_insecure_operation();
-        }
-        return;
-    }
-
-    // $SAFE は 4以上。すべてのオブジェクトが汚染されていなければならない
-    if (!OBJ_TAINTED(file) ||
-        (!NIL_P(name) && !OBJ_TAINTED(name)) ||
-        (!NIL_P(data) && !OBJ_TAINTED(data))) {
-
-        rb_insecure_operation();
+    struct aux_offload_job *job = (struct aux_offload_job *)arg;
+    pthread_mutex_lock(&aux_offload_mutex);
+    while (!job->done) {
+        pthread_cond_wait(&aux_offload_cond_done, &aux_offload_mutex);
     }
+    pthread_mutex_unlock(&aux_offload_mutex);
+    return NULL;
 }
 
+/*
+ * fork した子プロセスにワーカースレッドは引き継がれないため、最初からやり直す。
+ */
 static void
-ext_check_path_security(VALUE path, VALUE name, VALUE data)
+aux_offload_atfork_child(void)
 {
-    /*
-     * - すべてのオブジェクトが汚染されていない状態でなければならない。
-     * - $SAFE が4以上の場合、常に失敗する。
-     *
-     *      path name data | list    get     set     delete
-     *      -    -    -    | yes     yes     yes     yes
-     *      -    -    T    |                 no
-     *      -    T    -    |         no      no      no
-     *      -    T    T    |                 no
-     *      T    -    -    | no      no      no      no
-     *      T    -    T    |                 no
-     *      T    T    -    |         no      no      no
-     *      T    T    T    |                 no
-     */
-
-    int safe = rb_safe_level();
-    if (safe < 1) { return; }
-    if (safe < 4) {
-        if (OBJ_TAINTED(path) || OBJ_TAINTED(name) || OBJ_TAINTED(data)) {
-            rb_insecure_operation();
-        }
-    } else {
-        rb_insecure_operation();
-    }
+    pthread_mutex_init(&aux_offload_mutex, NULL);
+    pthread_cond_init(&aux_offload_cond_work, NULL);
+    pthread_cond_init(&aux_offload_cond_done, NULL);
+    aux_offload_head = aux_offload_tail = NULL;
+    aux_offload_queued = aux_offload_nthreads = aux_offload_idle = 0;
 }
-#endif
-
 
 /*
  * call-seq:
- *  list(path, namespace) -> names array
- *  list(path, namespace) { |name| ... } -> nil
+ *  offload_threads -> integer
+ *
+ * ファイバースケジューラが有効な時に、拡張属性のシステムコールを呼び出すワーカースレッドの数の上限を返します。
  */
 static VALUE
-ext_s_list(VALUE mod, VALUE path, VALUE namespace)
+ext_s_offload_threads(VALUE mod)
 {
-    if (rb_obj_is_kind_of(path, rb_cFile)) {
-        ext_check_file_security(path, Qnil, Qnil);
-        return file_extattr_list_main(path, file2fd(path),
-                conv_namespace(namespace));
-    } else {
-        ext_check_path_security(path, Qnil, Qnil);
-        return file_s_extattr_list_main(aux_to_path(path),
-                conv_namespace(namespace));
-    }
+    pthread_mutex_lock(&aux_offload_mutex);
+    int max = aux_offload_max;
+    pthread_mutex_unlock(&aux_offload_mutex);
+    return INT2NUM(max);
 }
 
 /*
  * call-seq:
- *  extattr_list!(path, namespace) -> names array
- *  extattr_list!(path, namespace) { |name| ... } -> nil
+ *  offload_threads = integer
+ *
+ * ワーカースレッドの数の上限を設定します (既定値は 64)。
+ *
+ * ワーカースレッドは待っているファイバーの数に応じて上限まで増やし、しばらく使われなかったものは終了させます。
+ * 遅いファイルシステムで多くのファイバーから同時に呼び出す場合は、その数に合わせて大きくして下さい。
  */
 static VALUE
-ext_s_list_link(VALUE mod, VALUE path, VALUE namespace)
+ext_s_set_offload_threads(VALUE mod, VALUE num)
 {
-    if (rb_obj_is_kind_of(path, rb_cFile)) {
-        ext_check_file_security(path, Qnil, Qnil);
-        return file_extattr_list_main(path, file2fd(path),
-                conv_namespace(namespace));
-    } else {
-        ext_check_path_security(path, Qnil, Qnil);
-        return file_s_extattr_list_link_main(aux_to_path(path),
-                conv_namespace(namespace));
+    int max = NUM2INT(num);
+    if (max < 1 || max > AUX_OFFLOAD_THREADS_LIMIT) {
+        rb_raise(rb_eArgError, "wrong number of threads - %d (expected 1..%d)",
+                 max, AUX_OFFLOAD_THREADS_LIMIT);
     }
+
+    pthread_mutex_lock(&aux_offload_mutex);
+    aux_offload_max = max;
+    // 上限を超えた分の待っているワーカーを終了させる。
+    pthread_cond_broadcast(&aux_offload_cond_work);
+    pthread_mutex_unlock(&aux_offload_mutex);
+    return num;
 }
 
+static void
+aux_offload_init(void)
+{
+    id_thread_variable_get = rb_intern("thread_variable_get");
+    id_thread_variable_set = rb_intern("thread_variable_set");
+    id_offload_pipes = rb_intern("extattr.offload_pipes");
+    pthread_atfork(NULL, NULL, aux_offload_atfork_child);
+
+    rb_define_singleton_method(mExtAttr, "offload_threads", RUBY_METHOD_FUNC(ext_s_offload_threads), 0);
+    rb_define_singleton_method(mExtAttr, "offload_threads=", RUBY_METHOD_FUNC(ext_s_set_offload_threads), 1);
+}
 
-/*
- * call-seq:
- *  size(path, namespace, name) -> size
- */
 static VALUE
-ext_s_size(VALUE mod, VALUE path, VALUE namespace, VALUE name)
+aux_offload_fdopen(VALUE arg)
 {
-    if (rb_obj_is_kind_of(path, rb_cFile)) {
-        ext_check_file_security(path, name, Qnil);
-        return file_extattr_size_main(path, file2fd(path), conv_namespace(namespace),
-                aux_should_be_string(name));
+    int *fds = (int *)arg;
+    VALUE r = rb_io_fdopen(fds[0], O_RDONLY, NULL);
+    fds[0] = -1;
+    VALUE w = rb_io_fdopen(fds[1], O_WRONLY, NULL);
+    fds[1] = -1;
+    return rb_assoc_new(r, w);
+}
+
+static void
+aux_offload_pipe_release(VALUE pool, VALUE pair)
+{
+    if (RARRAY_LEN(pool) < AUX_OFFLOAD_PIPES_KEEP) {
+        rb_ary_push(pool, pair);
     } else {
-        ext_check_path_security(path, name, Qnil);
-        return file_s_extattr_size_main(aux_to_path(path), conv_namespace(namespace),
-                aux_should_be_string(name));
+        rb_io_close(RARRAY_AREF(pair, 0));
+        rb_io_close(RARRAY_AREF(pair, 1));
     }
 }
 
 /*
- * call-seq:
- *  size!(path, namespace, name) -> size
+ * 現在のスレッドで使い回している pipe の組 [読み込み側, 書き込み側] を取り出す。
+ * なければ新しく作る。作れなければ nil を返す。
  */
 static VALUE
-ext_s_size_link(VALUE mod, VALUE path, VALUE namespace, VALUE name)
+aux_offload_pipe_acquire(VALUE *pool)
 {
-    if (rb_obj_is_kind_of(path, rb_cFile)) {
-        ext_check_file_security(path, name, Qnil);
-        return file_extattr_size_main(path, file2fd(path), conv_namespace(namespace),
-                aux_should_be_string(name));
-    } else {
-        ext_check_path_security(path, name, Qnil);
-        return file_s_extattr_size_link_main(aux_to_path(path), conv_namespace(namespace),
-                aux_should_be_string(name));
+    VALUE thread = rb_thread_current();
+    VALUE args[2] = { ID2SYM(id_offload_pipes), Qnil };
+    *pool = rb_funcall2(thread, id_thread_variable_get, 1, args);
+    if (NIL_P(*pool)) {
+        *pool = args[1] = rb_ary_new();
+        rb_funcall2(thread, id_thread_variable_set, 2, args);
     }
+
+    VALUE pair = rb_ary_pop(*pool);
+    if (!NIL_P(pair)) { return pair; }
+
+    int fds[2];
+    if (pipe(fds) < 0) { return Qnil; }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    int state;
+    pair = rb_protect(aux_offload_fdopen, (VALUE)fds, &state);
+    if (state) {
+        if (fds[0] >= 0) { close(fds[0]); }
+        if (fds[1] >= 0) { close(fds[1]); }
+        rb_jump_tag(state);
+    }
+
+    return pair;
 }
 
+struct aux_offload
+{
+    struct aux_offload_job *job;
+    rb_unblock_function_t *ubf;
+    void *ubfarg;
+    VALUE scheduler;
+    VALUE io;                   // pipe の読み込み側
+    int finished;
+};
 
-/*
- * call-seq:
- *  get(path, namespace, name) -> data
- */
 static VALUE
-ext_s_get(VALUE mod, VALUE path, VALUE namespace, VALUE name)
+aux_offload_wait(VALUE arg)
 {
-    VALUE v;
-    if (rb_obj_is_kind_of(path, rb_cFile)) {
-        ext_check_file_security(path, name, Qnil);
-        v = file_extattr_get_main(path, file2fd(path), conv_namespace(namespace),
-                aux_should_be_string(name));
-    } else {
-        ext_check_path_security(path, name, Qnil);
-        v = file_s_extattr_get_main(aux_to_path(path), conv_namespace(namespace),
-                aux_should_be_string(name));
+    struct aux_offload *p = (struct aux_offload *)arg;
+    int rfd = rb_io_descriptor(p->io);
+    for (;;) {
+        char c;
+        if (read(rfd, &c, 1) == 1) { break; }
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) { rb_sys_fail("read"); }
+        rb_fiber_scheduler_io_wait_readable(p->scheduler, p->io);
     }
-
-    rb_obj_infect(v, path);
-    return v;
+    p->finished = 1;
+    return Qnil;
 }
 
-/*
- * call-seq:
- *  get!(path, namespace, name) -> data
- */
 static VALUE
-ext_s_get_link(VALUE mod, VALUE path, VALUE namespace, VALUE name)
+aux_offload_cleanup(VALUE arg)
 {
-    VALUE v;
-    if (rb_obj_is_kind_of(path, rb_cFile)) {
-        ext_check_file_security(path, name, Qnil);
-        v = file_extattr_get_main(path, file2fd(path), conv_namespace(namespace),
-                aux_should_be_string(name));
-    } else {
-        ext_check_path_security(path, name, Qnil);
-        v = file_s_extattr_get_link_main(aux_to_path(path), conv_namespace(namespace),
-                aux_should_be_string(name));
+    struct aux_offload *p = (struct aux_offload *)arg;
+
+    // 例外などでファイバーが待つのを止めた場合でも、ワーカースレッドは呼び出し元の arg を使っているので、
+    // 中断を求めたうえで、もう一度スケジューラを通して終わるまで待つ。
+    // それもできなければ (ファイバーが終了させられているなど)、GVL を解放して待つ。
+    if (!p->finished) {
+        int state;
+        if (p->ubf) { p->ubf(p->ubfarg); }
+        rb_protect(aux_offload_wait, arg, &state);
+        if (state) {
+            rb_set_errinfo(Qnil);
+            rb_thread_call_without_gvl(aux_offload_wait_done, p->job, NULL, NULL);
+        }
     }
 
-    rb_obj_infect(v, path);
-    return v;
+    pthread_mutex_lock(&aux_offload_mutex);
+    aux_offload_unref(p->job);
+    pthread_mutex_unlock(&aux_offload_mutex);
+    return Qnil;
 }
 
-
 /*
- * call-seq:
- *  set(path, namespace, name, data) -> nil
+ * func(arg) をワーカースレッドで呼び出して、終わるまで現在のファイバーを scheduler に譲る。
+ *
+ * ワーカースレッドか pipe を用意できなかった場合は 0 を返すので、呼び出し側は通常の方法で呼び出すこと。
  */
-static VALUE
-ext_s_set(VALUE mod, VALUE path, VALUE namespace, VALUE name, VALUE data)
+static int
+aux_offload(VALUE scheduler, void *(*func)(void *), void *arg, rb_unblock_function_t *ubf, void *ubfarg)
 {
-    if (rb_obj_is_kind_of(path, rb_cFile)) {
-        ext_check_file_security(path, name, Qnil);
-        return file_extattr_set_main(path, file2fd(path),
-                conv_namespace(namespace),
-                aux_should_be_string(name), aux_should_be_string(data));
-    } else {
-        ext_check_path_security(path, name, Qnil);
-        return file_s_extattr_set_main(aux_to_path(path),
-                conv_namespace(namespace),
-                aux_should_be_string(name), aux_should_be_string(data));
+#ifdef HAVE_RB_FIBER_SCHEDULER_BLOCKING_OPERATION_WAIT
+    struct rb_fiber_scheduler_blocking_operation_state state = { 0 };
+    VALUE r = rb_fiber_scheduler_blocking_operation_wait(scheduler, func, arg, ubf, ubfarg,
+                                                         RB_NOGVL_UBF_ASYNC_SAFE, &state);
+    if (r != Qundef) { return 1; }
+#endif
+
+    // IO はワーカースレッドに渡す前に用意しておく。
+    VALUE pool;
+    VALUE pair = aux_offload_pipe_acquire(&pool);
+    if (NIL_P(pair)) { return 0; }
+
+    struct aux_offload_job *job = (struct aux_offload_job *)malloc(sizeof(*job));
+    if (!job) {
+        aux_offload_pipe_release(pool, pair);
+        return 0;
+    }
+    job->func = func;
+    job->arg = arg;
+    job->wfd = rb_io_descriptor(RARRAY_AREF(pair, 1));
+    job->done = 0;
+    job->refs = 2;
+    if (!aux_offload_enqueue(job)) {
+        free(job);
+        aux_offload_pipe_release(pool, pair);
+        return 0;
     }
+
+    struct aux_offload p = { job, ubf, ubfarg, scheduler, RARRAY_AREF(pair, 0), 0 };
+    rb_ensure(aux_offload_wait, (VALUE)&p, aux_offload_cleanup, (VALUE)&p);
+
+    // 通知は 1 バイトだけなので、読み終えていれば pipe は空になっている。
+    aux_offload_pipe_release(pool, pair);
+    RB_GC_GUARD(pair);
+    RB_GC_GUARD(pool);
+    return 1;
 }
+#else
+static void aux_offload_init(void) { }
+#endif
 
 /*
- * call-seq:
- *  set!(path, namespace, name, data) -> nil
+ * GVL を解放して func(arg) を呼び出す。
+ *
+ * NFS や FUSE などではシステムコールがしばらく戻らないことがあるため、
+ * その間に他のスレッドが止まらないように、拡張属性のシステムコールはこれを経由させる。
+ *
+ * ファイバースケジューラが有効な場合は、ワーカースレッドで呼び出して他のファイバーに処理を譲る。
  */
-static VALUE
-ext_s_set_link(VALUE mod, VALUE path, VALUE namespace, VALUE name, VALUE data)
+static void
+aux_blocking_call(void *(*func)(void *), void *arg)
 {
-    if (rb_obj_is_kind_of(path, rb_cFile)) {
-        ext_check_file_security(path, name, Qnil);
-        return file_extattr_set_main(path, file2fd(path),
-                conv_namespace(namespace),
-                aux_should_be_string(name), aux_should_be_string(data));
-    } else {
-        ext_check_path_security(path, name, Qnil);
-        return file_s_extattr_set_link_main(aux_to_path(path),
-                conv_namespace(namespace),
-                aux_should_be_string(name), aux_should_be_string(data));
-    }
+#ifdef EXTATTR_FIBER_SCHEDULER
+    VALUE scheduler = rb_fiber_scheduler_current();
+    if (!NIL_P(scheduler) && aux_offload(scheduler, func, arg, NULL, NULL)) { return; }
+#endif
+    rb_thread_call_without_gvl(func, arg, RUBY_UBF_IO, NULL);
 }
 
+static void
+aux_cancel(void *cancel)
+{
+    *(volatile int *)cancel = 1;
+}
 
 /*
- * call-seq:
- *  delete(path, namespace, name) -> nil
+ * 複数のシステムコールをまとめて行う func(arg) を、GVL を解放して呼び出す。
+ *
+ * 割り込みがあると *cancel に 1 が設定されるので、func はそれを確認して速やかに戻ること。
+ * 割り込みによって例外が発生しなかった場合は aux_blocking_call_cancelable から戻るので、
+ * 呼び出し側は *cancel を 0 に戻してから、残りの処理を継続する必要がある。
  */
-static VALUE
-ext_s_delete(VALUE mod, VALUE path, VALUE namespace, VALUE name)
+static void
+aux_blocking_call_cancelable(void *(*func)(void *), void *arg, volatile int *cancel)
 {
-    if (rb_obj_is_kind_of(path, rb_cFile)) {
+#ifdef EXTATTR_FIBER_SCHEDULER
+    VALUE scheduler = rb_fiber_scheduler_current();
+    if (!NIL_P(scheduler) && aux_offload(scheduler, func, arg, aux_cancel, (void *)cancel)) { return; }
+#endif
+    rb_thread_call_without_gvl(func, arg, aux_cancel, (void *)cancel);
+}
+
+
+/*
+ * スレッドごとに保持する、システムコールの出力を受け取るための作業領域。
+ *
+ * 拡張属性の一覧などは ruby のオブジェクトにする前の一時的なものなので、
+ * 呼び出しのたびに確保と解放を繰り返さずに、ネイティブスレッドごとに使い回す。
+ * スレッドごとに持つため、Ractor をまたいで共有されることはない。
+ *
+ * ブロックの中や他のファイバーから再び要求されるなど、使用中の場合は
+ * aux_scratch_acquire が NULL を返すので、呼び出し側で別に確保すること。
+ */
+struct aux_scratch
+{
+    char *ptr;
+    size_t capa;
+    int busy;
+};
+
+enum {
+    // 解放時にこれより大きな作業領域は手放して、メモリを抱え込まないようにする。
+    AUX_SCRATCH_KEEP_MAX = 1 << 20,
+};
+
+#if HAVE_PTHREAD_H
+static pthread_key_t aux_scratch_key;
+static int aux_scratch_ready;
+
+static void
+aux_scratch_destroy(void *ptr)
+{
+    struct aux_scratch *s = (struct aux_scratch *)ptr;
+    free(s->ptr);
+    free(s);
+}
+
+static void
+aux_scratch_init(void)
+{
+    aux_scratch_ready = (pthread_key_create(&aux_scratch_key, aux_scratch_destroy) == 0);
+}
+
+static struct aux_scratch *
+aux_scratch_acquire(void)
+{
+    if (!aux_scratch_ready) { return NULL; }
+
+    struct aux_scratch *s = (struct aux_scratch *)pthread_getspecific(aux_scratch_key);
+    if (!s) {
+        s = (struct aux_scratch *)calloc(1, sizeof(*s));
+        if (!s) { return NULL; }
+        if (pthread_setspecific(aux_scratch_key, s) != 0) {
+            free(s);
+            return NULL;
+        }
+    }
+    if (s->busy) { return NULL; }
+    s->busy = 1;
+
+    return s;
+}
+#else
+static void aux_scratch_init(void) { }
+static struct aux_scratch *aux_scratch_acquire(void) { return NULL; }
+#endif
+
+/*
+ * 作業領域を size バイト以上に広げる。
+ *
+ * 確保できなければ NULL を返す。GVL を解放した状態からも呼び出される。
+ */
+static void *
+aux_scratch_reserve(struct aux_scratch *s, size_t size)
+{
+    if (s->capa < size) {
+        size_t capa = (s->capa > 0 ? s->capa : 4096);
+        while (capa < size) { capa *= 2; }
+        char *ptr = (char *)realloc(s->ptr, capa);
+        if (!ptr) { return NULL; }
+        s->ptr = ptr;
+        s->capa = capa;
+    }
+
+    return s->ptr;
+}
+
+static void
+aux_scratch_release(struct aux_scratch *s)
+{
+    if (s->capa > AUX_SCRATCH_KEEP_MAX) {
+        free(s->ptr);
+        s->ptr = NULL;
+        s->capa = 0;
+    }
+    s->busy = 0;
+}
+
+
+/*
+ * get_into などで、値を書き込む先となる String または IO::Buffer。
+ *
+ * String の場合は長さを値の大きさに合わせ、容量が足りなければ広げる。
+ * IO::Buffer の場合は先頭から書き込み、大きさが足りなければ広げる。
+ */
+struct aux_outbuf
+{
+    VALUE buf;
+    int iobuf;
+    int locked;
+};
+
+static void
+aux_outbuf_init(struct aux_outbuf *o, VALUE buf)
+{
+    o->buf = buf;
+    o->locked = 0;
+#ifdef EXTATTR_IO_BUFFER
+    if (rb_obj_is_kind_of(buf, rb_cIOBuffer)) {
+        o->iobuf = 1;
+        return;
+    }
+#endif
+    o->iobuf = 0;
+    rb_check_type(buf, RUBY_T_STRING);
+    rb_str_modify(buf);
+}
+
+/*
+ * 書き込める領域とその大きさを返す。
+ */
+static char *
+aux_outbuf_ptr(struct aux_outbuf *o, size_t *capa)
+{
+#ifdef EXTATTR_IO_BUFFER
+    if (o->iobuf) {
+        void *ptr;
+        rb_io_buffer_get_bytes_for_writing(o->buf, &ptr, capa);
+        return (char *)ptr;
+    }
+#endif
+    rb_str_modify(o->buf);
+    *capa = rb_str_capacity(o->buf);
+    return RSTRING_PTR(o->buf);
+}
+
+/*
+ * size バイト以上を書き込めるようにする。
+ */
+static void
+aux_outbuf_reserve(struct aux_outbuf *o, size_t size)
+{
+#ifdef EXTATTR_IO_BUFFER
+    if (o->iobuf) {
+        size_t capa;
+        aux_outbuf_ptr(o, &capa);
+        if (capa < size) { rb_io_buffer_resize(o->buf, size); }
+        return;
+    }
+#endif
+    if (rb_str_capacity(o->buf) < size) {
+        rb_str_set_len(o->buf, 0);
+        rb_str_modify_expand(o->buf, size);
+    }
+}
+
+/*
+ * GVL を解放して書き込む間、他のスレッドから変更されないようにする。
+ */
+static void
+aux_outbuf_lock(struct aux_outbuf *o)
+{
+#ifdef EXTATTR_IO_BUFFER
+    if (o->iobuf) {
+        rb_io_buffer_lock(o->buf);
+        o->locked = 1;
+        return;
+    }
+#endif
+    rb_str_locktmp(o->buf);
+    o->locked = 1;
+}
+
+static void
+aux_outbuf_unlock(struct aux_outbuf *o)
+{
+    if (!o->locked) { return; }
+    o->locked = 0;
+#ifdef EXTATTR_IO_BUFFER
+    if (o->iobuf) {
+        rb_io_buffer_unlock(o->buf);
+        return;
+    }
+#endif
+    rb_str_unlocktmp(o->buf);
+}
+
+/*
+ * size バイトを書き込み終えた。String であれば長さを合わせて、バイナリ文字列とする。
+ */
+static void
+aux_outbuf_finish(struct aux_outbuf *o, size_t size)
+{
+    if (o->iobuf) { return; }
+    rb_str_set_len(o->buf, size);
+    rb_enc_associate_index(o->buf, rb_ascii8bit_encindex());
+}
+
+/*
+ * ptr から size バイトを書き込む。
+ */
+static void
+aux_outbuf_write(struct aux_outbuf *o, const void *ptr, size_t size)
+{
+    aux_outbuf_reserve(o, size);
+    size_t capa;
+    memcpy(aux_outbuf_ptr(o, &capa), ptr, size);
+    aux_outbuf_finish(o, size);
+}
+
+
+static VALUE
+aux_should_be_string(VALUE obj)
+{
+    rb_check_type(obj, RUBY_T_STRING);
+    return obj;
+}
+
+/*
+ * aux_should_be_name で受け付けた拡張属性名を文字列にする。
+ *
+ * Symbol の場合はそれが持つ文字列を返すため、新たな確保はない。
+ */
+static VALUE
+aux_name_string(VALUE name)
+{
+    return SYMBOL_P(name) ? rb_sym2str(name) : name;
+}
+
+
+#if defined(HAVE_SYS_EXTATTR_H)
+#   include "extattr-extattr.h"
+#elif defined(HAVE_WINNT_H)
+#   include "extattr-windows.h"
+#elif defined(HAVE_ATTR_XATTR_H) || defined(HAVE_SYS_XATTR_H)
+#   include "extattr-xattr.h"
+#else
+#   error ruby-extattr not supported on your system
+#endif
+
+
+/*
+ * 拡張属性名として String か Symbol を受け付ける。
+ *
+ * 環境ごとの実装が Symbol をそのまま扱えない (EXTATTR_HAVE_SYMBOL_NAME がない) 場合は、文字列にして返す。
+ */
+static VALUE
+aux_should_be_name(VALUE obj)
+{
+    if (SYMBOL_P(obj)) {
+#ifdef EXTATTR_HAVE_SYMBOL_NAME
+        return obj;
+#else
+        return aux_name_string(obj);
+#endif
+    }
+    if (!RB_TYPE_P(obj, RUBY_T_STRING)) {
+        rb_raise(rb_eTypeError,
+                 "wrong argument type %"PRIsVALUE" (expected String or Symbol)",
+                 rb_obj_class(obj));
+    }
+
+    return obj;
+}
+
+
+/*
+ * 名前空間の名前と値。ID は Init_extattr で設定する。
+ */
+static struct namespace_entry
+{
+    const char *name;
+    size_t len;
+    int namespace1;
+    ID id;
+} namespace_table[] = {
+    { "user", 4, EXTATTR_NAMESPACE_USER },
+    { "system", 6, EXTATTR_NAMESPACE_SYSTEM },
+#ifdef EXTATTR_HAVE_TRUSTED_SECURITY
+    { "trusted", 7, EXTATTR_NAMESPACE_TRUSTED },
+    { "security", 8, EXTATTR_NAMESPACE_SECURITY },
+#endif
+};
+
+#ifdef EXTATTR_HAVE_LIST_ALL
+static ID id_all;
+#endif
+
+/*
+ * 名前空間の値を、それを表すシンボルにする。
+ */
+static VALUE
+aux_namespace_symbol(int namespace1)
+{
+    for (size_t i = 0; i < ELEMENTOF(namespace_table); i++) {
+        if (namespace_table[i].namespace1 == namespace1) { return ID2SYM(namespace_table[i].id); }
+    }
+
+    return INT2NUM(namespace1);
+}
+
+static int
+convert_namespace_int(VALUE namespace)
+{
+    int n = NUM2INT(namespace);
+
+    for (size_t i = 0; i < ELEMENTOF(namespace_table); i++) {
+        if (namespace_table[i].namespace1 == n) { return n; }
+    }
+
+    rb_raise(rb_eArgError,
+            "wrong namespace value - #<%s:%p>",
+            rb_obj_classname(namespace), (void *)namespace);
+}
+
+static int
+convert_namespace_str(VALUE namespace)
+{
+    const char *p;
+    size_t len = aux_str_getmem(namespace, &p);
+
+    for (size_t i = 0; i < ELEMENTOF(namespace_table); i++) {
+        const struct namespace_entry *e = &namespace_table[i];
+        if (len == e->len && aux_memcasecmp(p, e->name, e->len) == 0) {
+            return e->namespace1;
+        }
+    }
+
+    rb_raise(rb_eArgError,
+            "wrong namespace - %s (expected to %s)",
+            StringValueCStr(namespace),
+#ifdef EXTATTR_HAVE_TRUSTED_SECURITY
+            "user, system, trusted or security"
+#else
+            "user or system"
+#endif
+            );
+}
+
+static int
+conv_namespace(VALUE namespace)
+{
+    if (SYMBOL_P(namespace)) {
+        // 動的なシンボルは ID を得ると解放されなくなるため、静的なシンボルに限って比較する。
+        if (STATIC_SYM_P(namespace)) {
+            ID id = SYM2ID(namespace);
+            for (size_t i = 0; i < ELEMENTOF(namespace_table); i++) {
+                if (namespace_table[i].id == id) { return namespace_table[i].namespace1; }
+            }
+        }
+        // :USER など、大文字小文字の異なるものは文字列として比較する。
+        // Symbol#to_s と異なり、rb_sym2str は新たな文字列を確保しない。
+        return convert_namespace_str(rb_sym2str(namespace));
+    } else if (NIL_P(namespace)) {
+        return EXTATTR_NAMESPACE_USER;
+    } else if (FIXNUM_P(namespace) || rb_obj_is_kind_of(namespace, rb_cNumeric)) {
+        return convert_namespace_int(namespace);
+    } else if (RB_TYPE_P(namespace, RUBY_T_STRING)) {
+        return convert_namespace_str(namespace);
+    } else {
+        rb_raise(rb_eArgError,
+                "wrong namespace object - %p",
+                (void *)namespace);
+    }
+}
+
+/*
+ * 一覧の取得に与えられた名前空間を変換する。
+ *
+ * 実装が対応していれば、全ての名前空間を表す ExtAttr::ALL (:all) も受け付ける。
+ */
+static int
+conv_namespace_list(VALUE namespace)
+{
+#ifdef EXTATTR_HAVE_LIST_ALL
+    if (SYMBOL_P(namespace) && STATIC_SYM_P(namespace) && SYM2ID(namespace) == id_all) {
+        return EXTATTR_NAMESPACE_ALL;
+    } else if (SYMBOL_P(namespace) || RB_TYPE_P(namespace, RUBY_T_STRING)) {
+        const char *p;
+        size_t len = aux_str_getmem(aux_name_string(namespace), &p);
+        if (len == 3 && aux_memcasecmp(p, "all", 3) == 0) { return EXTATTR_NAMESPACE_ALL; }
+    }
+#endif
+
+    return conv_namespace(namespace);
+}
+
+#if RUBY_API_VERSION_CODE >= 20700
+static void ext_check_file_security(VALUE file, VALUE name, VALUE data) { }
+static void ext_check_path_security(VALUE path, VALUE name, VALUE data) { }
+#else
+static void
+ext_check_file_security(VALUE file, VALUE name, VALUE data)
+{
+    /*
+     * - file が汚染されていない場合、他のオブジェクトも汚染されていてはならない。
+     * - file が汚染されている場合、他のオブジェクトの汚染に左右されない。
+     * - $SAFE が4以上の場合、非汚染オブジェクトがあれば失敗する。
+     *
+     *      file name data | list    get     set     delete
+     *      -    -    -    | yes     yes     yes     yes
+     *      -    -    T    |                 no
+     *      -    T    -    |         no      no      no
+     *      -    T    T    |                 no
+     *      T    -    -    | yes     yes     yes     yes
+     *      T    -    T    |                 yes
+     *      T    T    -    |         yes     yes     yes
+     *      T    T    T    |                 yes
+     */
+
+    int safe = rb_safe_level();
+
+    // $SAFE < 1 であれば、常に成功する
+    if (safe < 1) {
+        return;
+    }
+
+    // 0 < $SAFE < 4 であれば、file が汚染されていれば常に成功、
+    // そうでなければ name と data は非汚染状態でなければならない
+    if (safe < 4) {
+        if (OBJ_TAINTED(file)) {
+            return;
+        }
+        if (OBJ_TAINTED(name) || OBJ_TAINTED(data)) {
+            rb_insecure_operation();
+        }
+        return;
+    }
+
+    // $SAFE は 4以上。すべてのオブジェクトが汚染されていなければならない
+    if (!OBJ_TAINTED(file) ||
+        (!NIL_P(name) && !OBJ_TAINTED(name)) ||
+        (!NIL_P(data) && !OBJ_TAINTED(data))) {
+
+        rb_insecure_operation();
+    }
+}
+
+static void
+ext_check_path_security(VALUE path, VALUE name, VALUE data)
+{
+    /*
+     * - すべてのオブジェクトが汚染されていない状態でなければならない。
+     * - $SAFE が4以上の場合、常に失敗する。
+     *
+     *      path name data | list    get     set     delete
+     *      -    -    -    | yes     yes     yes     yes
+     *      -    -    T    |                 no
+     *      -    T    -    |         no      no      no
+     *      -    T    T    |                 no
+     *      T    -    -    | no      no      no      no
+     *      T    -    T    |                 no
+     *      T    T    -    |         no      no      no
+     *      T    T    T    |                 no
+     */
+
+    int safe = rb_safe_level();
+    if (safe < 1) { return; }
+    if (safe < 4) {
+        if (OBJ_TAINTED(path) || OBJ_TAINTED(name) || OBJ_TAINTED(data)) {
+            rb_insecure_operation();
+        }
+    } else {
+        rb_insecure_operation();
+    }
+}
+#endif
+
+
+/*
+ * call-seq:
+ *  list(path, namespace) -> names array
+ *  list(path, namespace) { |name| ... } -> nil
+ *  list(path, ExtAttr::ALL) -> array of [namespace, name]
+ *  list(path, ExtAttr::ALL) { |namespace, name| ... } -> nil
+ *
+ * namespace に ExtAttr::ALL を与えると、全ての名前空間の拡張属性を
+ * 名前空間のシンボルと名前の組として返します (xattr のみ)。
+ */
+static VALUE
+ext_s_list(VALUE mod, VALUE path, VALUE namespace)
+{
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, Qnil, Qnil);
+        return file_extattr_list_main(path, file2fd(path),
+                conv_namespace_list(namespace));
+    } else {
+        ext_check_path_security(path, Qnil, Qnil);
+        return file_s_extattr_list_main(aux_to_path(path),
+                conv_namespace_list(namespace));
+    }
+}
+
+/*
+ * call-seq:
+ *  extattr_list!(path, namespace) -> names array
+ *  extattr_list!(path, namespace) { |name| ... } -> nil
+ */
+static VALUE
+ext_s_list_link(VALUE mod, VALUE path, VALUE namespace)
+{
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, Qnil, Qnil);
+        return file_extattr_list_main(path, file2fd(path),
+                conv_namespace_list(namespace));
+    } else {
+        ext_check_path_security(path, Qnil, Qnil);
+        return file_s_extattr_list_link_main(aux_to_path(path),
+                conv_namespace_list(namespace));
+    }
+}
+
+
+/*
+ * call-seq:
+ *  size(path, namespace, name) -> size
+ */
+static VALUE
+ext_s_size(VALUE mod, VALUE path, VALUE namespace, VALUE name)
+{
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, name, Qnil);
+        return file_extattr_size_main(path, file2fd(path), conv_namespace(namespace),
+                aux_should_be_name(name));
+    } else {
+        ext_check_path_security(path, name, Qnil);
+        return file_s_extattr_size_main(aux_to_path(path), conv_namespace(namespace),
+                aux_should_be_name(name));
+    }
+}
+
+/*
+ * call-seq:
+ *  size!(path, namespace, name) -> size
+ */
+static VALUE
+ext_s_size_link(VALUE mod, VALUE path, VALUE namespace, VALUE name)
+{
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, name, Qnil);
+        return file_extattr_size_main(path, file2fd(path), conv_namespace(namespace),
+                aux_should_be_name(name));
+    } else {
+        ext_check_path_security(path, name, Qnil);
+        return file_s_extattr_size_link_main(aux_to_path(path), conv_namespace(namespace),
+                aux_should_be_name(name));
+    }
+}
+
+
+/*
+ * call-seq:
+ *  get(path, namespace, name) -> data
+ */
+static VALUE
+ext_s_get(VALUE mod, VALUE path, VALUE namespace, VALUE name)
+{
+    VALUE v;
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, name, Qnil);
+        v = file_extattr_get_main(path, file2fd(path), conv_namespace(namespace),
+                aux_should_be_name(name));
+    } else {
+        ext_check_path_security(path, name, Qnil);
+        v = file_s_extattr_get_main(aux_to_path(path), conv_namespace(namespace),
+                aux_should_be_name(name));
+    }
+
+    rb_obj_infect(v, path);
+    return v;
+}
+
+/*
+ * call-seq:
+ *  get!(path, namespace, name) -> data
+ */
+static VALUE
+ext_s_get_link(VALUE mod, VALUE path, VALUE namespace, VALUE name)
+{
+    VALUE v;
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, name, Qnil);
+        v = file_extattr_get_main(path, file2fd(path), conv_namespace(namespace),
+                aux_should_be_name(name));
+    } else {
+        ext_check_path_security(path, name, Qnil);
+        v = file_s_extattr_get_link_main(aux_to_path(path), conv_namespace(namespace),
+                aux_should_be_name(name));
+    }
+
+    rb_obj_infect(v, path);
+    return v;
+}
+
+
+/*
+ * call-seq:
+ *  set(path, namespace, name, data) -> nil
+ */
+static VALUE
+ext_s_set(VALUE mod, VALUE path, VALUE namespace, VALUE name, VALUE data)
+{
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, name, Qnil);
+        return file_extattr_set_main(path, file2fd(path),
+                conv_namespace(namespace),
+                aux_should_be_name(name), aux_should_be_string(data));
+    } else {
+        ext_check_path_security(path, name, Qnil);
+        return file_s_extattr_set_main(aux_to_path(path),
+                conv_namespace(namespace),
+                aux_should_be_name(name), aux_should_be_string(data));
+    }
+}
+
+/*
+ * call-seq:
+ *  set!(path, namespace, name, data) -> nil
+ */
+static VALUE
+ext_s_set_link(VALUE mod, VALUE path, VALUE namespace, VALUE name, VALUE data)
+{
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, name, Qnil);
+        return file_extattr_set_main(path, file2fd(path),
+                conv_namespace(namespace),
+                aux_should_be_name(name), aux_should_be_string(data));
+    } else {
+        ext_check_path_security(path, name, Qnil);
+        return file_s_extattr_set_link_main(aux_to_path(path),
+                conv_namespace(namespace),
+                aux_should_be_name(name), aux_should_be_string(data));
+    }
+}
+
+
+/*
+ * call-seq:
+ *  delete(path, namespace, name) -> nil
+ */
+static VALUE
+ext_s_delete(VALUE mod, VALUE path, VALUE namespace, VALUE name)
+{
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
         ext_check_file_security(path, name, Qnil);
         return file_extattr_delete_main(path, file2fd(path), conv_namespace(namespace),
-                aux_should_be_string(name));
+                aux_should_be_name(name));
+    } else {
+        ext_check_path_security(path, name, Qnil);
+        return file_s_extattr_delete_main(aux_to_path(path), conv_namespace(namespace),
+                aux_should_be_name(name));
+    }
+}
+
+/*
+ * call-seq:
+ *  delete!(path, namespace, name) -> nil
+ */
+static VALUE
+ext_s_delete_link(VALUE mod, VALUE path, VALUE namespace, VALUE name)
+{
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, name, Qnil);
+        return file_extattr_delete_main(path, file2fd(path), conv_namespace(namespace),
+                aux_should_be_name(name));
+    } else {
+        ext_check_path_security(path, name, Qnil);
+        return file_s_extattr_delete_link_main(aux_to_path(path), conv_namespace(namespace),
+                aux_should_be_name(name));
+    }
+}
+
+#ifdef EXTATTR_HAVE_GET_INTO
+/*
+ * call-seq:
+ *  get_into(path, namespace, name, buf) -> integer
+ *
+ * 拡張属性の値を buf に読み込み、そのバイト数を返します。
+ *
+ * buf には String か IO::Buffer を与えます。
+ * String の場合は長さが値の大きさとなり、容量が足りない場合に限って広げられます。
+ * IO::Buffer の場合は先頭から書き込まれ、大きさが足りない場合に限って広げられます。
+ */
+static VALUE
+ext_s_get_into(VALUE mod, VALUE path, VALUE namespace, VALUE name, VALUE buf)
+{
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, name, Qnil);
+        return file_extattr_get_into_main(path, file2fd(path), conv_namespace(namespace),
+                aux_should_be_name(name), buf);
+    } else {
+        ext_check_path_security(path, name, Qnil);
+        return file_s_extattr_get_into_main(aux_to_path(path), conv_namespace(namespace),
+                aux_should_be_name(name), buf);
+    }
+}
+
+/*
+ * call-seq:
+ *  get_into!(path, namespace, name, buf) -> integer
+ */
+static VALUE
+ext_s_get_into_link(VALUE mod, VALUE path, VALUE namespace, VALUE name, VALUE buf)
+{
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, name, Qnil);
+        return file_extattr_get_into_main(path, file2fd(path), conv_namespace(namespace),
+                aux_should_be_name(name), buf);
+    } else {
+        ext_check_path_security(path, name, Qnil);
+        return file_s_extattr_get_into_link_main(aux_to_path(path), conv_namespace(namespace),
+                aux_should_be_name(name), buf);
+    }
+}
+#endif
+
+#ifdef EXTATTR_HAVE_GET_MANY
+static VALUE
+aux_should_be_array(VALUE obj)
+{
+    return rb_convert_type(obj, RUBY_T_ARRAY, "Array", "to_ary");
+}
+
+/*
+ * call-seq:
+ *  get_many(path, namespace, names) -> hash
+ *
+ * names で与えられた拡張属性をまとめて取得し、名前と値からなるハッシュを返します。
+ *
+ * 存在しない拡張属性の値は nil となります。
+ */
+static VALUE
+ext_s_get_many(VALUE mod, VALUE path, VALUE namespace, VALUE names)
+{
+    VALUE v;
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, Qnil, Qnil);
+        v = file_extattr_get_many_main(path, file2fd(path), conv_namespace(namespace),
+                aux_should_be_array(names));
+    } else {
+        ext_check_path_security(path, Qnil, Qnil);
+        v = file_s_extattr_get_many_main(aux_to_path(path), conv_namespace(namespace),
+                aux_should_be_array(names));
+    }
+
+    rb_obj_infect(v, path);
+    return v;
+}
+
+/*
+ * call-seq:
+ *  get_many!(path, namespace, names) -> hash
+ */
+static VALUE
+ext_s_get_many_link(VALUE mod, VALUE path, VALUE namespace, VALUE names)
+{
+    VALUE v;
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, Qnil, Qnil);
+        v = file_extattr_get_many_main(path, file2fd(path), conv_namespace(namespace),
+                aux_should_be_array(names));
     } else {
-        ext_check_path_security(path, name, Qnil);
-        return file_s_extattr_delete_main(aux_to_path(path), conv_namespace(namespace),
-                aux_should_be_string(name));
+        ext_check_path_security(path, Qnil, Qnil);
+        v = file_s_extattr_get_many_link_main(aux_to_path(path), conv_namespace(namespace),
+                aux_should_be_array(names));
     }
+
+    rb_obj_infect(v, path);
+    return v;
 }
+#endif
 
+#ifdef EXTATTR_HAVE_TO_H
 /*
  * call-seq:
- *  delete!(path, namespace, name) -> nil
+ *  to_h(path, namespace) -> hash
+ *
+ * namespace に属する全ての拡張属性を、名前と値からなるハッシュとして返します。
  */
 static VALUE
-ext_s_delete_link(VALUE mod, VALUE path, VALUE namespace, VALUE name)
+ext_s_to_h(VALUE mod, VALUE path, VALUE namespace)
 {
+    VALUE v;
     if (rb_obj_is_kind_of(path, rb_cFile)) {
-        ext_check_file_security(path, name, Qnil);
-        return file_extattr_delete_main(path, file2fd(path), conv_namespace(namespace),
-                aux_should_be_string(name));
+        ext_check_file_security(path, Qnil, Qnil);
+        v = file_extattr_to_h_main(path, file2fd(path), conv_namespace(namespace));
     } else {
-        ext_check_path_security(path, name, Qnil);
-        return file_s_extattr_delete_link_main(aux_to_path(path), conv_namespace(namespace),
-                aux_should_be_string(name));
+        ext_check_path_security(path, Qnil, Qnil);
+        v = file_s_extattr_to_h_main(aux_to_path(path), conv_namespace(namespace));
+    }
+
+    rb_obj_infect(v, path);
+    return v;
+}
+
+/*
+ * call-seq:
+ *  to_h!(path, namespace) -> hash
+ */
+static VALUE
+ext_s_to_h_link(VALUE mod, VALUE path, VALUE namespace)
+{
+    VALUE v;
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, Qnil, Qnil);
+        v = file_extattr_to_h_main(path, file2fd(path), conv_namespace(namespace));
+    } else {
+        ext_check_path_security(path, Qnil, Qnil);
+        v = file_s_extattr_to_h_link_main(aux_to_path(path), conv_namespace(namespace));
+    }
+
+    rb_obj_infect(v, path);
+    return v;
+}
+#endif
+
+#ifdef EXTATTR_HAVE_NAME_ITERATOR
+/*
+ * call-seq:
+ *  names(path, namespace) -> ExtAttr::NameIterator
+ *
+ * 拡張属性名を一つずつ取り出す外部イテレータを返します。
+ *
+ * 一覧はこの時に一度だけ取得し、名前の文字列は取り出す時に作成します。
+ * ExtAttr::NameIterator は Enumerable を取り込んでおり、
+ * +next+、+peek+、+rewind+、+size+ も利用できます。
+ */
+static VALUE
+ext_s_names(VALUE mod, VALUE path, VALUE namespace)
+{
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, Qnil, Qnil);
+        return file_extattr_names_main(path, file2fd(path),
+                conv_namespace_list(namespace));
+    } else {
+        ext_check_path_security(path, Qnil, Qnil);
+        return file_s_extattr_names_main(aux_to_path(path),
+                conv_namespace_list(namespace));
+    }
+}
+
+/*
+ * call-seq:
+ *  names!(path, namespace) -> ExtAttr::NameIterator
+ */
+static VALUE
+ext_s_names_link(VALUE mod, VALUE path, VALUE namespace)
+{
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, Qnil, Qnil);
+        return file_extattr_names_main(path, file2fd(path),
+                conv_namespace_list(namespace));
+    } else {
+        ext_check_path_security(path, Qnil, Qnil);
+        return file_s_extattr_names_link_main(aux_to_path(path),
+                conv_namespace_list(namespace));
+    }
+}
+#endif
+
+#ifdef EXTATTR_HAVE_SET_MANY
+static VALUE
+aux_should_be_hash(VALUE obj)
+{
+    return rb_convert_type(obj, RUBY_T_HASH, "Hash", "to_hash");
+}
+
+static VALUE
+ext_set_many_common(int argc, VALUE argv[], int follow)
+{
+    VALUE path, namespace, pairs, opts;
+    rb_scan_args(argc, argv, "3:", &path, &namespace, &pairs, &opts);
+    int flags = NUM2INT(hash_lookup(opts, ID2SYM(id_flags), INT2FIX(0)));
+    int atomic = RTEST(hash_lookup(opts, ID2SYM(id_atomic), Qfalse));
+
+    if (rb_obj_is_kind_of(path, rb_cFile)) {
+        ext_check_file_security(path, Qnil, pairs);
+        return file_extattr_set_many_main(path, file2fd(path),
+                conv_namespace(namespace), aux_should_be_hash(pairs), flags, atomic);
+    } else {
+        ext_check_path_security(path, Qnil, pairs);
+        if (follow) {
+            return file_s_extattr_set_many_main(aux_to_path(path),
+                    conv_namespace(namespace), aux_should_be_hash(pairs), flags, atomic);
+        } else {
+            return file_s_extattr_set_many_link_main(aux_to_path(path),
+                    conv_namespace(namespace), aux_should_be_hash(pairs), flags, atomic);
+        }
+    }
+}
+
+/*
+ * call-seq:
+ *  set_many(path, namespace, hash, flags: 0, atomic: false) -> nil
+ *
+ * hash で与えられた名前と値の組をまとめて設定します。値が nil の場合はその拡張属性を削除します。
+ *
+ * flags には ExtAttr::CREATE か ExtAttr::REPLACE を与えることが出来ます。
+ *
+ * atomic に真を与えると、途中で失敗した場合にそれまでに変更した拡張属性を元に戻してから例外を発生させます。
+ */
+static VALUE
+ext_s_set_many(int argc, VALUE argv[], VALUE mod)
+{
+    return ext_set_many_common(argc, argv, 1);
+}
+
+/*
+ * call-seq:
+ *  set_many!(path, namespace, hash, flags: 0, atomic: false) -> nil
+ */
+static VALUE
+ext_s_set_many_link(int argc, VALUE argv[], VALUE mod)
+{
+    return ext_set_many_common(argc, argv, 0);
+}
+#endif
+
+#ifdef EXTATTR_HAVE_AT
+/*
+ * call-seq:
+ *  list_at(dir, path, namespace) -> names array
+ *  list_at(dir, path, namespace) { |name| ... } -> nil
+ *
+ * ディレクトリ dir からの相対パス名 path に対して list を行います。
+ *
+ * dir には Dir、File、ExtAttr::Handle またはファイル記述子を与えることが出来ます。
+ * 深い階層にあるファイルを繰り返し操作する場合に、パス名の解決を短く出来ます。
+ *
+ * 他の *_at メソッドも同様です。
+ */
+static VALUE
+ext_s_list_at(VALUE mod, VALUE dir, VALUE path, VALUE namespace)
+{
+    ext_check_path_security(path, Qnil, Qnil);
+    return file_s_extattr_list_at_main(dir, aux_to_path(path), 1,
+            conv_namespace_list(namespace));
+}
+
+/*
+ * call-seq:
+ *  list_at!(dir, path, namespace) -> names array
+ *  list_at!(dir, path, namespace) { |name| ... } -> nil
+ */
+static VALUE
+ext_s_list_at_link(VALUE mod, VALUE dir, VALUE path, VALUE namespace)
+{
+    ext_check_path_security(path, Qnil, Qnil);
+    return file_s_extattr_list_at_main(dir, aux_to_path(path), 0,
+            conv_namespace_list(namespace));
+}
+
+/*
+ * call-seq:
+ *  size_at(dir, path, namespace, name) -> size
+ */
+static VALUE
+ext_s_size_at(VALUE mod, VALUE dir, VALUE path, VALUE namespace, VALUE name)
+{
+    ext_check_path_security(path, name, Qnil);
+    return file_s_extattr_size_at_main(dir, aux_to_path(path), 1,
+            conv_namespace(namespace), aux_should_be_name(name));
+}
+
+/*
+ * call-seq:
+ *  size_at!(dir, path, namespace, name) -> size
+ */
+static VALUE
+ext_s_size_at_link(VALUE mod, VALUE dir, VALUE path, VALUE namespace, VALUE name)
+{
+    ext_check_path_security(path, name, Qnil);
+    return file_s_extattr_size_at_main(dir, aux_to_path(path), 0,
+            conv_namespace(namespace), aux_should_be_name(name));
+}
+
+/*
+ * call-seq:
+ *  get_at(dir, path, namespace, name) -> data
+ */
+static VALUE
+ext_s_get_at(VALUE mod, VALUE dir, VALUE path, VALUE namespace, VALUE name)
+{
+    ext_check_path_security(path, name, Qnil);
+    return file_s_extattr_get_at_main(dir, aux_to_path(path), 1,
+            conv_namespace(namespace), aux_should_be_name(name));
+}
+
+/*
+ * call-seq:
+ *  get_at!(dir, path, namespace, name) -> data
+ */
+static VALUE
+ext_s_get_at_link(VALUE mod, VALUE dir, VALUE path, VALUE namespace, VALUE name)
+{
+    ext_check_path_security(path, name, Qnil);
+    return file_s_extattr_get_at_main(dir, aux_to_path(path), 0,
+            conv_namespace(namespace), aux_should_be_name(name));
+}
+
+/*
+ * call-seq:
+ *  set_at(dir, path, namespace, name, data) -> nil
+ */
+static VALUE
+ext_s_set_at(VALUE mod, VALUE dir, VALUE path, VALUE namespace, VALUE name, VALUE data)
+{
+    ext_check_path_security(path, name, data);
+    return file_s_extattr_set_at_main(dir, aux_to_path(path), 1,
+            conv_namespace(namespace),
+            aux_should_be_name(name), aux_should_be_string(data));
+}
+
+/*
+ * call-seq:
+ *  set_at!(dir, path, namespace, name, data) -> nil
+ */
+static VALUE
+ext_s_set_at_link(VALUE mod, VALUE dir, VALUE path, VALUE namespace, VALUE name, VALUE data)
+{
+    ext_check_path_security(path, name, data);
+    return file_s_extattr_set_at_main(dir, aux_to_path(path), 0,
+            conv_namespace(namespace),
+            aux_should_be_name(name), aux_should_be_string(data));
+}
+
+/*
+ * call-seq:
+ *  delete_at(dir, path, namespace, name) -> nil
+ */
+static VALUE
+ext_s_delete_at(VALUE mod, VALUE dir, VALUE path, VALUE namespace, VALUE name)
+{
+    ext_check_path_security(path, name, Qnil);
+    return file_s_extattr_delete_at_main(dir, aux_to_path(path), 1,
+            conv_namespace(namespace), aux_should_be_name(name));
+}
+
+/*
+ * call-seq:
+ *  delete_at!(dir, path, namespace, name) -> nil
+ */
+static VALUE
+ext_s_delete_at_link(VALUE mod, VALUE dir, VALUE path, VALUE namespace, VALUE name)
+{
+    ext_check_path_security(path, name, Qnil);
+    return file_s_extattr_delete_at_main(dir, aux_to_path(path), 0,
+            conv_namespace(namespace), aux_should_be_name(name));
+}
+#endif
+
+#ifdef EXTATTR_HAVE_SCAN
+/*
+ * call-seq:
+ *  scan(root, namespace: ExtAttr::USER, names: nil, threads: 4) { |path, hash| ... } -> nil
+ *  scan(root, namespace: ExtAttr::USER, names: nil, threads: 4) -> enumerator
+ *
+ * root 以下のディレクトリツリーをたどり、拡張属性を持つファイルごとにそのパス名と、
+ * 拡張属性の名前と値からなるハッシュをブロックに渡します。
+ *
+ * names を与えた場合は、その名前の拡張属性のみを対象とします。
+ *
+ * ディレクトリツリーは threads 個のネイティブスレッドでたどるため、ブロックに渡される順番は不定です。
+ * シンボリックリンクはたどりません (root を除く)。
+ * 権限がないなどの理由で読めないファイルやディレクトリは無視されます。
+ */
+static VALUE
+ext_s_scan(int argc, VALUE argv[], VALUE mod)
+{
+#ifdef RB_PASS_CALLED_KEYWORDS
+    RETURN_ENUMERATOR_KW(mod, argc, argv, RB_PASS_CALLED_KEYWORDS);
+#else
+    RETURN_ENUMERATOR(mod, argc, argv);
+#endif
+
+    VALUE root, opts;
+    rb_scan_args(argc, argv, "1:", &root, &opts);
+    VALUE names = hash_lookup(opts, ID2SYM(id_names), Qnil);
+    if (!NIL_P(names)) { names = aux_should_be_array(names); }
+    int nthreads = NUM2INT(hash_lookup(opts, ID2SYM(id_threads), INT2FIX(4)));
+
+    ext_check_path_security(root, Qnil, Qnil);
+    return file_s_extattr_scan_main(aux_to_path(root),
+            conv_namespace(hash_lookup(opts, ID2SYM(id_namespace), Qnil)),
+            names, nthreads);
+}
+#endif
+
+#ifdef EXTATTR_HAVE_COPY
+/*
+ * call-seq:
+ *  copy(src, dst, namespace: ExtAttr::USER, filter: nil, existing: :overwrite) -> integer
+ *
+ * src の拡張属性を dst に複写して、複写した数を返します。
+ * src と dst には File オブジェクトかパス名を与えます。
+ *
+ * namespace に ExtAttr::ALL を与えると、全ての名前空間の拡張属性を複写します。
+ * filter にパターンの文字列 (または配列) を与えた場合は、名前空間を除いた名前が
+ * いずれかのパターンに fnmatch(3) で一致するものだけを複写します。
+ * existing に :skip を与えると、dst に既にある拡張属性は上書きしません。
+ *
+ * 値を ruby の文字列にすることなく、一つの作業領域を使い回して複写します。
+ */
+static VALUE
+ext_s_copy(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE src, dst, opts;
+    rb_scan_args(argc, argv, "2:", &src, &dst, &opts);
+    int namespace1 = conv_namespace_list(hash_lookup(opts, ID2SYM(id_namespace), Qnil));
+
+    VALUE filter = hash_lookup(opts, ID2SYM(id_filter), Qnil);
+    if (RB_TYPE_P(filter, RUBY_T_STRING)) {
+        filter = rb_ary_new_from_values(1, &filter);
+    } else if (!NIL_P(filter)) {
+        filter = aux_should_be_array(filter);
+        for (long i = 0; i < RARRAY_LEN(filter); i++) { aux_should_be_string(RARRAY_AREF(filter, i)); }
+    }
+
+    VALUE existing = hash_lookup(opts, ID2SYM(id_existing), ID2SYM(id_overwrite));
+    int skip;
+    if (existing == ID2SYM(id_overwrite)) {
+        skip = 0;
+    } else if (existing == ID2SYM(id_skip)) {
+        skip = 1;
+    } else {
+        rb_raise(rb_eArgError, "wrong existing policy - %+"PRIsVALUE" (expected :overwrite or :skip)", existing);
+    }
+
+    int srcfd = -1, dstfd = -1;
+    if (rb_obj_is_kind_of(src, rb_cFile)) {
+        ext_check_file_security(src, Qnil, Qnil);
+        srcfd = file2fd(src);
+    } else {
+        ext_check_path_security(src, Qnil, Qnil);
+        src = aux_to_path(src);
+    }
+    if (rb_obj_is_kind_of(dst, rb_cFile)) {
+        ext_check_file_security(dst, Qnil, Qnil);
+        dstfd = file2fd(dst);
+    } else {
+        ext_check_path_security(dst, Qnil, Qnil);
+        dst = aux_to_path(dst);
+    }
+
+    return file_s_extattr_copy_main(src, srcfd, dst, dstfd, namespace1, filter, skip);
+}
+#endif
+
+#ifdef EXTATTR_HAVE_SYNC_TREE
+/*
+ * call-seq:
+ *  sync_tree(src_root, dst_root, namespace: ExtAttr::USER, threads: 4) -> hash
+ *
+ * src_root 以下の各ファイルの拡張属性を、dst_root 以下の同じ相対パス名のファイルに揃えます。
+ * 値が異なるか dst にない拡張属性だけを設定し、src にない拡張属性は dst から削除します。
+ *
+ * namespace に ExtAttr::ALL を与えると、全ての名前空間の拡張属性を揃えます。
+ *
+ * src_root のディレクトリツリーは threads 個のネイティブスレッドでたどります。
+ * dst にない項目 (と、dst 側でシンボリックリンクを経由する項目) は何もせずに missing として数えます。
+ * 権限がないなどの理由で読めない src の項目は無視し、dst への書き込みの失敗は failed として数えます。
+ *
+ * 戻り値は次の件数からなるハッシュです。
+ *
+ *  files:: 比べたファイルの数
+ *  missing:: dst に見つからなかったファイルの数
+ *  compared:: 比べた拡張属性の数
+ *  written:: 設定した拡張属性の数
+ *  removed:: 削除した拡張属性の数
+ *  failed:: 失敗した操作の数
+ */
+static VALUE
+ext_s_sync_tree(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE src, dst, opts;
+    rb_scan_args(argc, argv, "2:", &src, &dst, &opts);
+    int namespace1 = conv_namespace_list(hash_lookup(opts, ID2SYM(id_namespace), Qnil));
+    int nthreads = NUM2INT(hash_lookup(opts, ID2SYM(id_threads), INT2FIX(4)));
+
+    ext_check_path_security(src, Qnil, Qnil);
+    ext_check_path_security(dst, Qnil, Qnil);
+    return file_s_extattr_sync_tree_main(aux_to_path(src), aux_to_path(dst), namespace1, nthreads);
+}
+#endif
+
+#ifdef EXTATTR_HAVE_DUMP
+/*
+ * call-seq:
+ *  dump(root, dest, namespace: ExtAttr::USER, threads: 4) -> hash
+ *
+ * root 以下のディレクトリツリーの拡張属性を、ExtAttr.restore で読み込めるバイナリ形式で
+ * dest に書き出します。dest にはパス名か、書き込み可能な IO オブジェクトを与えます。
+ * ノンブロッキングの IO (パイプなど) であれば、書き込めるようになるまで待ちます。
+ *
+ * ファイルごとに、root からの相対パス名と、名前空間、名前、値を長さ付きで記録します。
+ * namespace に ExtAttr::ALL を与えると、全ての名前空間の拡張属性を書き出します。
+ *
+ * ディレクトリツリーは threads 個のネイティブスレッドでたどるため、記録される順番は不定です。
+ * 書き出しを待つ量には上限があるため、ツリーの大きさによらず使用するメモリは一定です。
+ * シンボリックリンクはたどりません (root を除く)。読めないファイルやディレクトリは無視されます。
+ *
+ * 書き出したファイル数 (files)、拡張属性の数 (attributes)、バイト数 (bytes) からなるハッシュを返します。
+ */
+static VALUE
+ext_s_dump(int argc, VALUE argv[], VALUE mod)
+{
+    VALUE root, dest, opts;
+    rb_scan_args(argc, argv, "2:", &root, &dest, &opts);
+    int namespace1 = conv_namespace_list(hash_lookup(opts, ID2SYM(id_namespace), Qnil));
+    int nthreads = NUM2INT(hash_lookup(opts, ID2SYM(id_threads), INT2FIX(4)));
+
+    ext_check_path_security(root, Qnil, Qnil);
+    int destfd = -1;
+    if (rb_obj_is_kind_of(dest, rb_cIO)) {
+        dest = rb_io_get_write_io(dest);
+        rb_io_flush(dest);
+        destfd = file2fd(dest);
+    } else {
+        ext_check_path_security(dest, Qnil, Qnil);
+        dest = aux_to_path(dest);
     }
+
+    return file_s_extattr_dump_main(aux_to_path(root), dest, destfd, namespace1, nthreads);
+}
+
+/*
+ * call-seq:
+ *  restore(src, root) -> hash
+ *
+ * ExtAttr.dump で書き出したファイル src を読み込み、root 以下の同じ相対パス名のファイルに
+ * 拡張属性を設定します。
+ *
+ * src は mmap で読み込み、先頭から順に処理します。処理し終えた範囲は順次手放すため、
+ * src の大きさによらず使用するメモリは一定です。
+ *
+ * root にないファイルは何もせずに missing として数え、拡張属性の設定に失敗した数は failed として数えます。
+ * root の外を指すパス名や root 以下のシンボリックリンクはたどりません。
+ * src が壊れているか途中で切れている場合は RuntimeError 例外が発生します
+ * (それまでに読んだ拡張属性は設定されたままとなります)。
+ *
+ * 設定したファイル数 (files)、拡張属性の数 (attributes)、missing、failed からなるハッシュを返します。
+ */
+static VALUE
+ext_s_restore(VALUE mod, VALUE src, VALUE root)
+{
+    ext_check_path_security(src, Qnil, Qnil);
+    ext_check_path_security(root, Qnil, Qnil);
+    return file_s_extattr_restore_main(aux_to_path(src), aux_to_path(root));
+}
+#endif
+
+
+#if !defined(HAVE_WINNT_H)
+#   include "extattr-cache.h"
+#endif
+
+#ifdef EXTATTR_HAVE_DECODE_LIST
+/*
+ * call-seq:
+ *  decode_list(buffer, namespace) -> names array
+ *
+ * listxattr が返す形式の一覧 buffer を解析して、名前の配列を返します。
+ * 一覧を解析する処理の試験と計測のための非公開メソッドです。
+ */
+static VALUE
+ext_s_decode_list(VALUE mod, VALUE buf, VALUE namespace)
+{
+    int namespace1 = conv_namespace_list(namespace);
+    buf = rb_str_new_frozen(StringValue(buf));
+    VALUE list = extattr_list_yield(RSTRING_PTR(buf), RSTRING_LEN(buf), buf, namespace1);
+    RB_GC_GUARD(buf);
+    return list;
 }
+#endif
 
 
 void
@@ -512,10 +1900,31 @@ Init_extattr(void)
 #endif
     id_downcase = rb_intern("downcase");
     id_to_path = rb_intern("to_path");
+    id_flags = rb_intern("flags");
+    id_atomic = rb_intern("atomic");
+    id_namespace = rb_intern("namespace");
+    id_names = rb_intern("names");
+    id_threads = rb_intern("threads");
+    id_filter = rb_intern("filter");
+    id_existing = rb_intern("existing");
+    id_overwrite = rb_intern("overwrite");
+    id_skip = rb_intern("skip");
+
+    for (size_t i = 0; i < ELEMENTOF(namespace_table); i++) {
+        namespace_table[i].id = rb_intern(namespace_table[i].name);
+    }
 
     mExtAttr = rb_define_module("ExtAttr");
-    rb_define_const(mExtAttr, "USER", ID2SYM(rb_intern("user")));
-    rb_define_const(mExtAttr, "SYSTEM", ID2SYM(rb_intern("system")));
+    rb_define_const(mExtAttr, "USER", aux_namespace_symbol(EXTATTR_NAMESPACE_USER));
+    rb_define_const(mExtAttr, "SYSTEM", aux_namespace_symbol(EXTATTR_NAMESPACE_SYSTEM));
+#ifdef EXTATTR_HAVE_TRUSTED_SECURITY
+    rb_define_const(mExtAttr, "TRUSTED", aux_namespace_symbol(EXTATTR_NAMESPACE_TRUSTED));
+    rb_define_const(mExtAttr, "SECURITY", aux_namespace_symbol(EXTATTR_NAMESPACE_SECURITY));
+#endif
+#ifdef EXTATTR_HAVE_LIST_ALL
+    id_all = rb_intern("all");
+    rb_define_const(mExtAttr, "ALL", ID2SYM(id_all));
+#endif
 
     rb_define_singleton_method(mExtAttr, "list", RUBY_METHOD_FUNC(ext_s_list), 2);
     rb_define_singleton_method(mExtAttr, "list!", RUBY_METHOD_FUNC(ext_s_list_link), 2);
@@ -527,6 +1936,59 @@ Init_extattr(void)
     rb_define_singleton_method(mExtAttr, "set!", RUBY_METHOD_FUNC(ext_s_set_link), 4);
     rb_define_singleton_method(mExtAttr, "delete", RUBY_METHOD_FUNC(ext_s_delete), 3);
     rb_define_singleton_method(mExtAttr, "delete!", RUBY_METHOD_FUNC(ext_s_delete_link), 3);
+#ifdef EXTATTR_HAVE_GET_INTO
+    rb_define_singleton_method(mExtAttr, "get_into", RUBY_METHOD_FUNC(ext_s_get_into), 4);
+    rb_define_singleton_method(mExtAttr, "get_into!", RUBY_METHOD_FUNC(ext_s_get_into_link), 4);
+#endif
+#ifdef EXTATTR_HAVE_GET_MANY
+    rb_define_singleton_method(mExtAttr, "get_many", RUBY_METHOD_FUNC(ext_s_get_many), 3);
+    rb_define_singleton_method(mExtAttr, "get_many!", RUBY_METHOD_FUNC(ext_s_get_many_link), 3);
+#endif
+#ifdef EXTATTR_HAVE_NAME_ITERATOR
+    rb_define_singleton_method(mExtAttr, "names", RUBY_METHOD_FUNC(ext_s_names), 2);
+    rb_define_singleton_method(mExtAttr, "names!", RUBY_METHOD_FUNC(ext_s_names_link), 2);
+#endif
+#ifdef EXTATTR_HAVE_TO_H
+    rb_define_singleton_method(mExtAttr, "to_h", RUBY_METHOD_FUNC(ext_s_to_h), 2);
+    rb_define_singleton_method(mExtAttr, "to_h!", RUBY_METHOD_FUNC(ext_s_to_h_link), 2);
+#endif
+#ifdef EXTATTR_HAVE_SET_MANY
+    rb_define_singleton_method(mExtAttr, "set_many", RUBY_METHOD_FUNC(ext_s_set_many), -1);
+    rb_define_singleton_method(mExtAttr, "set_many!", RUBY_METHOD_FUNC(ext_s_set_many_link), -1);
+#endif
+#ifdef EXTATTR_HAVE_AT
+    rb_define_singleton_method(mExtAttr, "list_at", RUBY_METHOD_FUNC(ext_s_list_at), 3);
+    rb_define_singleton_method(mExtAttr, "list_at!", RUBY_METHOD_FUNC(ext_s_list_at_link), 3);
+    rb_define_singleton_method(mExtAttr, "size_at", RUBY_METHOD_FUNC(ext_s_size_at), 4);
+    rb_define_singleton_method(mExtAttr, "size_at!", RUBY_METHOD_FUNC(ext_s_size_at_link), 4);
+    rb_define_singleton_method(mExtAttr, "get_at", RUBY_METHOD_FUNC(ext_s_get_at), 4);
+    rb_define_singleton_method(mExtAttr, "get_at!", RUBY_METHOD_FUNC(ext_s_get_at_link), 4);
+    rb_define_singleton_method(mExtAttr, "set_at", RUBY_METHOD_FUNC(ext_s_set_at), 5);
+    rb_define_singleton_method(mExtAttr, "set_at!", RUBY_METHOD_FUNC(ext_s_set_at_link), 5);
+    rb_define_singleton_method(mExtAttr, "delete_at", RUBY_METHOD_FUNC(ext_s_delete_at), 4);
+    rb_define_singleton_method(mExtAttr, "delete_at!", RUBY_METHOD_FUNC(ext_s_delete_at_link), 4);
+#endif
+#ifdef EXTATTR_HAVE_SCAN
+    rb_define_singleton_method(mExtAttr, "scan", RUBY_METHOD_FUNC(ext_s_scan), -1);
+#endif
+#ifdef EXTATTR_HAVE_COPY
+    rb_define_singleton_method(mExtAttr, "copy", RUBY_METHOD_FUNC(ext_s_copy), -1);
+#endif
+#ifdef EXTATTR_HAVE_SYNC_TREE
+    rb_define_singleton_method(mExtAttr, "sync_tree", RUBY_METHOD_FUNC(ext_s_sync_tree), -1);
+#endif
+#ifdef EXTATTR_HAVE_DUMP
+    rb_define_singleton_method(mExtAttr, "dump", RUBY_METHOD_FUNC(ext_s_dump), -1);
+    rb_define_singleton_method(mExtAttr, "restore", RUBY_METHOD_FUNC(ext_s_restore), 2);
+#endif
+#ifdef EXTATTR_HAVE_CACHE
+    extattr_cache_init();
+#endif
+#ifdef EXTATTR_HAVE_DECODE_LIST
+    rb_define_private_method(rb_singleton_class(mExtAttr), "decode_list", RUBY_METHOD_FUNC(ext_s_decode_list), 2);
+#endif
 
+    aux_scratch_init();
+    aux_offload_init();
     extattr_init_implement();
 }
@@ -3,6 +3,30 @@
 require "mkmf"
 
 have_func("rb_ext_ractor_safe", "ruby.h")
+have_header("pthread.h")
+
+# ファイバースケジューラが有効な時に、拡張属性の操作をワーカースレッドへ逃がすため
+if have_header("ruby/fiber/scheduler.h")
+  have_func("rb_fiber_scheduler_current", "ruby/fiber/scheduler.h")
+  have_func("rb_fiber_scheduler_io_wait_readable", "ruby/fiber/scheduler.h")
+  have_func("rb_fiber_scheduler_blocking_operation_wait", "ruby/fiber/scheduler.h")
+end
+
+# ExtAttr.get_into で IO::Buffer に書き込むため
+if have_header("ruby/io/buffer.h")
+  have_func("rb_io_buffer_get_bytes_for_writing", "ruby/io/buffer.h")
+end
+
+# ExtAttr::Watcher で拡張属性の変更を監視するため
+have_header("sys/inotify.h")
+
+# ExtAttr.sync_tree で、複写先のパス名の途中にあるシンボリックリンクをたどらないようにするため
+have_header("linux/openat2.h") && have_header("sys/syscall.h")
+
+# ExtAttr::Ring で io_uring を用いるため (liburing は不要)
+if have_header("linux/io_uring.h") && have_header("sys/mman.h") && have_header("sys/syscall.h")
+  have_const("IORING_OP_FGETXATTR", "linux/io_uring.h")
+end
 
 case
 when have_header("sys/extattr.h")
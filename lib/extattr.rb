@@ -17,7 +17,10 @@ end
 # 拡張属性の名前空間を指定する場合、以下の値が利用できます:
 #
 # * ExtAttr::USER, ExtAttr::SYSTEM
-# * 文字列又はシンボルで +user+、+system+ (大文字小文字を区別しません)
+# * ExtAttr::TRUSTED, ExtAttr::SECURITY (xattr のみ)
+# * 文字列又はシンボルで +user+、+system+、+trusted+、+security+ (大文字小文字を区別しません)
+#
+# ExtAttr.list などの一覧の取得では、全ての名前空間を表す ExtAttr::ALL も与えられます (xattr のみ)。
 #
 # これらの値は内部で変換、または処理が分岐されます。
 #
@@ -25,7 +28,7 @@ end
 #   整数値に変換されて処理されます。
 #
 # xattr::
-#   拡張属性名に "user." または "system." を追加して処理されます。
+#   拡張属性名に "user."、"system."、"trusted." または "security." を追加して処理されます。
 #
 # Windows::
 #   ExtAttr::USER の場合は NTFS Alternative Data Stream (ADS) として処理されます。
@@ -55,8 +58,11 @@ module ExtAttr
   #   each(path, namespace = ExtAttr::USER) -> Enumerator
   #   each(path, namespace = ExtAttr::USER) { |name| ... } -> path
   #
+  # ブロックを与えない場合は、どの実装でも Enumerator を返します。
+  # その size は ExtAttr.names で数えます。ExtAttr::NameIterator が必要であれば ExtAttr.names を用いて下さい。
+  #
   def self.each(path, namespace = ExtAttr::USER, &block)
-    return to_enum(:each, path, namespace) unless block
+    return to_enum(:each, path, namespace) { names(path, namespace).size } unless block
 
     list(path, namespace, &block)
 
@@ -69,7 +75,7 @@ module ExtAttr
   #   each!(path, namespace = ExtAttr::USER) { |name| ... } -> path
   #
   def self.each!(path, namespace = ExtAttr::USER, &block)
-    return to_enum(:each!, path, namespace) unless block
+    return to_enum(:each!, path, namespace) { names!(path, namespace).size } unless block
 
     list!(path, namespace, &block)
 
@@ -138,6 +144,18 @@ module ExtAttr
       ExtAttr.size(obj, namespace, name)
     end
 
+    def get_into(name, buf, namespace: ExtAttr::USER)
+      ExtAttr.get_into(obj, namespace, name, buf)
+    end
+
+    def get_many(names, namespace: ExtAttr::USER)
+      ExtAttr.get_many(obj, namespace, names)
+    end
+
+    def to_h(namespace: ExtAttr::USER)
+      ExtAttr.to_h(obj, namespace)
+    end
+
     def get(name, namespace: ExtAttr::USER)
       ExtAttr.get(obj, namespace, name)
     end
@@ -149,6 +167,560 @@ module ExtAttr
     def delete(name, namespace: ExtAttr::USER)
       ExtAttr.delete(obj, namespace, name)
     end
+
+    def set_many(hash, namespace: ExtAttr::USER, **opts)
+      ExtAttr.set_many(obj, namespace, hash, **opts)
+    end
+
+    alias update set_many
+  end
+
+  unless respond_to?(:get_into)
+    #
+    # call-seq:
+    #   get_into(path, namespace, name, buf) -> integer
+    #
+    # 拡張属性の値を buf (String か IO::Buffer) に読み込み、そのバイト数を返します。
+    #
+    # 実装が専用の処理を持たない場合は、ExtAttr.get で取得した値を buf に複写します。
+    #
+    def self.get_into(path, namespace, name, buf)
+      get_into_fallback(get(path, namespace, name), buf)
+    end
+
+    #
+    # call-seq:
+    #   get_into!(path, namespace, name, buf) -> integer
+    #
+    def self.get_into!(path, namespace, name, buf)
+      get_into_fallback(get!(path, namespace, name), buf)
+    end
+
+    def self.get_into_fallback(value, buf)
+      if buf.kind_of?(String)
+        buf.replace(value)
+      else
+        buf.resize(value.bytesize) if buf.size < value.bytesize
+        buf.set_string(value)
+      end
+
+      value.bytesize
+    end
+
+    private_class_method :get_into_fallback
+  end
+
+  unless respond_to?(:names)
+    #
+    # call-seq:
+    #   names(path, namespace) -> Enumerator
+    #
+    # 拡張属性名を一つずつ取り出す外部イテレータを返します。
+    #
+    # 実装が専用の処理を持たない場合は、ExtAttr.list で取得した配列の Enumerator を返します。
+    #
+    def self.names(path, namespace)
+      list(path, namespace).each
+    end
+
+    #
+    # call-seq:
+    #   names!(path, namespace) -> Enumerator
+    #
+    def self.names!(path, namespace)
+      list!(path, namespace).each
+    end
+  end
+
+  unless respond_to?(:get_many)
+    #
+    # call-seq:
+    #   get_many(path, namespace, names) -> hash
+    #
+    # 拡張属性をまとめて取得します。存在しない拡張属性の値は nil となります。
+    #
+    # 実装が専用の処理を持たない場合は、ExtAttr.get を繰り返し呼び出します。
+    #
+    def self.get_many(path, namespace, names)
+      names.each_with_object({}) do |name, h|
+        h[name] = begin
+                    get(path, namespace, name)
+                  rescue Accessor::VIRT_ENOATTR
+                    nil
+                  end
+      end
+    end
+
+    #
+    # call-seq:
+    #   get_many!(path, namespace, names) -> hash
+    #
+    def self.get_many!(path, namespace, names)
+      names.each_with_object({}) do |name, h|
+        h[name] = begin
+                    get!(path, namespace, name)
+                  rescue Accessor::VIRT_ENOATTR
+                    nil
+                  end
+      end
+    end
+  end
+
+  unless respond_to?(:to_h)
+    #
+    # call-seq:
+    #   to_h(path, namespace) -> hash
+    #
+    # namespace に属する全ての拡張属性を、名前と値からなるハッシュとして返します。
+    #
+    def self.to_h(path, namespace)
+      each_pair(path, namespace).to_h
+    end
+
+    #
+    # call-seq:
+    #   to_h!(path, namespace) -> hash
+    #
+    def self.to_h!(path, namespace)
+      each_pair!(path, namespace).to_h
+    end
+  end
+
+  unless respond_to?(:set_many)
+    #
+    # call-seq:
+    #   set_many(path, namespace, hash, flags: 0, atomic: false) -> nil
+    #
+    # 拡張属性をまとめて設定します。値が nil の場合はその拡張属性を削除します。
+    #
+    # 実装が専用の処理を持たない場合は、ExtAttr.set / ExtAttr.delete を繰り返し呼び出します。
+    # この場合 flags には 0 のみが指定できます。
+    #
+    def self.set_many(path, namespace, hash, flags: 0, atomic: false)
+      set_many_fallback(path, namespace, hash, flags, atomic, :get_many, :set, :delete)
+    end
+
+    #
+    # call-seq:
+    #   set_many!(path, namespace, hash, flags: 0, atomic: false) -> nil
+    #
+    def self.set_many!(path, namespace, hash, flags: 0, atomic: false)
+      set_many_fallback(path, namespace, hash, flags, atomic, :get_many!, :set!, :delete!)
+    end
+
+    def self.set_many_fallback(path, namespace, hash, flags, atomic, get_many, set, delete)
+      raise NotImplementedError, "flags are not supported on #{ExtAttr::IMPLEMENT}" unless flags == 0
+
+      olds = atomic ? send(get_many, path, namespace, hash.keys) : {}
+      done = []
+      begin
+        hash.each_pair do |name, data|
+          if data.nil?
+            begin
+              send(delete, path, namespace, name)
+            rescue Accessor::VIRT_ENOATTR
+            end
+          else
+            send(set, path, namespace, name, data)
+          end
+          done << name
+        end
+      rescue Exception
+        done.reverse_each do |name|
+          begin
+            if olds[name]
+              send(set, path, namespace, name, olds[name])
+            else
+              send(delete, path, namespace, name)
+            end
+          rescue SystemCallError
+          end
+        end if atomic
+        raise
+      end
+
+      nil
+    end
+
+    private_class_method :set_many_fallback
+  end
+
+  unless respond_to?(:scan)
+    #
+    # call-seq:
+    #   scan(root, namespace: ExtAttr::USER, names: nil, threads: 4) { |path, hash| ... } -> nil
+    #   scan(root, namespace: ExtAttr::USER, names: nil, threads: 4) -> enumerator
+    #
+    # root 以下のディレクトリツリーをたどり、拡張属性を持つファイルごとにそのパス名と、
+    # 拡張属性の名前と値からなるハッシュをブロックに渡します。
+    #
+    # 実装が専用の処理を持たない場合は Find.find を用いるため、threads は無視されます。
+    #
+    def self.scan(root, namespace: ExtAttr::USER, names: nil, threads: 4)
+      return to_enum(:scan, root, namespace: namespace, names: names, threads: threads) unless block_given?
+
+      require "find"
+      Find.find(root) do |path|
+        begin
+          list = list!(path, namespace)
+          list &= names if names
+          next if list.empty?
+          hash = get_many!(path, namespace, list).compact
+          yield(path, hash) unless hash.empty?
+        rescue SystemCallError
+        end
+      end
+
+      nil
+    end
+  end
+
+  unless respond_to?(:copy)
+    #
+    # call-seq:
+    #   copy(src, dst, namespace: ExtAttr::USER, filter: nil, existing: :overwrite) -> integer
+    #
+    # src の拡張属性を dst に複写して、複写した数を返します。
+    #
+    # 実装が専用の処理を持たない場合は、ExtAttr.list / ExtAttr.get / ExtAttr.set を繰り返します。
+    # filter のパターンは File.fnmatch で比べます。
+    #
+    def self.copy(src, dst, namespace: ExtAttr::USER, filter: nil, existing: :overwrite)
+      unless [:overwrite, :skip].include?(existing)
+        raise ArgumentError, "wrong existing policy - #{existing.inspect} (expected :overwrite or :skip)"
+      end
+      patterns = filter && Array(filter)
+      present = existing == :skip ? list(dst, namespace) : []
+
+      list(src, namespace).count do |name|
+        next false if patterns && patterns.none? { |pat| ::File.fnmatch(pat, name) }
+        next false if present.include?(name)
+        set(dst, namespace, name, get(src, namespace, name))
+        true
+      end
+    end
+  end
+
+  unless respond_to?(:sync_tree)
+    #
+    # call-seq:
+    #   sync_tree(src_root, dst_root, namespace: ExtAttr::USER, threads: 4) -> hash
+    #
+    # src_root 以下の各ファイルの拡張属性を、dst_root 以下の同じ相対パス名のファイルに揃えます。
+    #
+    # 実装が専用の処理を持たない場合は Find.find を用いるため、threads は無視されます。
+    #
+    def self.sync_tree(src_root, dst_root, namespace: ExtAttr::USER, threads: 4)
+      require "find"
+      src = ::File.path(src_root)
+      dst = ::File.path(dst_root)
+      stats = { files: 0, missing: 0, compared: 0, written: 0, removed: 0, failed: 0 }
+
+      Find.find(src) do |path|
+        names = begin
+                  list!(path, namespace)
+                rescue SystemCallError
+                  next
+                end
+        target = path == src ? dst : ::File.join(dst, path[src.size..-1])
+        present = begin
+                    list!(target, namespace)
+                  rescue Errno::ENOENT, Errno::ENOTDIR
+                    stats[:missing] += 1
+                    next
+                  rescue SystemCallError
+                    stats[:failed] += 1
+                    next
+                  end
+        stats[:files] += 1
+
+        names.each do |name|
+          begin
+            value = get!(path, namespace, name)
+            stats[:compared] += 1
+            next if present.include?(name) && get!(target, namespace, name) == value
+            set!(target, namespace, name, value)
+            stats[:written] += 1
+          rescue SystemCallError
+            stats[:failed] += 1
+          end
+        end
+
+        (present - names).each do |name|
+          begin
+            delete!(target, namespace, name)
+            stats[:removed] += 1
+          rescue SystemCallError
+            stats[:failed] += 1
+          end
+        end
+      end
+
+      stats
+    end
+  end
+
+  unless respond_to?(:dump)
+    # ダンプファイルに記録する名前空間の番号 (1 から始まる)
+    DUMP_NAMESPACES = %w(user system trusted security)
+    private_constant :DUMP_NAMESPACES
+
+    #
+    # call-seq:
+    #   dump(root, dest, namespace: ExtAttr::USER, threads: 4) -> hash
+    #
+    # root 以下のディレクトリツリーの拡張属性を、ExtAttr.restore で読み込めるバイナリ形式で
+    # dest (パス名か IO オブジェクト) に書き出します。
+    #
+    # 実装が専用の処理を持たない場合は ExtAttr.scan を用います。
+    #
+    def self.dump(root, dest, namespace: ExtAttr::USER, threads: 4)
+      unless ns = DUMP_NAMESPACES.index(namespace.to_s.downcase)
+        raise ArgumentError, "wrong namespace - #{namespace.inspect}"
+      end
+      root = ::File.path(root)
+      prefix = root.chomp("/").size + 1
+      io = dest.kind_of?(IO) ? dest : ::File.open(dest, "wb")
+      stats = { files: 0, attributes: 0, bytes: 0 }
+
+      begin
+        stats[:bytes] += io.write(["EXTADUMP", 1, 0].pack("a8VV"))
+        scan(root, namespace: namespace, threads: threads) do |path, hash|
+          rel = (path == root ? "" : path[prefix..-1]).b
+          attrs = hash.select { |name, _| name.bytesize <= 255 }
+          record = [rel.bytesize, 0].pack("VC") << rel << [attrs.size].pack("V")
+          attrs.each { |name, value| record << [ns + 1, name.bytesize, value.bytesize].pack("CCV") << name.b << value.b }
+          stats[:bytes] += io.write(record)
+          stats[:files] += 1
+          stats[:attributes] += attrs.size
+        end
+        stats[:bytes] += io.write([0xffffffff, stats[:files], stats[:attributes]].pack("VQ<Q<"))
+      ensure
+        io.close unless io.equal?(dest)
+      end
+
+      stats
+    end
+
+    #
+    # call-seq:
+    #   restore(src, root) -> hash
+    #
+    # ExtAttr.dump で書き出したファイル src を読み込み、root 以下の同じ相対パス名のファイルに
+    # 拡張属性を設定します。
+    #
+    # 実装が専用の処理を持たない場合は、src を先頭から順に読みながら ExtAttr.set! を繰り返します。
+    #
+    def self.restore(src, root)
+      root = ::File.path(root)
+      stats = { files: 0, attributes: 0, missing: 0, failed: 0 }
+
+      ::File.open(src, "rb") do |io|
+        corrupted = -> { raise "corrupted extattr dump - #{src}" }
+        size = io.size
+        corrupted.() unless size >= 36 && io.read(16).unpack("a8VV") == ["EXTADUMP", 1, 0]
+        io.seek(size - 20)
+        marker, nfiles, nattrs = io.read(20).unpack("VQ<Q<")
+        corrupted.() unless marker == 0xffffffff
+        io.seek(16)
+        take = ->(n) {
+          data = io.read(n) || ""
+          corrupted.() unless data.bytesize == n && io.pos <= size - 20
+          data
+        }
+
+        nrecords = nentries = 0
+        while io.pos < size - 20
+          pathlen, = take.(5).unpack("VC")
+          rel = take.(pathlen)
+          corrupted.() if rel.start_with?("/") || rel.include?("\0") || rel.split("/").include?("..")
+          path = rel.empty? ? root : ::File.join(root, rel)
+          found = true
+          take.(4).unpack1("V").times do
+            ns, namelen, valuelen = take.(6).unpack("CCV")
+            name = take.(namelen)
+            value = take.(valuelen)
+            corrupted.() unless (1..DUMP_NAMESPACES.size).include?(ns) && namelen > 0
+            nentries += 1
+            next unless found
+            begin
+              set!(path, DUMP_NAMESPACES[ns - 1], name, value)
+              stats[:attributes] += 1
+            rescue Errno::ENOENT, Errno::ENOTDIR
+              stats[:missing] += 1
+              found = false
+            rescue SystemCallError
+              stats[:failed] += 1
+            end
+          end
+          nrecords += 1
+          stats[:files] += 1 if found
+        end
+        corrupted.() unless nrecords == nfiles && nentries == nattrs
+      end
+
+      stats
+    end
+  end
+
+  unless respond_to?(:get_at)
+    #
+    # ExtAttr.list_at / ExtAttr.size_at / ExtAttr.get_at / ExtAttr.set_at / ExtAttr.delete_at
+    # (と、それぞれの『!』付き) の、実装が専用の処理を持たない場合の代替。
+    #
+    # dir のパス名と path を連結したパス名で処理します。
+    #
+    [:list, :list!, :size, :size!, :get, :get!, :set, :set!, :delete, :delete!].each do |meth|
+      define_singleton_method(meth.to_s.sub(/!?\z/) { "_at#$&" }) do |dir, path, *args, &block|
+        dir = dir.path if dir.respond_to?(:path)
+        send(meth, ::File.expand_path(path, dir), *args, &block)
+      end
+    end
+  end
+
+  unless const_defined?(:Handle)
+    #
+    # ExtAttr::Handle の、実装が専用の処理を持たない場合の代替。
+    #
+    # ファイルを開いたままにはせず、パス名を保持して ExtAttr.get などを呼び出します。
+    #
+    class Handle
+      attr_reader :path
+
+      def initialize(dir, name = nil, follow: true)
+        if name
+          dir = dir.path if dir.respond_to?(:path)
+          @path = ::File.join(dir, name)
+        else
+          @path = dir.respond_to?(:to_path) ? dir.to_path : String(dir)
+        end
+        @follow = follow
+        @closed = false
+        ExtAttr.send(follow ? :list : :list!, @path, ExtAttr::USER)
+      end
+
+      def list(namespace = ExtAttr::USER, &block)
+        ExtAttr.send(call(:list), @path, namespace, &block)
+      end
+
+      def size(namespace, name)
+        ExtAttr.send(call(:size), @path, namespace, name)
+      end
+
+      def get(namespace, name)
+        ExtAttr.send(call(:get), @path, namespace, name)
+      end
+
+      def set(namespace, name, data)
+        ExtAttr.send(call(:set), @path, namespace, name, data)
+      end
+
+      def delete(namespace, name)
+        ExtAttr.send(call(:delete), @path, namespace, name)
+      end
+
+      def get_many(namespace, names)
+        ExtAttr.send(call(:get_many), @path, namespace, names)
+      end
+
+      def to_h(namespace = ExtAttr::USER)
+        ExtAttr.send(call(:to_h), @path, namespace)
+      end
+
+      def fileno
+        nil
+      end
+
+      def close
+        @closed = true
+        nil
+      end
+
+      def closed?
+        @closed
+      end
+
+      private
+
+      def call(name)
+        raise IOError, "closed handle" if @closed
+        @follow ? name : :"#{name}!"
+      end
+    end
+  end
+
+  unless const_defined?(:Ring)
+    #
+    # ExtAttr::Ring の、実装が専用の処理を持たない場合の代替。
+    #
+    # submit の時に ExtAttr.get / ExtAttr.set を順番に呼び出します。
+    #
+    class Ring
+      def initialize(entries: 64, threads: 4, backend: nil)
+        raise NotImplementedError, "io_uring is not available" if backend == :io_uring
+        @queue = []
+      end
+
+      def get(path, namespace, name)
+        @queue << [:get, path, namespace, name]
+        @queue.size - 1
+      end
+
+      def set(path, namespace, name, data, flags = 0)
+        raise NotImplementedError, "flags are not supported on #{ExtAttr::IMPLEMENT}" unless flags == 0
+        @queue << [:set, path, namespace, name, data]
+        @queue.size - 1
+      end
+
+      def submit
+        queue, @queue = @queue, []
+        queue.map do |op, path, namespace, name, data|
+          begin
+            if op == :get
+              begin
+                ExtAttr.get(path, namespace, name)
+              rescue Accessor::VIRT_ENOATTR
+                nil
+              end
+            else
+              ExtAttr.set(path, namespace, name, data)
+            end
+          rescue SystemCallError => e
+            e
+          end
+        end
+      end
+
+      def size
+        @queue.size
+      end
+
+      def backend
+        :serial
+      end
+    end
+  end
+
+  class Handle
+    #
+    # call-seq:
+    #   open(path, follow: true) -> handle
+    #   open(path, follow: true) { |handle| ... } -> block value
+    #   open(dir, name, follow: true) -> handle
+    #   open(dir, name, follow: true) { |handle| ... } -> block value
+    #
+    # ブロックを与えた場合は、ブロックを抜ける時にハンドルを閉じます。
+    #
+    def self.open(*args, **opts)
+      handle = new(*args, **opts)
+      return handle unless block_given?
+
+      begin
+        yield handle
+      ensure
+        handle.close
+      end
+    end
   end
 
   refine File do
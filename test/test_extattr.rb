@@ -3,6 +3,8 @@
 require "test/unit"
 require "fileutils"
 require "tmpdir"
+require "timeout"
+require "io/nonblock"
 
 include FileUtils
 
@@ -51,6 +53,818 @@ class ExtAttr::Test < Test::Unit::TestCase
     assert_equal([], File.extattr_list(FILEPATH2))
   end
 
+  def test_large_extattr
+    extdata = "0123456789abcdef" * 1024
+    File.open(FILEPATH2, "ab") {}
+
+    begin
+      File.extattr_set(FILEPATH2, "large", extdata)
+    rescue Errno::ENOSPC, Errno::E2BIG, Errno::ERANGE
+      omit "filesystem does not support large extattr"
+    end
+
+    assert_equal(extdata, File.extattr_get(FILEPATH2, "large"))
+    assert_equal(["large"], File.extattr_list(FILEPATH2))
+    assert_nil(File.extattr_delete(FILEPATH2, "large"))
+  end
+
+  def test_get_many
+    File.open(FILEPATH2, "ab") {}
+    File.extattr_set(FILEPATH2, "ext1", "abc")
+    File.extattr_set(FILEPATH2, "ext2", "")
+
+    assert_equal({ "ext1" => "abc", "ext2" => "", "ext3" => nil },
+                 ExtAttr.get_many(FILEPATH2, ExtAttr::USER, %w(ext1 ext2 ext3)))
+    assert_equal({ "ext2" => "" }, ExtAttr.get_many!(FILEPATH2, ExtAttr::USER, %w(ext2)))
+    File.open(FILEPATH2) do |file|
+      assert_equal({ "ext1" => "abc", "ext3" => nil }, file.extattr.get_many(%w(ext1 ext3)))
+    end
+    assert_raise(Errno::ENOENT) { ExtAttr.get_many(FILEPATH2 + ".none", ExtAttr::USER, %w(ext1)) }
+  ensure
+    File.extattr_delete(FILEPATH2, "ext1") rescue nil
+    File.extattr_delete(FILEPATH2, "ext2") rescue nil
+  end
+
+  def test_symbol_name
+    File.open(FILEPATH2, "ab") {}
+    assert_nil(ExtAttr.set(FILEPATH2, :user, :ext1, "abc"))
+    assert_equal("abc", ExtAttr.get(FILEPATH2, :user, :ext1))
+    assert_equal("abc", ExtAttr.get(FILEPATH2, :user, "ext1"))
+    assert_equal(3, ExtAttr.size(FILEPATH2, :user, :ext1))
+    File.open(FILEPATH2) do |file|
+      assert_equal("abc", file.extattr[:ext1])
+    end
+    assert_equal({ ext1: "abc", ext2: nil }, ExtAttr.get_many(FILEPATH2, :user, [:ext1, :ext2]))
+
+    # 動的に作られたシンボルも受け付けること
+    assert_equal("abc", ExtAttr.get(FILEPATH2, :user, "ext#{1}".to_sym))
+
+    assert_raise(Errno::ENODATA) { ExtAttr.get(FILEPATH2, :user, :ext2) }
+    assert_raise(ArgumentError) { ExtAttr.get(FILEPATH2, :user, :"ext\0") }
+    assert_raise(TypeError) { ExtAttr.get(FILEPATH2, :user, 1) }
+    assert_nil(ExtAttr.delete(FILEPATH2, :user, :ext1))
+    assert_equal([], ExtAttr.list(FILEPATH2, :user))
+  ensure
+    File.extattr_delete(FILEPATH2, "ext1") rescue nil
+  end
+
+  def test_namespace
+    File.open(FILEPATH2, "ab") {}
+    File.extattr_set(FILEPATH2, "ext1", "abc")
+
+    [ExtAttr::USER, :user, :USER, "user", "User", nil, "user".to_sym].each do |namespace|
+      assert_equal(%w(ext1), ExtAttr.list(FILEPATH2, namespace), "namespace=#{namespace.inspect}")
+    end
+    assert_raise(ArgumentError) { ExtAttr.list(FILEPATH2, :nothing) }
+    assert_raise(ArgumentError) { ExtAttr.list(FILEPATH2, "nothing#{1}".to_sym) }
+    assert_raise(ArgumentError) { ExtAttr.list(FILEPATH2, Object.new) }
+  ensure
+    File.extattr_delete(FILEPATH2, "ext1") rescue nil
+  end
+
+  def test_trusted_security
+    omit "trusted and security namespaces are not supported on #{ExtAttr::IMPLEMENT}" unless defined?(ExtAttr::SECURITY)
+
+    File.open(FILEPATH2, "ab") {}
+    File.extattr_set(FILEPATH2, "ext1", "abc")
+    begin
+      ExtAttr.set(FILEPATH2, ExtAttr::SECURITY, "extattr-test", "sec")
+      ExtAttr.set(FILEPATH2, :trusted, "extattr-test", "tru")
+    rescue Errno::EPERM, Errno::EACCES, Errno::ENOTSUP
+      omit "cannot set security or trusted attributes here"
+    end
+
+    assert_equal("sec", ExtAttr.get(FILEPATH2, :security, "extattr-test"))
+    assert_equal("tru", ExtAttr.get(FILEPATH2, ExtAttr::TRUSTED, "extattr-test"))
+    assert_include(ExtAttr.list(FILEPATH2, "Security"), "extattr-test")
+    assert_equal(%w(ext1), ExtAttr.list(FILEPATH2, ExtAttr::USER))
+
+    all = ExtAttr.list(FILEPATH2, ExtAttr::ALL)
+    assert_include(all, [:user, "ext1"])
+    assert_include(all, [:security, "extattr-test"])
+    assert_include(all, [:trusted, "extattr-test"])
+    assert_equal(all, ExtAttr.list!(FILEPATH2, :all))
+    assert_equal(all, ExtAttr.list(FILEPATH2, :all).each.to_a)
+    yielded = []
+    ExtAttr.list(FILEPATH2, :all) { |ns, name| yielded << [ns, name] }
+    assert_equal(all, yielded)
+
+    assert_raise(ArgumentError) { ExtAttr.get(FILEPATH2, ExtAttr::ALL, "ext1") }
+  ensure
+    File.extattr_delete(FILEPATH2, "ext1") rescue nil
+    ExtAttr.delete(FILEPATH2, :security, "extattr-test") rescue nil
+    ExtAttr.delete(FILEPATH2, :trusted, "extattr-test") rescue nil
+  end
+
+  def test_get_into
+    File.open(FILEPATH2, "ab") {}
+    File.extattr_set(FILEPATH2, "ext1", "abc")
+    File.extattr_set(FILEPATH2, "ext2", "x" * 3000)
+
+    buf = String.new
+    assert_equal(3, ExtAttr.get_into(FILEPATH2, ExtAttr::USER, "ext1", buf))
+    assert_equal("abc", buf)
+    assert_equal(Encoding::BINARY, buf.encoding)
+    assert_equal(3000, ExtAttr.get_into!(FILEPATH2, ExtAttr::USER, "ext2", buf))
+    assert_equal("x" * 3000, buf)
+
+    # 容量が十分な場合は、そのまま書き込まれること
+    buf = String.new("before", capacity: 8192)
+    assert_equal(3000, ExtAttr.get_into(FILEPATH2, ExtAttr::USER, "ext2", buf))
+    assert_equal("x" * 3000, buf)
+    File.open(FILEPATH2) do |file|
+      assert_equal(3, file.extattr.get_into("ext1", buf))
+      assert_equal("abc", buf)
+    end
+
+    assert_raise(Errno::ENODATA) { ExtAttr.get_into(FILEPATH2, ExtAttr::USER, "none", buf) }
+    assert_raise(FrozenError) { ExtAttr.get_into(FILEPATH2, ExtAttr::USER, "ext1", "".freeze) }
+
+    if defined?(IO::Buffer)
+      experimental, Warning[:experimental] = Warning[:experimental], false
+      iobuf = IO::Buffer.new(16)
+      assert_equal(3, ExtAttr.get_into(FILEPATH2, ExtAttr::USER, "ext1", iobuf))
+      assert_equal(["abc", 16], [iobuf.get_string(0, 3), iobuf.size])
+      assert_equal(3000, ExtAttr.get_into(FILEPATH2, ExtAttr::USER, "ext2", iobuf))
+      assert_equal("x" * 3000, iobuf.get_string(0, 3000))
+    end
+  ensure
+    Warning[:experimental] = experimental unless experimental.nil?
+    File.extattr_delete(FILEPATH2, "ext1") rescue nil
+    File.extattr_delete(FILEPATH2, "ext2") rescue nil
+  end
+
+  def test_to_h
+    File.open(FILEPATH2, "ab") {}
+    assert_equal({}, ExtAttr.to_h(FILEPATH2, ExtAttr::USER))
+
+    File.extattr_set(FILEPATH2, "ext1", "abc")
+    File.extattr_set(FILEPATH2, "ext2", "")
+    assert_equal({ "ext1" => "abc", "ext2" => "" }, ExtAttr.to_h(FILEPATH2, ExtAttr::USER))
+    assert_equal({ "ext1" => "abc", "ext2" => "" }, ExtAttr.to_h!(FILEPATH2, ExtAttr::USER))
+    File.open(FILEPATH2) do |file|
+      assert_equal({ "ext1" => "abc", "ext2" => "" }, file.extattr.to_h)
+    end
+    assert_raise(Errno::ENOENT) { ExtAttr.to_h(FILEPATH2 + ".none", ExtAttr::USER) }
+  ensure
+    File.extattr_delete(FILEPATH2, "ext1") rescue nil
+    File.extattr_delete(FILEPATH2, "ext2") rescue nil
+  end
+
+  def test_list_nested
+    File.open(FILEPATH2, "ab") {}
+    File.extattr_set(FILEPATH2, "ext1", "abc")
+    File.extattr_set(FILEPATH2, "ext2", "def")
+
+    # ブロックの中から呼び出しても、外側の一覧が壊れないこと
+    pairs = []
+    ExtAttr.list(FILEPATH2, ExtAttr::USER) do |name|
+      pairs << [name, ExtAttr.list(FILEPATH2, ExtAttr::USER).sort, ExtAttr.to_h(FILEPATH2, ExtAttr::USER)]
+    end
+    inner = [%w(ext1 ext2), { "ext1" => "abc", "ext2" => "def" }]
+    assert_equal([["ext1", *inner], ["ext2", *inner]], pairs.sort)
+
+    # ブロックから抜け出した後も、続けて呼び出せること
+    assert_raise(StopIteration) { ExtAttr.list(FILEPATH2, ExtAttr::USER) { raise StopIteration } }
+    assert_equal(%w(ext1 ext2), ExtAttr.list(FILEPATH2, ExtAttr::USER).sort)
+  ensure
+    File.extattr_delete(FILEPATH2, "ext1") rescue nil
+    File.extattr_delete(FILEPATH2, "ext2") rescue nil
+  end
+
+  def test_names
+    File.open(FILEPATH2, "ab") {}
+    names = %w(ext1 ext2 ext3)
+    names.each { |name| File.extattr_set(FILEPATH2, name, "abc") }
+
+    # ExtAttr.each はどの実装でも Enumerator を返す
+    enum = ExtAttr.each(FILEPATH2)
+    assert_kind_of(Enumerator, enum)
+    assert_equal(3, enum.size)
+    assert_equal([0, 1, 2], enum.with_index.map { |_, i| i })
+    assert_kind_of(Enumerator, ExtAttr.open(FILEPATH2) { |ea| ea.each })
+
+    iter = ExtAttr.names(FILEPATH2, ExtAttr::USER)
+    assert_kind_of(Enumerable, iter)
+    assert_equal(3, iter.size)
+    assert_equal(names, iter.to_a.sort)
+    first = iter.next
+    assert_equal(first, ExtAttr.names(FILEPATH2, ExtAttr::USER).first)
+    second = iter.peek
+    assert_equal(second, iter.next)
+    iter.next
+    assert_raise(StopIteration) { iter.next }
+    assert_equal(first, iter.rewind.next)
+    assert_equal("ext2", iter.find { |name| name == "ext2" })
+    assert_equal(%w(EXT1 EXT2), iter.lazy.map(&:upcase).sort.first(2)) # lazy も使えること
+    assert_equal(names, ExtAttr.each!(FILEPATH2).sort)
+    File.open(FILEPATH2) do |file|
+      assert_equal(names, ExtAttr.names(file, ExtAttr::USER).sort)
+    end
+    assert_raise(Errno::ENOENT) { ExtAttr.names(FILEPATH2 + ".none", ExtAttr::USER) }
+  ensure
+    names.each { |name| File.extattr_delete(FILEPATH2, name) rescue nil }
+  end
+
+  def test_cache
+    omit "ExtAttr::Cache is not available on #{ExtAttr::IMPLEMENT}" unless defined?(ExtAttr::Cache)
+
+    File.open(FILEPATH2, "ab") {}
+    File.extattr_set(FILEPATH2, "mime", "text/html")
+    sleep 0.05 # 変更直後の ctime は信用されないため
+
+    cache = ExtAttr::Cache.new(max_bytes: 1 << 20)
+    assert_equal("text/html", cache.get(FILEPATH2, ExtAttr::USER, "mime"))
+    assert_equal("text/html", cache.get(FILEPATH2, ExtAttr::USER, :mime))
+    File.open(FILEPATH2) { |file| assert_equal("text/html", cache.get(file, ExtAttr::USER, "mime")) }
+    assert_equal([1, 2], [cache.misses, cache.hits])
+    cache.get(FILEPATH2, ExtAttr::USER, "mime") << "x" # 記憶した値は壊れないこと
+    assert_equal("text/html", cache.get(FILEPATH2, ExtAttr::USER, "mime"))
+
+    # 存在しない拡張属性も記憶する
+    2.times { assert_raise(Errno::ENODATA) { cache.get(FILEPATH2, ExtAttr::USER, "etag") } }
+    assert_equal(%w(mime), cache.list(FILEPATH2, ExtAttr::USER))
+    assert_equal(%w(mime), cache.list(FILEPATH2, ExtAttr::USER))
+    assert_equal({ hits: 6, misses: 3 }, cache.stats.slice(:hits, :misses))
+
+    # 拡張属性を変更すると ctime が変わり、取得し直す
+    File.extattr_set(FILEPATH2, "mime", "text/plain")
+    assert_equal("text/plain", cache.get(FILEPATH2, ExtAttr::USER, "mime"))
+    File.extattr_set(FILEPATH2, "etag", "abc")
+    assert_equal("abc", cache.get(FILEPATH2, ExtAttr::USER, "etag"))
+    assert_equal(%w(etag mime), cache.list(FILEPATH2, ExtAttr::USER).sort)
+
+    assert_equal(0, cache.clear.stats[:entries])
+    small = ExtAttr::Cache.new(max_bytes: 0)
+    2.times { small.get(FILEPATH2, ExtAttr::USER, "mime") }
+    assert_equal(0, small.hits)
+    # 値を記憶できなくても、項目は上限を超えて増え続けない
+    3.times do |i|
+      path = File.join(WORKDIR, "cache#{i}")
+      File.write(path, "")
+      assert_raise(Errno::ENODATA) { small.get(path, ExtAttr::USER, "mime") }
+    end
+    assert_equal(1, small.stats[:entries])
+    assert_raise(Errno::ENOENT) { cache.get(FILEPATH2 + ".none", ExtAttr::USER, "mime") }
+  ensure
+    File.extattr_delete(FILEPATH2, "mime") rescue nil
+    File.extattr_delete(FILEPATH2, "etag") rescue nil
+  end
+
+  def test_decode_list
+    omit "ExtAttr.decode_list is not available on #{ExtAttr::IMPLEMENT}" unless ExtAttr.respond_to?(:decode_list, true)
+
+    decode = ->(buf, ns) { ExtAttr.send(:decode_list, buf, ns) }
+    prefixes = { user: "user.", system: "system.", trusted: "trusted.", security: "security." }
+
+    # 手で解析した結果。ヌルバイトで終端されていない末尾は捨てる。
+    expect = ->(buf, ns) do
+      entries = buf.b.split("\0", -1)
+      entries.pop
+      entries.filter_map do |e|
+        ens, prefix = prefixes.find { |_, pre| e.start_with?(pre) && e.bytesize > pre.bytesize }
+        next unless ens
+        name = e.byteslice(prefix.bytesize..)
+        if ns == :all
+          [ens, name]
+        elsif ens == ns
+          name
+        end
+      end
+    end
+
+    assert_equal([], decode.("", ExtAttr::USER))
+    assert_equal(%w(a b), decode.("user.a\0user.b\0", ExtAttr::USER))
+    assert_equal(%w(a), decode.("user.a\0user.b", ExtAttr::USER))
+    assert_equal(%w(a b), decode.("\0user.a\0\0user.\0system.x\0user.b\0", ExtAttr::USER))
+
+    rand = Random.new(20261017)
+    pieces = ["user.", "system.", "trusted.", "security.", "user", ".", "\0", "\0\0", "a", "bc", "\xff"].map(&:b)
+    bufs = Array.new(2000) { Array.new(rand.rand(0..24)) { pieces[rand.rand(pieces.size)] }.join }
+    [ExtAttr::USER, *(ExtAttr::ALL if defined?(ExtAttr::ALL))].each do |ns|
+      assert_equal(bufs.map { |buf| expect.(buf, ns) }, bufs.map { |buf| decode.(buf, ns) })
+    end
+
+    names = 10000.times.map { |i| "name%05d" % i }
+    buf = names.map { |n| "user.#{n}\0trusted.#{n}\0" }.join
+    assert_equal(names, decode.(buf, ExtAttr::USER))
+    assert_equal(names, decode.(buf + "user.tail", ExtAttr::USER))
+    assert_equal(names.flat_map { |n| [[:user, n], [:trusted, n]] }, decode.(buf, ExtAttr::ALL)) if defined?(ExtAttr::ALL)
+    assert_raise(NoMethodError) { ExtAttr.decode_list(buf, ExtAttr::USER) }
+  end
+
+  def test_set_many
+    File.open(FILEPATH2, "ab") {}
+
+    assert_nil(ExtAttr.set_many(FILEPATH2, ExtAttr::USER, { "ext1" => "abc", "ext2" => "def" }))
+    assert_equal(%w(ext1 ext2), File.extattr_list(FILEPATH2).sort)
+    File.open(FILEPATH2) do |file|
+      assert_nil(file.extattr.update({ "ext1" => nil, "ext3" => "ghi" }))
+    end
+    assert_equal({ "ext1" => nil, "ext2" => "def", "ext3" => "ghi" },
+                 ExtAttr.get_many(FILEPATH2, ExtAttr::USER, %w(ext1 ext2 ext3)))
+
+    if defined?(ExtAttr::REPLACE)
+      assert_raise(Errno::ENODATA) do
+        ExtAttr.set_many(FILEPATH2, ExtAttr::USER, { "ext2" => "xyz", "ext4" => "xyz" },
+                         flags: ExtAttr::REPLACE, atomic: true)
+      end
+      assert_equal({ "ext2" => "def", "ext4" => nil },
+                   ExtAttr.get_many(FILEPATH2, ExtAttr::USER, %w(ext2 ext4)))
+    end
+  ensure
+    ExtAttr.set_many(FILEPATH2, ExtAttr::USER, { "ext1" => nil, "ext2" => nil, "ext3" => nil })
+  end
+
+  def test_copy
+    src = File.join(WORKDIR, "copy-src")
+    dst = File.join(WORKDIR, "copy-dst")
+    File.write(src, "")
+    File.write(dst, "")
+    File.extattr_set(src, "mime", "text/plain")
+    File.extattr_set(src, "etag", "x" * 2000)
+    File.extattr_set(src, "etime", "1")
+    File.extattr_set(dst, "etag", "old")
+
+    assert_equal(2, ExtAttr.copy(src, dst, existing: :skip))
+    assert_equal({ "mime" => "text/plain", "etag" => "old", "etime" => "1" }, ExtAttr.to_h(dst, ExtAttr::USER))
+    assert_equal(2, ExtAttr.copy(src, dst, filter: %w(et*)))
+    assert_equal("x" * 2000, File.extattr_get(dst, "etag"))
+    File.open(src) do |file|
+      assert_equal(1, ExtAttr.copy(file, dst, filter: "mime"))
+    end
+    assert_equal(0, ExtAttr.copy(src, dst, filter: "none*"))
+
+    assert_raise(Errno::ENOENT) { ExtAttr.copy(src + ".none", dst) }
+    assert_raise(Errno::ENOENT) { ExtAttr.copy(src, dst + ".none") }
+    assert_raise(ArgumentError) { ExtAttr.copy(src, dst, existing: :merge) }
+  ensure
+    rm_f [src, dst]
+  end
+
+  def test_sync_tree
+    src = File.join(WORKDIR, "sync-src")
+    dst = File.join(WORKDIR, "sync-dst")
+    [src, dst].each { |root| mkdir_p File.join(root, "a/b") }
+    File.write(File.join(src, "a/file1"), "")
+    File.write(File.join(src, "a/b/file2"), "")
+    File.write(File.join(src, "a/b/file3"), "")
+    File.write(File.join(dst, "a/file1"), "")
+    File.write(File.join(dst, "a/b/file2"), "")
+    File.extattr_set(src, "root", "r")
+    File.extattr_set(File.join(src, "a/file1"), "tag", "one")
+    File.extattr_set(File.join(src, "a/file1"), "big", "x" * 2000)
+    File.extattr_set(File.join(src, "a/b/file2"), "tag", "two")
+    File.extattr_set(File.join(dst, "a/file1"), "tag", "one")
+    File.extattr_set(File.join(dst, "a/file1"), "big", "y" * 2000)
+    File.extattr_set(File.join(dst, "a/file1"), "stale", "1")
+
+    assert_equal({ files: 5, missing: 1, compared: 4, written: 3, removed: 1, failed: 0 },
+                 ExtAttr.sync_tree(src, dst, threads: 2))
+    [".", "a/file1", "a/b/file2"].each do |rel|
+      assert_equal(ExtAttr.to_h(File.join(src, rel), ExtAttr::USER),
+                   ExtAttr.to_h(File.join(dst, rel), ExtAttr::USER))
+    end
+    assert_equal({ files: 5, missing: 1, compared: 4, written: 0, removed: 0, failed: 0 },
+                 ExtAttr.sync_tree(src, dst))
+
+    # dst 以下のシンボリックリンクをたどって、dst の外の拡張属性を変えない
+    outside = File.join(WORKDIR, "sync-outside")
+    mkdir_p [File.join(src, "esc"), outside]
+    File.symlink("none", File.join(src, "esc/link"))
+    File.write(File.join(outside, "link"), "")
+    File.extattr_set(File.join(outside, "link"), "stale", "1")
+    File.symlink(outside, File.join(dst, "esc"))
+    assert_equal({ files: 5, missing: 3, compared: 4, written: 0, removed: 0, failed: 0 },
+                 ExtAttr.sync_tree(src, dst))
+    assert_equal({ "stale" => "1" }, ExtAttr.to_h(File.join(outside, "link"), ExtAttr::USER))
+
+    assert_raise(Errno::ENOENT) { ExtAttr.sync_tree(src, File.join(WORKDIR, "none")) }
+  ensure
+    rm_rf [src, dst, outside].compact
+  end
+
+  def test_dump_restore
+    # 大きな値を扱えるように、使えれば tmpfs で試す
+    base = File.writable?("/dev/shm") ? Dir.mktmpdir("extattr-test-", "/dev/shm") : WORKDIR
+    src = File.join(base, "dump-src")
+    dst = File.join(base, "dump-dst")
+    dump = File.join(base, "dump.bin")
+    files = %w(a/file1 a/b/file2 a/b/file3 a/b/empty)
+    [src, dst].each do |root|
+      mkdir_p File.join(root, "a/b")
+      files.each { |rel| File.write(File.join(root, rel), "") }
+    end
+    big = (0..255).map(&:chr).join.b * (base == WORKDIR ? 4 : 64)
+    File.extattr_set(src, "root", "r")
+    File.extattr_set(File.join(src, "a/file1"), "tag", "one")
+    File.extattr_set(File.join(src, "a/file1"), "big", big)
+    File.extattr_set(File.join(src, "a/b/file2"), "tag", "two")
+    File.extattr_set(File.join(src, "a/b/file3"), "empty", "")
+    rm_f File.join(dst, "a/b/file3")
+
+    stats = ExtAttr.dump(src, dump)
+    assert_equal([4, 5, File.size(dump)], stats.values_at(:files, :attributes, :bytes))
+    assert_equal({ files: 3, attributes: 4, missing: 1, failed: 0 }, ExtAttr.restore(dump, dst))
+    [".", "a/file1", "a/b/file2", "a/b/empty"].each do |rel|
+      assert_equal(ExtAttr.to_h(File.join(src, rel), ExtAttr::USER),
+                   ExtAttr.to_h(File.join(dst, rel), ExtAttr::USER))
+    end
+    assert_equal(big, File.extattr_get(File.join(dst, "a/file1"), "big"))
+
+    File.open(dump, "wb") { |io| ExtAttr.dump(src, io, threads: 1) }
+    assert_equal(4, ExtAttr.restore(dump, dst)[:attributes])
+
+    File.truncate(dump, File.size(dump) - 1)
+    assert_raise(RuntimeError) { ExtAttr.restore(dump, dst) }
+    assert_raise(Errno::ENOENT) { ExtAttr.restore(dump + ".none", dst) }
+
+    # root 以下のシンボリックリンクをたどって、root の外に書き込まない
+    outside = File.join(base, "dump-outside")
+    mkdir_p outside
+    File.write(File.join(outside, "file"), "")
+    File.symlink(outside, File.join(dst, "esc"))
+    # パス名で操作するレコードと、開いて操作するレコード (拡張属性は user 名前空間の "tag")
+    records = [0, 1].map { |kind|
+      ["esc/file".bytesize, kind].pack("VC") + "esc/file" + [1, 1, 3, 1].pack("VCCV") + "tag" + "x"
+    }
+    File.binwrite(dump, "EXTADUMP" + [1, 0].pack("VV") + records.join + [0xffffffff, 2, 2].pack("VQ<Q<"))
+    assert_equal({ files: 0, attributes: 0, missing: 2, failed: 0 }, ExtAttr.restore(dump, dst))
+    assert_equal({}, ExtAttr.to_h(File.join(outside, "file"), ExtAttr::USER))
+  ensure
+    base == WORKDIR ? rm_rf([src, dst, dump, outside].compact) : rm_rf(base) if base
+  end
+
+  def test_dump_pipe
+    src = File.join(WORKDIR, "dump-pipe")
+    mkdir_p src
+    64.times do |i|
+      path = File.join(src, "file%02d" % i)
+      File.write(path, "")
+      File.extattr_set(path, "tag", i.to_s * 2000)
+    end
+
+    # パイプの容量を超えても、読み出されるのを待って書き続ける
+    r, w = IO.pipe
+    reader = Thread.new { r.read }
+    stats = ExtAttr.dump(src, w, threads: 2)
+    w.close
+    data = reader.value
+    assert_operator(data.bytesize, :>, 65536)
+    assert_equal(data.bytesize, stats[:bytes])
+
+    # 読み出されないまま待っている間も、割り込むことが出来る
+    [true, false].each do |nonblock|
+      r, w = IO.pipe
+      w.nonblock = nonblock
+      assert_raise(Timeout::Error) { Timeout.timeout(0.5) { ExtAttr.dump(src, w) } }
+      r.close
+      w.close
+    end
+
+    if File.writable?("/dev/full")
+      e = assert_raise(Errno::ENOSPC) { File.open("/dev/full", "wb") { |io| ExtAttr.dump(src, io) } }
+      assert_match(%r{/dev/full}, e.message)
+    end
+  ensure
+    rm_rf src
+  end
+
+  def test_scan
+    root = File.join(WORKDIR, "scan")
+    mkdir_p File.join(root, "a/b")
+    File.write(File.join(root, "a/file1"), "")
+    File.write(File.join(root, "a/b/file2"), "")
+    File.write(File.join(root, "a/b/file3"), "")
+    File.extattr_set(File.join(root, "a/file1"), "tag", "one")
+    File.extattr_set(File.join(root, "a/b/file2"), "tag", "two")
+    File.extattr_set(File.join(root, "a/b/file2"), "other", "2")
+    File.extattr_set(File.join(root, "a/b"), "other", "b")
+
+    assert_equal([[File.join(root, "a/b"), { "other" => "b" }],
+                  [File.join(root, "a/b/file2"), { "tag" => "two", "other" => "2" }],
+                  [File.join(root, "a/file1"), { "tag" => "one" }]],
+                 ExtAttr.scan(root).to_a.sort)
+    assert_equal([[File.join(root, "a/b/file2"), { "tag" => "two" }],
+                  [File.join(root, "a/file1"), { "tag" => "one" }]],
+                 ExtAttr.scan(root, names: %w(tag), threads: 2).to_a.sort)
+    assert_equal([], ExtAttr.scan(File.join(root, "none")).to_a)
+
+    # FIFO を開いて止まることも、ディレクトリへのシンボリックリンクをたどることもない
+    File.mkfifo(File.join(root, "a/fifo"))
+    File.symlink(File.join(root, "a/b"), File.join(root, "a/link"))
+    assert_equal([File.join(root, "a/b"), File.join(root, "a/b/file2"), File.join(root, "a/file1")],
+                 ExtAttr.scan(root).map { |path, _| path }.sort)
+
+    # 子ディレクトリを開くための記述子を残さない
+    if File.directory?("/proc/self/fd")
+      nfds = Dir.children("/proc/self/fd").size
+      ExtAttr.scan(root, threads: 2).to_a
+      assert_equal(nfds, Dir.children("/proc/self/fd").size)
+    end
+  ensure
+    rmtree root
+  end
+
+  def test_index
+    omit "ExtAttr::Index is not available on #{ExtAttr::IMPLEMENT}" unless defined?(ExtAttr::Index)
+
+    root = File.join(WORKDIR, "index")
+    mkdir_p File.join(root, "a")
+    file1 = File.join(root, "file1")
+    file2 = File.join(root, "a/file2")
+    file3 = File.join(root, "a/file3")
+    [file1, file2, file3].each { |f| File.write(f, "") }
+    File.extattr_set(file1, "tag", "red")
+    File.extattr_set(file2, "tag", "reddish")
+    File.extattr_set(file2, "owner", "alice")
+    File.extattr_set(file3, "tag", "blue")
+    sleep 0.05 # ctime が作成時刻に近いファイルは、refresh で引き継がれない
+
+    path = File.join(WORKDIR, "index.db")
+    ix = ExtAttr::Index.build(path, root, threads: 2)
+    assert_equal(root, ix.root)
+    assert_equal(:user, ix.namespace)
+    assert_equal(5, ix.size)
+    assert_equal([file1], ix.lookup("tag", "red"))
+    assert_equal([file2, file1], ix.lookup_prefix(:tag, "red"))
+    assert_equal([file2, file3, file1], ix.lookup_prefix("tag", ""))
+    assert_equal([], ix.lookup("tag", "re"))
+    assert_equal([], ix.lookup("none", "red"))
+
+    File.extattr_set(file3, "tag", "redder")
+    ix.refresh
+    assert_equal({ files: 5, names: 2, keys: 4, reused: 4, scanned: 1 }, ix.stats.reject { |k, _| k == :bytes })
+    assert_equal([file2, file3, file1], ix.lookup_prefix("tag", "red"))
+    assert_equal([file2], ix.lookup("owner", "alice"))
+
+    other = ExtAttr::Index.open(path)
+    assert_equal([file3], other.lookup("tag", "redder"))
+    # 同じ索引ファイルを別のオブジェクトから同時に更新しても、一時ファイルは衝突せず残らない
+    [ix, other].map { |x| Thread.new { x.refresh } }.each(&:join)
+    assert_equal([path], Dir.glob(path + "*"))
+    assert_equal(0644, File.stat(path).mode & 0777)
+    other.close
+    assert_raise(IOError) { other.lookup("tag", "red") }
+
+    File.write(path + ".bad", "x" * 256)
+    assert_raise(RuntimeError) { ExtAttr::Index.open(path + ".bad") }
+  ensure
+    rmtree root
+    rm_f [path, path + ".bad"] if path
+  end
+
+  def test_watcher
+    omit "ExtAttr::Watcher is not available on #{ExtAttr::IMPLEMENT}" unless defined?(ExtAttr::Watcher)
+
+    root = File.join(WORKDIR, "watcher")
+    mkdir_p File.join(root, "a")
+    file1 = File.join(root, "file1")
+    file2 = File.join(root, "a/file2")
+    [file1, file2].each { |f| File.write(f, "") }
+    File.extattr_set(file1, "tag", "one")
+
+    watcher = ExtAttr::Watcher.new(root, threads: 2)
+    assert_equal(2, watcher.stats[:directories])
+    assert_equal({ "tag" => "one" }, watcher.snapshot(file1))
+    assert_nil(watcher.snapshot(file2))
+
+    File.extattr_set(file1, "tag", "uno")
+    File.extattr_set(file2, "other", "2")
+    assert_equal([[file1, "tag", "one", "uno"], [file2, "other", nil, "2"]], watcher.read(5))
+
+    # 拡張属性以外の変更は、イベントにならない
+    File.chmod(0600, file2)
+    assert_equal([], watcher.read(0.2))
+
+    # 新たに作られたディレクトリの中も監視する
+    file3 = File.join(root, "b/c/file3")
+    mkdir_p File.dirname(file3)
+    File.write(file3, "")
+    File.extattr_set(file3, "tag", "three")
+    File.unlink(file1)
+    events = []
+    5.times { events.size < 2 and events.concat(watcher.read(2)) }
+    assert_equal([[file3, "tag", nil, "three"], [file1, "tag", "uno", nil]], events.sort)
+
+    # ディレクトリを移動すると、元のパス名の拡張属性は削除され、移動先のものが追加される
+    file4 = File.join(root, "d/c/file3")
+    File.rename(File.join(root, "b"), File.join(root, "d"))
+    events = []
+    5.times { events.size < 2 and events.concat(watcher.read(2)) }
+    assert_equal([[file3, "tag", "three", nil], [file4, "tag", nil, "three"]], events.sort)
+    assert_nil(watcher.snapshot(file3))
+
+    # ツリーの外へ移動すると、削除されたものとして監視も取りやめる
+    outside = File.join(WORKDIR, "watch-outside")
+    ndirs = watcher.stats[:directories]
+    File.rename(File.join(root, "d"), outside)
+    assert_equal([[file4, "tag", "three", nil]], watcher.read(5))
+    File.extattr_set(File.join(outside, "c/file3"), "tag", "moved")
+    assert_equal([], watcher.read(0.2))
+    assert_equal(ndirs - 2, watcher.stats[:directories])
+
+    th = Thread.new { watcher.each.to_a }
+    sleep 0.1
+    watcher.close
+    assert_equal([], th.value)
+    assert_predicate(watcher, :closed?)
+    assert_raise(IOError) { watcher.read }
+  ensure
+    watcher&.close
+    rm_rf [root, outside].compact
+  end
+
+  def test_handle
+    root = File.join(WORKDIR, "handle")
+    mkdir_p root
+    path = File.join(root, "file")
+    File.write(path, "")
+
+    ExtAttr::Handle.open(path) do |h|
+      assert_equal(path, h.path)
+      assert_nil(h.set(ExtAttr::USER, "a", "1"))
+      assert_nil(h.set(ExtAttr::USER, "b", "22"))
+      assert_equal(%w(a b), h.list.sort)
+      assert_equal("22", h.get(ExtAttr::USER, "b"))
+      assert_equal(2, h.size(ExtAttr::USER, "b"))
+      assert_equal({ "a" => "1", "b" => "22", "c" => nil }, h.get_many(ExtAttr::USER, %w(a b c)))
+      assert_nil(h.delete(ExtAttr::USER, "a"))
+      assert_equal({ "b" => "22" }, h.to_h)
+    end
+    assert_equal("22", File.extattr_get(path, "b"))
+
+    Dir.open(root) do |dir|
+      h = ExtAttr::Handle.new(dir, "file")
+      assert_equal({ "b" => "22" }, h.to_h)
+      h.close
+      assert_true(h.closed?)
+      assert_raise(IOError) { h.to_h }
+    end
+
+    # 他のスレッドが使用中に閉じても、その操作は元のファイルに対して行われる
+    h = ExtAttr::Handle.new(path)
+    ths = 4.times.map { Thread.new { loop { assert_equal("22", h.get(ExtAttr::USER, "b")) } rescue IOError } }
+    sleep 0.05
+    h.close
+    ths.each(&:join)
+    assert_true(h.closed?)
+
+    # FIFO などは読み込み用に開かず、O_PATH を経由して扱う。
+    fifo = File.join(root, "fifo")
+    File.mkfifo(fifo)
+    ExtAttr::Handle.open(fifo) { |h| assert_equal([], h.list) }
+    assert_equal({}, ExtAttr.to_h(fifo, ExtAttr::USER))
+
+    assert_raise(Errno::ENOENT) { ExtAttr::Handle.new(File.join(root, "none")) }
+  ensure
+    rmtree root
+  end
+
+  def test_at
+    root = File.join(WORKDIR, "at")
+    mkdir_p File.join(root, "a/b")
+    File.write(File.join(root, "a/b/file"), "")
+    File.symlink("file", File.join(root, "a/b/link"))
+
+    Dir.open(File.join(root, "a")) do |dir|
+      assert_nil(ExtAttr.set_at(dir, "b/file", ExtAttr::USER, "x", "1"))
+      assert_equal(["x"], ExtAttr.list_at(dir, "b/file", ExtAttr::USER))
+      assert_equal(1, ExtAttr.size_at(dir, "b/file", ExtAttr::USER, "x"))
+      assert_equal("1", ExtAttr.get_at(dir, "b/file", ExtAttr::USER, "x"))
+      assert_equal("1", ExtAttr.get_at(dir, "b/link", ExtAttr::USER, "x"))
+      assert_equal([], ExtAttr.list_at!(dir, "b/link", ExtAttr::USER))
+      assert_raise(Errno::ENODATA) { ExtAttr.get_at!(dir, "b/link", ExtAttr::USER, "x") }
+      assert_nil(ExtAttr.delete_at(dir, "b/link", ExtAttr::USER, "x"))
+      assert_equal([], ExtAttr.list_at(dir, "b/file", ExtAttr::USER))
+      assert_raise(Errno::ENOENT) { ExtAttr.get_at(dir, "none", ExtAttr::USER, "x") }
+    end
+  ensure
+    rmtree root
+  end
+
+  def test_ring
+    root = File.join(WORKDIR, "ring")
+    mkdir_p root
+    path = File.join(root, "file")
+    File.write(path, "")
+    File.extattr_set(path, "a", "1")
+
+    assert_not_equal(:io_uring, ExtAttr::Ring.new.backend)
+    backends = [nil, :threads]
+    backends << :io_uring if (ExtAttr::Ring.new(backend: :io_uring) rescue nil)
+    backends.each do |backend|
+      ring = ExtAttr::Ring.new(backend: backend, entries: 2)
+      File.open(path) do |file|
+        assert_equal(0, ring.get(path, ExtAttr::USER, "a"))
+        assert_equal(1, ring.get(file, ExtAttr::USER, "none"))
+        assert_equal(2, ring.set(file, ExtAttr::USER, "b", "x" * 3000))
+        assert_equal(3, ring.get(File.join(root, "none"), ExtAttr::USER, "a"))
+        assert_equal(4, ring.size)
+        results = ring.submit
+        assert_equal(["1", nil, nil], results[0, 3])
+        assert_kind_of(Errno::ENOENT, results[3])
+        assert_equal(0, ring.size)
+      end
+      ring.get(path, ExtAttr::USER, "b")
+      assert_equal(["x" * 3000], ring.submit)
+      File.extattr_delete(path, "b")
+
+      # 要求は Handle の記述子を複製して持つので、submit の前に閉じてもよい
+      h = ExtAttr::Handle.new(path)
+      ring.get(h, ExtAttr::USER, "a")
+      h.close
+      assert_equal(["1"], ring.submit)
+    end
+  ensure
+    rmtree root
+  end
+
+  #
+  # 試験用の最小限のファイバースケジューラ。
+  #
+  class MiniScheduler
+    def initialize
+      @waiting = {}
+    end
+
+    def fiber(&block)
+      fiber = Fiber.new(blocking: false, &block)
+      fiber.resume
+      fiber
+    end
+
+    def io_wait(io, events, timeout)
+      @waiting[io] = Fiber.current
+      Fiber.yield
+      events
+    end
+
+    def kernel_sleep(*duration)
+      sleep(*duration)
+    end
+
+    def block(blocker, timeout = nil)
+      raise NotImplementedError
+    end
+
+    def unblock(blocker, fiber)
+      raise NotImplementedError
+    end
+
+    def close
+      until @waiting.empty?
+        readable, = IO.select(@waiting.keys)
+        readable.each { |io| @waiting.delete(io).resume }
+      end
+    end
+  end
+
+  def test_fiber_scheduler
+    omit "Fiber scheduler is not available" unless Fiber.respond_to?(:set_scheduler)
+
+    File.open(FILEPATH2, "ab") {}
+    File.extattr_set(FILEPATH2, "fiber", "value")
+    results = []
+    Thread.new {
+      scheduler = MiniScheduler.new
+      Fiber.set_scheduler(scheduler)
+      4.times do |i|
+        Fiber.schedule { results << [i, File.extattr_get(FILEPATH2, "fiber")] }
+      end
+      Fiber.schedule do
+        File.extattr_get(FILEPATH2, "nothing")
+      rescue SystemCallError => e
+        results << [4, e.class]
+      end
+      Fiber.set_scheduler(nil)
+    }.join
+
+    assert_equal(4.times.map { |i| [i, "value"] } + [[4, Errno::ENODATA]], results.sort_by(&:first))
+
+    if ExtAttr.respond_to?(:offload_threads)
+      assert_operator(ExtAttr.offload_threads, :>, 8)
+      assert_raise(ArgumentError) { ExtAttr.offload_threads = 0 }
+      begin
+        # 上限を下げても、残ったワーカースレッドで処理を続ける
+        max = ExtAttr.offload_threads
+        ExtAttr.offload_threads = 1
+        assert_equal(1, ExtAttr.offload_threads)
+        results.clear
+        Thread.new {
+          Fiber.set_scheduler(MiniScheduler.new)
+          4.times { |i| Fiber.schedule { results << File.extattr_get(FILEPATH2, "fiber") } }
+          Fiber.set_scheduler(nil)
+        }.join
+        assert_equal(["value"] * 4, results)
+      ensure
+        ExtAttr.offload_threads = max
+      end
+    end
+  ensure
+    File.extattr_delete(FILEPATH2, "fiber") rescue nil
+  end
+
   def test_ractor_extattr
     # Skip this test on Ruby < 3.0
     return true unless defined?(Ractor)